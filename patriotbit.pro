@@ -25,6 +25,8 @@ HEADERS += src/activemasternode.h \
            src/allocators.h \
            src/base58.h \
            src/bignum.h \
+           src/blockencodings.h \
+           src/blockfilter.h \
            src/bloom.h \
            src/patriotbit-config.h \
            src/chainparams.h \
@@ -33,6 +35,7 @@ HEADERS += src/activemasternode.h \
            src/clientversion.h \
            src/coincontrol.h \
            src/coins.h \
+           src/coinscommitment.h \
            src/common.h \
            src/compat.h \
            src/core.h \
@@ -40,6 +43,7 @@ HEADERS += src/activemasternode.h \
            src/darksend-relay.h \
            src/darksend.h \
            src/db.h \
+           src/eventpublisher.h \
            src/hash.h \
            src/hmac_sha256.h \
            src/init.h \
@@ -66,6 +70,7 @@ HEADERS += src/activemasternode.h \
            src/rpcserver.h \
            src/script.h \
            src/serialize.h \
+           src/socketevents.h \
            src/sha256.h \
            src/sph_blake.h \
            src/sph_bmw.h \
@@ -80,6 +85,7 @@ HEADERS += src/activemasternode.h \
            src/sph_skein.h \
            src/sph_types.h \
            src/spork.h \
+           src/stratum.h \
            src/sync.h \
            src/threadsafety.h \
            src/tinyformat.h \
@@ -90,6 +96,7 @@ HEADERS += src/activemasternode.h \
            src/uint256.h \
            src/util.h \
            src/utilstrencodings.h \
+           src/utxosnapshot.h \
            src/version.h \
            src/wallet.h \
            src/walletdb.h \
@@ -296,6 +303,8 @@ SOURCES += src/activemasternode.cpp \
            src/allocators.cpp \
            src/base58.cpp \
            src/blake.c \
+           src/blockencodings.cpp \
+           src/blockfilter.cpp \
            src/bloom.cpp \
            src/bmw.c \
            src/patriotbit-cli.cpp \
@@ -303,6 +312,7 @@ SOURCES += src/activemasternode.cpp \
            src/chainparams.cpp \
            src/checkpoints.cpp \
            src/coins.cpp \
+           src/coinscommitment.cpp \
            src/core.cpp \
            src/crypter.cpp \
            src/cubehash.c \
@@ -310,6 +320,7 @@ SOURCES += src/activemasternode.cpp \
            src/darksend.cpp \
            src/db.cpp \
            src/echo.c \
+           src/eventpublisher.cpp \
            src/groestl.c \
            src/hash.cpp \
            src/hmac_sha256.cpp \
@@ -333,6 +344,7 @@ SOURCES += src/activemasternode.cpp \
            src/noui.cpp \
            src/protocol.cpp \
            src/random.cpp \
+           src/rest.cpp \
            src/rpcblockchain.cpp \
            src/rpcclient.cpp \
            src/rpcdarksend.cpp \
@@ -349,13 +361,16 @@ SOURCES += src/activemasternode.cpp \
            src/shavite.c \
            src/simd.c \
            src/skein.c \
+           src/socketevents.cpp \
            src/spork.cpp \
+           src/stratum.cpp \
            src/sync.cpp \
            src/torcontrol.cpp \
            src/txdb.cpp \
            src/txmempool.cpp \
            src/util.cpp \
            src/utilstrencodings.cpp \
+           src/utxosnapshot.cpp \
            src/version.cpp \
            src/wallet.cpp \
            src/walletdb.cpp \
@@ -442,6 +457,8 @@ SOURCES += src/activemasternode.cpp \
            src/test/base64_tests.cpp \
            src/test/bignum_tests.cpp \
            src/test/bip32_tests.cpp \
+           src/test/blockencodings_tests.cpp \
+           src/test/blockfilter_tests.cpp \
            src/test/bloom_tests.cpp \
            src/test/canonical_tests.cpp \
            src/test/checkblock_tests.cpp \
@@ -453,6 +470,7 @@ SOURCES += src/activemasternode.cpp \
            src/test/hmac_tests.cpp \
            src/test/key_tests.cpp \
            src/test/main_tests.cpp \
+           src/test/mempool_tests.cpp \
            src/test/miner_tests.cpp \
            src/test/mruset_tests.cpp \
            src/test/multisig_tests.cpp \
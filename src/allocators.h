@@ -9,6 +9,7 @@
 #include <map>
 #include <string>
 #include <string.h>
+#include <type_traits>
 
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/once.hpp>
@@ -219,7 +220,10 @@ struct secure_allocator : public std::allocator<T>
 
 
 //
-// Allocator that clears its contents before deletion.
+// Allocator that clears its contents before deletion. Made with fZero=false it
+// does not, for buffers that only ever hold public data such as received
+// network messages. The choice goes along with the memory when containers are
+// swapped or moved.
 //
 template<typename T>
 struct zero_after_free_allocator : public std::allocator<T>
@@ -233,17 +237,21 @@ struct zero_after_free_allocator : public std::allocator<T>
     typedef typename base::reference reference;
     typedef typename base::const_reference const_reference;
     typedef typename base::value_type value_type;
-    zero_after_free_allocator() throw() {}
-    zero_after_free_allocator(const zero_after_free_allocator& a) throw() : base(a) {}
+    typedef std::true_type propagate_on_container_swap;
+    typedef std::true_type propagate_on_container_move_assignment;
+    bool fZero;
+    zero_after_free_allocator() throw() : fZero(true) {}
+    explicit zero_after_free_allocator(bool fZeroIn) throw() : fZero(fZeroIn) {}
+    zero_after_free_allocator(const zero_after_free_allocator& a) throw() : base(a), fZero(a.fZero) {}
     template <typename U>
-    zero_after_free_allocator(const zero_after_free_allocator<U>& a) throw() : base(a) {}
+    zero_after_free_allocator(const zero_after_free_allocator<U>& a) throw() : base(a), fZero(a.fZero) {}
     ~zero_after_free_allocator() throw() {}
     template<typename _Other> struct rebind
     { typedef zero_after_free_allocator<_Other> other; };
 
     void deallocate(T* p, std::size_t n)
     {
-        if (p != NULL)
+        if (p != NULL && fZero)
             OPENSSL_cleanse(p, sizeof(T) * n);
         std::allocator<T>::deallocate(p, n);
     }
@@ -0,0 +1,155 @@
+// Copyright (c) 2009-2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "hash.h"
+#include "main.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <limits>
+#include <map>
+#include <set>
+
+using namespace std;
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) :
+    nNonce(GetRand(std::numeric_limits<uint64_t>::max())), header(block.GetBlockHeader())
+{
+    FillShortTxIDSelector();
+
+    // The coinbase is never in the receiver's memory pool
+    CPrefilledTransaction prefilled;
+    prefilled.nIndex = 0;
+    prefilled.tx = block.vtx[0];
+    prefilledtxn.push_back(prefilled);
+
+    shorttxids.reserve(block.vtx.size() - 1);
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        shorttxids.push_back(GetShortID(block.vtx[i].GetHash()));
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortTxIDSelector() const
+{
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << header << nNonce;
+    uint256 hashSelector = ss.GetHash();
+    shorttxidk0 = hashSelector.Get64(0);
+    shorttxidk1 = hashSelector.Get64(1);
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
+{
+    return SipHashUint256(shorttxidk0, shorttxidk1, txhash) & 0xffffffffffffULL;
+}
+
+ReadStatus CPartialBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, CTxMemPool& pool, const vector<CTransaction>& vExtraTxn)
+{
+    SetNull();
+    if (cmpctblock.header.IsNull() || (cmpctblock.shorttxids.empty() && cmpctblock.prefilledtxn.empty()))
+        return READ_STATUS_INVALID;
+    // Every transaction takes at least 60 bytes of the block
+    if (cmpctblock.BlockTxCount() > MAX_BLOCK_SIZE / 60)
+        return READ_STATUS_INVALID;
+
+    unsigned int nTxCount = cmpctblock.BlockTxCount();
+    vtx.resize(nTxCount);
+    vHave.assign(nTxCount, false);
+
+    // Prefilled transactions may come in any order but each index only once
+    BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.prefilledtxn) {
+        if (prefilled.nIndex >= nTxCount || vHave[prefilled.nIndex] || prefilled.tx.IsNull())
+            return READ_STATUS_INVALID;
+        vtx[prefilled.nIndex] = prefilled.tx;
+        vHave[prefilled.nIndex] = true;
+    }
+
+    // The short IDs fill the remaining slots in order
+    map<uint64_t, unsigned int> mapShortIDs;
+    unsigned int nIndex = 0;
+    BOOST_FOREACH(uint64_t shortid, cmpctblock.shorttxids) {
+        while (vHave[nIndex])
+            nIndex++;
+        if (!mapShortIDs.insert(make_pair(shortid, nIndex)).second) {
+            // Two transactions of the block share a short ID
+            SetNull();
+            return READ_STATUS_FAILED;
+        }
+        nIndex++;
+    }
+
+    // Slots matched by more than one local transaction are left to getblocktxn
+    set<unsigned int> setCollided;
+    unsigned int nFound = 0;
+    {
+        LOCK(pool.cs);
+        for (map<uint256, CTxMemPoolEntry>::const_iterator it = pool.mapTx.begin(); it != pool.mapTx.end() && nFound < mapShortIDs.size(); ++it) {
+            map<uint64_t, unsigned int>::const_iterator mi = mapShortIDs.find(cmpctblock.GetShortID(it->first));
+            if (mi == mapShortIDs.end() || setCollided.count(mi->second))
+                continue;
+            if (vHave[mi->second]) {
+                vHave[mi->second] = false;
+                setCollided.insert(mi->second);
+                nFound--;
+                continue;
+            }
+            vtx[mi->second] = it->second.GetTx();
+            vHave[mi->second] = true;
+            nFound++;
+        }
+    }
+    for (unsigned int i = 0; i < vExtraTxn.size() && nFound < mapShortIDs.size(); i++) {
+        map<uint64_t, unsigned int>::const_iterator mi = mapShortIDs.find(cmpctblock.GetShortID(vExtraTxn[i].GetHash()));
+        if (mi == mapShortIDs.end() || vHave[mi->second] || setCollided.count(mi->second))
+            continue;
+        vtx[mi->second] = vExtraTxn[i];
+        vHave[mi->second] = true;
+        nFound++;
+    }
+
+    header = cmpctblock.header;
+    hashBlock = header.GetHash();
+    return READ_STATUS_OK;
+}
+
+bool CPartialBlock::IsTxAvailable(unsigned int nIndex) const
+{
+    assert(!IsNull());
+    assert(nIndex < vHave.size());
+    return vHave[nIndex];
+}
+
+vector<unsigned int> CPartialBlock::GetMissing() const
+{
+    vector<unsigned int> vMissing;
+    for (unsigned int i = 0; i < vHave.size(); i++)
+        if (!vHave[i])
+            vMissing.push_back(i);
+    return vMissing;
+}
+
+ReadStatus CPartialBlock::FillBlock(CBlock& block, const vector<CTransaction>& vMissingTxn) const
+{
+    assert(!IsNull());
+    block = CBlock(header);
+    block.vtx = vtx;
+
+    unsigned int nMissing = 0;
+    for (unsigned int i = 0; i < vHave.size(); i++) {
+        if (vHave[i])
+            continue;
+        if (nMissing >= vMissingTxn.size())
+            return READ_STATUS_INVALID;
+        block.vtx[i] = vMissingTxn[nMissing++];
+    }
+    if (nMissing != vMissingTxn.size())
+        return READ_STATUS_INVALID;
+
+    // A short ID that matched the wrong local transaction shows up here
+    if (block.BuildMerkleTree() != header.hashMerkleRoot)
+        return READ_STATUS_FAILED;
+
+    return READ_STATUS_OK;
+}
@@ -0,0 +1,181 @@
+// Copyright (c) 2009-2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "core.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <stdint.h>
+#include <vector>
+
+class CTxMemPool;
+
+/** Number of bytes of a short transaction ID on the wire */
+static const unsigned int SHORTTXIDS_LENGTH = 6;
+
+/** Serializes a list of short transaction IDs with SHORTTXIDS_LENGTH bytes each */
+class CShortTxIDList
+{
+private:
+    std::vector<uint64_t>& v;
+
+public:
+    CShortTxIDList(std::vector<uint64_t>& vIn) : v(vIn) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return GetSizeOfCompactSize(v.size()) + v.size() * SHORTTXIDS_LENGTH;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        WriteCompactSize(s, v.size());
+        for (unsigned int i = 0; i < v.size(); i++) {
+            uint32_t nLow = v[i] & 0xffffffff;
+            uint16_t nHigh = (v[i] >> 32) & 0xffff;
+            ::Serialize(s, nLow, nType, nVersion);
+            ::Serialize(s, nHigh, nType, nVersion);
+        }
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        // The count is not trusted; the vector only grows as IDs are actually read
+        uint64_t nSize = ReadCompactSize(s);
+        v.clear();
+        v.reserve(std::min(nSize, (uint64_t)100000));
+        for (uint64_t i = 0; i < nSize; i++) {
+            uint32_t nLow;
+            uint16_t nHigh;
+            ::Unserialize(s, nLow, nType, nVersion);
+            ::Unserialize(s, nHigh, nType, nVersion);
+            v.push_back(((uint64_t)nHigh << 32) | nLow);
+        }
+    }
+};
+
+/** A transaction that is sent in full with a compact block because the
+ *  receiver cannot have it yet (at least the coinbase). */
+class CPrefilledTransaction
+{
+public:
+    unsigned int nIndex;
+    CTransaction tx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(VARINT(nIndex));
+        READWRITE(tx);
+    )
+};
+
+/** A block as relayed to peers that support compact blocks: the header, a
+ *  salted 6-byte short ID for each transaction the peer probably has in its
+ *  memory pool, and the rest of the transactions in full. */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    mutable uint64_t shorttxidk0, shorttxidk1;
+    uint64_t nNonce;
+
+    void FillShortTxIDSelector() const;
+
+public:
+    CBlockHeader header;
+    std::vector<uint64_t> shorttxids;
+    std::vector<CPrefilledTransaction> prefilledtxn;
+
+    CBlockHeaderAndShortTxIDs() : shorttxidk0(0), shorttxidk1(0), nNonce(0) {}
+    CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    unsigned int BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
+
+    IMPLEMENT_SERIALIZE
+    (
+        CBlockHeaderAndShortTxIDs* pthis = const_cast<CBlockHeaderAndShortTxIDs*>(this);
+        READWRITE(header);
+        READWRITE(nNonce);
+        READWRITE(REF(CShortTxIDList(pthis->shorttxids)));
+        READWRITE(prefilledtxn);
+        if (fRead)
+            pthis->FillShortTxIDSelector();
+    )
+};
+
+/** Request for the transactions of a compact block that could not be found locally */
+class CBlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    std::vector<unsigned int> vIndexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(vIndexes);
+    )
+};
+
+/** Answer to a CBlockTransactionsRequest, with the transactions in the order they were asked for */
+class CBlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> txn;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(txn);
+    )
+};
+
+enum ReadStatus
+{
+    READ_STATUS_OK,
+    READ_STATUS_INVALID, // the peer sent something malformed
+    READ_STATUS_FAILED   // reconstruction failed (short ID collision), get the full block instead
+};
+
+/** A block being rebuilt from a compact block, the memory pool and the
+ *  transactions fetched with getblocktxn. */
+class CPartialBlock
+{
+private:
+    CBlockHeader header;
+    uint256 hashBlock;
+    std::vector<CTransaction> vtx;
+    std::vector<bool> vHave;
+
+public:
+    CPartialBlock() { SetNull(); }
+
+    void SetNull()
+    {
+        header.SetNull();
+        hashBlock = 0;
+        vtx.clear();
+        vHave.clear();
+    }
+
+    bool IsNull() const { return hashBlock == 0; }
+    const uint256& GetBlockHash() const { return hashBlock; }
+
+    // Place the prefilled transactions and look up the short IDs in pool and vExtraTxn
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, CTxMemPool& pool, const std::vector<CTransaction>& vExtraTxn);
+    bool IsTxAvailable(unsigned int nIndex) const;
+    // Indexes of the transactions that still have to be requested from the peer
+    std::vector<unsigned int> GetMissing() const;
+    // Complete the block with the missing transactions (in GetMissing() order) and check its merkle root
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vMissingTxn) const;
+};
+
+#endif // BITCOIN_BLOCKENCODINGS_H
@@ -0,0 +1,258 @@
+// Copyright (c) 2009-2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+
+#include "core.h"
+#include "hash.h"
+#include "main.h"
+#include "script.h"
+#include "serialize.h"
+
+#include <algorithm>
+
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+namespace {
+
+/** Writes bits most significant first */
+class CBitWriter
+{
+private:
+    vector<unsigned char>& vch;
+    unsigned char nBuffer;
+    int nBits;
+
+public:
+    CBitWriter(vector<unsigned char>& vchIn) : vch(vchIn), nBuffer(0), nBits(0) {}
+
+    void Write(uint64_t nValue, int nCount)
+    {
+        while (nCount > 0) {
+            int nTake = min(8 - nBits, nCount);
+            unsigned char nChunk = (nValue >> (nCount - nTake)) & ((1 << nTake) - 1);
+            nBuffer |= nChunk << (8 - nBits - nTake);
+            nBits += nTake;
+            nCount -= nTake;
+            if (nBits == 8) {
+                vch.push_back(nBuffer);
+                nBuffer = 0;
+                nBits = 0;
+            }
+        }
+    }
+
+    void Flush()
+    {
+        if (nBits > 0)
+            vch.push_back(nBuffer);
+        nBuffer = 0;
+        nBits = 0;
+    }
+};
+
+class CBitReader
+{
+private:
+    const vector<unsigned char>& vch;
+    size_t nPos;
+    int nBits; // bits of vch[nPos] already read
+
+public:
+    CBitReader(const vector<unsigned char>& vchIn, size_t nPosIn) : vch(vchIn), nPos(nPosIn), nBits(0) {}
+
+    uint64_t Read(int nCount)
+    {
+        uint64_t nValue = 0;
+        while (nCount > 0) {
+            if (nPos >= vch.size())
+                throw ios_base::failure("CBitReader::Read() : end of filter");
+            int nTake = min(8 - nBits, nCount);
+            nValue = (nValue << nTake) | ((vch[nPos] >> (8 - nBits - nTake)) & ((1 << nTake) - 1));
+            nBits += nTake;
+            nCount -= nTake;
+            if (nBits == 8) {
+                nPos++;
+                nBits = 0;
+            }
+        }
+        return nValue;
+    }
+};
+
+void GolombRiceEncode(CBitWriter& writer, uint8_t nP, uint64_t nValue)
+{
+    // Quotient in unary, then the remainder in nP bits
+    uint64_t nQuotient = nValue >> nP;
+    while (nQuotient > 0) {
+        int nCount = (int)min(nQuotient, (uint64_t)64);
+        writer.Write(~(uint64_t)0, nCount);
+        nQuotient -= nCount;
+    }
+    writer.Write(0, 1);
+    writer.Write(nValue, nP);
+}
+
+uint64_t GolombRiceDecode(CBitReader& reader, uint8_t nP)
+{
+    uint64_t nQuotient = 0;
+    while (reader.Read(1) == 1)
+        nQuotient++;
+    uint64_t nRemainder = reader.Read(nP);
+    return (nQuotient << nP) + nRemainder;
+}
+
+/** (x * n) >> 64, mapping a uniform 64-bit hash onto [0, n) without a division */
+uint64_t MapIntoRange(uint64_t x, uint64_t n)
+{
+#ifdef __SIZEOF_INT128__
+    return (uint64_t)(((unsigned __int128)x * n) >> 64);
+#else
+    uint64_t x_hi = x >> 32, x_lo = x & 0xFFFFFFFF;
+    uint64_t n_hi = n >> 32, n_lo = n & 0xFFFFFFFF;
+
+    uint64_t ac = x_hi * n_hi;
+    uint64_t ad = x_hi * n_lo;
+    uint64_t bc = x_lo * n_hi;
+    uint64_t bd = x_lo * n_lo;
+
+    uint64_t mid34 = (bd >> 32) + (bc & 0xFFFFFFFF) + (ad & 0xFFFFFFFF);
+    return ac + (bc >> 32) + (ad >> 32) + (mid34 >> 32);
+#endif
+}
+
+} // anon namespace
+
+CGCSFilter::CGCSFilter() : k0(0), k1(0), nP(BASIC_FILTER_P), nM(BASIC_FILTER_M), nElements(0), nF(0),
+    vchEncoded(1, 0) // an element count of zero
+{
+}
+
+CGCSFilter::CGCSFilter(uint64_t k0In, uint64_t k1In, uint8_t nPIn, uint32_t nMIn, const ElementSet& elements) :
+    k0(k0In), k1(k1In), nP(nPIn), nM(nMIn)
+{
+    if (elements.size() > numeric_limits<uint32_t>::max())
+        throw invalid_argument("CGCSFilter : too many elements");
+    nElements = elements.size();
+    nF = (uint64_t)nElements * nM;
+
+    vector<uint64_t> vHashed;
+    vHashed.reserve(nElements);
+    BOOST_FOREACH(const Element& element, elements)
+        vHashed.push_back(HashToRange(element));
+    sort(vHashed.begin(), vHashed.end());
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    WriteCompactSize(ss, nElements);
+    vchEncoded.assign(ss.begin(), ss.end());
+
+    CBitWriter writer(vchEncoded);
+    uint64_t nLast = 0;
+    BOOST_FOREACH(uint64_t nValue, vHashed) {
+        GolombRiceEncode(writer, nP, nValue - nLast);
+        nLast = nValue;
+    }
+    writer.Flush();
+}
+
+CGCSFilter::CGCSFilter(uint64_t k0In, uint64_t k1In, uint8_t nPIn, uint32_t nMIn, const vector<unsigned char>& vchEncodedIn) :
+    k0(k0In), k1(k1In), nP(nPIn), nM(nMIn), vchEncoded(vchEncodedIn)
+{
+    CDataStream ss(vchEncodedIn, SER_NETWORK, PROTOCOL_VERSION);
+    uint64_t nCount = ReadCompactSize(ss);
+    if (nCount > numeric_limits<uint32_t>::max())
+        throw ios_base::failure("CGCSFilter : too many elements");
+    nElements = nCount;
+    nF = (uint64_t)nElements * nM;
+
+    // Decode it all once, so that a truncated filter is noticed here rather than in Match
+    CBitReader reader(vchEncoded, GetSizeOfCompactSize(nCount));
+    for (uint32_t i = 0; i < nElements; i++)
+        GolombRiceDecode(reader, nP);
+}
+
+uint64_t CGCSFilter::HashToRange(const Element& element) const
+{
+    uint64_t nHash = CSipHasher(k0, k1).Write(element.empty() ? NULL : &element[0], element.size()).Finalize();
+    return MapIntoRange(nHash, nF);
+}
+
+bool CGCSFilter::MatchSorted(const vector<uint64_t>& vQueries) const
+{
+    CBitReader reader(vchEncoded, GetSizeOfCompactSize(nElements));
+    uint64_t nValue = 0;
+    vector<uint64_t>::const_iterator it = vQueries.begin();
+    for (uint32_t i = 0; i < nElements && it != vQueries.end(); i++) {
+        nValue += GolombRiceDecode(reader, nP);
+        // Both lists are sorted, so walk them together
+        while (it != vQueries.end() && *it < nValue)
+            it++;
+        if (it != vQueries.end() && *it == nValue)
+            return true;
+    }
+    return false;
+}
+
+bool CGCSFilter::Match(const Element& element) const
+{
+    return MatchSorted(vector<uint64_t>(1, HashToRange(element)));
+}
+
+bool CGCSFilter::MatchAny(const ElementSet& elements) const
+{
+    vector<uint64_t> vQueries;
+    vQueries.reserve(elements.size());
+    BOOST_FOREACH(const Element& element, elements)
+        vQueries.push_back(HashToRange(element));
+    sort(vQueries.begin(), vQueries.end());
+    return MatchSorted(vQueries);
+}
+
+static CGCSFilter::ElementSet BasicFilterElements(const CBlock& block, const CBlockUndo& blockundo)
+{
+    CGCSFilter::ElementSet elements;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        BOOST_FOREACH(const CTxOut& txout, tx.vout) {
+            const CScript& script = txout.scriptPubKey;
+            if (script.empty() || script[0] == OP_RETURN)
+                continue;
+            elements.insert(CGCSFilter::Element(script.begin(), script.end()));
+        }
+    }
+    BOOST_FOREACH(const CTxUndo& txundo, blockundo.vtxundo) {
+        BOOST_FOREACH(const CTxInUndo& txinundo, txundo.vprevout) {
+            const CScript& script = txinundo.txout.scriptPubKey;
+            if (script.empty())
+                continue;
+            elements.insert(CGCSFilter::Element(script.begin(), script.end()));
+        }
+    }
+    return elements;
+}
+
+CBlockFilter::CBlockFilter(const CBlock& block, const CBlockUndo& blockundo) :
+    hashBlock(block.GetHash()),
+    filter(hashBlock.Get64(0), hashBlock.Get64(1), BASIC_FILTER_P, BASIC_FILTER_M, BasicFilterElements(block, blockundo))
+{
+}
+
+CBlockFilter::CBlockFilter(const uint256& hashBlockIn, const vector<unsigned char>& vchEncoded) :
+    hashBlock(hashBlockIn),
+    filter(hashBlock.Get64(0), hashBlock.Get64(1), BASIC_FILTER_P, BASIC_FILTER_M, vchEncoded)
+{
+}
+
+uint256 CBlockFilter::GetHash() const
+{
+    const vector<unsigned char>& vch = filter.GetEncoded();
+    return Hash(vch.begin(), vch.end());
+}
+
+uint256 CBlockFilter::ComputeHeader(const uint256& hashPrevHeader) const
+{
+    uint256 hashFilter = GetHash();
+    return Hash(hashFilter.begin(), hashFilter.end(), hashPrevHeader.begin(), hashPrevHeader.end());
+}
@@ -0,0 +1,86 @@
+// Copyright (c) 2009-2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILTER_H
+#define BITCOIN_BLOCKFILTER_H
+
+#include "uint256.h"
+
+#include <set>
+#include <stdint.h>
+#include <vector>
+
+class CBlock;
+class CBlockUndo;
+
+/** Filter type of the basic block filter in getcfilters and friends */
+static const uint8_t BLOCK_FILTER_BASIC = 0;
+/** Golomb-Rice parameter of the basic block filter */
+static const uint8_t BASIC_FILTER_P = 19;
+/** Inverse false positive rate of the basic block filter */
+static const uint32_t BASIC_FILTER_M = 784931;
+/** Maximum number of blocks a getcfilters request may cover */
+static const unsigned int MAX_GETCFILTERS_SIZE = 1000;
+/** Maximum number of blocks a getcfheaders request may cover */
+static const unsigned int MAX_GETCFHEADERS_SIZE = 2000;
+/** Distance between the filter headers of a cfcheckpt reply */
+static const unsigned int CFCHECKPT_INTERVAL = 1000;
+
+/** Golomb-coded set (BIP 158): a compact, probabilistic set of byte strings.
+ *  Elements are hashed with SipHash into [0, N * M), sorted, and the
+ *  differences Golomb-Rice coded with parameter P. Any element matches with
+ *  probability 1/M if it was not added. */
+class CGCSFilter
+{
+public:
+    typedef std::vector<unsigned char> Element;
+    typedef std::set<Element> ElementSet;
+
+    CGCSFilter();
+    /** Build the filter of a set of elements */
+    CGCSFilter(uint64_t k0, uint64_t k1, uint8_t nP, uint32_t nM, const ElementSet& elements);
+    /** Wrap an encoded filter. Throws std::ios_base::failure if it is malformed. */
+    CGCSFilter(uint64_t k0, uint64_t k1, uint8_t nP, uint32_t nM, const std::vector<unsigned char>& vchEncodedIn);
+
+    uint32_t GetN() const { return nElements; }
+    const std::vector<unsigned char>& GetEncoded() const { return vchEncoded; }
+
+    bool Match(const Element& element) const;
+    /** Cheaper than calling Match for every element: the filter is decoded once */
+    bool MatchAny(const ElementSet& elements) const;
+
+private:
+    uint64_t k0, k1;
+    uint8_t nP;
+    uint32_t nM;
+    uint32_t nElements;
+    uint64_t nF;
+    std::vector<unsigned char> vchEncoded; // CompactSize element count followed by the Golomb-Rice bit stream
+
+    uint64_t HashToRange(const Element& element) const;
+    bool MatchSorted(const std::vector<uint64_t>& vQueries) const;
+};
+
+/** The basic filter of a block: the scripts of its outputs, except empty and
+ *  OP_RETURN ones, and the scripts of the outputs it spends. Light clients
+ *  fetch it to decide whether they need the block, rather than having every
+ *  block matched against their BIP 37 filter by the server. */
+class CBlockFilter
+{
+public:
+    uint256 hashBlock;
+    CGCSFilter filter;
+
+    CBlockFilter() {}
+    CBlockFilter(const CBlock& block, const CBlockUndo& blockundo);
+    /** Throws std::ios_base::failure if the filter is malformed */
+    CBlockFilter(const uint256& hashBlockIn, const std::vector<unsigned char>& vchEncoded);
+
+    /** Double SHA256 of the encoded filter */
+    uint256 GetHash() const;
+    /** Filter header, committing to this filter and all filters before it */
+    uint256 ComputeHeader(const uint256& hashPrevHeader) const;
+};
+
+#endif // BITCOIN_BLOCKFILTER_H
@@ -70,6 +70,10 @@ public:
         base58Prefixes[PUBKEY_ADDRESS] = std::vector<unsigned char>(1,18);
         base58Prefixes[SCRIPT_ADDRESS] = std::vector<unsigned char>(1,18);
         base58Prefixes[SECRET_KEY] =     std::vector<unsigned char>(1,28 + 128);            
+
+        // UTXO snapshots published for -loadsnapshot, checked against dumptxoutset's hash_serialized.
+        // Add an entry here together with the snapshot file when a new one is released:
+        // mapUTXOSnapshots[uint256("0x<block hash>")] = uint256("0x<hash_serialized>");
         
         for (unsigned int i = 0; i < ARRAYLEN(pnSeed); i++)
         {
@@ -130,6 +134,8 @@ public:
         base58Prefixes[SCRIPT_ADDRESS] = std::vector<unsigned char>(1,43);
         base58Prefixes[SECRET_KEY] =     std::vector<unsigned char>(1,88 + 128);
 
+        mapUTXOSnapshots.clear();
+
     }
     virtual Network NetworkID() const { return CChainParams::TESTNET; }
 };
@@ -160,6 +166,7 @@ public:
     }
 
     virtual bool RequireRPCPassword() const { return false; }
+    virtual bool RequireSnapshotCommitment() const { return false; }
     virtual Network NetworkID() const { return CChainParams::REGTEST; }
 };
 static CRegTestParams regTestParams;
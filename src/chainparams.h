@@ -9,6 +9,7 @@
 #include "bignum.h"
 #include "uint256.h"
 
+#include <map>
 #include <vector>
 
 using namespace std;
@@ -67,6 +68,10 @@ public:
     const std::vector<unsigned char> &Base58Prefix(Base58Type type) const { return base58Prefixes[type]; }
     virtual const vector<CAddress>& FixedSeeds() const = 0;
     int RPCPort() const { return nRPCPort; }
+    /** Known UTXO set commitments (block hash -> gettxoutsetinfo hash_serialized) accepted by -loadsnapshot */
+    const map<uint256, uint256>& UTXOSnapshots() const { return mapUTXOSnapshots; }
+    /** Whether -loadsnapshot only accepts snapshots listed in UTXOSnapshots() */
+    virtual bool RequireSnapshotCommitment() const { return true; }
 protected:
     CChainParams() {}
 
@@ -81,6 +86,7 @@ protected:
     string strDataDir;
     vector<CDNSSeedData> vSeeds;
     std::vector<unsigned char> base58Prefixes[MAX_BASE58_TYPES];
+    map<uint256, uint256> mapUTXOSnapshots;
 };
 
 /**
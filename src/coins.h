@@ -254,6 +254,28 @@ struct CCoinsStats
 };
 
 
+/** Cursor over a consistent state of a CCoinsView, as of when it was created. */
+class CCoinsViewCursor
+{
+public:
+    CCoinsViewCursor(const uint256 &hashBlockIn) : hashBlock(hashBlockIn) {}
+    virtual ~CCoinsViewCursor() {}
+
+    virtual bool GetKey(uint256 &txid) const = 0;
+    virtual bool GetValue(CCoins &coins) const = 0;
+    // Serialized size of the current value, as stored
+    virtual unsigned int GetValueSize() const = 0;
+
+    virtual bool Valid() const = 0;
+    virtual void Next() = 0;
+
+    // Get the best block at the time the cursor was created
+    const uint256 &GetBestBlock() const { return hashBlock; }
+
+private:
+    uint256 hashBlock;
+};
+
 /** Abstract view on the open txout dataset. */
 class CCoinsView
 {
@@ -280,6 +302,10 @@ public:
     // Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats &stats);
 
+    // Get a cursor to iterate over the whole state (NULL if not supported).
+    // Changes still held in caches above the backing store are not included.
+    virtual CCoinsViewCursor *Cursor();
+
     // As we use CCoinsViews polymorphically, have a virtual destructor
     virtual ~CCoinsView() {}
 };
@@ -301,6 +327,7 @@ public:
     void SetBackend(CCoinsView &viewIn);
     bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlock);
     bool GetStats(CCoinsStats &stats);
+    CCoinsViewCursor *Cursor();
 };
 
 
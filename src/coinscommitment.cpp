@@ -0,0 +1,134 @@
+// Copyright (c) 2009-2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinscommitment.h"
+
+#include "coins.h"
+#include "core.h"
+#include "hash.h"
+
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+
+namespace {
+
+const unsigned int MUHASH_BYTES = 384;
+
+const CBigNum& MuHashModulus()
+{
+    static const CBigNum bnModulus = (CBigNum(1) << 3072) - CBigNum(1103717);
+    return bnModulus;
+}
+
+/** Expand a 256-bit element hash to a number below the modulus */
+CBigNum ExpandElement(const uint256& hashElement)
+{
+    std::vector<unsigned char> vch;
+    vch.reserve(MUHASH_BYTES);
+    for (unsigned int i = 0; i < MUHASH_BYTES / 32; i++) {
+        CHashWriter ss(SER_GETHASH, 0);
+        ss << hashElement << i;
+        uint256 hash = ss.GetHash();
+        vch.insert(vch.end(), hash.begin(), hash.end());
+    }
+    CBigNum bn;
+    if (!BN_bin2bn(&vch[0], vch.size(), &bn))
+        throw bignum_error("ExpandElement : BN_bin2bn failed");
+    if (bn >= MuHashModulus())
+        bn -= MuHashModulus();
+    return bn;
+}
+
+void MulMod(CBigNum& bnAcc, const CBigNum& bn)
+{
+    CAutoBN_CTX pctx;
+    if (!BN_mod_mul(&bnAcc, &bnAcc, &bn, &MuHashModulus(), pctx))
+        throw bignum_error("CMuHash3072 : BN_mod_mul failed");
+}
+
+uint256 HashOutput(const COutPoint& out, const CTxOut& txout, int nHeight, bool fCoinBase)
+{
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << out << VARINT((unsigned int)nHeight * 2 + (fCoinBase ? 1 : 0)) << txout;
+    return ss.GetHash();
+}
+
+} // anon namespace
+
+void CMuHash3072::Insert(const uint256& hashElement)
+{
+    MulMod(bnNumerator, ExpandElement(hashElement));
+}
+
+void CMuHash3072::Remove(const uint256& hashElement)
+{
+    MulMod(bnDenominator, ExpandElement(hashElement));
+}
+
+uint256 CMuHash3072::GetHash() const
+{
+    CAutoBN_CTX pctx;
+    CBigNum bn;
+    if (!BN_mod_inverse(&bn, &bnDenominator, &MuHashModulus(), pctx))
+        throw bignum_error("CMuHash3072::GetHash : BN_mod_inverse failed");
+    MulMod(bn, bnNumerator);
+
+    std::vector<unsigned char> vch(MUHASH_BYTES, 0);
+    unsigned int nBytes = BN_num_bytes(&bn);
+    BN_bn2bin(&bn, &vch[MUHASH_BYTES - nBytes]);
+    return Hash(vch.begin(), vch.end());
+}
+
+void CCoinsCommitment::AddOutput(const COutPoint& out, const CTxOut& txout, int nHeight, bool fCoinBase)
+{
+    muhash.Insert(HashOutput(out, txout, nHeight, fCoinBase));
+    nTransactionOutputs++;
+    nTotalAmount += txout.nValue;
+}
+
+void CCoinsCommitment::RemoveOutput(const COutPoint& out, const CTxOut& txout, int nHeight, bool fCoinBase)
+{
+    muhash.Remove(HashOutput(out, txout, nHeight, fCoinBase));
+    nTransactionOutputs--;
+    nTotalAmount -= txout.nValue;
+}
+
+void CCoinsCommitment::AddCoins(const uint256& txid, const CCoins& coins)
+{
+    if (coins.IsPruned())
+        return;
+    for (unsigned int i = 0; i < coins.vout.size(); i++)
+        if (coins.IsAvailable(i))
+            AddOutput(COutPoint(txid, i), coins.vout[i], coins.nHeight, coins.fCoinBase);
+    nTransactions++;
+}
+
+void CCoinsCommitment::RemoveCoins(const uint256& txid, const CCoins& coins)
+{
+    if (coins.IsPruned())
+        return;
+    for (unsigned int i = 0; i < coins.vout.size(); i++)
+        if (coins.IsAvailable(i))
+            RemoveOutput(COutPoint(txid, i), coins.vout[i], coins.nHeight, coins.fCoinBase);
+    nTransactions--;
+}
+
+bool ComputeCoinsCommitment(CCoinsView& view, CCoinsCommitment& commitment, uint256& hashBlock)
+{
+    boost::scoped_ptr<CCoinsViewCursor> pcursor(view.Cursor());
+    if (!pcursor)
+        return false;
+    hashBlock = pcursor->GetBestBlock();
+    commitment = CCoinsCommitment();
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        uint256 txid;
+        CCoins coins;
+        if (!pcursor->GetKey(txid) || !pcursor->GetValue(coins))
+            return false;
+        commitment.AddCoins(txid, coins);
+        pcursor->Next();
+    }
+    return true;
+}
@@ -0,0 +1,79 @@
+// Copyright (c) 2009-2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_COINSCOMMITMENT_H
+#define BITCOIN_COINSCOMMITMENT_H
+
+#include "bignum.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <stdint.h>
+
+class CCoins;
+class CCoinsView;
+class COutPoint;
+class CTxOut;
+
+/** Multiset hash over the group of integers modulo 2^3072 - 1103717 (MuHash).
+ *
+ * Elements are expanded to 3072 bits and multiplied in, so the result does not
+ * depend on the order of insertion, and an element can be taken out again.
+ * Removed elements are collected in a separate denominator so that the (slow)
+ * modular inverse is only needed once, in GetHash().
+ */
+class CMuHash3072
+{
+private:
+    CBigNum bnNumerator;
+    CBigNum bnDenominator;
+
+public:
+    CMuHash3072() : bnNumerator(1), bnDenominator(1) {}
+
+    void Insert(const uint256& hashElement);
+    void Remove(const uint256& hashElement);
+    uint256 GetHash() const;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(bnNumerator);
+        READWRITE(bnDenominator);
+    )
+};
+
+/** Rolling summary of the UTXO set, maintained per block by ConnectBlock and
+ *  DisconnectBlock so that gettxoutsetinfo does not have to walk the chainstate. */
+class CCoinsCommitment
+{
+public:
+    uint64_t nTransactions;
+    uint64_t nTransactionOutputs;
+    int64_t nTotalAmount;
+    CMuHash3072 muhash;
+
+    CCoinsCommitment() : nTransactions(0), nTransactionOutputs(0), nTotalAmount(0) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(VARINT(nTransactions));
+        READWRITE(VARINT(nTransactionOutputs));
+        READWRITE(nTotalAmount);
+        READWRITE(muhash);
+    )
+
+    void AddOutput(const COutPoint& out, const CTxOut& txout, int nHeight, bool fCoinBase);
+    void RemoveOutput(const COutPoint& out, const CTxOut& txout, int nHeight, bool fCoinBase);
+
+    // Add or remove all unspent outputs of a transaction, counting it as one transaction
+    void AddCoins(const uint256& txid, const CCoins& coins);
+    void RemoveCoins(const uint256& txid, const CCoins& coins);
+
+    uint256 GetHash() const { return muhash.GetHash(); }
+};
+
+/** Compute the commitment for the full state of view from scratch (slow). */
+bool ComputeCoinsCommitment(CCoinsView& view, CCoinsCommitment& commitment, uint256& hashBlock);
+
+#endif // BITCOIN_COINSCOMMITMENT_H
@@ -38,6 +38,7 @@
 #include <ifaddrs.h>
 #include <limits.h>
 #include <netdb.h>
+#include <poll.h>
 #include <unistd.h>
 #endif
 
@@ -446,6 +446,7 @@ public:
     // memory only
     mutable CScript payee;
     mutable std::vector<uint256> vMerkleTree;
+    mutable bool fChecked; // context-free checks already passed (see CheckBlockStructure)
 
     CBlock()
     {
@@ -469,6 +470,7 @@ public:
         CBlockHeader::SetNull();
         vtx.clear();
         vMerkleTree.clear();
+        fChecked = false;
     }
 
     CBlockHeader GetBlockHeader() const
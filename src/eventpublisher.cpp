@@ -0,0 +1,481 @@
+// Copyright (c) 2014-2015 The Dash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "eventpublisher.h"
+
+#include "core.h"
+#include "main.h"
+#include "netbase.h"
+#include "sync.h"
+#include "ui_interface.h"
+#include "util.h"
+
+#include <deque>
+#include <list>
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+using namespace std;
+
+#ifndef WIN32
+namespace {
+
+enum EventTopic
+{
+    EVENT_HASHBLOCK,
+    EVENT_RAWBLOCK,
+    EVENT_HASHTX,
+    EVENT_RAWTX,
+    EVENT_HASHTXLOCK,
+    EVENT_RAWTXLOCK,
+    EVENT_MNLIST,
+    EVENT_TOPICS
+};
+
+const char* const pszEventTopics[EVENT_TOPICS] = {
+    "hashblock", "rawblock", "hashtx", "rawtx", "hashtxlock", "rawtxlock", "mnlist"
+};
+
+// Events waiting for the publisher thread beyond this are dropped
+const unsigned int MAX_QUEUED_EVENTS = 100000;
+
+/** An event on its way to the publisher thread */
+struct CEvent
+{
+    int nTopic;
+    uint32_t nSequence;
+    std::string strPayload;
+    const CBlockIndex* pindex; // rawblock: the block is read when it is published
+};
+
+struct CEventSubscriber
+{
+    SOCKET hSocket;
+    std::string strRecv;
+    bool fSubscribed[EVENT_TOPICS];
+    // Messages are shared by all subscribers of a topic
+    std::deque<boost::shared_ptr<const std::string> > queueSend;
+    size_t nSendOffset; // part of the front message already sent
+    size_t nQueuedBytes;
+    bool fDisconnect;
+
+    CEventSubscriber(SOCKET hSocketIn) : hSocket(hSocketIn), nSendOffset(0), nQueuedBytes(0), fDisconnect(false)
+    {
+        for (int i = 0; i < EVENT_TOPICS; i++)
+            fSubscribed[i] = false;
+    }
+};
+
+class CEventPublisher
+{
+public:
+    CEventPublisher() : hListenSocket(INVALID_SOCKET)
+    {
+        hWakePipe[0] = hWakePipe[1] = -1;
+        for (int i = 0; i < EVENT_TOPICS; i++) {
+            nSubscribers[i] = 0;
+            nSequence[i] = 0;
+        }
+    }
+
+    bool Bind(const std::string& strPathIn, std::string& strError);
+    void Run();
+
+    // Cheap check so that nothing is serialized for topics nobody reads
+    bool IsWanted(int nTopic)
+    {
+        LOCK(cs);
+        return nSubscribers[nTopic] > 0;
+    }
+    void Queue(int nTopic, const std::string& strPayload, const CBlockIndex* pindex = NULL);
+
+private:
+    CCriticalSection cs;
+    // Protected by cs
+    std::deque<CEvent> queueEvents;
+    unsigned int nSubscribers[EVENT_TOPICS];
+    uint32_t nSequence[EVENT_TOPICS];
+
+    // Only used by the publisher thread
+    SOCKET hListenSocket;
+    int hWakePipe[2];
+    std::string strPath;
+    std::list<CEventSubscriber> vSubscribers;
+
+    void Accept();
+    void Receive(CEventSubscriber& subscriber);
+    void Subscribe(CEventSubscriber& subscriber, const std::string& strTopic);
+    void SendQueued(CEventSubscriber& subscriber);
+    void PublishQueued();
+    void Disconnect(CEventSubscriber& subscriber);
+    void CloseAll();
+};
+
+CEventPublisher eventPublisher;
+
+bool CEventPublisher::Bind(const std::string& strPathIn, std::string& strError)
+{
+    struct sockaddr_un sockaddr;
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sun_family = AF_UNIX;
+    if (strPathIn.size() >= sizeof(sockaddr.sun_path)) {
+        strError = strprintf(_("Event socket path is too long: '%s'"), strPathIn);
+        return false;
+    }
+    memcpy(sockaddr.sun_path, strPathIn.c_str(), strPathIn.size());
+
+    // A socket left behind by an unclean shutdown would make bind fail;
+    // anything else at that path is not ours to remove
+    struct stat st;
+    if (lstat(strPathIn.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(strPathIn.c_str());
+
+    hListenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (hListenSocket == INVALID_SOCKET) {
+        strError = strprintf(_("Couldn't open socket for event subscribers (socket returned error %s)"), NetworkErrorString(WSAGetLastError()));
+        return false;
+    }
+    if (fcntl(hListenSocket, F_SETFL, O_NONBLOCK) == SOCKET_ERROR) {
+        strError = strprintf(_("Couldn't set properties on socket for event subscribers (error %s)"), NetworkErrorString(WSAGetLastError()));
+        return false;
+    }
+    if (::bind(hListenSocket, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) == SOCKET_ERROR) {
+        strError = strprintf(_("Unable to bind event socket to %s (bind returned error %s)"), strPathIn, NetworkErrorString(WSAGetLastError()));
+        return false;
+    }
+    strPath = strPathIn;
+    if (listen(hListenSocket, SOMAXCONN) == SOCKET_ERROR) {
+        strError = strprintf(_("Listening for event subscribers failed (listen returned error %s)"), NetworkErrorString(WSAGetLastError()));
+        return false;
+    }
+
+    // Lets Queue() wake the publisher thread right away
+    if (pipe(hWakePipe) != 0 ||
+        fcntl(hWakePipe[0], F_SETFL, O_NONBLOCK) == -1 ||
+        fcntl(hWakePipe[1], F_SETFL, O_NONBLOCK) == -1) {
+        strError = strprintf(_("Couldn't create event publisher wake-up pipe (error %s)"), NetworkErrorString(errno));
+        return false;
+    }
+
+    LogPrintf("Event publisher bound to %s\n", strPath);
+    return true;
+}
+
+void CEventPublisher::Queue(int nTopic, const std::string& strPayload, const CBlockIndex* pindex)
+{
+    {
+        LOCK(cs);
+        if (nSubscribers[nTopic] == 0)
+            return;
+        // The sequence number is taken even if the event is dropped, so the gap shows
+        CEvent event;
+        event.nTopic = nTopic;
+        event.nSequence = nSequence[nTopic]++;
+        if (queueEvents.size() >= MAX_QUEUED_EVENTS)
+            return;
+        queueEvents.push_back(event);
+        queueEvents.back().strPayload = strPayload;
+        queueEvents.back().pindex = pindex;
+    }
+    char c = 0;
+    if (write(hWakePipe[1], &c, 1) < 0) {
+        // The pipe is full, so the thread is going to wake up anyway
+    }
+}
+
+void CEventPublisher::Run()
+{
+    try {
+        while (true) {
+            struct timeval timeout;
+            timeout.tv_sec  = 0;
+            timeout.tv_usec = 100000; // frequency to check for shutdown
+
+            fd_set fdsetRecv;
+            fd_set fdsetSend;
+            FD_ZERO(&fdsetRecv);
+            FD_ZERO(&fdsetSend);
+            SOCKET hSocketMax = max(hListenSocket, (SOCKET)hWakePipe[0]);
+            FD_SET(hListenSocket, &fdsetRecv);
+            FD_SET(hWakePipe[0], &fdsetRecv);
+            BOOST_FOREACH(CEventSubscriber& subscriber, vSubscribers) {
+                FD_SET(subscriber.hSocket, &fdsetRecv);
+                if (!subscriber.queueSend.empty())
+                    FD_SET(subscriber.hSocket, &fdsetSend);
+                hSocketMax = max(hSocketMax, subscriber.hSocket);
+            }
+
+            int nSelect = select(hSocketMax + 1, &fdsetRecv, &fdsetSend, NULL, &timeout);
+            boost::this_thread::interruption_point();
+            if (nSelect == SOCKET_ERROR) {
+                LogPrintf("Event publisher socket select error %s\n", NetworkErrorString(WSAGetLastError()));
+                MilliSleep(timeout.tv_usec/1000);
+                continue;
+            }
+
+            if (FD_ISSET(hWakePipe[0], &fdsetRecv)) {
+                char pchBuf[256];
+                while (read(hWakePipe[0], pchBuf, sizeof(pchBuf)) > 0)
+                    ;
+            }
+            if (FD_ISSET(hListenSocket, &fdsetRecv))
+                Accept();
+
+            BOOST_FOREACH(CEventSubscriber& subscriber, vSubscribers) {
+                if (!subscriber.fDisconnect && FD_ISSET(subscriber.hSocket, &fdsetRecv))
+                    Receive(subscriber);
+                if (!subscriber.fDisconnect && FD_ISSET(subscriber.hSocket, &fdsetSend))
+                    SendQueued(subscriber);
+            }
+
+            PublishQueued();
+
+            for (std::list<CEventSubscriber>::iterator it = vSubscribers.begin(); it != vSubscribers.end(); ) {
+                if (it->fDisconnect) {
+                    LogPrint("eventpub", "Event subscriber disconnected\n");
+                    Disconnect(*it);
+                    vSubscribers.erase(it++);
+                } else {
+                    it++;
+                }
+            }
+        }
+    } catch (...) {
+        // Interrupted or failed; TraceThread logs the latter
+        CloseAll();
+        throw;
+    }
+}
+
+void CEventPublisher::Accept()
+{
+    SOCKET hSocket = accept(hListenSocket, NULL, NULL);
+    if (hSocket == INVALID_SOCKET) {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("Event publisher socket error accept failed: %s\n", NetworkErrorString(nErr));
+        return;
+    }
+    if (vSubscribers.size() >= MAX_EVENT_SUBSCRIBERS || hSocket >= FD_SETSIZE) {
+        closesocket(hSocket);
+        return;
+    }
+    LogPrint("eventpub", "Accepted event subscriber\n");
+    vSubscribers.push_back(CEventSubscriber(hSocket));
+}
+
+void CEventPublisher::Receive(CEventSubscriber& subscriber)
+{
+    char pchBuf[0x1000];
+    int nBytes = recv(subscriber.hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes == 0) {
+        subscriber.fDisconnect = true;
+        return;
+    }
+    if (nBytes < 0) {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+            subscriber.fDisconnect = true;
+        return;
+    }
+
+    subscriber.strRecv.append(pchBuf, nBytes);
+    size_t nPos;
+    while ((nPos = subscriber.strRecv.find('\n')) != std::string::npos) {
+        std::string strLine = subscriber.strRecv.substr(0, nPos);
+        subscriber.strRecv.erase(0, nPos + 1);
+        if (!strLine.empty() && strLine[strLine.size() - 1] == '\r')
+            strLine.erase(strLine.size() - 1);
+        if (!strLine.empty())
+            Subscribe(subscriber, strLine);
+    }
+    if (subscriber.strRecv.size() > MAX_EVENT_SUBSCRIBE_LINE)
+        subscriber.fDisconnect = true;
+}
+
+void CEventPublisher::Subscribe(CEventSubscriber& subscriber, const std::string& strTopic)
+{
+    for (int i = 0; i < EVENT_TOPICS; i++) {
+        if (strTopic == pszEventTopics[i]) {
+            if (!subscriber.fSubscribed[i]) {
+                subscriber.fSubscribed[i] = true;
+                LOCK(cs);
+                nSubscribers[i]++;
+            }
+            return;
+        }
+    }
+    LogPrint("eventpub", "Event subscriber asked for unknown topic %s\n", SanitizeString(strTopic));
+}
+
+void CEventPublisher::Disconnect(CEventSubscriber& subscriber)
+{
+    closesocket(subscriber.hSocket);
+    LOCK(cs);
+    for (int i = 0; i < EVENT_TOPICS; i++)
+        if (subscriber.fSubscribed[i])
+            nSubscribers[i]--;
+}
+
+void CEventPublisher::SendQueued(CEventSubscriber& subscriber)
+{
+    while (!subscriber.queueSend.empty()) {
+        const std::string& strMessage = *subscriber.queueSend.front();
+        int nBytes = send(subscriber.hSocket, strMessage.data() + subscriber.nSendOffset, strMessage.size() - subscriber.nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (nBytes < 0) {
+            int nErr = WSAGetLastError();
+            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                subscriber.fDisconnect = true;
+            return;
+        }
+        subscriber.nSendOffset += nBytes;
+        if (subscriber.nSendOffset < strMessage.size())
+            return;
+        subscriber.nQueuedBytes -= strMessage.size();
+        subscriber.nSendOffset = 0;
+        subscriber.queueSend.pop_front();
+    }
+}
+
+void CEventPublisher::PublishQueued()
+{
+    std::deque<CEvent> queue;
+    {
+        LOCK(cs);
+        queue.swap(queueEvents);
+    }
+
+    BOOST_FOREACH(CEvent& event, queue) {
+        if (event.pindex) {
+            // Off the validation thread, and without cs_main: block files are append-only
+            CBlock block;
+            if (!ReadBlockFromDisk(block, event.pindex)) {
+                LogPrintf("Event publisher could not read block %s\n", event.pindex->GetBlockHash().ToString());
+                continue;
+            }
+            CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+            ssBlock << block;
+            event.strPayload.assign(ssBlock.begin(), ssBlock.end());
+        }
+
+        CDataStream ssMessage(SER_NETWORK, PROTOCOL_VERSION);
+        ssMessage << std::string(pszEventTopics[event.nTopic]) << event.nSequence << event.strPayload;
+        CDataStream ssFrame(SER_NETWORK, PROTOCOL_VERSION);
+        ssFrame << (uint32_t)ssMessage.size();
+        boost::shared_ptr<std::string> pMessage(new std::string(ssFrame.begin(), ssFrame.end()));
+        pMessage->append(ssMessage.begin(), ssMessage.end());
+
+        BOOST_FOREACH(CEventSubscriber& subscriber, vSubscribers) {
+            if (subscriber.fDisconnect || !subscriber.fSubscribed[event.nTopic])
+                continue;
+            // A subscriber that does not keep up misses events, it does not hold up the node
+            if (subscriber.nQueuedBytes + pMessage->size() > MAX_EVENT_SUBSCRIBER_QUEUE)
+                continue;
+            subscriber.queueSend.push_back(pMessage);
+            subscriber.nQueuedBytes += pMessage->size();
+            SendQueued(subscriber);
+        }
+    }
+}
+
+void CEventPublisher::CloseAll()
+{
+    BOOST_FOREACH(CEventSubscriber& subscriber, vSubscribers)
+        Disconnect(subscriber);
+    vSubscribers.clear();
+    if (hListenSocket != INVALID_SOCKET) {
+        closesocket(hListenSocket);
+        unlink(strPath.c_str());
+    }
+    hListenSocket = INVALID_SOCKET;
+    {
+        LOCK(cs);
+        queueEvents.clear();
+    }
+}
+
+void PublishTransactionEvents(int nTopicHash, int nTopicRaw, const CTransaction& tx)
+{
+    if (eventPublisher.IsWanted(nTopicHash)) {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << tx.GetHash();
+        eventPublisher.Queue(nTopicHash, std::string(ss.begin(), ss.end()));
+    }
+    if (eventPublisher.IsWanted(nTopicRaw)) {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << tx;
+        eventPublisher.Queue(nTopicRaw, std::string(ss.begin(), ss.end()));
+    }
+}
+
+void ThreadEventPublisher()
+{
+    eventPublisher.Run();
+}
+
+} // anon namespace
+#endif // WIN32
+
+bool StartEventPublisher(boost::thread_group& threadGroup, std::string& strError)
+{
+#ifdef WIN32
+    strError = _("-eventsocket is not supported on Windows");
+    return false;
+#else
+    boost::filesystem::path path(GetArg("-eventsocket", ""));
+    if (!path.is_complete())
+        path = GetDataDir() / path;
+    if (!eventPublisher.Bind(path.string(), strError))
+        return false;
+
+    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "eventpub", &ThreadEventPublisher));
+    return true;
+#endif
+}
+
+void PublishBlock(const CBlockIndex* pindex)
+{
+#ifndef WIN32
+    if (eventPublisher.IsWanted(EVENT_HASHBLOCK)) {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << pindex->GetBlockHash();
+        eventPublisher.Queue(EVENT_HASHBLOCK, std::string(ss.begin(), ss.end()));
+    }
+    eventPublisher.Queue(EVENT_RAWBLOCK, "", pindex);
+#endif
+}
+
+void PublishTransaction(const CTransaction& tx)
+{
+#ifndef WIN32
+    PublishTransactionEvents(EVENT_HASHTX, EVENT_RAWTX, tx);
+#endif
+}
+
+void PublishTransactionLock(const CTransaction& tx)
+{
+#ifndef WIN32
+    PublishTransactionEvents(EVENT_HASHTXLOCK, EVENT_RAWTXLOCK, tx);
+#endif
+}
+
+void PublishMasternodeChange(const COutPoint& outpoint, bool fAdded)
+{
+#ifndef WIN32
+    if (eventPublisher.IsWanted(EVENT_MNLIST)) {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << outpoint << fAdded;
+        eventPublisher.Queue(EVENT_MNLIST, std::string(ss.begin(), ss.end()));
+    }
+#endif
+}
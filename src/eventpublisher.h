@@ -0,0 +1,40 @@
+// Copyright (c) 2014-2015 The Dash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_EVENTPUBLISHER_H
+#define BITCOIN_EVENTPUBLISHER_H
+
+#include <string>
+
+#include <boost/thread.hpp>
+
+class CBlockIndex;
+class COutPoint;
+class CTransaction;
+
+/** Maximum number of processes subscribed to -eventsocket at once */
+static const unsigned int MAX_EVENT_SUBSCRIBERS = 32;
+/** Events queued for a subscriber that does not keep up before new ones are dropped */
+static const unsigned int MAX_EVENT_SUBSCRIBER_QUEUE = 32 * 1024 * 1024;
+/** Maximum length of a subscription line sent by a subscriber */
+static const unsigned int MAX_EVENT_SUBSCRIBE_LINE = 256;
+
+/** Start publishing events on the Unix domain socket at -eventsocket.
+ *  Subscribers write the topics they want, one per line: hashblock,
+ *  rawblock, hashtx, rawtx, hashtxlock, rawtxlock or mnlist. Each event is
+ *  sent as a 4-byte length followed by the topic (string), a per-topic
+ *  sequence number (uint32) and the payload (string), serialized as on the
+ *  P2P network. A skipped sequence number means events were dropped. */
+bool StartEventPublisher(boost::thread_group& threadGroup, std::string& strError);
+
+/** Called for each block connected to the tip; the block is read from disk by the publisher thread */
+void PublishBlock(const CBlockIndex* pindex);
+/** Called when a transaction enters the memory pool or is connected in a block */
+void PublishTransaction(const CTransaction& tx);
+/** Called when an InstantX lock on tx is complete */
+void PublishTransactionLock(const CTransaction& tx);
+/** Called when a masternode is added to or removed from the list */
+void PublishMasternodeChange(const COutPoint& outpoint, bool fAdded);
+
+#endif // BITCOIN_EVENTPUBLISHER_H
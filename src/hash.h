@@ -179,6 +179,24 @@ inline uint160 Hash160(const std::vector<unsigned char>& vch)
 
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
+/** SipHash-2-4, a fast keyed 64-bit hash for short inputs */
+class CSipHasher
+{
+private:
+    uint64_t v[4];
+    uint64_t tmp;
+    int count;
+
+public:
+    CSipHasher(uint64_t k0, uint64_t k1);
+    CSipHasher& Write(uint64_t data);
+    CSipHasher& Write(const unsigned char* data, size_t size);
+    uint64_t Finalize() const;
+};
+
+/** SipHash-2-4 of a 256-bit value, the same as CSipHasher(k0, k1).Write(val.begin(), 32).Finalize() */
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
+
 typedef struct
 {
     SHA512_CTX ctxInner;
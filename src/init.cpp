@@ -12,12 +12,16 @@
 
 #include "addrman.h"
 #include "checkpoints.h"
+#include "eventpublisher.h"
+#include "instantx.h"
 #include "key.h"
 #include "main.h"
 #include "miner.h"
 #include "net.h"
 #include "rpcserver.h"
+#include "stratum.h"
 #include "txdb.h"
+#include "utxosnapshot.h"
 #include "ui_interface.h"
 #include "util.h"
 #include "activemasternode.h"
@@ -61,6 +65,9 @@ int nWalletBackups = 10;
 #define MIN_CORE_FILEDESCRIPTORS 150
 #endif
 
+// Seconds to wait before verifying again when a new best block cut the background check short
+static const int VERIFYDB_RETRY_INTERVAL = 10;
+
 // Used to pass flags to the Bind() function
 enum BindFlags {
     BF_NONE         = 0,
@@ -142,6 +149,11 @@ void Shutdown()
 
     RenameThread("patriotbit-shutoff");
     mempool.AddTransactionsUpdated(1);
+    {
+        // Let getblocktemplate longpolls see the shutdown
+        boost::unique_lock<boost::mutex> lock(csBestBlock);
+        cvBlockChange.notify_all();
+    }
     StopRPCThreads();
     ShutdownRPCMining();
 #ifdef ENABLE_WALLET
@@ -151,6 +163,10 @@ void Shutdown()
 #endif
     StopNode();
     DumpMasternodes();
+    if (GetBoolArg("-persistmempool", true)) {
+        DumpMempool();
+        DumpTransactionLocks();
+    }
     UnregisterNodeSignals(GetNodeSignals());
     {
         LOCK(cs_main);
@@ -166,6 +182,7 @@ void Shutdown()
         delete pcoinscatcher; pcoinscatcher = NULL;
         delete pcoinsdbview; pcoinsdbview = NULL;
         delete pblocktree; pblocktree = NULL;
+        delete pblockfilterdb; pblockfilterdb = NULL;
     }
 #ifdef ENABLE_WALLET
     if (pwalletMain)
@@ -223,9 +240,11 @@ std::string HelpMessage(HelpMessageMode hmm)
     string strUsage = _("Options:") + "\n";
     strUsage += "  -?                     " + _("This help message") + "\n";
     strUsage += "  -alertnotify=<cmd>     " + _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)") + "\n";
+    strUsage += "  -blockfilterindex      " + _("Maintain compact block filters and serve them to light clients (default: 0)") + "\n";
     strUsage += "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n";
     strUsage += "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 288, 0 = all)") + "\n";
     strUsage += "  -checklevel=<n>        " + _("How thorough the block verification of -checkblocks is (0-4, default: 3)") + "\n";
+    strUsage += "  -checkblocksasync      " + _("Run the -checkblocks verification in the background once the node has started (default: 1)") + "\n";
     strUsage += "  -conf=<file>           " + _("Specify configuration file (default: patriotbit.conf)") + "\n";
     if (hmm == HMM_BITCOIND)
     {
@@ -235,9 +254,19 @@ std::string HelpMessage(HelpMessageMode hmm)
     }
     strUsage += "  -datadir=<dir>         " + _("Specify data directory") + "\n";
     strUsage += "  -dbcache=<n>           " + strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache) + "\n";
+    strUsage += "  -eventsocket=<path>    " + _("Publish block, transaction, InstantX lock and masternode list events to subscribers of the Unix socket at <path>") + "\n";
+    strUsage += "  -importthreads=<n>     " + strprintf(_("Set the number of threads parsing the block index at startup and blocks during -reindex and -loadblock (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_IMPORT_THREADS, DEFAULT_IMPORT_THREADS) + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + " " + _("on startup") + "\n";
+    strUsage += "  -loadsnapshot=<file>   " + _("Start from a UTXO snapshot written by dumptxoutset instead of downloading the chain, if no blocks are known yet") + "\n";
     strUsage += "  -maxorphanblocks=<n>   " + strprintf(_("Keep at most <n> unconnectable blocks in memory (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";
     strUsage += "  -maxorphantx=<n>       " + strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS) + "\n";
+    strUsage += "  -maxmempool=<n>        " + strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE) + "\n";
+    strUsage += "  -mempoolexpiry=<n>     " + strprintf(_("Do not keep transactions in the mempool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY) + "\n";
+    strUsage += "  -limitancestorcount=<n>   " + strprintf(_("Do not accept transactions with more than <n> unconfirmed ancestors, themselves included (default: %u)"), DEFAULT_ANCESTOR_LIMIT) + "\n";
+    strUsage += "  -limitancestorsize=<n>    " + strprintf(_("Do not accept transactions whose unconfirmed ancestors, themselves included, exceed <n> kilobytes (default: %u)"), DEFAULT_ANCESTOR_SIZE_LIMIT) + "\n";
+    strUsage += "  -limitdescendantcount=<n> " + strprintf(_("Do not accept transactions that would give an unconfirmed transaction more than <n> descendants, itself included (default: %u)"), DEFAULT_DESCENDANT_LIMIT) + "\n";
+    strUsage += "  -limitdescendantsize=<n>  " + strprintf(_("Do not accept transactions that would take an unconfirmed transaction and its descendants over <n> kilobytes (default: %u)"), DEFAULT_DESCENDANT_SIZE_LIMIT) + "\n";
+    strUsage += "  -persistmempool        " + _("Save the mempool and InstantX lock state on shutdown and load them on startup (default: 1)") + "\n";
     strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS) + "\n";
     strUsage += "  -pid=<file>            " + _("Specify pid file (default: patriotbitd.pid)") + "\n";
     strUsage += "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + " " + _("on startup") + "\n";
@@ -258,6 +287,7 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -maxconnections=<n>    " + _("Maintain at most <n> connections to peers (default: 125)") + "\n";
     strUsage += "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n";
     strUsage += "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n";
+    strUsage += "  -msghandthreads=<n>    " + strprintf(_("Number of threads processing peer messages (1-%d, default: %d)"), MAX_MSGHAND_THREADS, DEFAULT_MSGHAND_THREADS) + "\n";
     strUsage += "  -onion=<ip:port>       " + _("Use separate SOCKS5 proxy to reach peers via Tor hidden services (default: -proxy)") + "\n";
     strUsage += "  -onlynet=<net>         " + _("Only connect to nodes in network <net> (IPv4, IPv6 or Tor)") + "\n";
     strUsage += "  -port=<port>           " + _("Listen for connections on <port> (default: 11994 or testnet: 21994)") + "\n";
@@ -362,14 +392,25 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -blockminsize=<n>      " + _("Set minimum block size in bytes (default: 0)") + "\n";
     strUsage += "  -blockmaxsize=<n>      " + strprintf(_("Set maximum block size in bytes (default: %d)"), DEFAULT_BLOCK_MAX_SIZE) + "\n";
     strUsage += "  -blockprioritysize=<n> " + strprintf(_("Set maximum size of high-priority/low-fee transactions in bytes (default: %d)"), DEFAULT_BLOCK_PRIORITY_SIZE) + "\n";
+    strUsage += "  -longpollfeedelta=<amt> " + _("Answer getblocktemplate longpolls once this much in fees has entered the mempool (default:") + " " + FormatMoney(DEFAULT_LONGPOLL_FEE_DELTA) + ")" + "\n";
+
+    strUsage += "\n" + _("Stratum server options:") + "\n";
+    strUsage += "  -stratum               " + _("Accept Stratum mining connections (default: 0)") + "\n";
+    strUsage += "  -stratumaddress=<addr> " + _("Pay the rewards of blocks found by Stratum miners to <addr>") + "\n";
+    strUsage += "  -stratumbind=<addr>    " + _("Bind the Stratum server to given address (default: 127.0.0.1, or all IPv4 interfaces with -stratumallowip)") + "\n";
+    strUsage += "  -stratumallowip=<ip>   " + _("Allow Stratum connections from specified IP address, wildcards allowed (default: this host only)") + "\n";
+    strUsage += "  -stratumport=<port>    " + strprintf(_("Listen for Stratum connections on <port> (default: %u)"), DEFAULT_STRATUM_PORT) + "\n";
+    strUsage += "  -stratumdifficulty=<n> " + _("Share difficulty for Stratum miners (default: 1)") + "\n";
 
     strUsage += "\n" + _("RPC server options:") + "\n";
     strUsage += "  -server                " + _("Accept command line and JSON-RPC commands") + "\n";
+    strUsage += "  -rest                  " + _("Accept public REST requests (default: 0)") + "\n";
     strUsage += "  -rpcuser=<user>        " + _("Username for JSON-RPC connections") + "\n";
     strUsage += "  -rpcpassword=<pw>      " + _("Password for JSON-RPC connections") + "\n";
     strUsage += "  -rpcport=<port>        " + _("Listen for JSON-RPC connections on <port> (default: 9998 or testnet: 19998)") + "\n";
     strUsage += "  -rpcallowip=<ip>       " + _("Allow JSON-RPC connections from specified IP address") + "\n";
-    strUsage += "  -rpcthreads=<n>        " + _("Set the number of threads to service RPC calls (default: 4)") + "\n";
+    strUsage += "  -rpcthreads=<n>        " + strprintf(_("Set the number of threads to service RPC calls (default: %d)"), DEFAULT_RPC_THREADS) + "\n";
+    strUsage += "  -rpcworkqueue=<n>      " + strprintf(_("Set the depth of the work queue to service RPC calls (default: %d)"), DEFAULT_RPC_WORK_QUEUE) + "\n";
 
     strUsage += "\n" + _("RPC SSL options: (see the Bitcoin Wiki for SSL setup instructions)") + "\n";
     strUsage += "  -rpcssl                                  " + _("Use OpenSSL (https) for JSON-RPC connections") + "\n";
@@ -393,6 +434,12 @@ struct CImportingNow
     }
 };
 
+void DumpMempoolState()
+{
+    DumpMempool();
+    DumpTransactionLocks();
+}
+
 void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
 {
     RenameThread("patriotbit-loadblk");
@@ -400,6 +447,8 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
     // -reindex
     if (fReindex) {
         CImportingNow imp;
+        // Out-of-order blocks may have their parent in a later file; dropped once the reindex is over
+        std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
         int nFile = 0;
         while (true) {
             CDiskBlockPos pos(nFile, 0);
@@ -407,9 +456,11 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
             if (!file)
                 break;
             LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
-            LoadExternalBlockFile(file, &pos);
+            LoadExternalBlockFile(file, &pos, &mapBlocksUnknownParent);
             nFile++;
         }
+        if (!mapBlocksUnknownParent.empty())
+            LogPrintf("Reindexing skipped %u blocks whose parent was never found\n", (unsigned int)mapBlocksUnknownParent.size());
         pblocktree->WriteReindexing(false);
         fReindex = false;
         LogPrintf("Reindexing finished\n");
@@ -443,6 +494,29 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
             LogPrintf("Warning: Could not open blocks file %s\n", path.string());
         }
     }
+
+    // Only once the chain is in place can the saved transactions be validated
+    if (GetBoolArg("-persistmempool", true))
+        LoadMempool();
+}
+
+void ThreadVerifyDB(int nCheckLevel, int nCheckDepth)
+{
+    RenameThread("patriotbit-verifydb");
+    int64_t nStart = GetTimeMillis();
+    while (true) {
+        bool fComplete;
+        if (!VerifyDB(nCheckLevel, nCheckDepth, &fComplete)) {
+            AbortNode(_("Corrupted block database detected") + ". " + _("Please restart with -reindex."));
+            return;
+        }
+        if (fComplete)
+            break;
+        // The new blocks were connected against the unverified ones, so start over from the new tip
+        LogPrintf("Background block verification interrupted by a new best block, blocks not verified yet; retrying in %ds\n", VERIFYDB_RETRY_INTERVAL);
+        MilliSleep(VERIFYDB_RETRY_INTERVAL * 1000);
+    }
+    LogPrintf("Background block verification finished in %dms\n", GetTimeMillis() - nStart);
 }
 
 /** Sanity checks
@@ -571,10 +645,20 @@ bool AppInit2(boost::thread_group& threadGroup)
             LogPrintf("AppInit2 : parameter interaction: -zapwallettxes=1 -> setting -rescan=1\n");
     }
 
+    // The filter headers commit to every block from genesis, and a snapshot
+    // leaves the blocks below it unconnected
+    if (mapArgs.count("-loadsnapshot") && GetBoolArg("-blockfilterindex", false))
+        return InitError(_("-blockfilterindex cannot be used with -loadsnapshot"));
+
     // Make sure enough file descriptors are available
-    int nBind = std::max((int)mapArgs.count("-bind"), 1);
     nMaxConnections = GetArg("-maxconnections", 125);
+#ifdef WIN32
+    int nBind = std::max((int)mapArgs.count("-bind"), 1);
+    // The network thread falls back to select() on Windows, which cannot watch more than FD_SETSIZE sockets
     nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
+#else
+    nMaxConnections = std::max(nMaxConnections, 0);
+#endif
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
@@ -649,6 +733,14 @@ bool AppInit2(boost::thread_group& threadGroup)
         else
             return InitError(strprintf(_("Invalid amount for -minrelaytxfee=<amount>: '%s'"), mapArgs["-minrelaytxfee"]));
     }
+    if (mapArgs.count("-longpollfeedelta"))
+    {
+        int64_t n = 0;
+        if (ParseMoney(mapArgs["-longpollfeedelta"], n) && n > 0)
+            nLongPollFeeDelta = n;
+        else
+            return InitError(strprintf(_("Invalid amount for -longpollfeedelta=<amount>: '%s'"), mapArgs["-longpollfeedelta"]));
+    }
 
 #ifdef ENABLE_WALLET
     if (mapArgs.count("-paytxfee"))
@@ -971,6 +1063,11 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", false))
         nBlockTreeDBCache = (1 << 21); // block tree db cache shouldn't be larger than 2 MiB
     nTotalCache -= nBlockTreeDBCache;
+    size_t nBlockFilterDBCache = 0;
+    if (GetBoolArg("-blockfilterindex", false)) {
+        nBlockFilterDBCache = std::min(nTotalCache / 8, (size_t)(1 << 23)); // block filter db cache shouldn't be larger than 8 MiB
+        nTotalCache -= nBlockFilterDBCache;
+    }
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
     nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
@@ -990,8 +1087,12 @@ bool AppInit2(boost::thread_group& threadGroup)
                 delete pcoinsdbview;
                 delete pcoinscatcher;
                 delete pblocktree;
+                delete pblockfilterdb;
+                pblockfilterdb = NULL;
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
+                if (GetBoolArg("-blockfilterindex", false))
+                    pblockfilterdb = new CBlockFilterDB(nBlockFilterDBCache, false, fReindex);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
                 pcoinscatcher = new CCoinsViewErrorCatcher(*pcoinsdbview);
                 pcoinsTip = new CCoinsViewCache(*pcoinscatcher);
@@ -1021,12 +1122,38 @@ bool AppInit2(boost::thread_group& threadGroup)
                     break;
                 }
 
-                uiInterface.InitMessage(_("Verifying blocks..."));
-                if (!VerifyDB(GetArg("-checklevel", 3),
-                              GetArg("-checkblocks", 288))) {
-                    strLoadError = _("Corrupted block database detected");
+                // The filter headers chain back to the genesis block, so the index is built from the start
+                if (fBlockFilterIndex != GetBoolArg("-blockfilterindex", false)) {
+                    strLoadError = _("You need to rebuild the database using -reindex to change -blockfilterindex");
                     break;
                 }
+
+                // A snapshot load that got interrupted leaves coins without a matching best block
+                bool fLoadingSnapshot = false;
+                pblocktree->ReadFlag("loadingsnapshot", fLoadingSnapshot);
+                if (fLoadingSnapshot) {
+                    strLoadError = _("Loading the UTXO snapshot did not complete");
+                    break;
+                }
+
+                if (mapArgs.count("-loadsnapshot") && chainActive.Height() == 0 && !fReindex) {
+                    uiInterface.InitMessage(_("Loading UTXO snapshot..."));
+                    boost::filesystem::path pathSnapshot(mapArgs["-loadsnapshot"]);
+                    if (!pathSnapshot.is_complete())
+                        pathSnapshot = GetDataDir() / pathSnapshot;
+                    std::string strError;
+                    if (!LoadUTXOSnapshot(pathSnapshot, strError))
+                        return InitError(strprintf(_("Unable to load UTXO snapshot %s: %s"), pathSnapshot.string(), strError));
+                }
+
+                if (!GetBoolArg("-checkblocksasync", true)) {
+                    uiInterface.InitMessage(_("Verifying blocks..."));
+                    if (!VerifyDB(GetArg("-checklevel", 3),
+                                  GetArg("-checkblocks", 288))) {
+                        strLoadError = _("Corrupted block database detected");
+                        break;
+                    }
+                }
             } catch(std::exception &e) {
                 if (fDebug) LogPrintf("%s\n", e.what());
                 strLoadError = _("Error opening block database");
@@ -1177,6 +1304,7 @@ bool AppInit2(boost::thread_group& threadGroup)
         LogPrintf(" wallet      %15dms\n", GetTimeMillis() - nStart);
 
         RegisterWallet(pwalletMain);
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "walletnotify", &ThreadWalletNotifications));
 
         CBlockIndex *pindexRescan = chainActive.Tip();
         if (GetBoolArg("-rescan", false))
@@ -1217,6 +1345,12 @@ bool AppInit2(boost::thread_group& threadGroup)
         BOOST_FOREACH(string strFile, mapMultiArgs["-loadblock"])
             vImportFiles.push_back(strFile);
     }
+    // Lock state goes in before the mempool, so that ThreadImport does not re-accept
+    // transactions that conflict with a lock
+    if (GetBoolArg("-persistmempool", true)) {
+        LoadTransactionLocks();
+        threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpmempool", &DumpMempoolState, MEMPOOL_DUMP_INTERVAL * 1000));
+    }
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
 
     // ********************************************************* Step 10: setup DarkSend
@@ -1377,11 +1511,36 @@ bool AppInit2(boost::thread_group& threadGroup)
     LogPrintf("mapAddressBook.size() = %u\n",  pwalletMain ? pwalletMain->mapAddressBook.size() : 0);
 #endif
 
+    if (fBlockFilterIndex)
+        nLocalServices |= NODE_COMPACT_FILTERS;
+
+    // Until the blocks below a loaded UTXO snapshot are downloaded and checked
+    // against it, we are not a full node for them
+    bool fValidateSnapshot = IsSnapshotValidationPending();
+    if (fValidateSnapshot)
+        nLocalServices &= ~NODE_NETWORK;
+    else
+        boost::filesystem::remove_all(GetDataDir() / "snapshotcheck");
+
     StartNode(threadGroup);
+    if (fValidateSnapshot)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "snapshotcheck", &ThreadValidateSnapshot));
+    if (GetBoolArg("-checkblocksasync", true) && !fReindex)
+        threadGroup.create_thread(boost::bind(&ThreadVerifyDB, GetArg("-checklevel", 3), GetArg("-checkblocks", 288)));
     // InitRPCMining is needed here so getwork/getblocktemplate in the GUI debug console works properly.
     InitRPCMining();
     if (fServer)
         StartRPCThreads();
+    if (GetBoolArg("-stratum", false)) {
+        std::string strError;
+        if (!StartStratumServer(threadGroup, strError))
+            return InitError(strError);
+    }
+    if (mapArgs.count("-eventsocket")) {
+        std::string strError;
+        if (!StartEventPublisher(threadGroup, strError))
+            return InitError(strError);
+    }
 
 #ifdef ENABLE_WALLET
     // Generate coins in the background
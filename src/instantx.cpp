@@ -14,6 +14,8 @@
 #include "masternodeman.h"
 #include "darksend.h"
 #include "spork.h"
+#include "eventpublisher.h"
+#include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
 
 using namespace std;
@@ -26,6 +28,21 @@ std::map<uint256, CTransactionLock> mapTxLocks;
 std::map<COutPoint, uint256> mapLockedInputs;
 std::map<uint256, int64_t> mapUnknownVotes; //track votes with no tx for DOS
 int nCompleteTXLocks;
+unsigned int nTXLockGeneration = 0;
+CCriticalSection cs_instantx;
+
+// Hand a lock to the event publisher the first time it is complete, whichever of its
+// transaction and its votes arrived last. Requires cs_instantx.
+static void PublishLockIfComplete(CTransaction& tx)
+{
+    std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(tx.GetHash());
+    if (i == mapTxLocks.end() || (*i).second.fPublished)
+        return;
+    if ((*i).second.CountSignatures() < INSTANTX_SIGNATURES_REQUIRED || CheckForConflictingLocks(tx))
+        return;
+    (*i).second.fPublished = true;
+    PublishTransactionLock(tx);
+}
 
 //txlock - Locks transaction
 //
@@ -49,8 +66,11 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
         CInv inv(MSG_TXLOCK_REQUEST, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        if(mapTxLockReq.count(tx.GetHash()) || mapTxLockReqRejected.count(tx.GetHash())){
-            return;
+        {
+            LOCK(cs_instantx);
+            if(mapTxLockReq.count(tx.GetHash()) || mapTxLockReqRejected.count(tx.GetHash())){
+                return;
+            }
         }
 
         if(!IsIXTXValid(tx)){
@@ -64,6 +84,8 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
             }
         }
 
+        // cs_main before cs_instantx, and never the other way around
+        LOCK(cs_main);
         int nBlockHeight = CreateNewLock(tx);
 
         bool fMissingInputs = false;
@@ -74,13 +96,20 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
         {
             vector<CInv> vInv;
             vInv.push_back(inv);
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-                pnode->PushMessage("inv", vInv);
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                    pnode->PushMessage("inv", vInv);
+            }
 
             DoConsensusVote(tx, nBlockHeight);
 
-            mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
+            {
+                LOCK(cs_instantx);
+                mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
+                // votes that came before the request are only counted now that the lock has a height
+                PublishLockIfComplete(tx);
+            }
 
             LogPrintf("ProcessMessageInstantX::txlreq - Transaction Lock Request: %s %s : accepted %s\n",
                 pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
@@ -90,36 +119,46 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
             return;
 
         } else {
-            mapTxLockReqRejected.insert(make_pair(tx.GetHash(), tx));
+            bool fCompleteLock = false;
+            {
+                LOCK(cs_instantx);
+                mapTxLockReqRejected.insert(make_pair(tx.GetHash(), tx));
 
-            // can we get the conflicting transaction as proof?
+                // can we get the conflicting transaction as proof?
 
-            LogPrintf("ProcessMessageInstantX::txlreq - Transaction Lock Request: %s %s : rejected %s\n",
-                pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
-                tx.GetHash().ToString().c_str()
-            );
+                LogPrintf("ProcessMessageInstantX::txlreq - Transaction Lock Request: %s %s : rejected %s\n",
+                    pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
+                    tx.GetHash().ToString().c_str()
+                );
 
-            BOOST_FOREACH(const CTxIn& in, tx.vin){
-                if(!mapLockedInputs.count(in.prevout)){
-                    mapLockedInputs.insert(make_pair(in.prevout, tx.GetHash()));
+                BOOST_FOREACH(const CTxIn& in, tx.vin){
+                    if(!mapLockedInputs.count(in.prevout)){
+                        mapLockedInputs.insert(make_pair(in.prevout, tx.GetHash()));
+                    }
                 }
-            }
 
-            // resolve conflicts
-            std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(tx.GetHash());
-            if (i != mapTxLocks.end()){
-                //we only care if we have a complete tx lock
-                if((*i).second.CountSignatures() >= INSTANTX_SIGNATURES_REQUIRED){
-                    if(!CheckForConflictingLocks(tx)){
-                        LogPrintf("ProcessMessageInstantX::txlreq - Found Existing Complete IX Lock\n");
-
-                        CValidationState state;
-                        DisconnectBlockAndInputs(state, tx);
-                        mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
+                // resolve conflicts
+                std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(tx.GetHash());
+                if (i != mapTxLocks.end()){
+                    //we only care if we have a complete tx lock
+                    if((*i).second.CountSignatures() >= INSTANTX_SIGNATURES_REQUIRED){
+                        if(!CheckForConflictingLocks(tx)){
+                            LogPrintf("ProcessMessageInstantX::txlreq - Found Existing Complete IX Lock\n");
+                            fCompleteLock = true;
+                        }
                     }
                 }
             }
 
+            // Disconnecting reaches into the wallets, so it runs without cs_instantx
+            if(fCompleteLock){
+                CValidationState state;
+                DisconnectBlockAndInputs(state, tx);
+                LOCK(cs_instantx);
+                mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
+                PublishLockIfComplete(tx);
+            }
+
             return;
         }
     }
@@ -131,11 +170,14 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
         CInv inv(MSG_TXLOCK_VOTE, ctx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        if(mapTxLockVote.count(ctx.GetHash())){
-            return;
-        }
+        {
+            LOCK(cs_instantx);
+            if(mapTxLockVote.count(ctx.GetHash())){
+                return;
+            }
 
-        mapTxLockVote.insert(make_pair(ctx.GetHash(), ctx));
+            mapTxLockVote.insert(make_pair(ctx.GetHash(), ctx));
+        }
 
         if(ProcessConsensusVote(ctx)){
             //Spam/Dos protection
@@ -144,20 +186,23 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
                 This tracks those messages and allows it at the same rate of the rest of the network, if
                 a peer violates it, it will simply be ignored
             */
-            if(!mapTxLockReq.count(ctx.txHash) && !mapTxLockReqRejected.count(ctx.txHash)){
-                if(!mapUnknownVotes.count(ctx.vinMasternode.prevout.hash)){
-                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] = GetTime()+(60*10);
-                }
+            {
+                LOCK(cs_instantx);
+                if(!mapTxLockReq.count(ctx.txHash) && !mapTxLockReqRejected.count(ctx.txHash)){
+                    if(!mapUnknownVotes.count(ctx.vinMasternode.prevout.hash)){
+                        mapUnknownVotes[ctx.vinMasternode.prevout.hash] = GetTime()+(60*10);
+                    }
 
-                if(mapUnknownVotes[ctx.vinMasternode.prevout.hash] > GetTime() &&
-                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] - GetAverageVoteTime() > 60*10){
-                        LogPrintf("ProcessMessageInstantX::txlreq - masternode is spamming transaction votes: %s %s\n",
-                            ctx.vinMasternode.ToString().c_str(),
-                            ctx.txHash.ToString().c_str()
-                        );
-                        return;
-                } else {
-                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] = GetTime()+(60*10);
+                    if(mapUnknownVotes[ctx.vinMasternode.prevout.hash] > GetTime() &&
+                        mapUnknownVotes[ctx.vinMasternode.prevout.hash] - GetAverageVoteTime() > 60*10){
+                            LogPrintf("ProcessMessageInstantX::txlreq - masternode is spamming transaction votes: %s %s\n",
+                                ctx.vinMasternode.ToString().c_str(),
+                                ctx.txHash.ToString().c_str()
+                            );
+                            return;
+                    } else {
+                        mapUnknownVotes[ctx.vinMasternode.prevout.hash] = GetTime()+(60*10);
+                    }
                 }
             }
             vector<CInv> vInv;
@@ -238,6 +283,7 @@ int64_t CreateNewLock(CTransaction tx)
     */
     int nBlockHeight = (chainActive.Tip()->nHeight - nTxAge)+4;
 
+    LOCK(cs_instantx);
     if (!mapTxLocks.count(tx.GetHash())){
         LogPrintf("CreateNewLock - New Transaction Lock %s !\n", tx.GetHash().ToString().c_str());
 
@@ -294,7 +340,10 @@ void DoConsensusVote(CTransaction& tx, int64_t nBlockHeight)
         return;
     }
 
-    mapTxLockVote[ctx.GetHash()] = ctx;
+    {
+        LOCK(cs_instantx);
+        mapTxLockVote[ctx.GetHash()] = ctx;
+    }
 
     CInv inv(MSG_TXLOCK_VOTE, ctx.GetHash());
 
@@ -337,32 +386,32 @@ bool ProcessConsensusVote(CConsensusVote& ctx)
         return false;
     }
 
-    if (!mapTxLocks.count(ctx.txHash)){
-        LogPrintf("InstantX::ProcessConsensusVote - New Transaction Lock %s !\n", ctx.txHash.ToString().c_str());
+    // Wallets and the chain are updated once cs_instantx has been released
+    bool fCompleteLock = false;
+    bool fRejectedLock = false;
+    CTransaction txRejected;
+    {
+        LOCK(cs_instantx);
+        if (!mapTxLocks.count(ctx.txHash)){
+            LogPrintf("InstantX::ProcessConsensusVote - New Transaction Lock %s !\n", ctx.txHash.ToString().c_str());
+
+            CTransactionLock newLock;
+            newLock.nBlockHeight = 0;
+            newLock.nExpiration = GetTime()+(60*60);
+            newLock.nTimeout = GetTime()+(60*5);
+            newLock.txHash = ctx.txHash;
+            mapTxLocks.insert(make_pair(ctx.txHash, newLock));
+        } else {
+            if(fDebug) LogPrintf("InstantX::ProcessConsensusVote - Transaction Lock Exists %s !\n", ctx.txHash.ToString().c_str());
+        }
 
-        CTransactionLock newLock;
-        newLock.nBlockHeight = 0;
-        newLock.nExpiration = GetTime()+(60*60);
-        newLock.nTimeout = GetTime()+(60*5);
-        newLock.txHash = ctx.txHash;
-        mapTxLocks.insert(make_pair(ctx.txHash, newLock));
-    } else {
-        if(fDebug) LogPrintf("InstantX::ProcessConsensusVote - Transaction Lock Exists %s !\n", ctx.txHash.ToString().c_str());
-    }
+        //compile consessus vote
+        std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(ctx.txHash);
+        if (i == mapTxLocks.end())
+            return false;
 
-    //compile consessus vote
-    std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(ctx.txHash);
-    if (i != mapTxLocks.end()){
         (*i).second.AddSignature(ctx);
 
-#ifdef ENABLE_WALLET
-        if(pwalletMain){
-            //when we get back signatures, we'll count them as requests. Otherwise the client will think it didn't propagate.
-            if(pwalletMain->mapRequestCount.count(ctx.txHash))
-                pwalletMain->mapRequestCount[ctx.txHash]++;
-        }
-#endif
-
         if(fDebug) LogPrintf("InstantX::ProcessConsensusVote - Transaction Lock Votes %d - %s !\n", (*i).second.CountSignatures(), ctx.GetHash().ToString().c_str());
 
         if((*i).second.CountSignatures() >= INSTANTX_SIGNATURES_REQUIRED){
@@ -370,16 +419,10 @@ bool ProcessConsensusVote(CConsensusVote& ctx)
 
             CTransaction& tx = mapTxLockReq[ctx.txHash];
             if(!CheckForConflictingLocks(tx)){
-
-#ifdef ENABLE_WALLET
-                if(pwalletMain){
-                    if(pwalletMain->UpdatedTransaction((*i).second.txHash)){
-                        nCompleteTXLocks++;
-                    }
-                }
-#endif
+                fCompleteLock = true;
 
                 if(mapTxLockReq.count(ctx.txHash)){
+                    PublishLockIfComplete(tx);
                     BOOST_FOREACH(const CTxIn& in, tx.vin){
                         if(!mapLockedInputs.count(in.prevout)){
                             mapLockedInputs.insert(make_pair(in.prevout, ctx.txHash));
@@ -391,16 +434,34 @@ bool ProcessConsensusVote(CConsensusVote& ctx)
 
                 //if this tx lock was rejected, we need to remove the conflicting blocks
                 if(mapTxLockReqRejected.count((*i).second.txHash)){
-                    CValidationState state;
-                    DisconnectBlockAndInputs(state, mapTxLockReqRejected[(*i).second.txHash]);
+                    fRejectedLock = true;
+                    txRejected = mapTxLockReqRejected[(*i).second.txHash];
                 }
             }
         }
-        return true;
     }
 
+#ifdef ENABLE_WALLET
+    if(pwalletMain){
+        //when we get back signatures, we'll count them as requests. Otherwise the client will think it didn't propagate.
+        {
+            LOCK(pwalletMain->cs_wallet);
+            if(pwalletMain->mapRequestCount.count(ctx.txHash))
+                pwalletMain->mapRequestCount[ctx.txHash]++;
+        }
+        if(fCompleteLock && pwalletMain->UpdatedTransaction(ctx.txHash)){
+            nCompleteTXLocks++;
+        }
+    }
+#endif
 
-    return false;
+    if(fRejectedLock){
+        LOCK(cs_main);
+        CValidationState state;
+        DisconnectBlockAndInputs(state, txRejected);
+    }
+
+    return true;
 }
 
 bool CheckForConflictingLocks(CTransaction& tx)
@@ -412,6 +473,7 @@ bool CheckForConflictingLocks(CTransaction& tx)
         Blocks could have been rejected during this time, which is OK. After they cancel out, the client will
         rescan the blocks and find they're acceptable and then take the chain with the most work.
     */
+    LOCK(cs_instantx);
     BOOST_FOREACH(const CTxIn& in, tx.vin){
         if(mapLockedInputs.count(in.prevout)){
             if(mapLockedInputs[in.prevout] != tx.GetHash()){
@@ -428,6 +490,7 @@ bool CheckForConflictingLocks(CTransaction& tx)
 
 int64_t GetAverageVoteTime()
 {
+    LOCK(cs_instantx);
     std::map<uint256, int64_t>::iterator it = mapUnknownVotes.begin();
     int64_t total = 0;
     int64_t count = 0;
@@ -445,6 +508,7 @@ void CleanTransactionLocksList()
 {
     if(chainActive.Tip() == NULL) return;
 
+    LOCK(cs_instantx);
     std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.begin();
 
     while(it != mapTxLocks.end()) {
@@ -486,6 +550,7 @@ void CleanTransactionLocksList()
             }
 
             mapTxLocks.erase(it++);
+            nTXLockGeneration++;
         } else {
             it++;
         }
@@ -493,6 +558,136 @@ void CleanTransactionLocksList()
 
 }
 
+static const int TXLOCKS_DUMP_VERSION = 1;
+
+// Set once txlocks.dat has been read or found unusable, so that an empty state is never
+// written over locks that could still be loaded
+static bool fTxLocksLoaded = false;
+
+bool DumpTransactionLocks()
+{
+    if (!fTxLocksLoaded)
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    CDataStream ssLocks(SER_DISK, CLIENT_VERSION);
+    unsigned int nLocks;
+    {
+        LOCK(cs_instantx);
+        nLocks = mapTxLocks.size();
+        ssLocks << TXLOCKS_DUMP_VERSION << FLATDATA(Params().MessageStart());
+        ssLocks << mapTxLockReq << mapTxLocks << mapLockedInputs << mapTxLockVote;
+    }
+    uint256 hash = Hash(ssLocks.begin(), ssLocks.end());
+    ssLocks << hash;
+
+    boost::filesystem::path path = GetDataDir() / "txlocks.dat";
+    boost::filesystem::path pathTmp = GetDataDir() / "txlocks.dat.new";
+    CAutoFile fileout = CAutoFile(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("%s : Failed to open file %s", __func__, pathTmp.string());
+    try {
+        fileout << ssLocks;
+    }
+    catch (std::exception &e) {
+        return error("%s : Serialize or I/O error - %s", __func__, e.what());
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+    if (!RenameOver(pathTmp, path))
+        return error("%s : Failed to rename %s", __func__, pathTmp.string());
+
+    LogPrintf("Written %u transaction locks to txlocks.dat  %dms\n", nLocks, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool LoadTransactionLocks()
+{
+    int64_t nStart = GetTimeMillis();
+    boost::filesystem::path path = GetDataDir() / "txlocks.dat";
+    CAutoFile filein = CAutoFile(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein) {
+        LogPrintf("Missing transaction lock file - txlocks.dat, will try to recreate\n");
+        fTxLocksLoaded = true;
+        return true;
+    }
+
+    int dataSize = boost::filesystem::file_size(path) - sizeof(uint256);
+    if (dataSize < 0)
+        dataSize = 0;
+    vector<unsigned char> vchData(dataSize);
+    uint256 hashIn;
+    try {
+        if (dataSize > 0)
+            filein.read((char *)&vchData[0], dataSize);
+        filein >> hashIn;
+    }
+    catch (std::exception &e) {
+        fTxLocksLoaded = true;
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    filein.fclose();
+
+    CDataStream ssLocks(vchData, SER_DISK, CLIENT_VERSION);
+    // An unusable file is safe to overwrite with the next dump
+    if (hashIn != Hash(ssLocks.begin(), ssLocks.end())) {
+        fTxLocksLoaded = true;
+        return error("%s : Checksum mismatch, data corrupted", __func__);
+    }
+
+    std::map<uint256, CTransaction> mapTxLockReqIn;
+    std::map<uint256, CTransactionLock> mapTxLocksIn;
+    std::map<COutPoint, uint256> mapLockedInputsIn;
+    std::map<uint256, CConsensusVote> mapTxLockVoteIn;
+    try {
+        int nVersion;
+        unsigned char pchMsgTmp[4];
+        ssLocks >> nVersion >> FLATDATA(pchMsgTmp);
+        if (nVersion != TXLOCKS_DUMP_VERSION || memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
+            fTxLocksLoaded = true;
+            return error("%s : txlocks.dat is of a different version or network", __func__);
+        }
+        ssLocks >> mapTxLockReqIn >> mapTxLocksIn >> mapLockedInputsIn >> mapTxLockVoteIn;
+    }
+    catch (std::exception &e) {
+        fTxLocksLoaded = true;
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+
+    // Locks that expired while we were down are dropped the way
+    // CleanTransactionLocksList would have, without blaming masternodes for it
+    LOCK(cs_instantx);
+    int nExpired = 0;
+    for (std::map<uint256, CTransactionLock>::iterator it = mapTxLocksIn.begin(); it != mapTxLocksIn.end(); ) {
+        if (GetTime() > it->second.nExpiration) {
+            std::map<uint256, CTransaction>::iterator itReq = mapTxLockReqIn.find(it->second.txHash);
+            if (itReq != mapTxLockReqIn.end()) {
+                BOOST_FOREACH(const CTxIn& in, itReq->second.vin)
+                    mapLockedInputsIn.erase(in.prevout);
+                mapTxLockReqIn.erase(itReq);
+            }
+            BOOST_FOREACH(CConsensusVote& v, it->second.vecConsensusVotes)
+                mapTxLockVoteIn.erase(v.GetHash());
+            mapTxLocksIn.erase(it++);
+            nExpired++;
+        } else {
+            // Subscribers heard about complete locks before the restart
+            it->second.fPublished = it->second.CountSignatures() >= INSTANTX_SIGNATURES_REQUIRED;
+            it++;
+        }
+    }
+
+    mapTxLockReq.insert(mapTxLockReqIn.begin(), mapTxLockReqIn.end());
+    mapTxLocks.insert(mapTxLocksIn.begin(), mapTxLocksIn.end());
+    mapLockedInputs.insert(mapLockedInputsIn.begin(), mapLockedInputsIn.end());
+    mapTxLockVote.insert(mapTxLockVoteIn.begin(), mapTxLockVoteIn.end());
+    nTXLockGeneration++;
+    fTxLocksLoaded = true;
+
+    LogPrintf("Loaded %u transaction locks from txlocks.dat (%d expired)  %dms\n", mapTxLocksIn.size(), nExpired, GetTimeMillis() - nStart);
+    return true;
+}
+
 uint256 CConsensusVote::GetHash() const
 {
     return vinMasternode.prevout.hash + vinMasternode.prevout.n + txHash;
@@ -30,6 +30,10 @@ extern map<uint256, CConsensusVote> mapTxLockVote;
 extern map<uint256, CTransactionLock> mapTxLocks;
 extern std::map<COutPoint, uint256> mapLockedInputs;
 extern int nCompleteTXLocks;
+// bumped whenever locks are removed from or loaded into mapTxLocks
+extern unsigned int nTXLockGeneration;
+// guards the maps above; taken after cs_main and cs_wallet, never before them
+extern CCriticalSection cs_instantx;
 
 
 int64_t CreateNewLock(CTransaction tx);
@@ -52,6 +56,10 @@ void CleanTransactionLocksList();
 
 int64_t GetAverageVoteTime();
 
+// keep the lock state across restarts (txlocks.dat)
+bool DumpTransactionLocks();
+bool LoadTransactionLocks();
+
 class CConsensusVote
 {
 public:
@@ -82,11 +90,24 @@ public:
     std::vector<CConsensusVote> vecConsensusVotes;
     int nExpiration;
     int nTimeout;
+    // set once the complete lock was handed to the event publisher; not persisted
+    bool fPublished;
+
+    CTransactionLock() : fPublished(false) {}
 
     bool SignaturesValid();
     int CountSignatures();
     void AddSignature(CConsensusVote& cv);
 
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nBlockHeight);
+        READWRITE(txHash);
+        READWRITE(vecConsensusVotes);
+        READWRITE(nExpiration);
+        READWRITE(nTimeout);
+    )
+
     uint256 GetHash()
     {
         return txHash;
@@ -150,6 +150,21 @@ public:
     leveldb::Iterator *NewIterator() {
         return pdb->NewIterator(iteroptions);
     }
+
+    // iterate over the state of the database at the time GetSnapshot was called
+    leveldb::Iterator *NewIterator(const leveldb::Snapshot *snapshot) {
+        leveldb::ReadOptions options = iteroptions;
+        options.snapshot = snapshot;
+        return pdb->NewIterator(options);
+    }
+
+    const leveldb::Snapshot *GetSnapshot() {
+        return pdb->GetSnapshot();
+    }
+
+    void ReleaseSnapshot(const leveldb::Snapshot *snapshot) {
+        pdb->ReleaseSnapshot(snapshot);
+    }
 };
 
 #endif // BITCOIN_LEVELDBWRAPPER_H
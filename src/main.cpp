@@ -8,9 +8,13 @@
 
 #include "addrman.h"
 #include "alert.h"
+#include "blockencodings.h"
+#include "blockfilter.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
+#include "coinscommitment.h"
+#include "eventpublisher.h"
 #include "init.h"
 #include "instantx.h"
 #include "darksend.h"
@@ -22,12 +26,15 @@
 #include "util.h"
 #include "spork.h"
 
+#include <deque>
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/function.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
 
 using namespace std;
 using namespace boost;
@@ -43,6 +50,10 @@ using namespace boost;
 CCriticalSection cs_main;
 
 CTxMemPool mempool;
+CWaitableCriticalSection csBestBlock;
+boost::condition_variable cvBlockChange;
+uint256 hashBestBlock = 0;
+int64_t nLongPollFeeDelta = DEFAULT_LONGPOLL_FEE_DELTA;
 
 map<uint256, CBlockIndex*> mapBlockIndex;
 CChain chainActive;
@@ -53,6 +64,7 @@ bool fImporting = false;
 bool fReindex = false;
 bool fBenchmark = false;
 bool fTxIndex = false;
+bool fBlockFilterIndex = false;
 bool fLargeWorkForkFound = false;
 bool fLargeWorkInvalidChainFound = false;
 
@@ -79,6 +91,11 @@ map<uint256, COrphanTx> mapOrphanTransactions;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
 void EraseOrphansFor(NodeId peer);
 
+// Orphan and rejected transactions that may still show up in a compact block,
+// a ring of at most MAX_EXTRA_TXN_FOR_COMPACT entries. Requires cs_main.
+vector<CTransaction> vExtraTxnForCompact;
+unsigned int nExtraTxnForCompactPos = 0;
+
 // Constant stuff for coinbase transactions we create:
 CScript COINBASE_FLAGS;
 
@@ -134,6 +151,15 @@ namespace {
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
     map<uint256, pair<NodeId, list<uint256>::iterator> > mapBlocksToDownload;
+
+    // Tip of a loaded UTXO snapshot whose blocks still have to be downloaded and
+    // validated, the hash_serialized they must reproduce, the height up to which
+    // they have been validated and the lowest one that may still be missing.
+    // Protected by cs_main.
+    CBlockIndex *pindexSnapshotBase = NULL;
+    uint256 hashSnapshotSerialized;
+    int nSnapshotValidatedHeight = 0;
+    int nSnapshotDownloadHeight = 1;
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -158,6 +184,127 @@ struct CMainSignals {
     // Tells listeners to broadcast their data.
     boost::signals2::signal<void ()> Broadcast;
 } g_signals;
+
+/** Wallet notifications, delivered in order by ThreadWalletNotifications so that
+ *  connecting the next block does not wait for wallet scans and database writes.
+ *  Without that thread they are delivered at once by the caller. */
+class CWalletNotificationQueue
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque<std::pair<boost::function<void ()>, bool> > queue; // notification, and whether it is a block batch
+    uint64_t nQueued;    // notifications added so far
+    uint64_t nDelivered; // notifications wallets have seen
+    unsigned int nBlocksQueued; // block batches in the queue, each holding on to its block
+    bool fRunning;
+
+    void RunLoop()
+    {
+        bool fInterrupted = false;
+        while (true) {
+            boost::function<void ()> func;
+            bool fBlock;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queue.empty()) {
+                    // On shutdown everything queued is delivered first, or the
+                    // wallet would record a best block past transactions it never saw
+                    if (fInterrupted)
+                        return;
+                    try {
+                        cond.wait(lock);
+                    } catch (boost::thread_interrupted) {
+                        fInterrupted = true;
+                    }
+                }
+                func = queue.front().first;
+                fBlock = queue.front().second;
+                queue.pop_front();
+            }
+            // One failing notification must not stop the ones after it
+            try {
+                func();
+            } catch (boost::thread_interrupted) {
+                fInterrupted = true;
+            } catch (std::exception& e) {
+                PrintExceptionContinue(&e, "ThreadWalletNotifications()");
+            }
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                nDelivered++;
+                if (fBlock)
+                    nBlocksQueued--;
+                cond.notify_all();
+            }
+        }
+    }
+
+    // Later notifications are delivered by their callers, and nobody waits on this thread
+    void Stop()
+    {
+        std::deque<std::pair<boost::function<void ()>, bool> > queueLeft;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fRunning = false;
+            queueLeft.swap(queue);
+            nDelivered += queueLeft.size();
+            nBlocksQueued = 0;
+            cond.notify_all();
+        }
+        for (unsigned int i = 0; i < queueLeft.size(); i++)
+            queueLeft[i].first();
+    }
+
+public:
+    CWalletNotificationQueue() : nQueued(0), nDelivered(0), nBlocksQueued(0), fRunning(false) {}
+
+    void Add(const boost::function<void ()>& func, bool fBlock = false)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (fRunning) {
+                queue.push_back(make_pair(func, fBlock));
+                nQueued++;
+                if (fBlock)
+                    nBlocksQueued++;
+                cond.notify_all();
+                return;
+            }
+        }
+        func();
+    }
+
+    void Run()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fRunning = true;
+        }
+        try {
+            RunLoop();
+        } catch (...) {
+            Stop();
+            throw;
+        }
+        Stop();
+    }
+
+    void Flush()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        uint64_t nTarget = nQueued;
+        while (fRunning && nDelivered < nTarget)
+            cond.wait(lock);
+    }
+
+    void Limit()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (fRunning && nBlocksQueued > MAX_WALLET_NOTIFICATION_BLOCKS)
+            cond.wait(lock);
+    }
+} walletNotificationQueue;
 }
 
 void RegisterWallet(CWalletInterface* pwalletIn) {
@@ -187,8 +334,46 @@ void UnregisterAllWallets() {
     g_signals.SyncTransaction.disconnect_all_slots();
 }
 
-void SyncWithWallets(const uint256 &hash, const CTransaction &tx, const CBlock *pblock) {
-    g_signals.SyncTransaction(hash, tx, pblock);
+static void SyncTransactionNow(const uint256 &hash, const CTransaction &tx) {
+    g_signals.SyncTransaction(hash, tx, NULL);
+}
+
+void SyncWithWallets(const uint256 &hash, const CTransaction &tx) {
+    walletNotificationQueue.Add(boost::bind(&SyncTransactionNow, hash, tx));
+}
+
+// One batch per block: the transactions it conflicted out of the memory pool, then its own
+static void SyncBlockNow(const list<CTransaction> &txConflicted, boost::shared_ptr<const CBlock> pblock, bool fConnected) {
+    BOOST_FOREACH(const CTransaction &tx, txConflicted)
+        g_signals.SyncTransaction(tx.GetHash(), tx, NULL);
+    BOOST_FOREACH(const CTransaction &tx, pblock->vtx)
+        g_signals.SyncTransaction(tx.GetHash(), tx, fConnected ? pblock.get() : NULL);
+}
+
+static void SetBestChainNow(const CBlockLocator &locator) {
+    g_signals.SetBestChain(locator);
+}
+
+static void UpdatedTransactionNow(const uint256 &hash) {
+    g_signals.UpdatedTransaction(hash);
+}
+
+// Transactions that left the memory pool without being mined or conflicted by a block
+static void SyncRemovedFromMempool(const list<CTransaction> &removed) {
+    BOOST_FOREACH(const CTransaction &tx, removed)
+        walletNotificationQueue.Add(boost::bind(&UpdatedTransactionNow, tx.GetHash()));
+}
+
+void ThreadWalletNotifications() {
+    walletNotificationQueue.Run();
+}
+
+void SyncWithWalletNotifications() {
+    walletNotificationQueue.Flush();
+}
+
+void LimitWalletNotifications() {
+    walletNotificationQueue.Limit();
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -223,6 +408,8 @@ struct CNodeState {
     int nBlocksToDownload;
     int64_t nLastBlockReceive;
     int64_t nLastBlockProcess;
+    // Compact block waiting for the transactions asked for with getblocktxn
+    CPartialBlock partialBlock;
 
     CNodeState() {
         nMisbehavior = 0;
@@ -237,6 +424,11 @@ struct CNodeState {
 // Map maintaining per-node state. Requires cs_main.
 map<NodeId, CNodeState> mapNodeState;
 
+// Salts for the deterministic randomness of address relay and transaction trickling.
+// Picked in RegisterNodeSignals, before any message handler thread reads them.
+uint256 hashAddrRelaySalt;
+uint256 hashTrickleSalt;
+
 // Requires cs_main.
 CNodeState *State(NodeId pnode) {
     map<NodeId, CNodeState>::iterator it = mapNodeState.find(pnode);
@@ -338,6 +530,8 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
 
 void RegisterNodeSignals(CNodeSignals& nodeSignals)
 {
+    hashAddrRelaySalt = GetRandHash();
+    hashTrickleSalt = GetRandHash();
     nodeSignals.GetHeight.connect(&GetHeight);
     nodeSignals.ProcessMessages.connect(&ProcessMessages);
     nodeSignals.SendMessages.connect(&SendMessages);
@@ -415,8 +609,19 @@ CBlockIndex *CChain::FindFork(const CBlockLocator &locator) const {
 
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
+CBlockFilterDB *pblockfilterdb = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
+// Requires cs_main.
+void static AddToCompactExtraTransactions(const CTransaction& tx)
+{
+    if (vExtraTxnForCompact.size() < MAX_EXTRA_TXN_FOR_COMPACT)
+        vExtraTxnForCompact.push_back(tx);
+    else
+        vExtraTxnForCompact[nExtraTxnForCompactPos] = tx;
+    nExtraTxnForCompactPos = (nExtraTxnForCompactPos + 1) % MAX_EXTRA_TXN_FOR_COMPACT;
+}
+
 //
 // mapOrphanTransactions
 //
@@ -870,9 +1075,27 @@ int64_t GetMinFee(const CTransaction& tx, unsigned int nBytes, bool fAllowFree,
     return nMinFee;
 }
 
+static void LimitMempoolSize(CTxMemPool& pool, size_t nLimit, int64_t nAge)
+{
+    list<CTransaction> removed;
+    int nExpired = pool.Expire(GetTime() - nAge, &removed);
+    if (nExpired != 0)
+        LogPrint("mempool", "Expired %i transactions from the memory pool\n", nExpired);
+
+    {
+        // InstantX locked transactions, and whatever they spend, are never evicted
+        LOCK(cs_instantx);
+        std::set<uint256> setLocked;
+        for (map<uint256, CTransactionLock>::const_iterator it = mapTxLocks.begin(); it != mapTxLocks.end(); ++it)
+            setLocked.insert(it->first);
+        pool.TrimToSize(nLimit, &removed, &setLocked);
+    }
+    if (&pool == &mempool)
+        SyncRemovedFromMempool(removed);
+}
 
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+                        bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees, int64_t nAcceptTime)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -900,12 +1123,15 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
 
     // ----------- instantX transaction scanning -----------
 
-    BOOST_FOREACH(const CTxIn& in, tx.vin){
-        if(mapLockedInputs.count(in.prevout)){
-            if(mapLockedInputs[in.prevout] != tx.GetHash()){
-                return state.DoS(0,
-                                 error("AcceptToMemoryPool : conflicts with existing transaction lock: %s", reason),
-                                 REJECT_INVALID, "tx-lock-conflict");
+    {
+        LOCK(cs_instantx);
+        BOOST_FOREACH(const CTxIn& in, tx.vin){
+            if(mapLockedInputs.count(in.prevout)){
+                if(mapLockedInputs[in.prevout] != tx.GetHash()){
+                    return state.DoS(0,
+                                     error("AcceptToMemoryPool : conflicts with existing transaction lock: %s", reason),
+                                     REJECT_INVALID, "tx-lock-conflict");
+                }
             }
         }
     }
@@ -974,7 +1200,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         int64_t nFees = nValueIn-nValueOut;
         double dPriority = view.GetPriority(tx, chainActive.Height());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height());
+        CTxMemPoolEntry entry(tx, nFees, nAcceptTime ? nAcceptTime : GetTime(), dPriority, chainActive.Height());
         unsigned int nSize = entry.GetTxSize();
 
         // Don't accept it if it can't get into a block
@@ -985,6 +1211,13 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                                           hash.ToString(), nFees, txMinFee),
                                  REJECT_INSUFFICIENTFEE, "insufficient fee");
 
+            // After evictions the pool asks for more than the relay fee for a while
+            int64_t nMempoolMinFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000) * nSize / 1000;
+            if (fLimitFree && nMempoolMinFee > 0 && nFees < nMempoolMinFee)
+                return state.DoS(0, error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d",
+                                          hash.ToString(), nFees, nMempoolMinFee),
+                                 REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+
             // Continuously rate-limit free transactions
             // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
             // be annoying or make others' transactions take longer to confirm.
@@ -1015,6 +1248,17 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                          hash.ToString(),
                          nFees, CTransaction::nMinRelayTxFee * 10000);
 
+        // Every add and remove walks the packages of the relatives, so keep them short
+        std::string strChainError;
+        if (!pool.CheckPackageLimits(tx, nSize,
+                                     GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT),
+                                     GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000,
+                                     GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT),
+                                     GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000,
+                                     strChainError))
+            return state.DoS(0, error("AcceptToMemoryPool : too long mempool chain %s, %s", hash.ToString(), strChainError),
+                             REJECT_NONSTANDARD, "too-long-mempool-chain");
+
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
         if (!CheckInputs(tx, state, view, true, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC | SCRIPT_VERIFY_DERSIG))
@@ -1023,9 +1267,24 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         }
         // Store transaction in memory
         pool.addUnchecked(hash, entry);
+
+        // The new transaction may be the one that does not fit
+        LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+        if (!pool.exists(hash))
+            return state.DoS(0, error("AcceptToMemoryPool : mempool full, %s not accepted", hash.ToString()),
+                             REJECT_INSUFFICIENTFEE, "mempool full");
+
+        // Wake up getblocktemplate longpolls each time another nLongPollFeeDelta has come in
+        static int64_t nFeesNotified = 0;
+        if (&pool == &mempool && pool.GetTotalFeesAdded() >= nFeesNotified + nLongPollFeeDelta) {
+            nFeesNotified = pool.GetTotalFeesAdded();
+            boost::unique_lock<boost::mutex> lock(csBestBlock);
+            cvBlockChange.notify_all();
+        }
     }
 
-    g_signals.SyncTransaction(hash, tx, NULL);
+    SyncWithWallets(hash, tx);
+    PublishTransaction(tx);
 
     return true;
 }
@@ -1181,6 +1440,7 @@ int CMerkleTx::GetTransactionLockSignatures() const
     if(nInstantXDepth == 0) return -1;
 
     //compile consessus vote
+    LOCK(cs_instantx);
     std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(GetHash());
     if (i != mapTxLocks.end()){
         return (*i).second.CountSignatures();
@@ -1194,6 +1454,7 @@ bool CMerkleTx::IsTransactionLockTimedOut() const
     if(nInstantXDepth == 0) return 0;
 
     //compile consessus vote
+    LOCK(cs_instantx);
     std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(GetHash());
     if (i != mapTxLocks.end()){
         return GetTime() > (*i).second.nTimeout;
@@ -1240,6 +1501,8 @@ bool CMerkleTx::AcceptToMemoryPool(bool fLimitFree)
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock, bool fAllowSlow)
 {
     CBlockIndex *pindexSlow = NULL;
+    CDiskTxPos postx;
+    bool fHavePos = false;
     {
         LOCK(cs_main);
         {
@@ -1249,26 +1512,10 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
             }
         }
 
-        if (fTxIndex) {
-            CDiskTxPos postx;
-            if (pblocktree->ReadTxIndex(hash, postx)) {
-                CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-                CBlockHeader header;
-                try {
-                    file >> header;
-                    fseek(file, postx.nTxOffset, SEEK_CUR);
-                    file >> txOut;
-                } catch (std::exception &e) {
-                    return error("%s : Deserialize or I/O error - %s", __func__, e.what());
-                }
-                hashBlock = header.GetHash();
-                if (txOut.GetHash() != hash)
-                    return error("%s : txid mismatch", __func__);
-                return true;
-            }
-        }
+        if (fTxIndex)
+            fHavePos = pblocktree->ReadTxIndex(hash, postx);
 
-        if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
+        if (!fHavePos && fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
             int nHeight = -1;
             {
                 CCoinsViewCache &view = *pcoinsTip;
@@ -1281,6 +1528,24 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
         }
     }
 
+    // Block files are only ever appended to, so the transaction is read
+    // without holding cs_main; parallel RPC calls do not queue up behind it.
+    if (fHavePos) {
+        CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
+        CBlockHeader header;
+        try {
+            file >> header;
+            fseek(file, postx.nTxOffset, SEEK_CUR);
+            file >> txOut;
+        } catch (std::exception &e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+        hashBlock = header.GetHash();
+        if (txOut.GetHash() != hash)
+            return error("%s : txid mismatch", __func__);
+        return true;
+    }
+
     if (pindexSlow) {
         CBlock block;
         if (ReadBlockFromDisk(block, pindexSlow)) {
@@ -1902,12 +2167,13 @@ void CheckForkWarningConditionsOnNewFork(CBlockIndex* pindexNewForkTip)
     CheckForkWarningConditions();
 }
 
-// Requires cs_main.
 void Misbehaving(NodeId pnode, int howmuch)
 {
     if (howmuch == 0)
         return;
 
+    // Lock-free message handlers call this without holding cs_main
+    LOCK(cs_main);
     CNodeState *state = State(pnode);
     if (state == NULL)
         return;
@@ -1989,6 +2255,22 @@ void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCach
     assert(ret);
 }
 
+void UpdateCoinsCommitment(const CTransaction& tx, CCoinsViewCache &inputs, const CTxUndo &txundo, int nHeight, const uint256 &txhash, CCoinsCommitment &commitment)
+{
+    if (!tx.IsCoinBase()) {
+        for (unsigned int i = 0; i < tx.vin.size(); i++) {
+            const COutPoint &prevout = tx.vin[i].prevout;
+            const CTxInUndo &undo = txundo.vprevout[i];
+            // spent coins keep their height and coinbase flag, even once pruned
+            const CCoins &coins = inputs.GetCoins(prevout.hash);
+            commitment.RemoveOutput(prevout, undo.txout, coins.nHeight, coins.fCoinBase);
+            if (undo.nHeight != 0)
+                commitment.nTransactions--;
+        }
+    }
+    commitment.AddCoins(txhash, CCoins(tx, nHeight));
+}
+
 bool CScriptCheck::operator()() const {
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
     if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType))
@@ -2088,6 +2370,35 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, CCoinsViewCach
     return true;
 }
 
+bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const COutPoint& out, CCoinsCommitment* pcommitment, bool& fClean)
+{
+    CCoins coins;
+    view.GetCoins(out.hash, coins); // this can fail if the prevout was already entirely spent
+    if (undo.nHeight != 0) {
+        // undo data contains height: this is the last output of the prevout tx being spent
+        if (!coins.IsPruned())
+            fClean = fClean && error("DisconnectBlock() : undo data overwriting existing transaction");
+        coins = CCoins();
+        coins.fCoinBase = undo.fCoinBase;
+        coins.nHeight = undo.nHeight;
+        coins.nVersion = undo.nVersion;
+    } else {
+        if (coins.IsPruned())
+            fClean = fClean && error("DisconnectBlock() : undo data adding output to missing transaction");
+    }
+    if (coins.IsAvailable(out.n))
+        fClean = fClean && error("DisconnectBlock() : undo data overwriting existing output");
+    if (coins.vout.size() < out.n+1)
+        coins.vout.resize(out.n+1);
+    coins.vout[out.n] = undo.txout;
+    if (pcommitment) {
+        pcommitment->AddOutput(out, undo.txout, coins.nHeight, coins.fCoinBase);
+        if (undo.nHeight != 0)
+            pcommitment->nTransactions++;
+    }
+    return view.SetCoins(out.hash, coins);
+}
+
 bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
 {
     assert(pindex->GetBlockHash() == view.GetBestBlock());
@@ -2107,6 +2418,12 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
     if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
         return error("DisconnectBlock() : block and undo data inconsistent");
 
+    // Roll the UTXO set commitment back, unless the previous block still has its own
+    CCoinsCommitment commitment;
+    bool fCommitment = false;
+    if (!pblocktree->ReadCoinsCommitment(pindex->pprev->GetBlockHash(), commitment))
+        fCommitment = pblocktree->ReadCoinsCommitment(pindex->GetBlockHash(), commitment);
+
     // undo transactions in reverse order
     for (int i = block.vtx.size() - 1; i >= 0; i--) {
         const CTransaction &tx = block.vtx[i];
@@ -2130,6 +2447,8 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
             fClean = fClean && error("DisconnectBlock() : added transaction mismatch? database corrupted");
 
         // remove outputs
+        if (fCommitment)
+            commitment.RemoveCoins(hash, outsBlock);
         outs = CCoins();
 
         // restore inputs
@@ -2138,33 +2457,15 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
             if (txundo.vprevout.size() != tx.vin.size())
                 return error("DisconnectBlock() : transaction and undo data inconsistent");
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
-                const COutPoint &out = tx.vin[j].prevout;
-                const CTxInUndo &undo = txundo.vprevout[j];
-                CCoins coins;
-                view.GetCoins(out.hash, coins); // this can fail if the prevout was already entirely spent
-                if (undo.nHeight != 0) {
-                    // undo data contains height: this is the last output of the prevout tx being spent
-                    if (!coins.IsPruned())
-                        fClean = fClean && error("DisconnectBlock() : undo data overwriting existing transaction");
-                    coins = CCoins();
-                    coins.fCoinBase = undo.fCoinBase;
-                    coins.nHeight = undo.nHeight;
-                    coins.nVersion = undo.nVersion;
-                } else {
-                    if (coins.IsPruned())
-                        fClean = fClean && error("DisconnectBlock() : undo data adding output to missing transaction");
-                }
-                if (coins.IsAvailable(out.n))
-                    fClean = fClean && error("DisconnectBlock() : undo data overwriting existing output");
-                if (coins.vout.size() < out.n+1)
-                    coins.vout.resize(out.n+1);
-                coins.vout[out.n] = undo.txout;
-                if (!view.SetCoins(out.hash, coins))
+                if (!ApplyTxInUndo(txundo.vprevout[j], view, tx.vin[j].prevout, fCommitment ? &commitment : NULL, fClean))
                     return error("DisconnectBlock() : cannot restore coin inputs");
             }
         }
     }
 
+    if (fCommitment && !pblocktree->WriteCoinsCommitment(pindex->pprev->GetBlockHash(), commitment))
+        return error("DisconnectBlock() : failed to write UTXO set commitment");
+
     // move best block pointer to prevout block
     view.SetBestBlock(pindex->pprev->GetBlockHash());
 
@@ -2209,6 +2510,63 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+// Write the filters of pindexLast and of its ancestors that have none, back to the
+// last block with a filter, and return the header of pindexLast's filter. The
+// filter index is synced with the chain state but a crash can still lose its
+// newest writes, while the coins of those blocks survive.
+static bool RebuildBlockFilters(CValidationState& state, const CBlockIndex* pindexLast, uint256& hashHeader)
+{
+    std::vector<const CBlockIndex*> vMissing;
+    uint256 hashFilter;
+    hashHeader = 0;
+    for (const CBlockIndex* pindex = pindexLast; pindex; pindex = pindex->pprev) {
+        if (pblockfilterdb->ReadFilterHeader(pindex->GetBlockHash(), hashFilter, hashHeader))
+            break;
+        vMissing.push_back(pindex);
+    }
+    LogPrintf("RebuildBlockFilters() : %u blocks up to %s have no filter, rebuilding them\n", vMissing.size(), pindexLast->GetBlockHash().ToString());
+
+    BOOST_REVERSE_FOREACH(const CBlockIndex* pindex, vMissing) {
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pindex))
+            return state.Abort(_("Failed to read block"));
+        CBlockUndo blockundo;
+        if (pindex->pprev) {
+            CDiskBlockPos pos = pindex->GetUndoPos();
+            if (pos.IsNull() || !blockundo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
+                return state.Abort(_("Failed to read undo data"));
+        }
+        CBlockFilter filter(block, blockundo);
+        hashHeader = filter.ComputeHeader(hashHeader);
+        if (!pblockfilterdb->WriteFilter(filter, hashHeader))
+            return state.Abort(_("Failed to write block filter index"));
+    }
+    return true;
+}
+
+// Add the compact filter of a connected block to -blockfilterindex. The filter
+// header commits to the parent's, so the index grows along the chain only.
+static bool WriteBlockFilter(CValidationState& state, const CBlock& block, const CBlockUndo& blockundo, const CBlockIndex* pindex)
+{
+    if (!fBlockFilterIndex || !pblockfilterdb)
+        return true;
+
+    uint256 hashFilter, hashHeader;
+    if (pblockfilterdb->ReadFilterHeader(pindex->GetBlockHash(), hashFilter, hashHeader))
+        return true; // reconnected after a reorganization
+
+    uint256 hashPrevHeader = 0;
+    if (pindex->pprev && !pblockfilterdb->ReadFilterHeader(pindex->pprev->GetBlockHash(), hashFilter, hashPrevHeader)) {
+        if (!RebuildBlockFilters(state, pindex->pprev, hashPrevHeader))
+            return false;
+    }
+
+    CBlockFilter filter(block, blockundo);
+    if (!pblockfilterdb->WriteFilter(filter, filter.ComputeHeader(hashPrevHeader)))
+        return state.Abort(_("Failed to write block filter index"));
+    return true;
+}
+
 bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck)
 {
     AssertLockHeld(cs_main);
@@ -2223,6 +2581,10 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
     // Special case for the genesis block, skipping connection of its transactions
     // (its coinbase is unspendable)
     if (block.GetHash() == Params().HashGenesisBlock()) {
+        if (!fJustCheck && !pblocktree->WriteCoinsCommitment(pindex->GetBlockHash(), CCoinsCommitment()))
+            return state.Abort(_("Failed to write UTXO set commitment"));
+        if (!fJustCheck && !WriteBlockFilter(state, block, CBlockUndo(), pindex))
+            return false;
         view.SetBestBlock(pindex->GetBlockHash());
         return true;
     }
@@ -2267,6 +2629,10 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
 
     CBlockUndo blockundo;
 
+    // Roll the UTXO set commitment forward, if the previous block has one
+    CCoinsCommitment commitment;
+    bool fCommitment = !fJustCheck && pblocktree->ReadCoinsCommitment(hashPrevBlock, commitment);
+
     CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
 
     int64_t nStart = GetTimeMicros();
@@ -2313,6 +2679,8 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
 
         CTxUndo txundo;
         UpdateCoins(tx, state, view, txundo, pindex->nHeight, block.GetTxHash(i));
+        if (fCommitment)
+            UpdateCoinsCommitment(tx, view, txundo, pindex->nHeight, block.GetTxHash(i), commitment);
         if (!tx.IsCoinBase())
             blockundo.vtxundo.push_back(txundo);
 
@@ -2364,15 +2732,25 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
         if (!pblocktree->WriteTxIndex(vPos))
             return state.Abort(_("Failed to write transaction index"));
 
+    if (fCommitment) {
+        if (!pblocktree->WriteCoinsCommitment(pindex->GetBlockHash(), commitment))
+            return state.Abort(_("Failed to write UTXO set commitment"));
+        // Older blocks only need theirs again for a reorganization deeper than this
+        CBlockIndex* pindexOld = pindex;
+        for (int i = 0; i < COINS_COMMITMENT_DEPTH && pindexOld; i++)
+            pindexOld = pindexOld->pprev;
+        if (pindexOld)
+            pblocktree->EraseCoinsCommitment(pindexOld->GetBlockHash());
+    }
+
+    if (!WriteBlockFilter(state, block, blockundo, pindex))
+        return false;
+
     // add this block to the view's block chain
     bool ret;
     ret = view.SetBestBlock(pindex->GetBlockHash());
     assert(ret);
 
-    // Watch for transactions paying to me
-    for (unsigned int i = 0; i < block.vtx.size(); i++)
-        g_signals.SyncTransaction(block.GetTxHash(i), block.vtx[i], &block);
-
     return true;
 }
 
@@ -2389,6 +2767,9 @@ bool static WriteChainState(CValidationState &state) {
             return state.Error("out of disk space");
         FlushBlockFile();
         pblocktree->Sync();
+        // Filters must not fall behind the coins they were built from
+        if (pblockfilterdb)
+            pblockfilterdb->Sync();
         if (!pcoinsTip->Flush())
             return state.Abort(_("Failed to write to coin database"));
         nLastWrite = GetTimeMicros();
@@ -2396,6 +2777,15 @@ bool static WriteChainState(CValidationState &state) {
     return true;
 }
 
+bool FlushStateToDisk() {
+    LOCK(cs_main);
+    FlushBlockFile();
+    pblocktree->Sync();
+    if (pblockfilterdb)
+        pblockfilterdb->Sync();
+    return pcoinsTip->Flush();
+}
+
 // Update chainActive and related internal data structures.
 void static UpdateTip(CBlockIndex *pindexNew) {
     chainActive.SetTip(pindexNew);
@@ -2403,11 +2793,16 @@ void static UpdateTip(CBlockIndex *pindexNew) {
     // Update best block in wallet (so we can detect restored wallets)
     bool fIsInitialDownload = IsInitialBlockDownload();
     if ((chainActive.Height() % 20160) == 0 || (!fIsInitialDownload && (chainActive.Height() % 144) == 0))
-        g_signals.SetBestChain(chainActive.GetLocator());
+        walletNotificationQueue.Add(boost::bind(&SetBestChainNow, chainActive.GetLocator()));
 
     // New best block
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
+    {
+        boost::unique_lock<boost::mutex> lock(csBestBlock);
+        hashBestBlock = pindexNew->GetBlockHash();
+        cvBlockChange.notify_all();
+    }
     LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f\n",
       chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble())/log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
       DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
@@ -2438,7 +2833,8 @@ bool static DisconnectTip(CValidationState &state) {
     assert(pindexDelete);
     mempool.check(pcoinsTip);
     // Read block from disk.
-    CBlock block;
+    boost::shared_ptr<CBlock> pblock(new CBlock());
+    CBlock &block = *pblock;
     if (!ReadBlockFromDisk(block, pindexDelete))
         return state.Abort(_("Failed to read block"));
     // Apply the block atomically to the chain state.
@@ -2455,22 +2851,21 @@ bool static DisconnectTip(CValidationState &state) {
     if (!WriteChainState(state))
         return false;
     // Resurrect mempool transactions from the disconnected block.
+    list<CTransaction> removed;
     BOOST_FOREACH(const CTransaction &tx, block.vtx) {
         // ignore validation errors in resurrected transactions
-        list<CTransaction> removed;
         CValidationState stateDummy;
         if (!tx.IsCoinBase())
             if (!AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
                 mempool.remove(tx, removed, true);
     }
+    SyncRemovedFromMempool(removed);
     mempool.check(pcoinsTip);
     // Update chainActive and related variables.
     UpdateTip(pindexDelete->pprev);
     // Let wallets know transactions went from 1-confirmed to
     // 0-confirmed or conflicted:
-    BOOST_FOREACH(const CTransaction &tx, block.vtx) {
-        SyncWithWallets(tx.GetHash(), tx, NULL);
-    }
+    walletNotificationQueue.Add(boost::bind(&SyncBlockNow, list<CTransaction>(), pblock, false), true);
     return true;
 }
 
@@ -2479,7 +2874,8 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew) {
     assert(pindexNew->pprev == chainActive.Tip());
     mempool.check(pcoinsTip);
     // Read block from disk.
-    CBlock block;
+    boost::shared_ptr<CBlock> pblock(new CBlock());
+    CBlock &block = *pblock;
     if (!ReadBlockFromDisk(block, pindexNew))
         return state.Abort(_("Failed to read block"));
     // Apply the block atomically to the chain state.
@@ -2510,15 +2906,13 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew) {
     mempool.check(pcoinsTip);
     // Update chainActive & related variables.
     UpdateTip(pindexNew);
+    // Subscribers see every connected block, not only the final tip
+    PublishBlock(pindexNew);
     // Tell wallet about transactions that went from mempool
-    // to conflicted:
-    BOOST_FOREACH(const CTransaction &tx, txConflicted) {
-        SyncWithWallets(tx.GetHash(), tx, NULL);
-    }
-    // ... and about transactions that got confirmed:
-    BOOST_FOREACH(const CTransaction &tx, block.vtx) {
-        SyncWithWallets(tx.GetHash(), tx, &block);
-    }
+    // to conflicted, and about transactions that got confirmed:
+    walletNotificationQueue.Add(boost::bind(&SyncBlockNow, txConflicted, pblock, true), true);
+    BOOST_FOREACH(const CTransaction &tx, block.vtx)
+        PublishTransaction(tx);
     return true;
 }
 
@@ -2556,6 +2950,7 @@ bool DisconnectBlockAndInputs(CValidationState &state, CTransaction txLock)
     //remove anything conflicting in the memory pool
     list<CTransaction> txConflicted;
     mempool.removeConflicts(txLock, txConflicted);
+    SyncRemovedFromMempool(txConflicted);
 
 
     // List of what to disconnect (typically nothing)
@@ -2750,7 +3145,7 @@ bool AddToBlockIndex(CBlock& block, CValidationState& state, const CDiskBlockPos
         CheckForkWarningConditions();
         // Notify UI to display prev block's coinbase if it was ours
         static uint256 hashPrevBestCoinBase;
-        g_signals.UpdatedTransaction(hashPrevBestCoinBase);
+        walletNotificationQueue.Add(boost::bind(&UpdatedTransactionNow, hashPrevBestCoinBase));
         hashPrevBestCoinBase = block.GetTxHash(0);
     } else
         CheckForkWarningConditionsOnNewFork(pindexNew);
@@ -2861,11 +3256,8 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
 }
 
 
-bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot)
+bool CheckBlockStructure(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot)
 {
-    // These are checks that are independent of context
-    // that can be verified before saving an orphan block.
-
     // Size limits
     if (block.vtx.empty() || block.vtx.size() > MAX_BLOCK_SIZE || ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE)
         return state.DoS(100, error("CheckBlock() : size limits failed"),
@@ -2876,11 +3268,6 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         return state.DoS(50, error("CheckBlock() : proof of work failed"),
                          REJECT_INVALID, "high-hash");
 
-    // Check timestamp
-    if (block.GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
-        return state.Invalid(error("CheckBlock() : block timestamp too far in the future"),
-                             REJECT_INVALID, "time-too-new");
-
     // First transaction must be coinbase, the rest must not be
     if (block.vtx.empty() || !block.vtx[0].IsCoinBase())
         return state.DoS(100, error("CheckBlock() : first tx is not coinbase"),
@@ -2890,10 +3277,61 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
             return state.DoS(100, error("CheckBlock() : more than one coinbase"),
                              REJECT_INVALID, "bad-cb-multiple");
 
+    // Check transactions
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        if (!CheckTransaction(tx, state))
+            return error("CheckBlock() : CheckTransaction failed");
+
+    // Build the merkle tree already. We need it anyway later, and it makes the
+    // block cache the transaction hashes, which means they don't need to be
+    // recalculated many times during this block's validation.
+    block.BuildMerkleTree();
+
+    // Check for duplicate txids. This is caught by ConnectInputs(),
+    // but catching it earlier avoids a potential DoS attack:
+    set<uint256> uniqueTx;
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        uniqueTx.insert(block.GetTxHash(i));
+    }
+    if (uniqueTx.size() != block.vtx.size())
+        return state.DoS(100, error("CheckBlock() : duplicate transaction"),
+                         REJECT_INVALID, "bad-txns-duplicate", true);
+
+    unsigned int nSigOps = 0;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        nSigOps += GetLegacySigOpCount(tx);
+    }
+    if (nSigOps > MAX_BLOCK_SIGOPS)
+        return state.DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"),
+                         REJECT_INVALID, "bad-blk-sigops", true);
+
+    // Check merkle root
+    if (fCheckMerkleRoot && block.hashMerkleRoot != block.vMerkleTree.back())
+        return state.DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"),
+                         REJECT_INVALID, "bad-txnmrklroot", true);
+
+    return true;
+}
+
+bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot)
+{
+    // These are checks that are independent of context
+    // that can be verified before saving an orphan block.
+    // fChecked is only ever set after a full CheckBlockStructure pass.
+    if (!block.fChecked && !CheckBlockStructure(block, state, fCheckPOW, fCheckMerkleRoot))
+        return false;
+
+    // Check timestamp
+    if (block.GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
+        return state.Invalid(error("CheckBlock() : block timestamp too far in the future"),
+                             REJECT_INVALID, "time-too-new");
+
 
     // ----------- instantX transaction scanning -----------
 
     if(IsSporkActive(SPORK_3_INSTANTX_BLOCK_FILTERING)){
+        LOCK(cs_instantx);
         BOOST_FOREACH(const CTransaction& tx, block.vtx){
             if (!tx.IsCoinBase()){
                 //only reject blocks when it's based on complete consensus
@@ -2986,40 +3424,86 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         LogPrintf("CheckBlock() : skipping masternode payment checks\n");
     }
 
+    return true;
+}
 
-    // Check transactions
-    BOOST_FOREACH(const CTransaction& tx, block.vtx)
-        if (!CheckTransaction(tx, state))
-            return error("CheckBlock() : CheckTransaction failed");
-
-    // Build the merkle tree already. We need it anyway later, and it makes the
-    // block cache the transaction hashes, which means they don't need to be
-    // recalculated many times during this block's validation.
-    block.BuildMerkleTree();
+// Checks of a block that depend on its position in the chain
+static bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindexPrev)
+{
+    uint256 hash = block.GetHash();
+    int nHeight = pindexPrev->nHeight+1;
 
-    // Check for duplicate txids. This is caught by ConnectInputs(),
-    // but catching it earlier avoids a potential DoS attack:
-    set<uint256> uniqueTx;
-    for (unsigned int i = 0; i < block.vtx.size(); i++) {
-        uniqueTx.insert(block.GetTxHash(i));
+    if(TestNet()) {
+        if (block.nBits != GetNextWorkRequired(pindexPrev, &block))
+            return state.DoS(100, error("ContextualCheckBlock() : incorrect proof of work"),
+                             REJECT_INVALID, "bad-diffbits");
+    } else {
+        // Check proof of work (Here for the architecture issues with DGW v1 and v2)
+        if(nHeight <= 5000000){
+            unsigned int nBitsNext = GetNextWorkRequired(pindexPrev, &block);
+            double n1 = ConvertBitsToDouble(block.nBits);
+            double n2 = ConvertBitsToDouble(nBitsNext);
+
+            if (abs(n1-n2) > n1*0.5)
+                return state.DoS(100, error("ContextualCheckBlock() : incorrect proof of work (DGW pre-fork) - %f", abs(n1-n2)),
+                                REJECT_INVALID, "bad-diffbits");
+        } else {
+            if (block.nBits != GetNextWorkRequired(pindexPrev, &block))
+                return state.DoS(100, error("ContextualCheckBlock() : incorrect proof of work"),
+                                REJECT_INVALID, "bad-diffbits");
+        }
     }
-    if (uniqueTx.size() != block.vtx.size())
-        return state.DoS(100, error("CheckBlock() : duplicate transaction"),
-                         REJECT_INVALID, "bad-txns-duplicate", true);
 
-    unsigned int nSigOps = 0;
+    // Check timestamp against prev
+    if (block.GetBlockTime() <= pindexPrev->GetMedianTimePast())
+        return state.Invalid(error("ContextualCheckBlock() : block's timestamp is too early"),
+                             REJECT_INVALID, "time-too-old");
+
+    // Check that all transactions are finalized
     BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        if (!IsFinalTx(tx, nHeight, block.GetBlockTime()))
+            return state.DoS(10, error("ContextualCheckBlock() : contains a non-final transaction"),
+                             REJECT_INVALID, "bad-txns-nonfinal");
+
+    // Check that the block chain matches the known block chain up to a checkpoint
+    if (!Checkpoints::CheckBlock(nHeight, hash))
+        return state.DoS(100, error("ContextualCheckBlock() : rejected by checkpoint lock-in at %d", nHeight),
+                         REJECT_CHECKPOINT, "checkpoint mismatch");
+
+    // Reject block.nVersion=1 blocks when 95% (75% on testnet) of the network has upgraded:
+    if (block.nVersion < 2)
     {
-        nSigOps += GetLegacySigOpCount(tx);
+        if ((!TestNet() && CBlockIndex::IsSuperMajority(2, pindexPrev, 950, 1000)) ||
+            (TestNet() && CBlockIndex::IsSuperMajority(2, pindexPrev, 75, 100)))
+        {
+            return state.Invalid(error("ContextualCheckBlock() : rejected nVersion=1 block"),
+                                 REJECT_OBSOLETE, "bad-version");
+        }
+    }
+    // Reject block.nVersion=2 blocks when 95% (75% on testnet) of the network has upgraded:
+    if (block.nVersion < 3)
+    {
+        if ((!TestNet() && CBlockIndex::IsSuperMajority(3, pindexPrev, 950, 1000)) ||
+            (TestNet() && CBlockIndex::IsSuperMajority(3, pindexPrev, 75, 100)))
+        {
+            return state.Invalid(error("ContextualCheckBlock() : rejected nVersion=2 block"),
+                                 REJECT_OBSOLETE, "bad-version");
+        }
+    }
+    // Enforce block.nVersion=2 rule that the coinbase starts with serialized block height
+    if (block.nVersion >= 2)
+    {
+        // if 750 of the last 1,000 blocks are version 2 or greater (51/100 if testnet):
+        if ((!TestNet() && CBlockIndex::IsSuperMajority(2, pindexPrev, 750, 1000)) ||
+            (TestNet() && CBlockIndex::IsSuperMajority(2, pindexPrev, 51, 100)))
+        {
+            CScript expect = CScript() << nHeight;
+            if (block.vtx[0].vin[0].scriptSig.size() < expect.size() ||
+                !std::equal(expect.begin(), expect.end(), block.vtx[0].vin[0].scriptSig.begin()))
+                return state.DoS(100, error("ContextualCheckBlock() : block height mismatch in coinbase"),
+                                 REJECT_INVALID, "bad-cb-height");
+        }
     }
-    if (nSigOps > MAX_BLOCK_SIGOPS)
-        return state.DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"),
-                         REJECT_INVALID, "bad-blk-sigops", true);
-
-    // Check merkle root
-    if (fCheckMerkleRoot && block.hashMerkleRoot != block.vMerkleTree.back())
-        return state.DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"),
-                         REJECT_INVALID, "bad-txnmrklroot", true);
 
     return true;
 }
@@ -3042,82 +3526,13 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp)
         pindexPrev = (*mi).second;
         nHeight = pindexPrev->nHeight+1;
 
-        if(TestNet()) {
-            if (block.nBits != GetNextWorkRequired(pindexPrev, &block))
-                return state.DoS(100, error("AcceptBlock() : incorrect proof of work"),
-                                 REJECT_INVALID, "bad-diffbits");
-        } else {
-            // Check proof of work (Here for the architecture issues with DGW v1 and v2)
-            if(nHeight <= 5000000){
-                unsigned int nBitsNext = GetNextWorkRequired(pindexPrev, &block);
-                double n1 = ConvertBitsToDouble(block.nBits);
-                double n2 = ConvertBitsToDouble(nBitsNext);
-
-                if (abs(n1-n2) > n1*0.5)
-                    return state.DoS(100, error("AcceptBlock() : incorrect proof of work (DGW pre-fork) - %f", abs(n1-n2)),
-                                    REJECT_INVALID, "bad-diffbits");
-            } else {
-                if (block.nBits != GetNextWorkRequired(pindexPrev, &block))
-                    return state.DoS(100, error("AcceptBlock() : incorrect proof of work"),
-                                    REJECT_INVALID, "bad-diffbits");
-            }
-        }
-
-        // Check timestamp against prev
-        if (block.GetBlockTime() <= pindexPrev->GetMedianTimePast())
-            return state.Invalid(error("AcceptBlock() : block's timestamp is too early"),
-                                 REJECT_INVALID, "time-too-old");
-
-        // Check that all transactions are finalized
-        BOOST_FOREACH(const CTransaction& tx, block.vtx)
-            if (!IsFinalTx(tx, nHeight, block.GetBlockTime()))
-                return state.DoS(10, error("AcceptBlock() : contains a non-final transaction"),
-                                 REJECT_INVALID, "bad-txns-nonfinal");
-
-        // Check that the block chain matches the known block chain up to a checkpoint
-        if (!Checkpoints::CheckBlock(nHeight, hash))
-            return state.DoS(100, error("AcceptBlock() : rejected by checkpoint lock-in at %d", nHeight),
-                             REJECT_CHECKPOINT, "checkpoint mismatch");
-
         // Don't accept any forks from the main chain prior to last checkpoint
         CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
         if (pcheckpoint && nHeight < pcheckpoint->nHeight)
             return state.DoS(100, error("AcceptBlock() : forked chain older than last checkpoint (height %d)", nHeight));
 
-        // Reject block.nVersion=1 blocks when 95% (75% on testnet) of the network has upgraded:
-        if (block.nVersion < 2)
-        {
-            if ((!TestNet() && CBlockIndex::IsSuperMajority(2, pindexPrev, 950, 1000)) ||
-                (TestNet() && CBlockIndex::IsSuperMajority(2, pindexPrev, 75, 100)))
-            {
-                return state.Invalid(error("AcceptBlock() : rejected nVersion=1 block"),
-                                     REJECT_OBSOLETE, "bad-version");
-            }
-        }
-        // Reject block.nVersion=2 blocks when 95% (75% on testnet) of the network has upgraded:
-        if (block.nVersion < 3)
-        {
-            if ((!TestNet() && CBlockIndex::IsSuperMajority(3, pindexPrev, 950, 1000)) ||
-                (TestNet() && CBlockIndex::IsSuperMajority(3, pindexPrev, 75, 100)))
-            {
-                return state.Invalid(error("AcceptBlock() : rejected nVersion=2 block"),
-                                     REJECT_OBSOLETE, "bad-version");
-            }
-        }
-        // Enforce block.nVersion=2 rule that the coinbase starts with serialized block height
-        if (block.nVersion >= 2)
-        {
-            // if 750 of the last 1,000 blocks are version 2 or greater (51/100 if testnet):
-            if ((!TestNet() && CBlockIndex::IsSuperMajority(2, pindexPrev, 750, 1000)) ||
-                (TestNet() && CBlockIndex::IsSuperMajority(2, pindexPrev, 51, 100)))
-            {
-                CScript expect = CScript() << nHeight;
-                if (block.vtx[0].vin[0].scriptSig.size() < expect.size() ||
-                    !std::equal(expect.begin(), expect.end(), block.vtx[0].vin[0].scriptSig.begin()))
-                    return state.DoS(100, error("AcceptBlock() : block height mismatch in coinbase"),
-                                     REJECT_INVALID, "bad-cb-height");
-            }
-        }
+        if (!ContextualCheckBlock(block, state, pindexPrev))
+            return false;
     }
 
     // Write block to history file
@@ -3187,6 +3602,60 @@ void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
     pnode->PushMessage("getblocks", chainActive.GetLocator(pindexBegin), hashEnd);
 }
 
+// A block below the loaded UTXO snapshot that we only know the header of. Requires cs_main.
+static bool IsMissingSnapshotBlock(const CBlockIndex* pindex)
+{
+    return pindexSnapshotBase && !(pindex->nStatus & BLOCK_HAVE_DATA) &&
+           pindex->nHeight <= pindexSnapshotBase->nHeight && chainActive.Contains(pindex);
+}
+
+// Store a downloaded block below the loaded UTXO snapshot; ThreadValidateSnapshot connects it
+static bool AcceptSnapshotBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex)
+{
+    AssertLockHeld(cs_main);
+    // The hash matches the header we have, so this also checks the merkle root against it
+    if (!CheckBlock(block, state))
+        return error("AcceptSnapshotBlock() : CheckBlock FAILED");
+
+    try {
+        unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+        CDiskBlockPos blockPos;
+        if (!FindBlockPos(state, blockPos, nBlockSize+8, pindex->nHeight, block.nTime))
+            return error("AcceptSnapshotBlock() : FindBlockPos failed");
+        if (!WriteBlockToDisk(block, blockPos))
+            return state.Abort(_("Failed to write block"));
+        pindex->nFile = blockPos.nFile;
+        pindex->nDataPos = blockPos.nPos;
+        pindex->nStatus |= BLOCK_HAVE_DATA;
+        if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex)))
+            return state.Abort(_("Failed to write block index"));
+    } catch(std::runtime_error &e) {
+        return state.Abort(_("System error: ") + e.what());
+    }
+    return true;
+}
+
+// Queue the next blocks below the loaded UTXO snapshot for download from a peer,
+// in height order and at most SNAPSHOT_DOWNLOAD_WINDOW ahead of the lowest
+// missing one. Requires cs_main.
+static void QueueSnapshotBlocks(NodeId nodeid)
+{
+    CNodeState *state = State(nodeid);
+    if (state == NULL)
+        return;
+    int nBaseHeight = pindexSnapshotBase->nHeight;
+    while (nSnapshotDownloadHeight <= nBaseHeight && (chainActive[nSnapshotDownloadHeight]->nStatus & BLOCK_HAVE_DATA))
+        nSnapshotDownloadHeight++;
+    int nEnd = std::min(nBaseHeight, nSnapshotDownloadHeight + SNAPSHOT_DOWNLOAD_WINDOW - 1);
+    for (int nHeight = nSnapshotDownloadHeight; nHeight <= nEnd; nHeight++) {
+        if (state->nBlocksInFlight + state->nBlocksToDownload >= MAX_BLOCKS_IN_TRANSIT_PER_PEER)
+            break;
+        CBlockIndex* pindex = chainActive[nHeight];
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+            AddBlockToQueue(nodeid, pindex->GetBlockHash());
+    }
+}
+
 bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp)
 {
     AssertLockHeld(cs_main);
@@ -3203,8 +3672,11 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
 
     // Check for duplicate
     uint256 hash = pblock->GetHash();
-    if (mapBlockIndex.count(hash))
-        return state.Invalid(error("ProcessBlock() : already have block %d %s", mapBlockIndex[hash]->nHeight, hash.ToString()), 0, "duplicate");
+    map<uint256, CBlockIndex*>::iterator miSelf = mapBlockIndex.find(hash);
+    if (miSelf != mapBlockIndex.end() && IsMissingSnapshotBlock(miSelf->second))
+        return AcceptSnapshotBlock(*pblock, state, miSelf->second);
+    if (miSelf != mapBlockIndex.end())
+        return state.Invalid(error("ProcessBlock() : already have block %d %s", miSelf->second->nHeight, hash.ToString()), 0, "duplicate");
     if (mapOrphanBlocks.count(hash))
         return state.Invalid(error("ProcessBlock() : already have block (orphan) %s", hash.ToString()), 0, "duplicate");
 
@@ -3538,19 +4010,24 @@ bool static LoadBlockIndexDB()
 
     boost::this_thread::interruption_point();
 
-    // Calculate nChainWork
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
+    // Calculate nChainWork. LoadBlockIndexGuts left each block's own work in nChainWork;
+    // order the entries by height with a counting sort so that every parent is summed
+    // before its children, then accumulate in one pass.
+    int nMaxHeight = 0;
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        nMaxHeight = std::max(nMaxHeight, item.second->nHeight);
+    vector<size_t> vHeightOffset(nMaxHeight + 2, 0);
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vHeightOffset[item.second->nHeight + 1]++;
+    for (int nHeight = 1; nHeight <= nMaxHeight + 1; nHeight++)
+        vHeightOffset[nHeight] += vHeightOffset[nHeight - 1];
+    vector<CBlockIndex*> vSortedByHeight(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vSortedByHeight[vHeightOffset[item.second->nHeight]++] = item.second;
+    BOOST_FOREACH(CBlockIndex* pindex, vSortedByHeight)
     {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
-    }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
-    {
-        CBlockIndex* pindex = item.second;
-        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork().getuint256();
+        if (pindex->pprev)
+            pindex->nChainWork += pindex->pprev->nChainWork;
         pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
         if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & BLOCK_FAILED_MASK))
             setBlockIndexValid.insert(pindex);
@@ -3572,12 +4049,29 @@ bool static LoadBlockIndexDB()
     // Check whether we have a transaction index
     pblocktree->ReadFlag("txindex", fTxIndex);
     LogPrintf("LoadBlockIndexDB(): transaction index %s\n", fTxIndex ? "enabled" : "disabled");
+    pblocktree->ReadFlag("blockfilterindex", fBlockFilterIndex);
+    LogPrintf("LoadBlockIndexDB(): block filter index %s\n", fBlockFilterIndex ? "enabled" : "disabled");
 
     // Load pointer to end of best chain
     std::map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     if (it == mapBlockIndex.end())
         return true;
     chainActive.SetTip(it->second);
+    {
+        boost::unique_lock<boost::mutex> lock(csBestBlock);
+        hashBestBlock = it->second->GetBlockHash();
+    }
+
+    // Blocks below a loaded UTXO snapshot that still have to be validated
+    uint256 hashSnapshotBase;
+    if (pblocktree->ReadSnapshotBase(hashSnapshotBase, hashSnapshotSerialized)) {
+        map<uint256, CBlockIndex*>::iterator itBase = mapBlockIndex.find(hashSnapshotBase);
+        if (itBase == mapBlockIndex.end())
+            return error("LoadBlockIndexDB() : UTXO snapshot block %s not in the block index", hashSnapshotBase.ToString());
+        pindexSnapshotBase = itBase->second;
+        LogPrintf("LoadBlockIndexDB(): blocks below the UTXO snapshot at height %d are not validated yet\n", pindexSnapshotBase->nHeight);
+    }
+
     LogPrintf("LoadBlockIndexDB(): hashBestChain=%s height=%d date=%s progress=%f\n",
         chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(),
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
@@ -3586,28 +4080,48 @@ bool static LoadBlockIndexDB()
     return true;
 }
 
-bool VerifyDB(int nCheckLevel, int nCheckDepth)
+bool VerifyDB(int nCheckLevel, int nCheckDepth, bool* pfComplete)
 {
-    LOCK(cs_main);
-    if (chainActive.Tip() == NULL || chainActive.Tip()->pprev == NULL)
+    // cs_main is only held for one block at a time, so that this can run while the
+    // node is already serving. If the tip moves underneath us the coins view no longer
+    // matches the blocks being checked, and verification stops early without a verdict.
+    if (pfComplete)
+        *pfComplete = false;
+    CBlockIndex* pindexTip;
+    {
+        LOCK(cs_main);
+        pindexTip = chainActive.Tip();
+    }
+    if (pindexTip == NULL || pindexTip->pprev == NULL) {
+        if (pfComplete)
+            *pfComplete = true;
         return true;
+    }
 
     // Verify blocks in the best chain
     if (nCheckDepth <= 0)
         nCheckDepth = 1000000000; // suffices until the year 19000
-    if (nCheckDepth > chainActive.Height())
-        nCheckDepth = chainActive.Height();
+    if (nCheckDepth > pindexTip->nHeight)
+        nCheckDepth = pindexTip->nHeight;
     nCheckLevel = std::max(0, std::min(4, nCheckLevel));
     LogPrintf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
     CCoinsViewCache coins(*pcoinsTip, true);
-    CBlockIndex* pindexState = chainActive.Tip();
+    CBlockIndex* pindexState = pindexTip;
     CBlockIndex* pindexFailure = NULL;
     int nGoodTransactions = 0;
     CValidationState state;
-    for (CBlockIndex* pindex = chainActive.Tip(); pindex && pindex->pprev; pindex = pindex->pprev)
+    for (CBlockIndex* pindex = pindexTip; pindex && pindex->pprev; pindex = pindex->pprev)
     {
         boost::this_thread::interruption_point();
-        if (pindex->nHeight < chainActive.Height()-nCheckDepth)
+        if (pindex->nHeight < pindexTip->nHeight-nCheckDepth)
+            break;
+        LOCK(cs_main);
+        if (chainActive.Tip() != pindexTip) {
+            LogPrintf("VerifyDB() : best chain changed, stopping verification at height %d\n", pindex->nHeight);
+            return true;
+        }
+        // blocks below a loaded UTXO snapshot have no data to check
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA))
             break;
         CBlock block;
         // check level 0: read from disk
@@ -3639,13 +4153,18 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
         }
     }
     if (pindexFailure)
-        return error("VerifyDB() : *** coin database inconsistencies found (last %i blocks, %i good transactions before that)\n", chainActive.Height() - pindexFailure->nHeight + 1, nGoodTransactions);
+        return error("VerifyDB() : *** coin database inconsistencies found (last %i blocks, %i good transactions before that)\n", pindexTip->nHeight - pindexFailure->nHeight + 1, nGoodTransactions);
 
     // check level 4: try reconnecting blocks
     if (nCheckLevel >= 4) {
         CBlockIndex *pindex = pindexState;
-        while (pindex != chainActive.Tip()) {
+        while (pindex != pindexTip) {
             boost::this_thread::interruption_point();
+            LOCK(cs_main);
+            if (chainActive.Tip() != pindexTip) {
+                LogPrintf("VerifyDB() : best chain changed, stopping verification at height %d\n", pindex->nHeight);
+                return true;
+            }
             pindex = chainActive.Next(pindex);
             CBlock block;
             if (!ReadBlockFromDisk(block, pindex))
@@ -3655,17 +4174,152 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
         }
     }
 
-    LogPrintf("No coin database inconsistencies in last %i blocks (%i transactions)\n", chainActive.Height() - pindexState->nHeight, nGoodTransactions);
+    LogPrintf("No coin database inconsistencies in last %i blocks (%i transactions)\n", pindexTip->nHeight - pindexState->nHeight, nGoodTransactions);
 
+    if (pfComplete)
+        *pfComplete = true;
     return true;
 }
 
+bool IsSnapshotValidationPending()
+{
+    LOCK(cs_main);
+    return pindexSnapshotBase != NULL;
+}
+
+bool CanServeBlock(const CBlockIndex* pindex)
+{
+    AssertLockHeld(cs_main);
+    if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+        return false;
+    return pindexSnapshotBase == NULL || pindex->nHeight > pindexSnapshotBase->nHeight ||
+           pindex->nHeight <= nSnapshotValidatedHeight;
+}
+
+void ThreadValidateSnapshot()
+{
+    vector<CBlockIndex*> vChain;
+    uint256 hashSerialized;
+    {
+        LOCK(cs_main);
+        if (pindexSnapshotBase == NULL)
+            return;
+        vChain.resize(pindexSnapshotBase->nHeight + 1);
+        for (CBlockIndex* pindex = pindexSnapshotBase; pindex; pindex = pindex->pprev)
+            vChain[pindex->nHeight] = pindex;
+        hashSerialized = hashSnapshotSerialized;
+    }
+    CBlockIndex* pindexBase = vChain.back();
+
+    {
+        // Kept across restarts, so that validation resumes where it stopped
+        CCoinsViewDB viewdb(1 << 23, false, false, "snapshotcheck");
+        CCoinsViewCache view(viewdb);
+        int nHeight = 0;
+        uint256 hashBest = view.GetBestBlock();
+        if (hashBest != 0) {
+            LOCK(cs_main);
+            map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(hashBest);
+            if (it == mapBlockIndex.end() || it->second->nHeight > pindexBase->nHeight || vChain[it->second->nHeight] != it->second) {
+                AbortNode(_("The UTXO snapshot validation state does not match the block index, restart with -reindex"));
+                return;
+            }
+            nHeight = it->second->nHeight + 1;
+            nSnapshotValidatedHeight = it->second->nHeight;
+        }
+        LogPrintf("Validating the blocks below the UTXO snapshot at height %d, from height %d\n", pindexBase->nHeight, nHeight);
+
+        try {
+            for (; nHeight <= pindexBase->nHeight; nHeight++) {
+                CBlockIndex* pindex = vChain[nHeight];
+                CDiskBlockPos pos;
+                while (true) {
+                    {
+                        LOCK(cs_main);
+                        if (pindex->nStatus & BLOCK_HAVE_DATA) {
+                            pos = pindex->GetBlockPos();
+                            break;
+                        }
+                    }
+                    MilliSleep(500);
+                }
+
+                CBlock block;
+                if (!ReadBlockFromDisk(block, pos)) {
+                    AbortNode(strprintf(_("Failed to read block %s below the UTXO snapshot"), pindex->GetBlockHash().ToString()));
+                    return;
+                }
+                {
+                    LOCK(cs_main);
+                    CValidationState state;
+                    if ((pindex->pprev && !ContextualCheckBlock(block, state, pindex->pprev)) ||
+                        !ConnectBlock(block, state, pindex, view, true)) {
+                        AbortNode(strprintf(_("Block %s below the UTXO snapshot is invalid (%s), the snapshot cannot be trusted"),
+                            pindex->GetBlockHash().ToString(), state.GetRejectReason()));
+                        return;
+                    }
+                    view.SetBestBlock(pindex->GetBlockHash());
+                }
+                if ((view.GetCacheSize() > nCoinCacheSize / 4 || pindex == pindexBase) && !view.Flush()) {
+                    AbortNode(_("Failed to write to the UTXO snapshot validation database"));
+                    return;
+                }
+                {
+                    LOCK(cs_main);
+                    nSnapshotValidatedHeight = nHeight;
+                }
+                if (nHeight % 10000 == 0)
+                    LogPrintf("Validated the blocks below the UTXO snapshot up to height %d\n", nHeight);
+            }
+        } catch (boost::thread_interrupted&) {
+            view.Flush();
+            throw;
+        }
+
+        // The coins of the downloaded chain must be exactly the snapshot's
+        CCoinsStats stats;
+        CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+        ss << pindexBase->GetBlockHash();
+        boost::scoped_ptr<CCoinsViewCursor> pcursor(viewdb.Cursor());
+        while (pcursor->Valid()) {
+            boost::this_thread::interruption_point();
+            uint256 txid;
+            CCoins coins;
+            if (!pcursor->GetKey(txid) || !pcursor->GetValue(coins)) {
+                AbortNode(_("Failed to read the UTXO snapshot validation database"));
+                return;
+            }
+            ApplyStats(stats, ss, txid, coins);
+            pcursor->Next();
+        }
+        if (ss.GetHash() != hashSerialized) {
+            AbortNode(_("The block chain does not produce the coins of the loaded UTXO snapshot, the snapshot is invalid"));
+            return;
+        }
+    }
+
+    {
+        LOCK(cs_main);
+        if (!pblocktree->EraseSnapshotBase() || !pblocktree->Sync()) {
+            AbortNode(_("Failed to write to the block index database"));
+            return;
+        }
+        pindexSnapshotBase = NULL;
+        nLocalServices |= NODE_NETWORK;
+    }
+    boost::filesystem::remove_all(GetDataDir() / "snapshotcheck");
+    LogPrintf("Validated the UTXO snapshot at block %s against the block chain\n", pindexBase->GetBlockHash().ToString());
+}
+
 void UnloadBlockIndex()
 {
     mapBlockIndex.clear();
     setBlockIndexValid.clear();
     chainActive.SetTip(NULL);
     pindexBestInvalid = NULL;
+    pindexSnapshotBase = NULL;
+    nSnapshotValidatedHeight = 0;
+    nSnapshotDownloadHeight = 1;
 }
 
 bool LoadBlockIndex()
@@ -3686,6 +4340,8 @@ bool InitBlockIndex() {
     // Use the provided setting for -txindex in the new database
     fTxIndex = GetBoolArg("-txindex", false);
     pblocktree->WriteFlag("txindex", fTxIndex);
+    fBlockFilterIndex = GetBoolArg("-blockfilterindex", false);
+    pblocktree->WriteFlag("blockfilterindex", fBlockFilterIndex);
     LogPrintf("Initializing databases...\n");
 
     // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
@@ -3781,7 +4437,263 @@ void PrintBlockTree()
     }
 }
 
-bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
+int GetImportThreads()
+{
+    int nThreads = GetArg("-importthreads", DEFAULT_IMPORT_THREADS);
+    if (nThreads <= 0)
+        nThreads += boost::thread::hardware_concurrency();
+    return std::max(1, std::min(nThreads, MAX_IMPORT_THREADS));
+}
+
+namespace {
+
+/** Three-stage pipeline behind LoadExternalBlockFile:
+ *  - the calling thread scans the file for message-start bytes and queues the raw
+ *    block bytes (Push),
+ *  - worker threads deserialize, hash and run CheckBlockStructure on them,
+ *  - a connect thread takes the parsed blocks back in file order, parks those with
+ *    an unknown parent in the caller's map and feeds the rest to ProcessBlock.
+ */
+class CBlockImporter
+{
+private:
+    struct CRawBlock
+    {
+        uint64_t nSeq;
+        uint64_t nBlockPos;
+        std::vector<char> vchBlock;
+    };
+
+    struct CParsedBlock
+    {
+        uint64_t nBlockPos;
+        bool fValid;
+        uint256 hash;
+        CBlock block;
+    };
+
+    boost::mutex mutex;
+    boost::condition_variable condRaw;    // workers wait for raw blocks
+    boost::condition_variable condParsed; // connect stage waits for the next parsed block
+    boost::condition_variable condSpace;  // reader waits for queue space
+
+    std::deque<CRawBlock> queueRaw;
+    std::map<uint64_t, CParsedBlock*> mapParsed;
+    uint64_t nNextSeq;     // sequence number of the next block pushed by the reader
+    uint64_t nConnectSeq;  // sequence number the connect stage is waiting for
+    bool fFinished;        // reader is done, drain and exit
+    bool fAbort;           // stop everything as soon as possible
+    bool fJoined;
+
+    boost::thread_group workers;
+    boost::thread* pthreadConnect;
+
+    CDiskBlockPos* dbp;
+    // Blocks whose parent was not known yet, by parent hash. Only their position on
+    // disk is kept; they are re-read once the parent has been connected.
+    std::multimap<uint256, CDiskBlockPos>* pmapBlocksUnknownParent;
+    int nLoaded;
+
+    void ThreadParse()
+    {
+        while (true) {
+            CRawBlock raw;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queueRaw.empty() && !fFinished && !fAbort)
+                    condRaw.wait(lock);
+                if (fAbort || queueRaw.empty())
+                    return;
+                raw.nSeq = queueRaw.front().nSeq;
+                raw.nBlockPos = queueRaw.front().nBlockPos;
+                raw.vchBlock.swap(queueRaw.front().vchBlock);
+                queueRaw.pop_front();
+            }
+            condSpace.notify_one();
+
+            CParsedBlock* pparsed = new CParsedBlock();
+            pparsed->nBlockPos = raw.nBlockPos;
+            pparsed->fValid = false;
+            try {
+                CDataStream ss(raw.vchBlock, SER_DISK, CLIENT_VERSION);
+                ss >> pparsed->block;
+                pparsed->hash = pparsed->block.GetHash();
+                pparsed->fValid = true;
+                // Blocks failing here are still handed to ProcessBlock, which reports them
+                CValidationState state;
+                if (CheckBlockStructure(pparsed->block, state))
+                    pparsed->block.fChecked = true;
+            } catch (std::exception &e) {
+                LogPrintf("%s : Deserialize or I/O error - %s\n", "LoadExternalBlockFile", e.what());
+            }
+
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                mapParsed.insert(make_pair(raw.nSeq, pparsed));
+            }
+            condParsed.notify_one();
+        }
+    }
+
+    void ThreadConnect()
+    {
+        while (true) {
+            CParsedBlock* pparsed = NULL;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fAbort && !mapParsed.count(nConnectSeq) && !(fFinished && nConnectSeq == nNextSeq))
+                    condParsed.wait(lock);
+                if (fAbort || !mapParsed.count(nConnectSeq))
+                    return;
+                pparsed = mapParsed[nConnectSeq];
+                mapParsed.erase(nConnectSeq);
+                nConnectSeq++;
+            }
+            condSpace.notify_one();
+
+            bool fContinue = true;
+            try {
+                if (pparsed->fValid)
+                    fContinue = ConnectParsed(*pparsed);
+            } catch (std::exception &e) {
+                // This runs on a bare thread; never let a disk or database error escape it
+                AbortNode(_("Error: system error: ") + e.what());
+                fContinue = false;
+            }
+            delete pparsed;
+            if (!fContinue) {
+                Abort();
+                return;
+            }
+            LimitWalletNotifications();
+        }
+    }
+
+    // Returns false if processing ran into a system error and the import must stop
+    bool ConnectParsed(CParsedBlock& parsed)
+    {
+        LOCK(cs_main);
+        if (dbp) {
+            // Keep out-of-order blocks for later; their parent may still be ahead in this file or the next
+            if (parsed.hash != Params().HashGenesisBlock() && !mapBlockIndex.count(parsed.block.hashPrevBlock)) {
+                LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, parsed.hash.ToString(), parsed.block.hashPrevBlock.ToString());
+                pmapBlocksUnknownParent->insert(make_pair(parsed.block.hashPrevBlock, CDiskBlockPos(dbp->nFile, parsed.nBlockPos)));
+                return true;
+            }
+            dbp->nPos = parsed.nBlockPos;
+        }
+
+        CValidationState state;
+        if (ProcessBlock(state, NULL, &parsed.block, dbp))
+            nLoaded++;
+        if (state.IsError())
+            return false;
+
+        // Recursively process earlier encountered successors of this block
+        deque<uint256> queue;
+        queue.push_back(parsed.hash);
+        while (!queue.empty()) {
+            uint256 head = queue.front();
+            queue.pop_front();
+            std::pair<multimap<uint256, CDiskBlockPos>::iterator, multimap<uint256, CDiskBlockPos>::iterator> range = pmapBlocksUnknownParent->equal_range(head);
+            while (range.first != range.second) {
+                multimap<uint256, CDiskBlockPos>::iterator it = range.first;
+                CBlock block;
+                if (ReadBlockFromDisk(block, it->second)) {
+                    LogPrint("reindex", "%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(), head.ToString());
+                    CValidationState dummy;
+                    if (ProcessBlock(dummy, NULL, &block, &it->second)) {
+                        nLoaded++;
+                        queue.push_back(block.GetHash());
+                    }
+                }
+                range.first++;
+                pmapBlocksUnknownParent->erase(it);
+            }
+        }
+        return true;
+    }
+
+public:
+    CBlockImporter(CDiskBlockPos* dbpIn, std::multimap<uint256, CDiskBlockPos>* pmapBlocksUnknownParentIn) :
+        nNextSeq(0), nConnectSeq(0), fFinished(false), fAbort(false), fJoined(false), pthreadConnect(NULL),
+        dbp(dbpIn), pmapBlocksUnknownParent(pmapBlocksUnknownParentIn), nLoaded(0)
+    {
+        int nThreads = GetImportThreads();
+        for (int i = 0; i < nThreads; i++)
+            workers.create_thread(boost::bind(&CBlockImporter::ThreadParse, this));
+        pthreadConnect = new boost::thread(boost::bind(&CBlockImporter::ThreadConnect, this));
+    }
+
+    ~CBlockImporter()
+    {
+        // Only does work when the reader was interrupted or threw before Finish()
+        boost::this_thread::disable_interruption di;
+        Abort();
+        Join();
+        BOOST_FOREACH(PAIRTYPE(const uint64_t, CParsedBlock*)& item, mapParsed)
+            delete item.second;
+    }
+
+    /** Queue the raw bytes of one block found at nBlockPos. Returns false once the import was aborted. */
+    bool Push(uint64_t nBlockPos, std::vector<char>& vchBlock)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!fAbort && nNextSeq - nConnectSeq >= MAX_IMPORT_QUEUE)
+                condSpace.wait(lock);
+            if (fAbort)
+                return false;
+            CRawBlock raw;
+            raw.nSeq = nNextSeq++;
+            raw.nBlockPos = nBlockPos;
+            queueRaw.push_back(raw);
+            queueRaw.back().vchBlock.swap(vchBlock);
+        }
+        condRaw.notify_one();
+        return true;
+    }
+
+    void Abort()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fAbort = true;
+        }
+        condRaw.notify_all();
+        condParsed.notify_all();
+        condSpace.notify_all();
+    }
+
+    /** Wait for every queued block to be processed and return the number of blocks loaded. */
+    int Finish()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fFinished = true;
+        }
+        condRaw.notify_all();
+        condParsed.notify_all();
+        Join();
+        return nLoaded;
+    }
+
+private:
+    void Join()
+    {
+        if (fJoined)
+            return;
+        workers.join_all();
+        pthreadConnect->join();
+        delete pthreadConnect;
+        pthreadConnect = NULL;
+        fJoined = true;
+    }
+};
+
+} // anon namespace
+
+bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp, std::multimap<uint256, CDiskBlockPos>* pmapBlocksUnknownParent)
 {
     int64_t nStart = GetTimeMillis();
 
@@ -3797,6 +4709,9 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
                 blkdat.Seek(info.nSize);
             }
         }
+        // Without a caller-owned map, out-of-order blocks can only be matched up within this file
+        std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+        CBlockImporter importer(dbp, pmapBlocksUnknownParent ? pmapBlocksUnknownParent : &mapBlocksUnknownParent);
         uint64_t nRewind = blkdat.GetPos();
         while (blkdat.good() && !blkdat.eof()) {
             boost::this_thread::interruption_point();
@@ -3822,28 +4737,20 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
                 break;
             }
             try {
-                // read block
+                // read block; parsing and hashing happen on the importer's worker threads
                 uint64_t nBlockPos = blkdat.GetPos();
                 blkdat.SetLimit(nBlockPos + nSize);
-                CBlock block;
-                blkdat >> block;
+                std::vector<char> vchBlock(nSize);
+                blkdat.read(&vchBlock[0], nSize);
                 nRewind = blkdat.GetPos();
 
-                // process block
-                if (nBlockPos >= nStartByte) {
-                    LOCK(cs_main);
-                    if (dbp)
-                        dbp->nPos = nBlockPos;
-                    CValidationState state;
-                    if (ProcessBlock(state, NULL, &block, dbp))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
-                }
+                if (nBlockPos >= nStartByte && !importer.Push(nBlockPos, vchBlock))
+                    break;
             } catch (std::exception &e) {
                 LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
             }
         }
+        nLoaded = importer.Finish();
         fclose(fileIn);
     } catch(std::runtime_error &e) {
         AbortNode(_("Error: system error: ") + e.what());
@@ -3947,12 +4854,21 @@ bool static AlreadyHave(const CInv& inv)
         return mapBlockIndex.count(inv.hash) ||
                mapOrphanBlocks.count(inv.hash);
     case MSG_TXLOCK_REQUEST:
-        return mapTxLockReq.count(inv.hash) ||
-               mapTxLockReqRejected.count(inv.hash);
+        {
+            LOCK(cs_instantx);
+            return mapTxLockReq.count(inv.hash) ||
+                   mapTxLockReqRejected.count(inv.hash);
+        }
     case MSG_TXLOCK_VOTE:
-        return mapTxLockVote.count(inv.hash);
+        {
+            LOCK(cs_instantx);
+            return mapTxLockVote.count(inv.hash);
+        }
     case MSG_SPORK:
-        return mapSporks.count(inv.hash);
+        {
+            LOCK(cs_spork);
+            return mapSporks.count(inv.hash);
+        }
     case MSG_MASTERNODE_WINNER:
         return mapSeenMasternodeVotes.count(inv.hash);
     case MSG_MASTERNODE_SCANNING_ERROR:
@@ -3963,6 +4879,57 @@ bool static AlreadyHave(const CInv& inv)
 }
 
 
+namespace {
+
+// Each extension subsystem serializes its own message handlers with one of these, so
+// that messages for different subsystems are handled concurrently by the message
+// handler threads. Only taken by ProcessMessages, before any other lock.
+CCriticalSection cs_sporkMessages;
+CCriticalSection cs_masternodeMessages;
+CCriticalSection cs_darksendMessages;
+CCriticalSection cs_instantxMessages;
+
+} // anon namespace
+
+CCriticalSection* GetMessageLock(const string& strCommand)
+{
+    // Handlers that only touch the sending node, its own locks and addrman
+    if (strCommand == "verack" ||
+        strCommand == "addr" ||
+        strCommand == "getaddr" ||
+        strCommand == "ping" ||
+        strCommand == "pong" ||
+        strCommand == "filterload" ||
+        strCommand == "filteradd" ||
+        strCommand == "filterclear" ||
+        strCommand == "reject")
+        return NULL;
+
+    if (strCommand == "spork" || strCommand == "getsporks")
+        return &cs_sporkMessages;
+
+    // mnw and mnse stay with the chainstate handlers: the maps they fill are read by
+    // AlreadyHave and ProcessGetData, and written by ProcessBlock, all under cs_main
+    if (strCommand == "dsee" || strCommand == "dseep" || strCommand == "mvote" ||
+        strCommand == "dseg" || strCommand == "mnget")
+        return &cs_masternodeMessages;
+
+    if (strCommand == "dsa" || strCommand == "dsq" || strCommand == "dsi" || strCommand == "dssu" ||
+        strCommand == "dss" || strCommand == "dsf" || strCommand == "dsc")
+        return &cs_darksendMessages;
+
+    if (strCommand == "txlreq" || strCommand == "txlvote")
+        return &cs_instantxMessages;
+
+    return &cs_main;
+}
+
+// The "block" and "cmpctblock" messages for the chain tip as last served by ProcessGetData (protected by cs_main)
+static uint256 hashLastBlockMessage;
+static CSendBuffer msgLastBlock;
+static uint256 hashLastCmpctBlockMessage;
+static CSendBuffer msgLastCmpctBlock;
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -3981,7 +4948,7 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
                 bool send = false;
                 map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
@@ -4001,14 +4968,50 @@ void static ProcessGetData(CNode* pfrom)
                     } else {
                         send = true;
                     }
+                    // Blocks below a loaded UTXO snapshot are only served once downloaded and validated
+                    if (!CanServeBlock(mi->second))
+                        send = false;
+                }
+                if (send && inv.type == MSG_BLOCK && inv.hash == hashLastBlockMessage)
+                {
+                    // A new block is asked for by every peer; serve them all the same message
+                    pfrom->PushMessage(msgLastBlock);
                 }
-                if (send)
+                else if (send && inv.type == MSG_CMPCT_BLOCK && inv.hash == hashLastCmpctBlockMessage)
+                {
+                    pfrom->PushMessage(msgLastCmpctBlock);
+                }
+                else if (send)
                 {
                     // Send block from disk
                     CBlock block;
                     ReadBlockFromDisk(block, (*mi).second);
                     if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                    {
+                        CSendBuffer msg = MakeMessage("block", block);
+                        pfrom->PushMessage(msg);
+                        if ((*mi).second == chainActive.Tip())
+                        {
+                            hashLastBlockMessage = inv.hash;
+                            msgLastBlock = msg;
+                        }
+                    }
+                    else if (inv.type == MSG_CMPCT_BLOCK)
+                    {
+                        // Only recent blocks are likely to have their transactions in the peer's memory pool
+                        if ((*mi).second->nHeight + MAX_CMPCTBLOCK_DEPTH >= chainActive.Height())
+                        {
+                            CSendBuffer msg = MakeMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+                            pfrom->PushMessage(msg);
+                            if ((*mi).second == chainActive.Tip())
+                            {
+                                hashLastCmpctBlockMessage = inv.hash;
+                                msgLastCmpctBlock = msg;
+                            }
+                        }
+                        else
+                            pfrom->PushMessage("block", block);
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
                         LOCK(pfrom->cs_filter);
@@ -4030,18 +5033,19 @@ void static ProcessGetData(CNode* pfrom)
                         // else
                             // no response
                     }
+                }
 
-                    // Trigger them to send a getblocks request for the next batch of inventory
-                    if (inv.hash == pfrom->hashContinue)
-                    {
-                        // Bypass PushInventory, this must send even if redundant,
-                        // and we want it right after the last block so they don't
-                        // wait for other stuff first.
-                        vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
-                        pfrom->PushMessage("inv", vInv);
-                        pfrom->hashContinue = 0;
-                    }
+                // Trigger them to send a getblocks request for the next batch of inventory,
+                // whether the block came from disk or from the cached messages above
+                if (send && inv.hash == pfrom->hashContinue)
+                {
+                    // Bypass PushInventory, this must send even if redundant,
+                    // and we want it right after the last block so they don't
+                    // wait for other stuff first.
+                    vector<CInv> vInv;
+                    vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
+                    pfrom->PushMessage("inv", vInv);
+                    pfrom->hashContinue = 0;
                 }
             }
             else if (inv.IsKnownType())
@@ -4050,9 +5054,9 @@ void static ProcessGetData(CNode* pfrom)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CSendBuffer>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushMessage((*mi).second);
                         pushed = true;
                     }
                 }
@@ -4082,6 +5086,7 @@ void static ProcessGetData(CNode* pfrom)
                     }
                 }
                 if (!pushed && inv.type == MSG_TXLOCK_VOTE) {
+                    LOCK(cs_instantx);
                     if(mapTxLockVote.count(inv.hash)){
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
@@ -4091,6 +5096,7 @@ void static ProcessGetData(CNode* pfrom)
                     }
                 }
                 if (!pushed && inv.type == MSG_TXLOCK_REQUEST) {
+                    LOCK(cs_instantx);
                     if(mapTxLockReq.count(inv.hash)){
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
@@ -4100,13 +5106,17 @@ void static ProcessGetData(CNode* pfrom)
                     }
                 }
                 if (!pushed && inv.type == MSG_SPORK) {
-                    if(mapSporks.count(inv.hash)){
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mapSporks[inv.hash];
-                        pfrom->PushMessage("spork", ss);
-                        pushed = true;
+                    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                    {
+                        LOCK(cs_spork);
+                        if(mapSporks.count(inv.hash)){
+                            ss.reserve(1000);
+                            ss << mapSporks[inv.hash];
+                            pushed = true;
+                        }
                     }
+                    if (pushed)
+                        pfrom->PushMessage("spork", ss);
                 }
                 if (!pushed && inv.type == MSG_MASTERNODE_WINNER) {
                     if(mapSeenMasternodeVotes.count(inv.hash)){
@@ -4135,7 +5145,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             g_signals.Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -4154,6 +5164,58 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+// Finish a compact block from pfrom with the transactions it sent for it. Requires cs_main.
+bool static ProcessCompactBlock(CNode* pfrom, CPartialBlock& partialBlock, const vector<CTransaction>& vMissingTxn)
+{
+    uint256 hash = partialBlock.GetBlockHash();
+    CBlock block;
+    ReadStatus status = partialBlock.FillBlock(block, vMissingTxn);
+    partialBlock.SetNull();
+    if (status == READ_STATUS_INVALID)
+    {
+        Misbehaving(pfrom->GetId(), 100);
+        return error("ProcessCompactBlock() : peer %s sent the wrong transactions for block %s", pfrom->addr.ToString(), hash.ToString());
+    }
+    if (status == READ_STATUS_FAILED)
+    {
+        // Most likely a short ID collision; fall back to the full block
+        LogPrint("net", "failed to rebuild compact block %s, requesting full block\n", hash.ToString());
+        vector<CInv> vGetData(1, CInv(MSG_BLOCK, hash));
+        pfrom->PushMessage("getdata", vGetData);
+        return true;
+    }
+
+    LogPrint("net", "rebuilt compact block %s with %u of %u transactions sent by peer\n", hash.ToString(), vMissingTxn.size(), block.vtx.size());
+    mapBlockSource[hash] = pfrom->GetId();
+    MarkBlockAsReceived(hash, pfrom->GetId());
+
+    CValidationState state;
+    ProcessBlock(state, pfrom, &block);
+    return true;
+}
+
+// The blocks from nStartHeight up to hashStop covered by a getcfilters or getcfheaders request
+bool static GetBlockFilterRange(CNode* pfrom, uint8_t nFilterType, uint32_t nStartHeight, const uint256& hashStop, unsigned int nMaxBlocks, vector<CBlockIndex*>& vBlocks)
+{
+    LOCK(cs_main);
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+    if (nFilterType != BLOCK_FILTER_BASIC || mi == mapBlockIndex.end())
+    {
+        LogPrint("net", "block filter request of type %d for unknown block %s from %s\n", nFilterType, hashStop.ToString(), pfrom->addr.ToString());
+        return false;
+    }
+    CBlockIndex* pindex = mi->second;
+    if (nStartHeight > (uint32_t)pindex->nHeight || pindex->nHeight - nStartHeight >= nMaxBlocks)
+    {
+        Misbehaving(pfrom->GetId(), 100);
+        return error("GetBlockFilterRange() : peer %s requested filters for heights %u to %d", pfrom->addr.ToString(), nStartHeight, pindex->nHeight);
+    }
+    vBlocks.resize(pindex->nHeight - nStartHeight + 1);
+    for (int i = vBlocks.size() - 1; i >= 0; i--, pindex = pindex->pprev)
+        vBlocks[i] = pindex;
+    return true;
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 {
     RandAddSeedPerfmon();
@@ -4164,13 +5226,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         return true;
     }
 
-    {
-        LOCK(cs_main);
-        State(pfrom->GetId())->nLastBlockProcess = GetTimeMicros();
-    }
-
-
-
     if (strCommand == "version")
     {
         // Each connection can only send one version message
@@ -4323,11 +5378,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
                     // at a time so the setAddrKnowns of the chosen nodes prevent repeats
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
                     uint64_t hashAddr = addr.GetHash();
-                    uint256 hashRand = hashSalt ^ (hashAddr<<32) ^ ((GetTime()+hashAddr)/(24*60*60));
+                    uint256 hashRand = hashAddrRelaySalt ^ (hashAddr<<32) ^ ((GetTime()+hashAddr)/(24*60*60));
                     hashRand = Hash(BEGIN(hashRand), END(hashRand));
                     multimap<uint256, CNode*> mapMix;
                     BOOST_FOREACH(CNode* pnode, vNodes)
@@ -4445,6 +5497,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 LogPrint("net", "  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
                 break;
             }
+            if (!CanServeBlock(pindex))
+            {
+                LogPrint("net", "  getblocks stopping at %d %s, below the unvalidated UTXO snapshot\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+                break;
+            }
             pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
             if (--nLimit <= 0)
             {
@@ -4625,6 +5682,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         else if (fMissingInputs)
         {
             AddOrphanTx(tx, pfrom->GetId());
+            AddToCompactExtraTransactions(tx);
 
             // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
             unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
@@ -4642,6 +5700,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                                state.GetRejectReason(), inv.hash);
             if (nDoS > 0)
                 Misbehaving(pfrom->GetId(), nDoS);
+            else
+                AddToCompactExtraTransactions(tx);
         }
     }
 
@@ -4668,9 +5728,216 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex)
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        uint256 hash = cmpctblock.header.GetHash();
+        LogPrint("net", "received compact block %s (%u transactions, %u prefilled)\n", hash.ToString(), cmpctblock.BlockTxCount(), cmpctblock.prefilledtxn.size());
+        pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hash));
+
+        LOCK(cs_main);
+        if (!CheckProofOfWork(hash, cmpctblock.header.nBits))
+        {
+            Misbehaving(pfrom->GetId(), 50);
+            return error("cmpctblock : proof of work failed for %s", hash.ToString());
+        }
+        if (mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash))
+        {
+            MarkBlockAsReceived(hash, pfrom->GetId());
+            return true;
+        }
+
+        // One block per peer is rebuilt at a time; a block still waiting for its
+        // blocktxn is fetched in full rather than left in flight until it times out
+        CPartialBlock& partialBlock = State(pfrom->GetId())->partialBlock;
+        if (!partialBlock.IsNull() && partialBlock.GetBlockHash() != hash && !mapBlockIndex.count(partialBlock.GetBlockHash()))
+        {
+            LogPrint("net", "compact block %s replaces %s, requesting the latter in full\n", hash.ToString(), partialBlock.GetBlockHash().ToString());
+            vector<CInv> vGetData(1, CInv(MSG_BLOCK, partialBlock.GetBlockHash()));
+            pfrom->PushMessage("getdata", vGetData);
+        }
+        ReadStatus status = partialBlock.InitData(cmpctblock, mempool, vExtraTxnForCompact);
+        if (status == READ_STATUS_INVALID)
+        {
+            Misbehaving(pfrom->GetId(), 100);
+            return error("cmpctblock : invalid compact block %s", hash.ToString());
+        }
+        if (status == READ_STATUS_FAILED)
+        {
+            LogPrint("net", "short ID collision in compact block %s, requesting full block\n", hash.ToString());
+            vector<CInv> vGetData(1, CInv(MSG_BLOCK, hash));
+            pfrom->PushMessage("getdata", vGetData);
+            return true;
+        }
+
+        CBlockTransactionsRequest req;
+        req.blockhash = hash;
+        req.vIndexes = partialBlock.GetMissing();
+        if (req.vIndexes.empty())
+            return ProcessCompactBlock(pfrom, partialBlock, vector<CTransaction>());
+
+        LogPrint("net", "requesting %u of %u transactions of compact block %s\n", req.vIndexes.size(), cmpctblock.BlockTxCount(), hash.ToString());
+        pfrom->PushMessage("getblocktxn", req);
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        CBlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA))
+        {
+            LogPrint("net", "getblocktxn for unknown block %s from %s\n", req.blockhash.ToString(), pfrom->addr.ToString());
+            return true;
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, mi->second))
+            return error("getblocktxn : failed to read block %s", req.blockhash.ToString());
+
+        // Old blocks are not requested for compact relay; whoever asks gets the full block
+        if (mi->second->nHeight + MAX_BLOCKTXN_DEPTH < chainActive.Height())
+        {
+            pfrom->PushMessage("block", block);
+            return true;
+        }
+
+        CBlockTransactions resp;
+        resp.blockhash = req.blockhash;
+        resp.txn.reserve(req.vIndexes.size());
+        BOOST_FOREACH(unsigned int nIndex, req.vIndexes)
+        {
+            if (nIndex >= block.vtx.size())
+            {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("getblocktxn : out-of-bounds transaction index %u for block %s", nIndex, req.blockhash.ToString());
+            }
+            resp.txn.push_back(block.vtx[nIndex]);
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "getcfilters" && fBlockFilterIndex)
+    {
+        uint8_t nFilterType;
+        uint32_t nStartHeight;
+        uint256 hashStop;
+        vRecv >> nFilterType >> nStartHeight >> hashStop;
+
+        vector<CBlockIndex*> vBlocks;
+        if (!GetBlockFilterRange(pfrom, nFilterType, nStartHeight, hashStop, MAX_GETCFILTERS_SIZE, vBlocks))
+            return true;
+
+        // Each filter was computed once, when its block was connected; only the lookup is per peer
+        BOOST_FOREACH(CBlockIndex* pindex, vBlocks)
+        {
+            vector<unsigned char> vchFilter;
+            if (!pblockfilterdb->ReadFilter(pindex->GetBlockHash(), vchFilter))
+            {
+                LogPrint("net", "no filter for block %s requested by %s\n", pindex->GetBlockHash().ToString(), pfrom->addr.ToString());
+                break;
+            }
+            pfrom->PushMessage("cfilter", nFilterType, pindex->GetBlockHash(), vchFilter);
+        }
+    }
+
+
+    else if (strCommand == "getcfheaders" && fBlockFilterIndex)
+    {
+        uint8_t nFilterType;
+        uint32_t nStartHeight;
+        uint256 hashStop;
+        vRecv >> nFilterType >> nStartHeight >> hashStop;
+
+        vector<CBlockIndex*> vBlocks;
+        if (!GetBlockFilterRange(pfrom, nFilterType, nStartHeight, hashStop, MAX_GETCFHEADERS_SIZE, vBlocks))
+            return true;
+
+        uint256 hashFilter, hashHeader, hashPrevHeader = 0;
+        if (vBlocks[0]->pprev && !pblockfilterdb->ReadFilterHeader(vBlocks[0]->pprev->GetBlockHash(), hashFilter, hashPrevHeader))
+        {
+            LogPrint("net", "no filter header for block %s requested by %s\n", vBlocks[0]->pprev->GetBlockHash().ToString(), pfrom->addr.ToString());
+            return true;
+        }
+        vector<uint256> vFilterHashes;
+        vFilterHashes.reserve(vBlocks.size());
+        BOOST_FOREACH(CBlockIndex* pindex, vBlocks)
+        {
+            if (!pblockfilterdb->ReadFilterHeader(pindex->GetBlockHash(), hashFilter, hashHeader))
+            {
+                LogPrint("net", "no filter header for block %s requested by %s\n", pindex->GetBlockHash().ToString(), pfrom->addr.ToString());
+                return true;
+            }
+            vFilterHashes.push_back(hashFilter);
+        }
+        pfrom->PushMessage("cfheaders", nFilterType, hashStop, hashPrevHeader, vFilterHashes);
+    }
+
+
+    else if (strCommand == "getcfcheckpt" && fBlockFilterIndex)
+    {
+        uint8_t nFilterType;
+        uint256 hashStop;
+        vRecv >> nFilterType >> hashStop;
+
+        vector<uint256> vHashes;
+        {
+            LOCK(cs_main);
+            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            // Checkpoints are looked up by height, so only the active chain is served
+            if (nFilterType != BLOCK_FILTER_BASIC || mi == mapBlockIndex.end() || !chainActive.Contains(mi->second))
+            {
+                LogPrint("net", "getcfcheckpt of type %d for block %s not in the active chain from %s\n", nFilterType, hashStop.ToString(), pfrom->addr.ToString());
+                return true;
+            }
+            for (int nHeight = CFCHECKPT_INTERVAL; nHeight <= mi->second->nHeight; nHeight += CFCHECKPT_INTERVAL)
+                vHashes.push_back(chainActive[nHeight]->GetBlockHash());
+        }
+
+        vector<uint256> vHeaders;
+        vHeaders.reserve(vHashes.size());
+        BOOST_FOREACH(const uint256& hash, vHashes)
+        {
+            uint256 hashFilter, hashHeader;
+            if (!pblockfilterdb->ReadFilterHeader(hash, hashFilter, hashHeader))
+            {
+                LogPrint("net", "no filter header for block %s requested by %s\n", hash.ToString(), pfrom->addr.ToString());
+                return true;
+            }
+            vHeaders.push_back(hashHeader);
+        }
+        pfrom->PushMessage("cfcheckpt", nFilterType, hashStop, vHeaders);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex)
+    {
+        CBlockTransactions resp;
+        vRecv >> resp;
+
+        LOCK(cs_main);
+        CPartialBlock& partialBlock = State(pfrom->GetId())->partialBlock;
+        if (partialBlock.IsNull() || partialBlock.GetBlockHash() != resp.blockhash)
+        {
+            LogPrint("net", "ignoring blocktxn for %s we did not ask for\n", resp.blockhash.ToString());
+            return true;
+        }
+        return ProcessCompactBlock(pfrom, partialBlock, resp.txn);
+    }
+
+
     else if (strCommand == "getaddr")
     {
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_inventory);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -4978,7 +6245,21 @@ bool ProcessMessages(CNode* pfrom)
         bool fRet = false;
         try
         {
-            fRet = ProcessMessage(pfrom, strCommand, vRecv);
+            CCriticalSection* pcsMessage = GetMessageLock(strCommand);
+            if (pcsMessage == NULL)
+                fRet = ProcessMessage(pfrom, strCommand, vRecv);
+            else
+            {
+                {
+                    LOCK(*pcsMessage);
+                    if (pcsMessage == &cs_main)
+                        State(pfrom->GetId())->nLastBlockProcess = GetTimeMicros();
+                    fRet = ProcessMessage(pfrom, strCommand, vRecv);
+                }
+                // Let the wallets catch up with the blocks this may have connected
+                if (pcsMessage == &cs_main)
+                    LimitWalletNotifications();
+            }
             boost::this_thread::interruption_point();
         }
         catch (std::ios_base::failure& e)
@@ -5073,7 +6354,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 {
                     // Periodically clear setAddrKnown to allow refresh broadcasts
                     if (nLastRebroadcast)
+                    {
+                        LOCK(pnode->cs_inventory);
                         pnode->setAddrKnown.clear();
+                    }
 
                     // Rebroadcast our address
                     if (!fNoListen)
@@ -5092,6 +6376,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         if (fSendTrickle)
         {
+            LOCK(pto->cs_inventory);
             vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
@@ -5160,10 +6445,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 if (inv.type == MSG_TX && !fSendTrickle)
                 {
                     // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = inv.hash ^ hashSalt;
+                    uint256 hashRand = inv.hash ^ hashTrickleSalt;
                     hashRand = Hash(BEGIN(hashRand), END(hashRand));
                     bool fTrickleWait = ((hashRand & 3) != 0);
 
@@ -5206,10 +6488,19 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         // Message: getdata (blocks)
         //
+        if (pindexSnapshotBase && !pto->fClient && !pto->fDisconnect && state.nBlocksToDownload == 0)
+            QueueSnapshotBlocks(pto->GetId());
         vector<CInv> vGetData;
         while (!pto->fDisconnect && state.nBlocksToDownload && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
             uint256 hash = state.vBlocksToDownload.front();
-            vGetData.push_back(CInv(MSG_BLOCK, hash));
+            // Outside of initial download the peer most likely sends a block we
+            // already have most transactions of; ask for it as a compact block.
+            // Blocks we know the header of lie below a loaded UTXO snapshot and
+            // are old, so those are asked for in full.
+            if (pto->nVersion >= COMPACT_BLOCKS_VERSION && !IsInitialBlockDownload() && !mapBlockIndex.count(hash))
+                vGetData.push_back(CInv(MSG_CMPCT_BLOCK, hash));
+            else
+                vGetData.push_back(CInv(MSG_BLOCK, hash));
             MarkBlockAsInFlight(pto->GetId(), hash);
             LogPrint("net", "Requesting block %s from %s\n", hash.ToString().c_str(), state.name.c_str());
             if (vGetData.size() >= 1000)
@@ -5250,6 +6541,120 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 
 
 
+//
+// Mempool persistence
+//
+
+static const int MEMPOOL_DUMP_VERSION = 1;
+
+// Set once mempool.dat has been read or found unusable, so that an empty pool is never
+// written over transactions that could still be loaded
+static bool fMempoolLoaded = false;
+
+bool DumpMempool()
+{
+    if (!fMempoolLoaded)
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    std::vector<std::pair<CTransaction, int64_t> > vEntries;
+    {
+        LOCK(mempool.cs);
+        // Parents before children, so that every transaction finds its inputs when loaded
+        std::vector<std::pair<uint64_t, const CTxMemPoolEntry*> > vSorted;
+        vSorted.reserve(mempool.mapTx.size());
+        for (std::map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+            vSorted.push_back(make_pair(mi->second.GetCountWithAncestors(), &mi->second));
+        sort(vSorted.begin(), vSorted.end());
+        vEntries.reserve(vSorted.size());
+        for (unsigned int i = 0; i < vSorted.size(); i++)
+            vEntries.push_back(make_pair(vSorted[i].second->GetTx(), vSorted[i].second->GetTime()));
+    }
+
+    boost::filesystem::path path = GetDataDir() / "mempool.dat";
+    boost::filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+    CAutoFile fileout = CAutoFile(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("DumpMempool() : failed to open %s", pathTmp.string());
+    try {
+        fileout << MEMPOOL_DUMP_VERSION << FLATDATA(Params().MessageStart());
+        fileout << (uint64_t)vEntries.size();
+        for (unsigned int i = 0; i < vEntries.size(); i++)
+            fileout << vEntries[i].first << vEntries[i].second;
+    } catch (std::exception &e) {
+        return error("DumpMempool() : Serialize or I/O error - %s", e.what());
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+    if (!RenameOver(pathTmp, path))
+        return error("DumpMempool() : failed to rename %s", pathTmp.string());
+
+    LogPrint("mempool", "Dumped %u mempool transactions in %dms\n", vEntries.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+bool LoadMempool()
+{
+    int64_t nStart = GetTimeMillis();
+    boost::filesystem::path path = GetDataDir() / "mempool.dat";
+    CAutoFile filein = CAutoFile(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein) {
+        LogPrintf("No mempool.dat to load\n");
+        fMempoolLoaded = true;
+        return true;
+    }
+
+    uint64_t nCount = 0, nAccepted = 0, nFailed = 0, nExpired = 0;
+    int64_t nExpiryCutoff = GetTime() - GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+    try {
+        int nVersion;
+        unsigned char pchMessageStart[MESSAGE_START_SIZE];
+        filein >> nVersion >> FLATDATA(pchMessageStart);
+        if (nVersion != MEMPOOL_DUMP_VERSION || memcmp(pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE)) {
+            // Nothing in it can be used, so the next dump may replace it
+            fMempoolLoaded = true;
+            return error("LoadMempool() : mempool.dat is of a different version or network");
+        }
+        filein >> nCount;
+
+        // Re-accept in batches under a single cs_main lock, which keeps message
+        // processing going in between. Going through AcceptToMemoryPool fills the
+        // signature cache, so the blocks that confirm these transactions later do
+        // not verify their signatures again.
+        uint64_t nRead = 0;
+        while (nRead < nCount) {
+            std::vector<std::pair<CTransaction, int64_t> > vBatch;
+            for (; nRead < nCount && vBatch.size() < MEMPOOL_LOAD_BATCH; nRead++) {
+                vBatch.push_back(std::make_pair(CTransaction(), 0));
+                filein >> vBatch.back().first >> vBatch.back().second;
+            }
+
+            LOCK(cs_main);
+            for (unsigned int i = 0; i < vBatch.size(); i++) {
+                if (vBatch[i].second < nExpiryCutoff) {
+                    nExpired++;
+                    continue;
+                }
+                CValidationState state;
+                if (AcceptToMemoryPool(mempool, state, vBatch[i].first, false, NULL, false, false, vBatch[i].second))
+                    nAccepted++;
+                else
+                    nFailed++;
+            }
+            // Left unset, so that the part not read yet is not overwritten at shutdown
+            if (ShutdownRequested())
+                return false;
+        }
+    } catch (std::exception &e) {
+        LogPrintf("LoadMempool() : failed to read mempool.dat (%s), continuing anyway\n", e.what());
+    }
+
+    fMempoolLoaded = true;
+    LogPrintf("Loaded %u of %u mempool transactions (%u failed, %u expired) in %dms\n",
+        nAccepted, nCount, nFailed, nExpired, GetTimeMillis() - nStart);
+    return true;
+}
+
 class CMainCleanup
 {
 public:
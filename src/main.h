@@ -71,10 +71,46 @@ static const unsigned int LOCKTIME_THRESHOLD = 500000000;
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Maximum number of block parsing threads used by -reindex and -loadblock */
+static const int MAX_IMPORT_THREADS = 16;
+/** -importthreads default (number of block parsing threads, 0 = auto) */
+static const int DEFAULT_IMPORT_THREADS = 0;
+/** Number of parsed blocks the import readers may run ahead of the connect stage */
+static const unsigned int MAX_IMPORT_QUEUE = 256;
+/** Number of connected or disconnected blocks that may wait for the wallet notification thread */
+static const unsigned int MAX_WALLET_NOTIFICATION_BLOCKS = 64;
+/** Number of blocks below the tip for which the UTXO set commitment is kept */
+static const int COINS_COMMITMENT_DEPTH = 288;
+/** Default for -maxmempool, upper bound on the memory used by the mempool in megabytes */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry, hours after which a transaction is dropped from the mempool */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+/** Default for -limitancestorcount, max number of in-mempool ancestors of a transaction, itself included */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, max size in kilobytes of a transaction with its in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Default for -limitdescendantcount, max number of in-mempool descendants of a transaction, itself included */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, max size in kilobytes of a transaction with its in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
+/** Default for -longpollfeedelta, fees entering the mempool that end a getblocktemplate longpoll */
+static const int64_t DEFAULT_LONGPOLL_FEE_DELTA = COIN / 100;
+/** Seconds between periodic writes of mempool.dat */
+static const int MEMPOOL_DUMP_INTERVAL = 15 * 60;
+/** Number of saved transactions re-accepted per cs_main lock when loading mempool.dat */
+static const unsigned int MEMPOOL_LOAD_BATCH = 100;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 128;
+/** How far past the lowest missing block below a loaded UTXO snapshot blocks are requested */
+static const int SNAPSHOT_DOWNLOAD_WINDOW = 1024;
 /** Timeout in seconds before considering a block download peer unresponsive. */
 static const unsigned int BLOCK_DOWNLOAD_TIMEOUT = 60;
+/** Blocks deeper than this are sent in full when asked for as a compact block */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** Deepest block whose transactions are served with getblocktxn */
+static const int MAX_BLOCKTXN_DEPTH = 10;
+/** Number of rejected and orphan transactions kept to help rebuild compact blocks */
+static const unsigned int MAX_EXTRA_TXN_FOR_COMPACT = 100;
 /** Tx comments */
 static const unsigned int MAX_TX_COMMENT_LEN = 256;
 
@@ -98,6 +134,11 @@ static const unsigned char REJECT_CHECKPOINT = 0x43;
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
+extern CWaitableCriticalSection csBestBlock;
+extern boost::condition_variable cvBlockChange;
+/** Hash of chainActive.Tip(), guarded by csBestBlock so that waiters on cvBlockChange can test it */
+extern uint256 hashBestBlock;
+extern int64_t nLongPollFeeDelta;
 extern std::map<uint256, CBlockIndex*> mapBlockIndex;
 extern uint64_t nLastBlockTx;
 extern uint64_t nLastBlockSize;
@@ -108,6 +149,7 @@ extern bool fReindex;
 extern bool fBenchmark;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
+extern bool fBlockFilterIndex;
 extern unsigned int nCoinCacheSize;
 
 extern bool fLargeWorkForkFound;
@@ -118,9 +160,12 @@ static const uint64_t nMinDiskSpace = 52428800;
 
 
 class CCoinsDB;
+class CBlockFilterDB;
 class CBlockTreeDB;
 struct CDiskBlockPos;
 class CTxUndo;
+class CTxInUndo;
+class CCoinsCommitment;
 class CScriptCheck;
 class CValidationState;
 class CWalletInterface;
@@ -134,8 +179,15 @@ void RegisterWallet(CWalletInterface* pwalletIn);
 void UnregisterWallet(CWalletInterface* pwalletIn);
 /** Unregister all wallets from core */
 void UnregisterAllWallets();
-/** Push an updated transaction to all registered wallets */
-void SyncWithWallets(const uint256 &hash, const CTransaction& tx, const CBlock* pblock = NULL);
+/** Push an updated mempool transaction to all registered wallets */
+void SyncWithWallets(const uint256 &hash, const CTransaction& tx);
+/** Deliver wallet notifications on this thread, in per-block batches, until interrupted */
+void ThreadWalletNotifications();
+/** Wait until wallets have seen every notification queued so far. Must not be called with cs_main held. */
+void SyncWithWalletNotifications();
+/** Wait while more than MAX_WALLET_NOTIFICATION_BLOCKS connected or disconnected blocks are
+ *  queued for the wallets. Must not be called with cs_main held. */
+void LimitWalletNotifications();
 
 /** Register with a network node to receive its signals */
 void RegisterNodeSignals(CNodeSignals& nodeSignals);
@@ -152,20 +204,37 @@ bool CheckDiskSpace(uint64_t nAdditionalBytes = 0);
 FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 /** Open an undo file (rev?????.dat) */
 FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
-/** Import blocks from an external file */
-bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp = NULL);
+/** Import blocks from an external file. Blocks found before their parent are kept in
+ *  pmapBlocksUnknownParent, so that a -reindex can match them up across blk?????.dat files. */
+bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp = NULL, std::multimap<uint256, CDiskBlockPos>* pmapBlocksUnknownParent = NULL);
+/** Number of threads used to parse blocks and block index entries (-importthreads) */
+int GetImportThreads();
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex();
 /** Load the block tree and coins database from disk */
 bool LoadBlockIndex();
 /** Unload database information */
 void UnloadBlockIndex();
-/** Verify consistency of the block and coin databases */
-bool VerifyDB(int nCheckLevel, int nCheckDepth);
+/** Verify consistency of the block and coin databases. Returns false on inconsistencies;
+ *  pfComplete is set to false if the best chain changed before the check got through. */
+bool VerifyDB(int nCheckLevel, int nCheckDepth, bool* pfComplete = NULL);
+/** Write the block files, the block index and the coin cache to disk */
+bool FlushStateToDisk();
+/** Whether the blocks below a loaded UTXO snapshot still have to be downloaded and validated */
+bool IsSnapshotValidationPending();
+/** Whether a block's data may be announced and sent to peers: it is on disk and,
+ *  if it lies below a loaded UTXO snapshot, has been validated already */
+bool CanServeBlock(const CBlockIndex* pindex);
+/** Connect the blocks below a loaded UTXO snapshot into a coin database of their
+ *  own as they are downloaded, and check the result against the snapshot */
+void ThreadValidateSnapshot();
 /** Print the loaded block tree */
 void PrintBlockTree();
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
+/** The lock a message's handler runs under (cs_main for the chainstate handlers, one lock
+ *  per extension subsystem), or NULL if it needs none */
+CCriticalSection* GetMessageLock(const std::string& strCommand);
 /** Send queued protocol messages to be sent to a give node */
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
@@ -203,7 +272,12 @@ void Misbehaving(NodeId nodeid, int howmuch);
 
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectInsaneFee=false, bool ignoreFees=false);
+                        bool* pfMissingInputs, bool fRejectInsaneFee=false, bool ignoreFees=false, int64_t nAcceptTime=0);
+
+/** Write the contents of the mempool to mempool.dat */
+bool DumpMempool();
+/** Re-accept the transactions saved in mempool.dat (-persistmempool) */
+bool LoadMempool();
 
 bool AcceptableInputs(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool ignoreFees=true);
 
@@ -327,6 +401,14 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, CCoinsViewCach
 // Apply the effects of this transaction on the UTXO set represented by view
 void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCache &inputs, CTxUndo &txundo, int nHeight, const uint256 &txhash);
 
+/** Apply a transaction that UpdateCoins has just connected to a UTXO set commitment */
+void UpdateCoinsCommitment(const CTransaction& tx, CCoinsViewCache &inputs, const CTxUndo &txundo, int nHeight, const uint256 &txhash, CCoinsCommitment &commitment);
+
+/** Put an output spent by a transaction that is being disconnected back into view and, if
+ *  given, into the UTXO set commitment. Clears fClean if the undo data does not fit the view;
+ *  returns false if the coins could not be written. */
+bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const COutPoint& out, CCoinsCommitment* pcommitment, bool& fClean);
+
 // Context-independent validity checks
 bool CheckTransaction(const CTransaction& tx, CValidationState& state);
 
@@ -627,6 +709,11 @@ bool AddToBlockIndex(CBlock& block, CValidationState& state, const CDiskBlockPos
 // Context-independent validity checks
 bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
 
+// The part of CheckBlock that needs neither cs_main nor the current tip (size, proof of work,
+// transactions, merkle root). Safe to run from any thread; CheckBlock skips it for blocks
+// that have fChecked set.
+bool CheckBlockStructure(const CBlock& block, CValidationState& state, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
+
 // Store block on disk
 // if dbp is provided, the file is known to already reside on disk
 bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp = NULL);
@@ -1090,6 +1177,9 @@ extern CCoinsViewCache *pcoinsTip;
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
+/** Global variable that points to the compact block filter index, if -blockfilterindex is set */
+extern CBlockFilterDB *pblockfilterdb;
+
 struct CBlockTemplate
 {
     CBlock block;
@@ -9,6 +9,7 @@
 #include "core.h"
 #include "util.h"
 #include "addrman.h"
+#include "eventpublisher.h"
 #include <boost/lexical_cast.hpp>
 #include <boost/filesystem.hpp>
 
@@ -206,6 +207,7 @@ bool CMasternodeMan::Add(CMasternode &mn)
     {
         if(fDebug) LogPrintf("CMasternodeMan: Adding new Masternode %s - %i now\n", mn.addr.ToString().c_str(), size() + 1);
         vMasternodes.push_back(mn);
+        PublishMasternodeChange(mn.vin.prevout, true);
         return true;
     }
 
@@ -231,6 +233,7 @@ void CMasternodeMan::CheckAndRemove()
     while(it != vMasternodes.end()){
         if((*it).activeState == CMasternode::MASTERNODE_REMOVE || (*it).activeState == CMasternode::MASTERNODE_VIN_SPENT){
             if(fDebug) LogPrintf("CMasternodeMan: Removing inactive Masternode %s - %i now\n", (*it).addr.ToString().c_str(), size() - 1);
+            PublishMasternodeChange((*it).vin.prevout, false);
             it = vMasternodes.erase(it);
         } else {
             ++it;
@@ -836,9 +839,10 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                 pmn->lastVote = GetAdjustedTime();
 
                 //send to all peers
+                CSendBuffer msg = MakeMessage("mvote", CDataStream(SER_NETWORK, PROTOCOL_VERSION) << vin << vchSig << nVote);
                 LOCK(cs_vNodes);
                 BOOST_FOREACH(CNode* pnode, vNodes)
-                    pnode->PushMessage("mvote", vin, vchSig, nVote);
+                    pnode->PushMessage(msg);
             }
 
             return;
@@ -896,16 +900,19 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
 void CMasternodeMan::RelayMasternodeEntry(const CTxIn vin, const CService addr, const std::vector<unsigned char> vchSig, const int64_t nNow, const CPubKey pubkey, const CPubKey pubkey2, const int count, const int current, const int64_t lastUpdated, const int protocolVersion, CScript donationAddress, int donationPercentage)
 {
+    CSendBuffer msg = MakeMessage("dsee", CDataStream(SER_NETWORK, PROTOCOL_VERSION) << vin << addr << vchSig << nNow << pubkey << pubkey2
+        << count << current << lastUpdated << protocolVersion << donationAddress << donationPercentage);
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
-        pnode->PushMessage("dsee", vin, addr, vchSig, nNow, pubkey, pubkey2, count, current, lastUpdated, protocolVersion, donationAddress, donationPercentage);
+        pnode->PushMessage(msg);
 }
 
 void CMasternodeMan::RelayMasternodeEntryPing(const CTxIn vin, const std::vector<unsigned char> vchSig, const int64_t nNow, const bool stop)
 {
+    CSendBuffer msg = MakeMessage("dseep", CDataStream(SER_NETWORK, PROTOCOL_VERSION) << vin << vchSig << nNow << stop);
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
-        pnode->PushMessage("dseep", vin, vchSig, nNow, stop);
+        pnode->PushMessage(msg);
 }
 
 void CMasternodeMan::Remove(CTxIn vin)
@@ -916,6 +923,7 @@ void CMasternodeMan::Remove(CTxIn vin)
     while(it != vMasternodes.end()){
         if((*it).vin == vin){
             if(fDebug) LogPrintf("CMasternodeMan: Removing Masternode %s - %i now\n", (*it).addr.ToString().c_str(), size() - 1);
+            PublishMasternodeChange(vin.prevout, false);
             vMasternodes.erase(it);
             break;
         }
@@ -14,6 +14,9 @@
 #endif
 #include "masternodeman.h"
 
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // PatriotBitMiner
@@ -55,57 +58,309 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
         ((uint32_t*)pstate)[i] = ctx.h[i];
 }
 
-// Some explaining would be appreciated
-class COrphan
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+
+namespace {
+
+typedef CTxMemPool::txiter txiter;
+
+// The high-priority part of the block is filled from a heap of coin age priorities
+typedef std::pair<double, txiter> TxCoinAgePriority;
+
+struct TxCoinAgePriorityCompare
 {
-public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dPriority;
-    double dFeePerKb;
+    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b) const
+    {
+        if (a.first == b.first)
+            return CTxMemPool::CompareIteratorByAncestorScore()(b.second, a.second);
+        return a.first < b.first;
+    }
+};
+
+/** Package state of a mempool entry after some of its ancestors went into the block */
+struct CModifiedEntry
+{
+    uint64_t nSizeWithAncestors;
+    int64_t nFeesWithAncestors;
+    unsigned int nSigOpsWithAncestors;
+    double dScore;
+};
 
-    COrphan(const CTransaction* ptxIn)
+struct CompareModifiedScore
+{
+    bool operator()(const std::pair<double, txiter>& a, const std::pair<double, txiter>& b) const
     {
-        ptx = ptxIn;
-        dPriority = dFeePerKb = 0;
+        if (a.first != b.first)
+            return a.first > b.first;
+        return a.second->first < b.second->first;
     }
+};
+
+/**
+ * Fills a block template from the mempool. The fee-paying part walks
+ * mempool.setAncestorScore, which the pool keeps sorted, adding each entry
+ * together with its not yet included ancestors. Entries whose ancestors were
+ * included in the meantime are re-scored in mapModified, so the walk is a
+ * merge of the index and that (small) set.
+ */
+class CBlockAssembler
+{
+private:
+    CBlockTemplate* pblocktemplate;
+    CCoinsViewCache& view;
+    int nHeight;
+    unsigned int nBlockMaxSize;
+    bool fPrintPriority;
+
+    CTxMemPool::setEntries setInBlock;
+    CTxMemPool::setEntries setFailed;
+    std::map<txiter, CModifiedEntry, CTxMemPool::CompareIteratorByHash> mapModified;
+    std::set<std::pair<double, txiter>, CompareModifiedScore> setModifiedScore;
+
+    bool TestAndAddPackage(std::vector<txiter>& vPackage);
+    void UpdatePackagesForAdded(const std::vector<txiter>& vAdded);
 
-    void print() const
+public:
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    unsigned int nBlockSigOps;
+    int64_t nFees;
+
+    CBlockAssembler(CBlockTemplate* pblocktemplateIn, CCoinsViewCache& viewIn, int nHeightIn, unsigned int nBlockMaxSizeIn) :
+        pblocktemplate(pblocktemplateIn), view(viewIn), nHeight(nHeightIn), nBlockMaxSize(nBlockMaxSizeIn),
+        nBlockSize(1000), nBlockTx(0), nBlockSigOps(100), nFees(0)
     {
-        LogPrintf("COrphan(hash=%s, dPriority=%.1f, dFeePerKb=%.1f)\n",
-               ptx->GetHash().ToString(), dPriority, dFeePerKb);
-        BOOST_FOREACH(uint256 hash, setDependsOn)
-            LogPrintf("   setDependsOn %s\n", hash.ToString());
+        fPrintPriority = GetBoolArg("-printpriority", false);
     }
+
+    void AddPriorityTxs(unsigned int nBlockPrioritySize);
+    void AddPackageTxs(unsigned int nBlockMinSize);
 };
 
+bool CompareByAncestorCount(const txiter& a, const txiter& b)
+{
+    if (a->second.GetCountWithAncestors() != b->second.GetCountWithAncestors())
+        return a->second.GetCountWithAncestors() < b->second.GetCountWithAncestors();
+    return a->first < b->first;
+}
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
+// Validate vPackage (parents first) against the block so far and add it as a whole
+bool CBlockAssembler::TestAndAddPackage(std::vector<txiter>& vPackage)
+{
+    std::sort(vPackage.begin(), vPackage.end(), CompareByAncestorCount);
+
+    CCoinsViewCache viewPackage(view, true);
+    std::vector<int64_t> vTxFees;
+    std::vector<unsigned int> vTxSigOps;
+    uint64_t nPackageSize = 0;
+    unsigned int nPackageSigOps = 0;
+    BOOST_FOREACH(txiter it, vPackage)
+    {
+        const CTransaction& tx = it->second.GetTx();
+        if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight))
+            return false;
+
+        nPackageSize += it->second.GetTxSize();
+        if (nBlockSize + nPackageSize >= nBlockMaxSize)
+            return false;
+
+        if (!viewPackage.HaveInputs(tx))
+            return false;
+
+        unsigned int nTxSigOps = it->second.GetSigOpCount() + GetP2SHSigOpCount(tx, viewPackage);
+        nPackageSigOps += nTxSigOps;
+        if (nBlockSigOps + nPackageSigOps >= MAX_BLOCK_SIGOPS)
+            return false;
+
+        CValidationState state;
+        if (!CheckInputs(tx, state, viewPackage, true, SCRIPT_VERIFY_P2SH))
+            return false;
+
+        vTxFees.push_back(viewPackage.GetValueIn(tx)-tx.GetValueOut());
+        vTxSigOps.push_back(nTxSigOps);
+
+        CTxUndo txundo;
+        UpdateCoins(tx, state, viewPackage, txundo, nHeight, it->first);
+    }
+    viewPackage.Flush();
+
+    CBlock *pblock = &pblocktemplate->block;
+    for (unsigned int i = 0; i < vPackage.size(); i++)
+    {
+        const CTxMemPoolEntry& entry = vPackage[i]->second;
+        pblock->vtx.push_back(entry.GetTx());
+        pblocktemplate->vTxFees.push_back(vTxFees[i]);
+        pblocktemplate->vTxSigOps.push_back(vTxSigOps[i]);
+        nBlockSize += entry.GetTxSize();
+        ++nBlockTx;
+        nBlockSigOps += vTxSigOps[i];
+        nFees += vTxFees[i];
+        setInBlock.insert(vPackage[i]);
+
+        std::map<txiter, CModifiedEntry, CTxMemPool::CompareIteratorByHash>::iterator mit = mapModified.find(vPackage[i]);
+        if (mit != mapModified.end()) {
+            setModifiedScore.erase(std::make_pair(mit->second.dScore, vPackage[i]));
+            mapModified.erase(mit);
+        }
 
-// We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, const CTransaction*> TxPriority;
-class TxPriorityCompare
+        if (fPrintPriority)
+        {
+            LogPrintf("priority %.1f feeperkb %.1f txid %s\n",
+                   entry.GetPriority(nHeight), entry.GetFee() * 1000.0 / entry.GetTxSize(), vPackage[i]->first.ToString());
+        }
+    }
+    UpdatePackagesForAdded(vPackage);
+    return true;
+}
+
+// Take the transactions just added out of the package state of their descendants
+void CBlockAssembler::UpdatePackagesForAdded(const std::vector<txiter>& vAdded)
 {
-    bool byFee;
-public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
-    bool operator()(const TxPriority& a, const TxPriority& b)
+    BOOST_FOREACH(txiter itAdded, vAdded)
     {
-        if (byFee)
+        CTxMemPool::setEntries setDescendants;
+        mempool.CalculateDescendants(itAdded, setDescendants);
+        BOOST_FOREACH(txiter it, setDescendants)
         {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
+            if (setInBlock.count(it))
+                continue;
+            std::map<txiter, CModifiedEntry, CTxMemPool::CompareIteratorByHash>::iterator mit = mapModified.find(it);
+            if (mit == mapModified.end()) {
+                CModifiedEntry modified;
+                modified.nSizeWithAncestors = it->second.GetSizeWithAncestors();
+                modified.nFeesWithAncestors = it->second.GetFeesWithAncestors();
+                modified.nSigOpsWithAncestors = it->second.GetSigOpsWithAncestors();
+                mit = mapModified.insert(std::make_pair(it, modified)).first;
+            } else {
+                setModifiedScore.erase(std::make_pair(mit->second.dScore, it));
+            }
+            CModifiedEntry& modified = mit->second;
+            modified.nSizeWithAncestors -= itAdded->second.GetTxSize();
+            modified.nFeesWithAncestors -= itAdded->second.GetFee();
+            modified.nSigOpsWithAncestors -= itAdded->second.GetSigOpCount();
+            modified.dScore = GetAncestorScore(it->second.GetFee(), it->second.GetTxSize(),
+                                               modified.nFeesWithAncestors, modified.nSizeWithAncestors);
+            setModifiedScore.insert(std::make_pair(modified.dScore, it));
         }
-        else
+    }
+}
+
+// Fill the first nBlockPrioritySize bytes by coin age priority, regardless of fees
+void CBlockAssembler::AddPriorityTxs(unsigned int nBlockPrioritySize)
+{
+    std::vector<TxCoinAgePriority> vecPriority;
+    vecPriority.reserve(mempool.mapTx.size());
+    for (txiter mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        vecPriority.push_back(TxCoinAgePriority(mi->second.GetPriority(nHeight), mi));
+
+    TxCoinAgePriorityCompare comparer;
+    std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+
+    // Transactions whose in-mempool parents are not in the block yet
+    std::map<txiter, double, CTxMemPool::CompareIteratorByHash> mapWaiting;
+
+    while (!vecPriority.empty())
+    {
+        double dPriority = vecPriority.front().first;
+        txiter iter = vecPriority.front().second;
+        std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        vecPriority.pop_back();
+
+        if (setInBlock.count(iter))
+            continue;
+
+        bool fParentsInBlock = true;
+        BOOST_FOREACH(txiter itParent, mempool.GetMemPoolParents(iter))
+            if (!setInBlock.count(itParent))
+                fParentsInBlock = false;
+        if (!fParentsInBlock) {
+            mapWaiting.insert(std::make_pair(iter, dPriority));
+            continue;
+        }
+
+        // Switch to fee ordering once past the priority size or out of high-priority transactions
+        if (nBlockSize + iter->second.GetTxSize() >= nBlockPrioritySize || !AllowFree(dPriority))
+            break;
+
+        std::vector<txiter> vPackage(1, iter);
+        if (!TestAndAddPackage(vPackage))
+            continue;
+
+        BOOST_FOREACH(txiter itChild, mempool.GetMemPoolChildren(iter))
         {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
+            std::map<txiter, double, CTxMemPool::CompareIteratorByHash>::iterator wit = mapWaiting.find(itChild);
+            if (wit == mapWaiting.end())
+                continue;
+            vecPriority.push_back(TxCoinAgePriority(wit->second, wit->first));
+            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
+            mapWaiting.erase(wit);
         }
     }
-};
+}
+
+// Fill the rest of the block with the best paying packages
+void CBlockAssembler::AddPackageTxs(unsigned int nBlockMinSize)
+{
+    CTxMemPool::indexed_ancestor_score::const_iterator mi = mempool.setAncestorScore.begin();
+    while (mi != mempool.setAncestorScore.end() || !setModifiedScore.empty())
+    {
+        if (mi != mempool.setAncestorScore.end() &&
+            (setInBlock.count(*mi) || setFailed.count(*mi) || mapModified.count(*mi))) {
+            ++mi;
+            continue;
+        }
+
+        // Take the better of the next entry from the index and the best re-scored one
+        txiter iter;
+        uint64_t nPackageSize;
+        int64_t nPackageFees;
+        unsigned int nPackageSigOps;
+        bool fUseModified = mi == mempool.setAncestorScore.end();
+        if (!fUseModified && !setModifiedScore.empty()) {
+            const CTxMemPoolEntry& entry = (*mi)->second;
+            fUseModified = setModifiedScore.begin()->first > GetAncestorScore(entry.GetFee(), entry.GetTxSize(),
+                                                                              entry.GetFeesWithAncestors(), entry.GetSizeWithAncestors());
+        }
+        if (fUseModified) {
+            iter = setModifiedScore.begin()->second;
+            setModifiedScore.erase(setModifiedScore.begin());
+            const CModifiedEntry& modified = mapModified[iter];
+            nPackageSize = modified.nSizeWithAncestors;
+            nPackageFees = modified.nFeesWithAncestors;
+            nPackageSigOps = modified.nSigOpsWithAncestors;
+            mapModified.erase(iter);
+        } else {
+            iter = *mi;
+            ++mi;
+            nPackageSize = iter->second.GetSizeWithAncestors();
+            nPackageFees = iter->second.GetFeesWithAncestors();
+            nPackageSigOps = iter->second.GetSigOpsWithAncestors();
+        }
+
+        // Skip free transactions if we're past the minimum block size; everything
+        // after this pays less
+        double dFeePerKb = nPackageFees * 1000.0 / nPackageSize;
+        if (dFeePerKb < CTransaction::nMinRelayTxFee && nBlockSize + nPackageSize >= nBlockMinSize)
+            break;
+
+        if (nBlockSize + nPackageSize >= nBlockMaxSize || nBlockSigOps + nPackageSigOps >= MAX_BLOCK_SIGOPS) {
+            setFailed.insert(iter);
+            continue;
+        }
+
+        CTxMemPool::setEntries setAncestors;
+        mempool.CalculateMemPoolAncestors(iter, setAncestors);
+        std::vector<txiter> vPackage(1, iter);
+        BOOST_FOREACH(txiter it, setAncestors)
+            if (!setInBlock.count(it))
+                vPackage.push_back(it);
+        if (!TestAndAddPackage(vPackage))
+            setFailed.insert(iter);
+    }
+}
+
+} // anon namespace
 
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
 {
@@ -192,180 +447,16 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
         pblocktemplate->vTxFees.push_back(-1); // updated at end
         pblocktemplate->vTxSigOps.push_back(-1); // updated at end
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
+        CBlockAssembler assembler(pblocktemplate.get(), view, pindexPrev->nHeight + 1, nBlockMaxSize);
+        if (nBlockPrioritySize > 0)
+            assembler.AddPriorityTxs(nBlockPrioritySize);
+        assembler.AddPackageTxs(nBlockMinSize);
 
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi)
-        {
-            const CTransaction& tx = mi->second.GetTx();
-            if (tx.IsCoinBase() || !IsFinalTx(tx, pindexPrev->nHeight + 1))
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64_t nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                const CCoins &coins = view.GetCoins(txin.prevout.hash);
-
-                int64_t nValueIn = coins.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = pindexPrev->nHeight - coins.nHeight + 1;
-
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
-
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
-            }
-            else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &mi->second.GetTx()));
-        }
-
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
-        {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+        nFees = assembler.nFees;
 
-            // Skip free transactions if we're past the minimum block size:
-            if (fSortedByFee && (dFeePerKb < CTransaction::nMinRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritize by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority)))
-            {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            if (!view.HaveInputs(tx))
-                continue;
-
-            int64_t nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, SCRIPT_VERIFY_P2SH))
-                continue;
-
-            CTxUndo txundo;
-            uint256 hash = tx.GetHash();
-            UpdateCoins(tx, state, view, txundo, pindexPrev->nHeight+1, hash);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fPrintPriority)
-            {
-                LogPrintf("priority %.1f feeperkb %.1f txid %s\n",
-                       dPriority, dFeePerKb, tx.GetHash().ToString());
-            }
-
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
-        }
-
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
-        LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
+        nLastBlockTx = assembler.nBlockTx;
+        nLastBlockSize = assembler.nBlockSize;
+        LogPrintf("CreateNewBlock(): total size %u\n", nLastBlockSize);
         int64_t blockValue = GetBlockValue(pindexPrev->nBits, pindexPrev->nHeight, nFees);
         int64_t masternodePayment = GetMasternodePayment(pindexPrev->nHeight+1, blockValue);
 
@@ -517,57 +608,215 @@ bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
     return true;
 }
 
-void static BitcoinMiner(CWallet *pwallet)
+namespace {
+
+/** State shared by the miner threads started by one GenerateBitcoins call. A
+ *  single producer thread builds the block template; every worker takes a copy
+ *  with an extranonce nobody else has been given for that template, so the
+ *  threads never scan the same headers and CreateNewBlock runs only once per
+ *  template instead of once per thread. */
+class CMinerWork
 {
-    LogPrintf("PatriotBitMiner started\n");
-    SetThreadPriority(THREAD_PRIORITY_LOWEST);
-    RenameThread("patriotbit-miner");
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    boost::shared_ptr<CBlockTemplate> pblocktemplate;
+    CBlockIndex* pindexPrev;
+    unsigned int nExtraNonce;
+    unsigned int nWorkId;
+    bool fStopped;
+    int nWorkers;
+    CReserveKey reservekey;
+
+public:
+    CWallet* pwallet;
 
-    // Each thread has its own key and counter
-    CReserveKey reservekey(pwallet);
-    unsigned int nExtraNonce = 0;
+    CMinerWork(CWallet* pwalletIn, int nWorkersIn) : pindexPrev(NULL), nExtraNonce(0), nWorkId(0),
+        fStopped(false), nWorkers(nWorkersIn), reservekey(pwalletIn), pwallet(pwalletIn) {}
 
-    try { while (true) {
-        if (Params().NetworkID() != CChainParams::REGTEST) {
-            // Busy-wait for the network to come online so we don't waste time mining
-            // on an obsolete chain. In regtest mode we expect to fly solo.
-            while (vNodes.empty())
-                MilliSleep(1000);
+    /** Build a new template on top of pindexPrevIn and hand it to the workers */
+    bool UpdateTemplate(CBlockIndex* pindexPrevIn)
+    {
+        CPubKey pubkey;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (!reservekey.GetReservedKey(pubkey))
+                return false;
         }
+        // Assembling the block takes cs_main, so do it without holding the work lock
+        boost::shared_ptr<CBlockTemplate> pblocktemplateNew(CreateNewBlock(CScript() << pubkey << OP_CHECKSIG));
+        if (!pblocktemplateNew)
+            return false;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            pblocktemplate = pblocktemplateNew;
+            pindexPrev = pindexPrevIn;
+            nExtraNonce = 0;
+            nWorkId++;
+        }
+        cond.notify_all();
+        return true;
+    }
 
-        //
-        // Create new block
-        //
-        unsigned int nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-        CBlockIndex* pindexPrev = chainActive.Tip();
-        if(!pindexPrev) break;
+    /** Wait for a template and return a copy of it with a fresh extranonce. */
+    bool GetWork(CBlock& block, CBlockIndex*& pindexPrevOut, unsigned int& nWorkIdOut)
+    {
+        unsigned int nExtraNonceOut;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!pblocktemplate && !fStopped)
+                cond.wait(lock);
+            if (fStopped)
+                return false;
+            block = pblocktemplate->block;
+            pindexPrevOut = pindexPrev;
+            nWorkIdOut = nWorkId;
+            nExtraNonceOut = ++nExtraNonce;
+        }
+        unsigned int nHeight = pindexPrevOut->nHeight+1; // Height first in coinbase required for block.version=2
+        block.vtx[0].vin[0].scriptSig = (CScript() << nHeight << CScriptNum(nExtraNonceOut)) + COINBASE_FLAGS;
+        assert(block.vtx[0].vin[0].scriptSig.size() <= 100);
+        block.hashMerkleRoot = block.BuildMerkleTree();
+        return true;
+    }
 
-        auto_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockWithKey(reservekey));
-        if (!pblocktemplate.get())
-            return;
-        CBlock *pblock = &pblocktemplate->block;
-        IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
+    /** True while the template a worker got with nWorkIdIn is still the current one */
+    bool IsCurrent(unsigned int nWorkIdIn)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return nWorkId == nWorkIdIn;
+    }
 
+    bool SubmitWork(CBlock* pblock)
+    {
+        // Lock order: work lock, then cs_main (in CheckWork)
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return CheckWork(pblock, *pwallet, reservekey);
+    }
 
-        LogPrintf("Running PatriotBitMiner with %u transactions in block (%u bytes)\n", pblock->vtx.size(),
-               ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
+    void Stop()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStopped = true;
+        }
+        cond.notify_all();
+    }
 
-        //
-        // Pre-build hash buffers
-        //
-        char pmidstatebuf[32+16]; char* pmidstate = alignup<16>(pmidstatebuf);
-        char pdatabuf[128+16];    char* pdata     = alignup<16>(pdatabuf);
-        char phash1buf[64+16];    char* phash1    = alignup<16>(phash1buf);
+    void WorkerExited()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nWorkers--;
+    }
+
+    bool HaveWorkers()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return nWorkers > 0;
+    }
+};
+
+CCriticalSection cs_hashmeter;
+std::vector<double> vThreadHashesPerSec;
+
+void UpdateHashMeter(unsigned int nThread, double dThreadHashesPerSec)
+{
+    LOCK(cs_hashmeter);
+    if (nThread >= vThreadHashesPerSec.size())
+        vThreadHashesPerSec.resize(nThread + 1, 0.0);
+    vThreadHashesPerSec[nThread] = dThreadHashesPerSec;
+    dHashesPerSec = 0.0;
+    BOOST_FOREACH(double d, vThreadHashesPerSec)
+        dHashesPerSec += d;
+    nHPSTimerStart = GetTimeMillis();
+
+    static int64_t nLogTime;
+    if (GetTime() - nLogTime > 30 * 60)
+    {
+        nLogTime = GetTime();
+        LogPrintf("hashmeter %6.0f khash/s (%u threads)\n", dHashesPerSec/1000.0, vThreadHashesPerSec.size());
+    }
+}
 
-        FormatHashBuffers(pblock, pmidstate, pdata, phash1);
+} // anon namespace
 
-        unsigned int& nBlockTime = *(unsigned int*)(pdata + 64 + 4);
-        unsigned int& nBlockBits = *(unsigned int*)(pdata + 64 + 8);
+std::vector<double> GetThreadHashesPerSec()
+{
+    LOCK(cs_hashmeter);
+    if (GetTimeMillis() - nHPSTimerStart > 8000)
+        return std::vector<double>(vThreadHashesPerSec.size(), 0.0);
+    return vThreadHashesPerSec;
+}
+
+void static BitcoinMinerTemplates(boost::shared_ptr<CMinerWork> work)
+{
+    RenameThread("patriotbit-minertpl");
+
+    try {
+        while (work->HaveWorkers()) {
+            if (Params().NetworkID() != CChainParams::REGTEST) {
+                // Busy-wait for the network to come online so we don't waste time mining
+                // on an obsolete chain. In regtest mode we expect to fly solo.
+                while (vNodes.empty())
+                    MilliSleep(1000);
+            }
+
+            unsigned int nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+            CBlockIndex* pindexPrev = chainActive.Tip();
+            if (!pindexPrev || !work->UpdateTemplate(pindexPrev))
+                break;
+            int64_t nStart = GetTime();
+
+            // Sleep until the tip moves, or the mempool has changed and the template is a minute old
+            while (work->HaveWorkers()) {
+                {
+                    boost::unique_lock<boost::mutex> lock(csBestBlock);
+                    if (chainActive.Tip() == pindexPrev)
+                        cvBlockChange.timed_wait(lock, boost::posix_time::seconds(1));
+                }
+                boost::this_thread::interruption_point();
+                if (chainActive.Tip() != pindexPrev)
+                    break;
+                if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 60)
+                    break;
+            }
+        }
+    }
+    catch (boost::thread_interrupted)
+    {
+        work->Stop();
+        throw;
+    }
+    work->Stop();
+}
+
+void static BitcoinMiner(boost::shared_ptr<CMinerWork> work, unsigned int nThread)
+{
+    LogPrintf("PatriotBitMiner started\n");
+    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+    RenameThread("patriotbit-miner");
+
+    unsigned int nCores = boost::thread::hardware_concurrency();
+    if (nCores > 0)
+        SetThreadAffinity(nThread % nCores);
+
+    int64_t nMeterStart = GetTimeMillis();
+    int64_t nHashCounter = 0;
+
+    try { while (true) {
+        CBlock block;
+        CBlockIndex* pindexPrev;
+        unsigned int nWorkId;
+        if (!work->GetWork(block, pindexPrev, nWorkId))
+            break;
+        CBlock *pblock = &block;
+
+        LogPrint("miner", "Running PatriotBitMiner with %u transactions in block (%u bytes)\n", pblock->vtx.size(),
+               ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
 
         //
         // Search
         //
-        int64_t nStart = GetTime();
         uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
         while (true)
         {
@@ -581,7 +830,7 @@ void static BitcoinMiner(CWallet *pwallet)
                 {
                     // Found a solution
                     SetThreadPriority(THREAD_PRIORITY_NORMAL);
-                    CheckWork(pblock, *pwallet, reservekey);
+                    work->SubmitWork(pblock);
                     SetThreadPriority(THREAD_PRIORITY_LOWEST);
 
                     // In regression test mode, stop mining after a block is found. This
@@ -598,33 +847,13 @@ void static BitcoinMiner(CWallet *pwallet)
             }
 
             // Meter hashes/sec
-            static int64_t nHashCounter;
-            if (nHPSTimerStart == 0)
+            nHashCounter += nHashesDone;
+            if (GetTimeMillis() - nMeterStart > 4000)
             {
-                nHPSTimerStart = GetTimeMillis();
+                UpdateHashMeter(nThread, 1000.0 * nHashCounter / (GetTimeMillis() - nMeterStart));
+                nMeterStart = GetTimeMillis();
                 nHashCounter = 0;
             }
-            else
-                nHashCounter += nHashesDone;
-            if (GetTimeMillis() - nHPSTimerStart > 4000)
-            {
-                static CCriticalSection cs;
-                {
-                    LOCK(cs);
-                    if (GetTimeMillis() - nHPSTimerStart > 4000)
-                    {
-                        dHashesPerSec = 1000.0 * nHashCounter / (GetTimeMillis() - nHPSTimerStart);
-                        nHPSTimerStart = GetTimeMillis();
-                        nHashCounter = 0;
-                        static int64_t nLogTime;
-                        if (GetTime() - nLogTime > 30 * 60)
-                        {
-                            nLogTime = GetTime();
-                            LogPrintf("hashmeter %6.0f khash/s\n", dHashesPerSec/1000.0);
-                        }
-                    }
-                }
-            }
 
             // Check for stop or if block needs to be rebuilt
             boost::this_thread::interruption_point();
@@ -632,27 +861,27 @@ void static BitcoinMiner(CWallet *pwallet)
                 break;
             if (pblock->nNonce >= 0xffff0000)
                 break;
-            if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 60)
-                break;
-            if (pindexPrev != chainActive.Tip())
+            if (!work->IsCurrent(nWorkId))
                 break;
 
             // Update nTime every few seconds
             UpdateTime(*pblock, pindexPrev);
-            nBlockTime = ByteReverse(pblock->nTime);
             if (TestNet())
             {
                 // Changing pblock->nTime can change work required on testnet:
-                nBlockBits = ByteReverse(pblock->nBits);
                 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
             }
         }
     } }
     catch (boost::thread_interrupted)
     {
+        work->WorkerExited();
+        UpdateHashMeter(nThread, 0.0);
         LogPrintf("PatriotBitMiner terminated\n");
         throw;
     }
+    work->WorkerExited();
+    UpdateHashMeter(nThread, 0.0);
 }
 
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet, int nThreads)
@@ -672,13 +901,21 @@ void GenerateBitcoins(bool fGenerate, CWallet* pwallet, int nThreads)
         delete minerThreads;
         minerThreads = NULL;
     }
+    {
+        LOCK(cs_hashmeter);
+        vThreadHashesPerSec.assign(fGenerate ? std::max(nThreads, 0) : 0, 0.0);
+        dHashesPerSec = 0.0;
+    }
 
     if (nThreads == 0 || !fGenerate)
         return;
 
+    // The work object outlives this generation of threads until the last of them exits
+    boost::shared_ptr<CMinerWork> work(new CMinerWork(pwallet, nThreads));
     minerThreads = new boost::thread_group();
+    minerThreads->create_thread(boost::bind(&BitcoinMinerTemplates, work));
     for (int i = 0; i < nThreads; i++)
-        minerThreads->create_thread(boost::bind(&BitcoinMiner, pwallet));
+        minerThreads->create_thread(boost::bind(&BitcoinMiner, work, (unsigned int)i));
 }
 
 #endif
@@ -7,6 +7,7 @@
 #define BITCOIN_MINER_H
 
 #include <stdint.h>
+#include <vector>
 
 class CBlock;
 class CBlockIndex;
@@ -15,7 +16,8 @@ class CReserveKey;
 class CScript;
 class CWallet;
 
-/** Run the miner threads */
+/** Run the miner threads: one template producer and nThreads workers, each
+ *  scanning its own extranonce range of the shared template */
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet, int nThreads);
 /** Generate a new block, without valid proof-of-work */
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn);
@@ -32,4 +34,7 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit);
 extern double dHashesPerSec;
 extern int64_t nHPSTimerStart;
 
+/** Recent hashes per second of each miner thread (zeros while not generating) */
+std::vector<double> GetThreadHashesPerSec();
+
 #endif // BITCOIN_MINER_H
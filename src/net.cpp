@@ -15,12 +15,14 @@
 #include "core.h"
 #include "ui_interface.h"
 #include "darksend.h"
+#include "socketevents.h"
 #include "wallet.h"
 
 #ifdef WIN32
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
 #endif
 
 #ifdef USE_UPNP
@@ -31,6 +33,7 @@
 #endif
 
 #include <boost/filesystem.hpp>
+#include <boost/function.hpp>
 
 // Dump addresses to peers.dat every 15 minutes (900s)
 #define DUMP_ADDRESSES_INTERVAL 900
@@ -43,6 +46,8 @@ using namespace std;
 using namespace boost;
 
 static const int MAX_OUTBOUND_CONNECTIONS = 8;
+/** Most queued messages passed to a single sendmsg() call */
+static const int SEND_IOV_MAX = 64;
 
 bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound = NULL, const char *strDest = NULL, bool fOneShot = false);
 
@@ -65,7 +70,7 @@ int nMaxConnections = 125;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CSendBuffer> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
@@ -497,6 +502,8 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool darkSendMaste
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         // }
+        // Have the socket handler start watching it
+        WakeSocketHandler();
 
         pnode->nTimeConnected = GetTime();
         pnode->AddRef();
@@ -624,6 +631,55 @@ void CNode::copyStats(CNodeStats &stats)
 }
 #undef X
 
+CReceiveBufferPool::CReceiveBufferPool()
+{
+    vBuffers.reserve(RECV_BUFFER_POOL_SIZE);
+}
+
+void CReceiveBufferPool::Get(CDataStream& vRecv)
+{
+    CSerializeData data((zero_after_free_allocator<char>(false)));
+    {
+        LOCK(cs);
+        if (!vBuffers.empty()) {
+            data.swap(vBuffers.back());
+            vBuffers.pop_back();
+        }
+    }
+    vRecv.SwapBuffer(data);
+    vRecv.clear();
+}
+
+void CReceiveBufferPool::Put(CDataStream& vRecv)
+{
+    CSerializeData data;
+    vRecv.SwapBuffer(data);
+    if (data.capacity() == 0 || data.capacity() > MAX_POOLED_RECV_BUFFER)
+        return;
+    LOCK(cs);
+    if (vBuffers.size() < RECV_BUFFER_POOL_SIZE) {
+        vBuffers.push_back(CSerializeData());
+        vBuffers.back().swap(data);
+    }
+}
+
+size_t CReceiveBufferPool::size() const
+{
+    LOCK(cs);
+    return vBuffers.size();
+}
+
+namespace {
+
+CReceiveBufferPool recvBufferPool;
+
+} // anon namespace
+
+CNetMessage::~CNetMessage()
+{
+    recvBufferPool.Put(vRecv);
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 {
@@ -678,9 +734,11 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
     if (hdr.nMessageSize > MAX_SIZE)
             return -1;
 
-    // switch state to reading message data
+    // switch state to reading message data; the announced size is not trusted
+    // beyond MAX_RECV_PREALLOC, larger messages grow the buffer as data arrives
     in_data = true;
-    vRecv.resize(hdr.nMessageSize);
+    recvBufferPool.Get(vRecv);
+    vRecv.reserve(std::min(hdr.nMessageSize, MAX_RECV_PREALLOC));
 
     return nCopy;
 }
@@ -690,7 +748,7 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
+    vRecv.write(pch, nCopy);
     nDataPos += nCopy;
 
     return nCopy;
@@ -705,25 +763,72 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
 
 // requires LOCK(cs_vSend)
+CSendBuffer FinishMessage(CDataStream& ss)
+{
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    memcpy((char*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ss.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+
+    boost::shared_ptr<CSerializeData> pdata(new CSerializeData());
+    ss.GetAndClear(*pdata);
+    return pdata;
+}
+
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSendBuffer>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
+        // Hand as many queued messages to the kernel at once as it takes
+        size_t nAttempt = 0;
+#ifdef WIN32
+        const CSerializeData &data = **it;
         assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        nAttempt = data.size() - pnode->nSendOffset;
+        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], nAttempt, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        struct iovec iov[SEND_IOV_MAX];
+        int nIov = 0;
+        size_t nOffset = pnode->nSendOffset;
+        for (std::deque<CSendBuffer>::iterator mi = it; mi != pnode->vSendMsg.end() && nIov < SEND_IOV_MAX; ++mi, nIov++) {
+            const CSerializeData &data = **mi;
+            assert(data.size() > nOffset);
+            iov[nIov].iov_base = (void*)&data[nOffset];
+            iov[nIov].iov_len = data.size() - nOffset;
+            nAttempt += iov[nIov].iov_len;
+            nOffset = 0;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+        int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+            size_t nSent = nBytes;
+            while (nSent > 0) {
+                size_t nLeft = (*it)->size() - pnode->nSendOffset;
+                if (nSent < nLeft) {
+                    pnode->nSendOffset += nSent;
+                    break;
+                }
+                nSent -= nLeft;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= (*it)->size();
                 it++;
-            } else {
-                // could not send full message; stop sending more
+            }
+            if ((size_t)nBytes < nAttempt) {
+                // could not send everything; stop sending more
                 break;
             }
         } else {
@@ -750,9 +855,31 @@ void SocketSendData(CNode *pnode)
 
 static list<CNode*> vNodesDisconnected;
 
+namespace {
+
+/** Receive at most this many bytes from one node in one pass, so a fast peer cannot starve the others */
+const int SOCKET_RECV_BUDGET = 4 * 0x10000;
+
+CSocketEvents socketEvents;
+
+} // anon namespace
+
+void WakeSocketHandler()
+{
+    socketEvents.Wakeup();
+}
+
+void SocketSendPending()
+{
+    // The edge-triggered backend already watches every node for writability
+    if (!socketEvents.IsEdgeTriggered())
+        socketEvents.Wakeup();
+}
+
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+    int nTimeout = 0;
     while (true)
     {
         //
@@ -825,92 +952,80 @@ void ThreadSocketHandler()
 
 
         //
-        // Find which sockets have data to receive
+        // Find which sockets need watching
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
-        }
+        vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
+            vNodesCopy = vNodes;
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->AddRef();
+        }
+
+        socketEvents.Reset();
+        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+            socketEvents.Watch(hListenSocket, SOCKET_EVENT_RECV);
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        {
+            SOCKET hSocket = pnode->hSocket;
+            if (hSocket == INVALID_SOCKET)
+                continue;
+
+            if (socketEvents.IsEdgeTriggered())
             {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
+                // Registered once; from then on the node's fRecvReady/fSendReady track the socket
+                if (!pnode->fSocketRegistered)
                 {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
+                    socketEvents.Add(hSocket, false);
+                    pnode->fSocketRegistered = true;
                 }
+                continue;
             }
-        }
-
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
 
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
+            // Implement the following logic:
+            // * If there is data to send, watch for sending data. As this only
+            //   happens when optimistic write failed, we choose to first drain the
+            //   write buffer in this case before receiving more. This avoids
+            //   needlessly queueing received data, if the remote peer is not themselves
+            //   receiving data. This means properly utilizing TCP flow control signalling.
+            // * Otherwise, if there is no (complete) message in the receive buffer,
+            //   or there is space left in the buffer, watch for receiving data.
+            // * (if neither of the above applies, there is certainly one message
+            //   in the receiver buffer ready to be processed).
+            // Together, that means that at least one of the following is always possible,
+            // so we don't deadlock:
+            // * We send some data.
+            // * We wait for data to be received (and disconnect after timeout).
+            // * We process a message in the buffer (message handler thread).
+            int nInterest = 0;
             {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend && !pnode->vSendMsg.empty())
+                    nInterest = SOCKET_EVENT_SEND;
+            }
+            if (nInterest == 0)
+            {
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv && (
+                    pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+                    pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+                    nInterest = SOCKET_EVENT_RECV;
+                else
+                    nTimeout = min(nTimeout, SOCKET_WAIT_POLL_MS); // nobody tells us when the buffer drains
             }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
+            socketEvents.Watch(hSocket, nInterest);
         }
 
+        std::map<SOCKET, int> mapEvents;
+        socketEvents.Wait(nTimeout, mapEvents);
+        boost::this_thread::interruption_point();
+
 
         //
         // Accept new connections
         //
         BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+        if (hListenSocket != INVALID_SOCKET && mapEvents.count(hListenSocket))
         {
             struct sockaddr_storage sockaddr;
             socklen_t len = sizeof(sockaddr);
@@ -960,30 +1075,82 @@ void ThreadSocketHandler()
         //
         // Service each socket
         //
-        vector<CNode*> vNodesCopy;
-        {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->AddRef();
-        }
+        nTimeout = socketEvents.MaxTimeout();
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
             boost::this_thread::interruption_point();
 
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+
+            // Level-triggered backends report the current state again on every
+            // Wait; the edge-triggered one only reports changes.
+            if (!socketEvents.IsEdgeTriggered())
+                pnode->fRecvReady = pnode->fSendReady = false;
+            int nEvents = 0;
+            std::map<SOCKET, int>::const_iterator mi = mapEvents.find(pnode->hSocket);
+            if (mi != mapEvents.end())
+                nEvents = mi->second;
+            if (nEvents & (SOCKET_EVENT_RECV | SOCKET_EVENT_ERR))
+                pnode->fRecvReady = true;
+            if (nEvents & SOCKET_EVENT_SEND)
+                pnode->fSendReady = true;
+
+            //
+            // Send
+            //
+            bool fSendQueued = false;
+            if (pnode->fSendReady)
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend)
+                {
+                    if (!pnode->vSendMsg.empty())
+                    {
+                        SocketSendData(pnode);
+                        // Anything left over means the socket buffer is full again
+                        if (!pnode->vSendMsg.empty())
+                            pnode->fSendReady = false;
+                    }
+                    fSendQueued = !pnode->vSendMsg.empty();
+                }
+                else
+                    nTimeout = min(nTimeout, SOCKET_WAIT_POLL_MS);
+            }
+            else
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                fSendQueued = lockSend && !pnode->vSendMsg.empty();
+            }
+
             //
             // Receive
             //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            // As above, drain the send queue before reading more from a peer, unless
+            // the socket reported an error or hangup that recv() has to pick up.
+            if (pnode->fRecvReady && pnode->hSocket != INVALID_SOCKET && (!fSendQueued || (nEvents & SOCKET_EVENT_ERR)))
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
                 {
+                    // typical socket buffer is 8K-64K
+                    char pchBuf[0x10000];
+                    int nBudget = SOCKET_RECV_BUDGET;
+                    while (pnode->fRecvReady && pnode->hSocket != INVALID_SOCKET)
                     {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
+                        if (!(pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+                              pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+                        {
+                            // Receive buffer full; retry once the message handler made room
+                            nTimeout = min(nTimeout, SOCKET_WAIT_POLL_MS);
+                            break;
+                        }
+                        if (nBudget <= 0)
+                        {
+                            // Give the other nodes a turn and come back right away
+                            nTimeout = 0;
+                            break;
+                        }
                         int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
                         if (nBytes > 0)
                         {
@@ -992,6 +1159,10 @@ void ThreadSocketHandler()
                             pnode->nLastRecv = GetTime();
                             pnode->nRecvBytes += nBytes;
                             pnode->RecordBytesRecv(nBytes);
+                            nBudget -= nBytes;
+                            // poll() and select() will say so again if there is more
+                            if (!socketEvents.IsEdgeTriggered())
+                                pnode->fRecvReady = false;
                         }
                         else if (nBytes == 0)
                         {
@@ -1010,21 +1181,13 @@ void ThreadSocketHandler()
                                     LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
                                 pnode->CloseSocketDisconnect();
                             }
+                            else if (nErr != WSAEINTR)
+                                pnode->fRecvReady = false;
                         }
                     }
                 }
-            }
-
-            //
-            // Send
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
-            {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    SocketSendData(pnode);
+                else
+                    nTimeout = min(nTimeout, SOCKET_WAIT_POLL_MS);
             }
 
             //
@@ -1504,7 +1667,7 @@ void static StartSync(const vector<CNode*> &vNodes) {
     }
 }
 
-void ThreadMessageHandler()
+void ThreadMessageHandler(unsigned int nWorker, unsigned int nWorkers)
 {
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (true)
@@ -1522,21 +1685,32 @@ void ThreadMessageHandler()
             }
         }
 
-        if (!fHaveSyncNode)
+        // Sync node selection is left to the first worker
+        if (nWorker == 0 && !fHaveSyncNode)
             StartSync(vNodesCopy);
 
-        // Poll the connected nodes for messages
+        // Poll the connected nodes for messages. Every worker picks a trickle node but
+        // only sends to the nodes it owns, so on average one node trickles per pass.
         CNode* pnodeTrickle = NULL;
         if (!vNodesCopy.empty())
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
 
         bool fSleep = true;
 
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        // Workers start at different nodes, so they spread over the peers instead of
+        // queueing up behind the one that is being handled
+        size_t nStart = vNodesCopy.size() * nWorker / nWorkers;
+        for (size_t i = 0; i < vNodesCopy.size(); i++)
         {
+            CNode* pnode = vNodesCopy[(nStart + i) % vNodesCopy.size()];
             if (pnode->fDisconnect)
                 continue;
 
+            // Skip nodes that another worker is busy with
+            TRY_LOCK(pnode->cs_messageHandler, lockHandler);
+            if (!lockHandler)
+                continue;
+
             // Receive messages
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
@@ -1556,7 +1730,8 @@ void ThreadMessageHandler()
             }
             boost::this_thread::interruption_point();
 
-            // Send messages
+            // Send messages, from one worker per node so the others don't repeat the work
+            if (pnode->id % nWorkers == nWorker)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
@@ -1756,6 +1931,10 @@ void StartNode(boost::thread_group& threadGroup)
 #endif
 
     // Send and receive from sockets, accept connections
+    socketEvents.Init(nMaxConnections + 1);
+    LogPrintf("Using %s for network I/O\n", socketEvents.GetBackendName());
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+        socketEvents.Add(hListenSocket, true);
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
     // Initiate outbound connections from -addnode
@@ -1765,7 +1944,10 @@ void StartNode(boost::thread_group& threadGroup)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    int nWorkers = std::max(1, std::min((int)GetArg("-msghandthreads", DEFAULT_MSGHAND_THREADS), MAX_MSGHAND_THREADS));
+    for (int i = 0; i < nWorkers; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand",
+            boost::function<void()>(boost::bind(&ThreadMessageHandler, (unsigned int)i, (unsigned int)nWorkers))));
 
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, DUMP_ADDRESSES_INTERVAL * 1000));
@@ -1838,6 +2020,8 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash)
 void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss)
 {
     CInv inv(MSG_TX, hash);
+    // Serialized once here; every peer that asks for it gets the same buffer
+    CSendBuffer msg = MakeMessage("tx", ss);
     {
         LOCK(cs_mapRelay);
         // Expire old relay messages
@@ -1848,7 +2032,7 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
         }
 
         // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        mapRelay.insert(std::make_pair(inv, msg));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
     LOCK(cs_vNodes);
@@ -1870,6 +2054,7 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
 void RelayTransactionLockReq(const CTransaction& tx, const uint256& hash, bool relayToAll)
 {
     CInv inv(MSG_TXLOCK_REQUEST, tx.GetHash());
+    CSendBuffer msg = MakeMessage("txlreq", tx);
 
     //broadcast the new lock
     LOCK(cs_vNodes);
@@ -1878,7 +2063,7 @@ void RelayTransactionLockReq(const CTransaction& tx, const uint256& hash, bool r
         if(!relayToAll && !pnode->fRelayTxes)
             continue;
 
-        pnode->PushMessage("txlreq", tx);
+        pnode->PushMessage(msg);
     }
 
 }
@@ -26,6 +26,7 @@
 #endif
 
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 #include <openssl/rand.h>
 
@@ -43,6 +44,16 @@ static const unsigned int MAX_INV_SZ = 50000;
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
 /** The maximum number of new addresses to accumulate before announcing. */
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
+/** Receive buffers are allocated up front for at most this much of a message's announced size */
+static const unsigned int MAX_RECV_PREALLOC = 1024 * 1024;
+/** Number of spare receive buffers kept for reuse */
+static const unsigned int RECV_BUFFER_POOL_SIZE = 32;
+/** Receive buffers with a larger capacity are freed instead of being reused */
+static const unsigned int MAX_POOLED_RECV_BUFFER = 256 * 1024;
+/** Default number of message handler threads (-msghandthreads) */
+static const int DEFAULT_MSGHAND_THREADS = 4;
+/** Maximum number of message handler threads */
+static const int MAX_MSGHAND_THREADS = 16;
 
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
@@ -61,6 +72,29 @@ void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode *pnode);
 
+/** A complete wire message, header included. It is never modified once built,
+ *  so the same buffer can be queued to any number of peers. */
+typedef boost::shared_ptr<const CSerializeData> CSendBuffer;
+
+/** Fill in the payload size and checksum of the message in ss, which must start
+ *  with a CMessageHeader, and move its bytes into a send buffer. */
+CSendBuffer FinishMessage(CDataStream& ss);
+
+/** Serialize a message once, for sending to many peers with CNode::PushMessage(CSendBuffer).
+ *  Only for payloads that serialize the same for every protocol version. Several
+ *  fields can be passed as one CDataStream, which is written without a length prefix. */
+template<typename T1>
+CSendBuffer MakeMessage(const char* pszCommand, const T1& a1)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader(pszCommand, 0) << a1;
+    return FinishMessage(ss);
+}
+/** Interrupt the socket handler's wait, e.g. when a new connection was added */
+void WakeSocketHandler();
+/** Called by EndMessage when the optimistic write left data in a send queue */
+void SocketSendPending();
+
 typedef int NodeId;
 
 // Signals for message handling
@@ -110,7 +144,7 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSendBuffer> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
@@ -153,6 +187,26 @@ public:
 
 
 
+/** Spare message buffers, so that receiving a message does not allocate a new
+ *  one every time. Buffers are taken by the socket thread and given back by
+ *  whichever thread drops the message. Received data is nothing secret, so
+ *  these buffers are not zeroed when they are freed. */
+class CReceiveBufferPool
+{
+private:
+    mutable CCriticalSection cs;
+    std::vector<CSerializeData> vBuffers;
+
+public:
+    CReceiveBufferPool();
+
+    // Swap a spare or new non-zeroing buffer into vRecv, which must be empty
+    void Get(CDataStream& vRecv);
+    // Take the buffer out of vRecv and keep it if it is worth keeping
+    void Put(CDataStream& vRecv);
+    size_t size() const;
+};
+
 class CNetMessage {
 public:
     bool in_data;                   // parsing header (false) or data (true)
@@ -171,6 +225,9 @@ public:
         nDataPos = 0;
     }
 
+    // Hands the data buffer back to the receive buffer pool
+    ~CNetMessage();
+
     bool complete() const
     {
         if (!in_data)
@@ -203,7 +260,7 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSendBuffer> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
@@ -231,6 +288,10 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    // Socket readiness as last reported to ThreadSocketHandler; cleared when a recv or send would block
+    bool fSocketRegistered;
+    bool fRecvReady;
+    bool fSendReady;
     // We use fRelayTxes for two purposes -
     // a) it allows us to not relay tx invs before receiving the peer's version message
     // b) the peer may tell us in their version message that we should not relay tx invs
@@ -240,6 +301,9 @@ public:
     CSemaphoreGrant grantOutbound;
     CCriticalSection cs_filter;
     CBloomFilter* pfilter;
+    // Held by the message handler thread that is processing this node, so that
+    // its messages are handled (and its replies sent) in order, by one thread at a time
+    CCriticalSection cs_messageHandler;
     int nRefCount;
     NodeId id;
 protected:
@@ -261,7 +325,8 @@ public:
     int nStartingHeight;
     bool fStartSync;
 
-    // flood relay
+    // flood relay (vAddrToSend and setAddrKnown are protected by cs_inventory,
+    // other nodes' message handlers relay addresses to this node)
     std::vector<CAddress> vAddrToSend;
     mruset<CAddress> setAddrKnown;
     bool fGetAddr;
@@ -300,6 +365,9 @@ public:
         fNetworkNode = false;
         fSuccessfullyConnected = false;
         fDisconnect = false;
+        fSocketRegistered = false;
+        fRecvReady = true;
+        fSendReady = true;
         nRefCount = 0;
         nSendSize = 0;
         nSendOffset = 0;
@@ -403,6 +471,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_inventory);
         setAddrKnown.insert(addr);
     }
 
@@ -411,6 +480,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_inventory);
         if (addr.IsValid() && !setAddrKnown.count(addr)) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
@@ -508,32 +578,35 @@ public:
         if (ssSend.size() == 0)
             return;
 
-        // Set the size
-        unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-        memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+        LogPrint("net", "(%d bytes)\n", ssSend.size() - CMessageHeader::HEADER_SIZE);
 
-        // Set the checksum
-        uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-        memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+        QueueSendBuffer(FinishMessage(ssSend));
 
-        LogPrint("net", "(%d bytes)\n", nSize);
+        LEAVE_CRITICAL_SECTION(cs_vSend);
+    }
 
-        std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-        ssSend.GetAndClear(*it);
-        nSendSize += (*it).size();
+    void QueueSendBuffer(const CSendBuffer& msg) EXCLUSIVE_LOCKS_REQUIRED(cs_vSend)
+    {
+        vSendMsg.push_back(msg);
+        nSendSize += msg->size();
 
         // If write queue empty, attempt "optimistic write"
-        if (it == vSendMsg.begin())
+        if (vSendMsg.size() == 1)
             SocketSendData(this);
-
-        LEAVE_CRITICAL_SECTION(cs_vSend);
+        if (!vSendMsg.empty())
+            SocketSendPending();
     }
 
     void PushVersion();
 
+    // Queue a message built by MakeMessage, without copying it
+    void PushMessage(const CSendBuffer& msg)
+    {
+        LOCK(cs_vSend);
+        LogPrint("net", "sending: %s (%d bytes)\n", SanitizeString(std::string(&(*msg)[MESSAGE_START_SIZE], CMessageHeader::COMMAND_SIZE)), msg->size() - CMessageHeader::HEADER_SIZE);
+        QueueSendBuffer(msg);
+    }
+
 
     void PushMessage(const char* pszCommand)
     {
@@ -347,6 +347,7 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
         // WSAEINVAL is here because some legacy version of winsock uses it
         if (WSAGetLastError() == WSAEINPROGRESS || WSAGetLastError() == WSAEWOULDBLOCK || WSAGetLastError() == WSAEINVAL)
         {
+#ifdef WIN32
             struct timeval timeout;
             timeout.tv_sec  = nTimeout / 1000;
             timeout.tv_usec = (nTimeout % 1000) * 1000;
@@ -355,6 +356,14 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
             FD_ZERO(&fdset);
             FD_SET(hSocket, &fdset);
             int nRet = select(hSocket + 1, NULL, &fdset, NULL, &timeout);
+#else
+            // poll() rather than select(): with many peers the descriptor can be past FD_SETSIZE
+            struct pollfd pollfd;
+            pollfd.fd = hSocket;
+            pollfd.events = POLLOUT;
+            pollfd.revents = 0;
+            int nRet = poll(&pollfd, 1, nTimeout);
+#endif
             if (nRet == 0)
             {
                 LogPrint("net", "connection to %s timeout\n", addrConnect.ToString());
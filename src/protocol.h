@@ -62,6 +62,8 @@ class CMessageHeader
 enum
 {
     NODE_NETWORK = (1 << 0),
+    // Serves compact block filters (getcfilters, getcfheaders, getcfcheckpt)
+    NODE_COMPACT_FILTERS = (1 << 6),
 };
 
 /** A CService with information about it as peer */
@@ -139,7 +141,9 @@ enum
     MSG_TXLOCK_VOTE,
     MSG_SPORK,
     MSG_MASTERNODE_WINNER,
-    MSG_MASTERNODE_SCANNING_ERROR
+    MSG_MASTERNODE_SCANNING_ERROR,
+    // Only used in getdata, to ask for a block as a "cmpctblock" message
+    MSG_CMPCT_BLOCK
 };
 
 #endif // __INCLUDED_PROTOCOL_H__
@@ -0,0 +1,394 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "core.h"
+#include "main.h"
+#include "rpcserver.h"
+#include "sync.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <boost/algorithm/string.hpp>
+#include <boost/foreach.hpp>
+
+using namespace std;
+using namespace json_spirit;
+
+extern Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex);
+extern Object blockHeaderToJSON(const CBlock& block, const CBlockIndex* blockindex);
+extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry);
+extern void ScriptPubKeyToJSON(const CScript& scriptPubKey, Object& out, bool fIncludeHex);
+
+namespace {
+
+enum RetFormat {
+    RF_BINARY,
+    RF_HEX,
+    RF_JSON
+};
+
+const struct {
+    enum RetFormat rf;
+    const char *name;
+} rf_names[] = {
+    { RF_BINARY, "bin" },
+    { RF_HEX,    "hex" },
+    { RF_JSON,   "json" },
+};
+
+/** An unspent output as returned by /rest/getutxos */
+struct CCoin {
+    uint32_t nTxVer; // Don't call this nVersion, that name has a special meaning inside IMPLEMENT_SERIALIZE
+    uint32_t nHeight;
+    CTxOut out;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nTxVer);
+        READWRITE(nHeight);
+        READWRITE(out);
+    )
+};
+
+/** Thrown by the handlers, becomes a plain text reply with the given status */
+class RestErr
+{
+public:
+    enum HTTPStatusCode status;
+    string message;
+};
+
+RestErr RESTERR(enum HTTPStatusCode status, string message)
+{
+    RestErr re;
+    re.status = status;
+    re.message = message;
+    return re;
+}
+
+// Strip the format suffix off the last part of the URI
+enum RetFormat ParseDataFormat(vector<string>& params, const string& strReq)
+{
+    boost::split(params, strReq, boost::is_any_of("/"));
+    string& strLast = params.back();
+    size_t nDot = strLast.rfind('.');
+    if (nDot != string::npos)
+    {
+        string strFormat = strLast.substr(nDot + 1);
+        for (unsigned int i = 0; i < ARRAYLEN(rf_names); i++)
+            if (strFormat == rf_names[i].name)
+            {
+                strLast.erase(nDot);
+                return rf_names[i].rf;
+            }
+    }
+    throw RESTERR(HTTP_NOT_FOUND, "output format not found (available: bin, hex, json)");
+}
+
+bool ParseHashStr(const string& strReq, uint256& v)
+{
+    if (!IsHex(strReq) || (strReq.size() != 64))
+        return false;
+
+    v.SetHex(strReq);
+    return true;
+}
+
+string RESTReply(enum RetFormat rf, const CDataStream& ss, const Value& json, bool fKeepAlive)
+{
+    switch (rf) {
+    case RF_BINARY:
+        return HTTPReply(HTTP_OK, string(ss.begin(), ss.end()), fKeepAlive, "application/octet-stream");
+    case RF_HEX:
+        return HTTPReply(HTTP_OK, HexStr(ss.begin(), ss.end()) + "\n", fKeepAlive, "text/plain");
+    case RF_JSON:
+    default:
+        return HTTPReply(HTTP_OK, write_string(json, false) + "\n", fKeepAlive);
+    }
+}
+
+/**
+ * Send a block as it is stored on disk, which is its network serialization,
+ * without deserializing it. The file is read and handed to send in
+ * JSON_STREAM_CHUNK_SIZE pieces behind a header with the final length.
+ */
+string SendRawBlock(const CDiskBlockPos& pos, bool fHex, bool& fKeepAlive, const CJSONStreamWriter::SinkFunc& send)
+{
+    // The block is preceded by the network magic and its size
+    CAutoFile file(OpenBlockFile(CDiskBlockPos(pos.nFile, pos.nPos - 4), true), SER_DISK, CLIENT_VERSION);
+    if (!file)
+        throw RESTERR(HTTP_INTERNAL_SERVER_ERROR, "Can't read block from disk");
+    unsigned int nSize;
+    try {
+        file >> nSize;
+    } catch (std::exception &e) {
+        throw RESTERR(HTTP_INTERNAL_SERVER_ERROR, "Can't read block from disk");
+    }
+    if (nSize > MAX_BLOCK_SIZE)
+        throw RESTERR(HTTP_INTERNAL_SERVER_ERROR, "Can't read block from disk");
+
+    size_t nContentLength = fHex ? 2 * (size_t)nSize + 1 : nSize;
+    string strPart = HTTPReplyHeader(HTTP_OK, fKeepAlive, nContentLength, fHex ? "text/plain" : "application/octet-stream");
+    vector<char> vch(std::min(nSize, JSON_STREAM_CHUNK_SIZE));
+    bool fSent = false;
+    unsigned int nLeft = nSize;
+    while (nLeft > 0)
+    {
+        unsigned int n = std::min(nLeft, (unsigned int)vch.size());
+        if (fread(&vch[0], 1, n, file) != n)
+        {
+            if (!fSent)
+                throw RESTERR(HTTP_INTERNAL_SERVER_ERROR, "Can't read block from disk");
+            // Part of the block is out already, the length can't be kept
+            fKeepAlive = false;
+            return "";
+        }
+        nLeft -= n;
+        if (fHex)
+            strPart += HexStr(vch.begin(), vch.begin() + n) + (nLeft == 0 ? "\n" : "");
+        else
+            strPart.append(&vch[0], n);
+        if (!send(strPart))
+        {
+            fKeepAlive = false;
+            return "";
+        }
+        fSent = true;
+        strPart.clear();
+    }
+    return "";
+}
+
+string rest_block(const string& strURIPart, bool& fKeepAlive, const CJSONStreamWriter::SinkFunc& send)
+{
+    vector<string> params;
+    enum RetFormat rf = ParseDataFormat(params, strURIPart);
+    if (params.size() != 1)
+        throw RESTERR(HTTP_BAD_REQUEST, "Invalid URI format. Expected /rest/block/<hash>.<ext>");
+
+    uint256 hash;
+    if (!ParseHashStr(params[0], hash))
+        throw RESTERR(HTTP_BAD_REQUEST, "Invalid hash: " + params[0]);
+
+    CBlockIndex* pblockindex;
+    CDiskBlockPos pos;
+    {
+        LOCK(cs_main);
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        if (mi == mapBlockIndex.end())
+            throw RESTERR(HTTP_NOT_FOUND, hash.GetHex() + " not found");
+        pblockindex = mi->second;
+        if (!(pblockindex->nStatus & BLOCK_HAVE_DATA))
+            throw RESTERR(HTTP_NOT_FOUND, hash.GetHex() + " not available");
+        pos = pblockindex->GetBlockPos();
+    }
+
+    if (rf != RF_JSON)
+        return SendRawBlock(pos, rf == RF_HEX, fKeepAlive, send);
+
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pblockindex))
+        throw RESTERR(HTTP_INTERNAL_SERVER_ERROR, "Can't read block from disk");
+    Object objBlock;
+    {
+        LOCK(cs_main);
+        objBlock = blockToJSON(block, pblockindex);
+    }
+    return HTTPReply(HTTP_OK, write_string(Value(objBlock), false) + "\n", fKeepAlive);
+}
+
+string rest_tx(const string& strURIPart, bool& fKeepAlive, const CJSONStreamWriter::SinkFunc& send)
+{
+    vector<string> params;
+    enum RetFormat rf = ParseDataFormat(params, strURIPart);
+    if (params.size() != 1)
+        throw RESTERR(HTTP_BAD_REQUEST, "Invalid URI format. Expected /rest/tx/<txid>.<ext>");
+
+    uint256 hash;
+    if (!ParseHashStr(params[0], hash))
+        throw RESTERR(HTTP_BAD_REQUEST, "Invalid hash: " + params[0]);
+
+    CTransaction tx;
+    uint256 hashBlock = 0;
+    if (!GetTransaction(hash, tx, hashBlock, true))
+        throw RESTERR(HTTP_NOT_FOUND, hash.GetHex() + " not found");
+
+    CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+    Object objTx;
+    if (rf == RF_JSON)
+        TxToJSON(tx, hashBlock, objTx);
+    else
+        ssTx << tx;
+    return RESTReply(rf, ssTx, objTx, fKeepAlive);
+}
+
+string rest_headers(const string& strURIPart, bool& fKeepAlive, const CJSONStreamWriter::SinkFunc& send)
+{
+    vector<string> params;
+    enum RetFormat rf = ParseDataFormat(params, strURIPart);
+    if (params.size() != 2)
+        throw RESTERR(HTTP_BAD_REQUEST, "Invalid URI format. Expected /rest/headers/<count>/<hash>.<ext>");
+
+    long nCount = strtol(params[0].c_str(), NULL, 10);
+    if (nCount < 1 || nCount > MAX_REST_HEADERS_RESULTS)
+        throw RESTERR(HTTP_BAD_REQUEST, strprintf("Header count out of range: %s", params[0]));
+
+    uint256 hash;
+    if (!ParseHashStr(params[1], hash))
+        throw RESTERR(HTTP_BAD_REQUEST, "Invalid hash: " + params[1]);
+
+    // The given block and the ones following it in the active chain
+    CDataStream ssHeaders(SER_NETWORK, PROTOCOL_VERSION);
+    Array arrHeaders;
+    {
+        LOCK(cs_main);
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        if (mi == mapBlockIndex.end())
+            throw RESTERR(HTTP_NOT_FOUND, hash.GetHex() + " not found");
+        const CBlockIndex* pindex = mi->second;
+        for (long i = 0; pindex && i < nCount; i++)
+        {
+            CBlockHeader header = pindex->GetBlockHeader();
+            if (rf == RF_JSON)
+                arrHeaders.push_back(blockHeaderToJSON(CBlock(header), pindex));
+            else
+                ssHeaders << header;
+            pindex = chainActive.Next(pindex);
+        }
+    }
+    return RESTReply(rf, ssHeaders, arrHeaders, fKeepAlive);
+}
+
+string rest_getutxos(const string& strURIPart, bool& fKeepAlive, const CJSONStreamWriter::SinkFunc& send)
+{
+    vector<string> params;
+    enum RetFormat rf = ParseDataFormat(params, strURIPart);
+
+    // /rest/getutxos[/checkmempool]/<txid>-<n>/<txid>-<n>/...
+    bool fCheckMemPool = false;
+    unsigned int nFirst = 0;
+    if (!params.empty() && params[0] == "checkmempool")
+    {
+        fCheckMemPool = true;
+        nFirst = 1;
+    }
+
+    vector<COutPoint> vOutPoints;
+    for (unsigned int i = nFirst; i < params.size(); i++)
+    {
+        if (params[i].empty())
+            continue;
+        vector<string> vOutPoint;
+        boost::split(vOutPoint, params[i], boost::is_any_of("-"));
+        uint256 txid;
+        if (vOutPoint.size() != 2 || !ParseHashStr(vOutPoint[0], txid) ||
+            vOutPoint[1].empty() || vOutPoint[1].find_first_not_of("0123456789") != string::npos)
+            throw RESTERR(HTTP_BAD_REQUEST, "Parse error");
+        vOutPoints.push_back(COutPoint(txid, atoi(vOutPoint[1].c_str())));
+    }
+
+    if (vOutPoints.empty())
+        throw RESTERR(HTTP_BAD_REQUEST, "Error: empty request");
+    if (vOutPoints.size() > MAX_GETUTXOS_OUTPOINTS)
+        throw RESTERR(HTTP_BAD_REQUEST, strprintf("Error: max outpoints exceeded (max: %d, tried: %d)", MAX_GETUTXOS_OUTPOINTS, vOutPoints.size()));
+
+    vector<unsigned char> bitmap((vOutPoints.size() + 7) / 8);
+    string strBitmap;
+    vector<CCoin> outs;
+    int nHeight;
+    uint256 hashTip;
+    {
+        LOCK2(cs_main, mempool.cs);
+        CCoinsViewMemPool viewMemPool(*pcoinsTip, mempool);
+        for (unsigned int i = 0; i < vOutPoints.size(); i++)
+        {
+            const COutPoint& outpoint = vOutPoints[i];
+            CCoins coins;
+            bool fHit = false;
+            if (fCheckMemPool ? viewMemPool.GetCoins(outpoint.hash, coins) : pcoinsTip->GetCoins(outpoint.hash, coins))
+            {
+                if (fCheckMemPool)
+                    mempool.pruneSpent(outpoint.hash, coins);
+                if (coins.IsAvailable(outpoint.n))
+                {
+                    fHit = true;
+                    CCoin coin;
+                    coin.nTxVer = coins.nVersion;
+                    coin.nHeight = coins.nHeight;
+                    coin.out = coins.vout[outpoint.n];
+                    outs.push_back(coin);
+                }
+            }
+            bitmap[i / 8] |= ((unsigned char)fHit) << (i % 8);
+            strBitmap += fHit ? "1" : "0";
+        }
+        nHeight = chainActive.Height();
+        hashTip = chainActive.Tip()->GetBlockHash();
+    }
+
+    CDataStream ssUTXO(SER_NETWORK, PROTOCOL_VERSION);
+    Object objUTXO;
+    if (rf == RF_JSON)
+    {
+        objUTXO.push_back(Pair("chainHeight", nHeight));
+        objUTXO.push_back(Pair("chaintipHash", hashTip.GetHex()));
+        objUTXO.push_back(Pair("bitmap", strBitmap));
+        Array utxos;
+        BOOST_FOREACH(const CCoin& coin, outs)
+        {
+            Object utxo;
+            utxo.push_back(Pair("txvers", (int64_t)coin.nTxVer));
+            utxo.push_back(Pair("height", (int64_t)coin.nHeight));
+            utxo.push_back(Pair("value", ValueFromAmount(coin.out.nValue)));
+            Object o;
+            ScriptPubKeyToJSON(coin.out.scriptPubKey, o, true);
+            utxo.push_back(Pair("scriptPubKey", o));
+            utxos.push_back(utxo);
+        }
+        objUTXO.push_back(Pair("utxos", utxos));
+    }
+    else
+        ssUTXO << nHeight << hashTip << bitmap << outs;
+    return RESTReply(rf, ssUTXO, objUTXO, fKeepAlive);
+}
+
+const struct {
+    const char* prefix;
+    string (*handler)(const string& strURIPart, bool& fKeepAlive, const CJSONStreamWriter::SinkFunc& send);
+} uri_prefixes[] = {
+      { "/rest/tx/", rest_tx },
+      { "/rest/block/", rest_block },
+      { "/rest/headers/", rest_headers },
+      { "/rest/getutxos", rest_getutxos },
+};
+
+} // anon namespace
+
+string HTTPReq_REST(const string& strURI, bool& fKeepAlive, const CJSONStreamWriter::SinkFunc& send)
+{
+    try {
+        for (unsigned int i = 0; i < ARRAYLEN(uri_prefixes); i++) {
+            unsigned int plen = strlen(uri_prefixes[i].prefix);
+            if (strURI.substr(0, plen) == uri_prefixes[i].prefix) {
+                string strURIPart = strURI.substr(plen);
+                if (!strURIPart.empty() && strURIPart[0] == '/')
+                    strURIPart.erase(0, 1);
+                return uri_prefixes[i].handler(strURIPart, fKeepAlive, send);
+            }
+        }
+    }
+    catch (RestErr& re) {
+        fKeepAlive = false;
+        return HTTPReply(re.status, re.message + "\r\n", false, "text/plain");
+    }
+    catch (std::exception& e) {
+        // Deserialization or I/O errors the handlers did not turn into a RestErr
+        fKeepAlive = false;
+        return HTTPReply(HTTP_INTERNAL_SERVER_ERROR, string(e.what()) + "\r\n", false, "text/plain");
+    }
+
+    fKeepAlive = false;
+    return HTTPReply(HTTP_NOT_FOUND, "", false);
+}
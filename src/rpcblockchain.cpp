@@ -8,9 +8,14 @@
 #include "main.h"
 #include "sync.h"
 #include "checkpoints.h"
+#include "coinscommitment.h"
+#include "txdb.h"
+#include "utxosnapshot.h"
 
 #include <stdint.h>
 
+#include <boost/filesystem.hpp>
+
 #include "json/json_spirit_value.h"
 
 using namespace json_spirit;
@@ -107,6 +112,7 @@ Value getblockcount(const Array& params, bool fHelp)
             + HelpExampleRpc("getblockcount", "")
         );
 
+    LOCK(cs_main);
     return chainActive.Height();
 }
 
@@ -123,6 +129,7 @@ Value getbestblockhash(const Array& params, bool fHelp)
             + HelpExampleRpc("getbestblockhash", "")
         );
 
+    LOCK(cs_main);
     return chainActive.Tip()->GetBlockHash().GetHex();
 }
 
@@ -143,6 +150,28 @@ Value getdifficulty(const Array& params, bool fHelp)
 }
 
 
+// mempool.cs must be held
+static Object MempoolEntryToJSON(const CTxMemPoolEntry& e, int nChainHeight)
+{
+    Object info;
+    info.push_back(Pair("size", (int)e.GetTxSize()));
+    info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
+    info.push_back(Pair("time", e.GetTime()));
+    info.push_back(Pair("height", (int)e.GetHeight()));
+    info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
+    info.push_back(Pair("currentpriority", e.GetPriority(nChainHeight)));
+    const CTransaction& tx = e.GetTx();
+    set<string> setDepends;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        if (mempool.exists(txin.prevout.hash))
+            setDepends.insert(txin.prevout.hash.ToString());
+    }
+    Array depends(setDepends.begin(), setDepends.end());
+    info.push_back(Pair("depends", depends));
+    return info;
+}
+
 Value getrawmempool(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -184,27 +213,7 @@ Value getrawmempool(const Array& params, bool fHelp)
         LOCK(mempool.cs);
         Object o;
         BOOST_FOREACH(const PAIRTYPE(uint256, CTxMemPoolEntry)& entry, mempool.mapTx)
-        {
-            const uint256& hash = entry.first;
-            const CTxMemPoolEntry& e = entry.second;
-            Object info;
-            info.push_back(Pair("size", (int)e.GetTxSize()));
-            info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
-            info.push_back(Pair("time", e.GetTime()));
-            info.push_back(Pair("height", (int)e.GetHeight()));
-            info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
-            info.push_back(Pair("currentpriority", e.GetPriority(chainActive.Height())));
-            const CTransaction& tx = e.GetTx();
-            set<string> setDepends;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                if (mempool.exists(txin.prevout.hash))
-                    setDepends.insert(txin.prevout.hash.ToString());
-            }
-            Array depends(setDepends.begin(), setDepends.end());
-            info.push_back(Pair("depends", depends));
-            o.push_back(Pair(hash.ToString(), info));
-        }
+            o.push_back(Pair(entry.first.ToString(), MempoolEntryToJSON(entry.second, chainActive.Height())));
         return o;
     }
     else
@@ -220,6 +229,48 @@ Value getrawmempool(const Array& params, bool fHelp)
     }
 }
 
+// Same result as getrawmempool, but the verbose form is written one entry
+// at a time and mempool.cs is only held while an entry is formatted.
+// Streamed calls run without the table's locks, so cs_main is taken here
+// for as long as the chain is looked at.
+void getrawmempoolstream(const Array& params, CJSONStreamWriter& writer)
+{
+    if (params.size() == 0 || params.size() > 1 || !params[0].get_bool())
+    {
+        Value result;
+        {
+            LOCK(cs_main);
+            result = getrawmempool(params, false);
+        }
+        writer.WriteValue(result);
+        return;
+    }
+
+    vector<uint256> vtxid;
+    int nChainHeight;
+    {
+        LOCK(cs_main);
+        mempool.queryHashes(vtxid);
+        nChainHeight = chainActive.Height();
+    }
+
+    writer.BeginObject();
+    BOOST_FOREACH(const uint256& hash, vtxid)
+    {
+        Object info;
+        {
+            LOCK(mempool.cs);
+            map<uint256, CTxMemPoolEntry>::const_iterator it = mempool.mapTx.find(hash);
+            if (it == mempool.mapTx.end())
+                continue; // mined or evicted in the meantime
+            info = MempoolEntryToJSON(it->second, nChainHeight);
+        }
+        writer.WriteKey(hash.ToString());
+        writer.WriteValue(info);
+    }
+    writer.EndObject();
+}
+
 Value getblockhash(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -236,6 +287,7 @@ Value getblockhash(const Array& params, bool fHelp)
         );
 
     int nHeight = params[0].get_int();
+    LOCK(cs_main);
     if (nHeight < 0 || nHeight > chainActive.Height())
         throw runtime_error("Block number out of range.");
 
@@ -286,12 +338,16 @@ Value getblock(const Array& params, bool fHelp)
     if (params.size() > 1)
         fVerbose = params[1].get_bool();
 
-    if (mapBlockIndex.count(hash) == 0)
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+    CBlockIndex* pblockindex;
+    {
+        LOCK(cs_main);
+        if (mapBlockIndex.count(hash) == 0)
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+        pblockindex = mapBlockIndex[hash];
+    }
 
+    // Block index entries are never freed, the disk read needs no lock
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
-
     if(!ReadBlockFromDisk(block, pblockindex))
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
 
@@ -303,6 +359,7 @@ Value getblock(const Array& params, bool fHelp)
         return strHex;
     }
 
+    LOCK(cs_main);
     return blockToJSON(block, pblockindex);
 }
 
@@ -339,12 +396,15 @@ Value getblockheader(const Array& params, bool fHelp)
     if (params.size() > 1)
         fVerbose = params[1].get_bool();
 
-    if (mapBlockIndex.count(hash) == 0)
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+    CBlockIndex* pblockindex;
+    {
+        LOCK(cs_main);
+        if (mapBlockIndex.count(hash) == 0)
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+        pblockindex = mapBlockIndex[hash];
+    }
 
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
-
     if(!ReadBlockFromDisk(block, pblockindex))
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
 
@@ -359,40 +419,149 @@ Value getblockheader(const Array& params, bool fHelp)
     return blockHeaderToJSON(block, pblockindex);
 }
 
+Value getblockfilter(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+                "getblockfilter \"hash\"\n"
+                "\nReturns the compact filter (BIP 158 basic filter) of block 'hash'. Needs -blockfilterindex.\n"
+                "\nArguments:\n"
+                "1. \"hash\"          (string, required) The block hash\n"
+                "\nResult:\n"
+                "{\n"
+                "  \"filter\" : \"xxxx\",  (string) The hex encoded filter\n"
+                "  \"header\" : \"hash\",  (string) The filter header, which commits to the filters of all earlier blocks\n"
+                "}\n"
+                "\nExamples:\n"
+                + HelpExampleCli("getblockfilter", "\"00000000000fd08c2fb661d2fcb0d49abb3a91e5f27082ce64feed3b4dede2e2\"")
+                + HelpExampleRpc("getblockfilter", "\"00000000000fd08c2fb661d2fcb0d49abb3a91e5f27082ce64feed3b4dede2e2\"")
+                );
+
+    if (!fBlockFilterIndex || !pblockfilterdb)
+        throw JSONRPCError(RPC_MISC_ERROR, "Block filter index is not enabled (use -blockfilterindex and -reindex)");
+
+    uint256 hash(params[0].get_str());
+    {
+        LOCK(cs_main);
+        if (mapBlockIndex.count(hash) == 0)
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+    }
+
+    std::vector<unsigned char> vchFilter;
+    uint256 hashFilter, hashHeader;
+    if (!pblockfilterdb->ReadFilter(hash, vchFilter) || !pblockfilterdb->ReadFilterHeader(hash, hashFilter, hashHeader))
+        throw JSONRPCError(RPC_MISC_ERROR, "No filter for this block; it has not been connected");
+
+    Object result;
+    result.push_back(Pair("filter", HexStr(vchFilter)));
+    result.push_back(Pair("header", hashHeader.GetHex()));
+    return result;
+}
+
 Value gettxoutsetinfo(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "gettxoutsetinfo\n"
+            "gettxoutsetinfo ( fast )\n"
             "\nReturns statistics about the unspent transaction output set.\n"
-            "Note this call may take some time.\n"
+            "Note this call may take some time, unless fast is set.\n"
+            "\nArguments:\n"
+            "1. fast    (boolean, optional, default=false) Skip the walk over the whole set and leave out\n"
+            "           bytes_serialized and hash_serialized; the rest is kept up to date with every block\n"
             "\nResult:\n"
             "{\n"
             "  \"height\":n,     (numeric) The current block height (index)\n"
             "  \"bestblock\": \"hex\",   (string) the best block hash hex\n"
             "  \"transactions\": n,      (numeric) The number of transactions\n"
             "  \"txouts\": n,            (numeric) The number of output transactions\n"
-            "  \"bytes_serialized\": n,  (numeric) The serialized size\n"
-            "  \"hash_serialized\": \"hash\",   (string) The serialized hash\n"
+            "  \"bytes_serialized\": n,  (numeric) The serialized size (not with fast)\n"
+            "  \"hash_serialized\": \"hash\",   (string) The serialized hash (not with fast)\n"
+            "  \"muhash\": \"hash\",     (string) Rolling multiset hash of all unspent outputs\n"
             "  \"total_amount\": x.xxx          (numeric) The total amount\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("gettxoutsetinfo", "")
+            + HelpExampleCli("gettxoutsetinfo", "true")
             + HelpExampleRpc("gettxoutsetinfo", "")
         );
 
     Object ret;
 
+    bool fFast = false;
+    if (params.size() > 0)
+        fFast = params[0].get_bool();
+
     CCoinsStats stats;
-    if (pcoinsTip->GetStats(stats)) {
-        ret.push_back(Pair("height", (int64_t)stats.nHeight));
-        ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
+    if (!fFast && !pcoinsTip->GetStats(stats))
+        return ret;
+
+    CBlockIndex* pindex = chainActive.Tip();
+    CCoinsCommitment commitment;
+    if (!pblocktree->ReadCoinsCommitment(pindex->GetBlockHash(), commitment)) {
+        // Started from a chainstate that predates commitments: compute one for the
+        // tip now, and ConnectBlock keeps it rolling from here on.
+        uint256 hashBlock;
+        if (!pcoinsTip->Flush() || !ComputeCoinsCommitment(*pcoinsTip, commitment, hashBlock) || hashBlock != pindex->GetBlockHash())
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read UTXO set");
+        pblocktree->WriteCoinsCommitment(hashBlock, commitment);
+    }
+
+    ret.push_back(Pair("height", (int64_t)pindex->nHeight));
+    ret.push_back(Pair("bestblock", pindex->GetBlockHash().GetHex()));
+    if (fFast) {
+        ret.push_back(Pair("transactions", (int64_t)commitment.nTransactions));
+        ret.push_back(Pair("txouts", (int64_t)commitment.nTransactionOutputs));
+    } else {
         ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
         ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
         ret.push_back(Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
         ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
-        ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
     }
+    ret.push_back(Pair("muhash", commitment.GetHash().GetHex()));
+    ret.push_back(Pair("total_amount", ValueFromAmount(fFast ? commitment.nTotalAmount : stats.nTotalAmount)));
+    return ret;
+}
+
+Value dumptxoutset(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "dumptxoutset \"filename\"\n"
+            "\nWrites the unspent transaction output set at the current tip to a snapshot file,\n"
+            "which a new node can start from with -loadsnapshot.\n"
+            "Note this call may take some time.\n"
+            "\nArguments:\n"
+            "1. \"filename\"    (string, required) The filename, relative to the data directory if not absolute\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"height\":n,                (numeric) The height of the snapshot block\n"
+            "  \"bestblock\": \"hex\",        (string) The snapshot block hash hex\n"
+            "  \"transactions\": n,         (numeric) The number of transactions\n"
+            "  \"hash_serialized\": \"hash\", (string) The serialized hash, as in gettxoutsetinfo true\n"
+            "  \"path\": \"path\"             (string) The file written\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("dumptxoutset", "\"utxo.dat\"")
+            + HelpExampleRpc("dumptxoutset", "\"utxo.dat\"")
+        );
+
+    boost::filesystem::path path(params[0].get_str());
+    if (!path.is_complete())
+        path = GetDataDir() / path;
+    if (boost::filesystem::exists(path))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "File " + path.string() + " already exists");
+
+    CUTXOSnapshotHeader header;
+    std::string strError;
+    if (!DumpUTXOSnapshot(path, header, strError))
+        throw JSONRPCError(RPC_MISC_ERROR, strError);
+
+    Object ret;
+    ret.push_back(Pair("height", header.nHeight));
+    ret.push_back(Pair("bestblock", header.hashBlock.GetHex()));
+    ret.push_back(Pair("transactions", (int64_t)header.nTransactions));
+    ret.push_back(Pair("hash_serialized", header.hashSerialized.GetHex()));
+    ret.push_back(Pair("path", path.string()));
     return ret;
 }
 
@@ -443,6 +612,7 @@ Value gettxout(const Array& params, bool fHelp)
     if (params.size() > 2)
         fMempool = params[2].get_bool();
 
+    LOCK(cs_main);
     CCoins coins;
     if (fMempool) {
         LOCK(mempool.cs);
@@ -497,7 +667,9 @@ Value verifychain(const Array& params, bool fHelp)
     if (params.size() > 1)
         nCheckDepth = params[1].get_int();
 
-    return VerifyDB(nCheckLevel, nCheckDepth);
+    // A check cut short by a new best block verified nothing
+    bool fComplete;
+    return VerifyDB(nCheckLevel, nCheckDepth, &fComplete) && fComplete;
 }
 
 Value getblockchaininfo(const Array& params, bool fHelp)
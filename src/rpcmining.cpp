@@ -252,6 +252,7 @@ Value getmininginfo(const Array& params, bool fHelp)
             "  \"hashespersec\": n          (numeric) The hashes per second of the generation, or 0 if no generation.\n"
             "  \"pooledtx\": n              (numeric) The size of the mem pool\n"
             "  \"testnet\": true|false      (boolean) If using testnet or not\n"
+            "  \"threadhashespersec\": [n,...] (array) The hashes per second of each generation thread\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getmininginfo", "")
@@ -271,6 +272,10 @@ Value getmininginfo(const Array& params, bool fHelp)
 #ifdef ENABLE_WALLET
     obj.push_back(Pair("generate",         getgenerate(params, false)));
     obj.push_back(Pair("hashespersec",     gethashespersec(params, false)));
+    Array threadHashes;
+    BOOST_FOREACH(double dThreadHashesPerSec, GetThreadHashesPerSec())
+        threadHashes.push_back((int64_t)dThreadHashesPerSec);
+    obj.push_back(Pair("threadhashespersec", threadHashes));
 #endif
     return obj;
 }
@@ -415,6 +420,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "1. \"jsonrequestobject\"       (string, optional) A json object in the following spec\n"
             "     {\n"
             "       \"mode\":\"template\"    (string, optional) This must be set to \"template\" or omitted\n"
+            "       \"longpollid\":\"id\"     (string, optional) wait until the template identified by this id is out of date\n"
             "       \"capabilities\":[       (array, optional) A list of strings\n"
             "           \"support\"           (string) client side supported feature, 'longpoll', 'coinbasetxn', 'coinbasevalue', 'proposal', 'serverlist', 'workid'\n"
             "           ,...\n"
@@ -444,6 +450,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "      \"flags\" : \"flags\"            (string) \n"
             "  },\n"
             "  \"coinbasevalue\" : n,               (numeric) maximum allowable input to coinbase transaction, including the generation award and transaction fees (in Satoshis)\n"
+            "  \"longpollid\" : \"xxxx\",           (string) id to pass back in a longpoll request for the next template\n"
             "  \"coinbasetxn\" : { ... },           (json object) information for coinbase transaction\n"
             "  \"target\" : \"xxxx\",               (string) The hash target\n"
             "  \"mintime\" : xxx,                   (numeric) The minimum timestamp appropriate for next block time in seconds since epoch (Jan 1 1970 GMT)\n"
@@ -473,6 +480,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
          );
 
     std::string strMode = "template";
+    Value lpval = Value::null;
     if (params.size() > 0)
     {
         const Object& oparam = params[0].get_obj();
@@ -485,6 +493,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
         }
         else
             throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid mode");
+        lpval = find_value(oparam, "longpollid");
     }
 
     if (strMode != "template")
@@ -496,19 +505,57 @@ Value getblocktemplate(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "PatriotBit is downloading blocks...");
 
-    // Update block
-    static unsigned int nTransactionsUpdatedLast;
+    bool fLongPollFees = false;
+    if (lpval.type() != null_type)
+    {
+        // Wait to respond until either the best block changes, or another
+        // nLongPollFeeDelta in fees has entered the mempool since the template
+        // identified by longpollid was made
+        if (lpval.type() != str_type || lpval.get_str().size() < 64)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid longpollid");
+        std::string lpstr = lpval.get_str();
+        uint256 hashWatchedChain(lpstr.substr(0, 64));
+        int64_t nFeesWatched = atoi64(lpstr.substr(64));
+
+        // Both conditions are updated before cvBlockChange is notified under
+        // csBestBlock, so testing them with it held cannot miss a wakeup
+        boost::unique_lock<boost::mutex> lock(csBestBlock);
+        while (!ShutdownRequested() && hashBestBlock == hashWatchedChain &&
+               mempool.GetTotalFeesAdded() < nFeesWatched + nLongPollFeeDelta)
+        {
+            // Re-check at least once a minute, in case a notification was missed
+            cvBlockChange.timed_wait(lock, boost::posix_time::minutes(1));
+        }
+        fLongPollFees = (hashBestBlock == hashWatchedChain);
+        lock.unlock();
+        if (ShutdownRequested())
+            throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Shutting down");
+    }
+
+    LOCK(cs_main);
+
+    // The template is shared by all callers and only rebuilt when the tip moves,
+    // when enough fees have come in to be worth it, or once it is a minute old and
+    // the mempool has changed. The transaction list is serialized once per template.
+    // A longpoll woken by fees always gets a rebuilt template, or it would be handed
+    // its own longpollid back and return at once until the 5s limit had passed.
     static CBlockIndex* pindexPrev;
+    static unsigned int nTransactionsUpdatedLast;
+    static int64_t nFeesAddedLast;
     static int64_t nStart;
     static CBlockTemplate* pblocktemplate;
+    static Array transactions;
+    int64_t nFeesAdded = mempool.GetTotalFeesAdded();
     if (pindexPrev != chainActive.Tip() ||
-        (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5))
+        (nFeesAdded >= nFeesAddedLast + nLongPollFeeDelta && (fLongPollFees || GetTime() - nStart > 5)) ||
+        (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 60))
     {
         // Clear pindexPrev so future calls make a new block, despite any failures from here on
         pindexPrev = NULL;
 
         // Store the chainActive.Tip() used before CreateNewBlock, to avoid races
         nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+        nFeesAddedLast = nFeesAdded;
         CBlockIndex* pindexPrevNew = chainActive.Tip();
         nStart = GetTime();
 
@@ -523,48 +570,48 @@ Value getblocktemplate(const Array& params, bool fHelp)
         if (!pblocktemplate)
             throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
 
-        // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
-    }
-    CBlock* pblock = &pblocktemplate->block; // pointer for convenience
+        transactions.clear();
+        map<uint256, int64_t> setTxIndex;
+        int i = 0;
+        BOOST_FOREACH (CTransaction& tx, pblocktemplate->block.vtx)
+        {
+            uint256 txHash = tx.GetHash();
+            setTxIndex[txHash] = i++;
 
-    // Update nTime
-    UpdateTime(*pblock, pindexPrev);
-    pblock->nNonce = 0;
+            if (tx.IsCoinBase())
+                continue;
 
-    Array transactions;
-    map<uint256, int64_t> setTxIndex;
-    int i = 0;
-    BOOST_FOREACH (CTransaction& tx, pblock->vtx)
-    {
-        uint256 txHash = tx.GetHash();
-        setTxIndex[txHash] = i++;
+            Object entry;
 
-        if (tx.IsCoinBase())
-            continue;
+            CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+            ssTx << tx;
+            entry.push_back(Pair("data", HexStr(ssTx.begin(), ssTx.end())));
 
-        Object entry;
+            entry.push_back(Pair("hash", txHash.GetHex()));
 
-        CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
-        ssTx << tx;
-        entry.push_back(Pair("data", HexStr(ssTx.begin(), ssTx.end())));
+            Array deps;
+            BOOST_FOREACH (const CTxIn &in, tx.vin)
+            {
+                if (setTxIndex.count(in.prevout.hash))
+                    deps.push_back(setTxIndex[in.prevout.hash]);
+            }
+            entry.push_back(Pair("depends", deps));
 
-        entry.push_back(Pair("hash", txHash.GetHex()));
+            int index_in_template = i - 1;
+            entry.push_back(Pair("fee", pblocktemplate->vTxFees[index_in_template]));
+            entry.push_back(Pair("sigops", pblocktemplate->vTxSigOps[index_in_template]));
 
-        Array deps;
-        BOOST_FOREACH (const CTxIn &in, tx.vin)
-        {
-            if (setTxIndex.count(in.prevout.hash))
-                deps.push_back(setTxIndex[in.prevout.hash]);
+            transactions.push_back(entry);
         }
-        entry.push_back(Pair("depends", deps));
-
-        int index_in_template = i - 1;
-        entry.push_back(Pair("fee", pblocktemplate->vTxFees[index_in_template]));
-        entry.push_back(Pair("sigops", pblocktemplate->vTxSigOps[index_in_template]));
 
-        transactions.push_back(entry);
+        // Need to update only after we know CreateNewBlock succeeded
+        pindexPrev = pindexPrevNew;
     }
+    CBlock* pblock = &pblocktemplate->block; // pointer for convenience
+
+    // Update nTime
+    UpdateTime(*pblock, pindexPrev);
+    pblock->nNonce = 0;
 
     Object aux;
     aux.push_back(Pair("flags", HexStr(COINBASE_FLAGS.begin(), COINBASE_FLAGS.end())));
@@ -587,6 +634,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
     result.push_back(Pair("transactions", transactions));
     result.push_back(Pair("coinbaseaux", aux));
     result.push_back(Pair("coinbasevalue", (int64_t)pblock->vtx[0].GetValueOut()));
+    result.push_back(Pair("longpollid", pindexPrev->GetBlockHash().GetHex() + i64tostr(nFeesAddedLast)));
     result.push_back(Pair("target", hashTarget.GetHex()));
     result.push_back(Pair("mintime", (int64_t)pindexPrev->GetMedianTimePast()+1));
     result.push_back(Pair("mutable", aMutable));
@@ -139,6 +139,7 @@ public:
 Value spork(const Array& params, bool fHelp)
 {
     if(params.size() == 1 && params[0].get_str() == "show"){
+        LOCK(cs_spork);
         std::map<int, CSporkMessage>::iterator it = mapSporksActive.begin();
 
         Object ret;
@@ -206,14 +207,19 @@ Value validateaddress(const Array& params, bool fHelp)
         string currentAddress = address.ToString();
         ret.push_back(Pair("address", currentAddress));
 #ifdef ENABLE_WALLET
-        bool fMine = pwalletMain ? IsMine(*pwalletMain, dest) : false;
-        ret.push_back(Pair("ismine", fMine));
-        if (fMine) {
-            Object detail = boost::apply_visitor(DescribeAddressVisitor(), dest);
-            ret.insert(ret.end(), detail.begin(), detail.end());
-        }
-        if (pwalletMain && pwalletMain->mapAddressBook.count(dest))
-            ret.push_back(Pair("account", pwalletMain->mapAddressBook[dest].name));
+        if (pwalletMain) {
+            // validateaddress runs without cs_wallet held by the dispatcher
+            LOCK(pwalletMain->cs_wallet);
+            bool fMine = IsMine(*pwalletMain, dest);
+            ret.push_back(Pair("ismine", fMine));
+            if (fMine) {
+                Object detail = boost::apply_visitor(DescribeAddressVisitor(), dest);
+                ret.insert(ret.end(), detail.begin(), detail.end());
+            }
+            if (pwalletMain->mapAddressBook.count(dest))
+                ret.push_back(Pair("account", pwalletMain->mapAddressBook[dest].name));
+        } else
+            ret.push_back(Pair("ismine", false));
 #endif
     }
     return ret;
@@ -55,7 +55,38 @@ static string rfc1123Time()
     return DateTimeStrFormat("%a, %d %b %Y %H:%M:%S +0000", GetTime());
 }
 
-string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
+static const char *HTTPStatusText(int nStatus)
+{
+    if (nStatus == HTTP_OK) return "OK";
+    if (nStatus == HTTP_BAD_REQUEST) return "Bad Request";
+    if (nStatus == HTTP_FORBIDDEN) return "Forbidden";
+    if (nStatus == HTTP_NOT_FOUND) return "Not Found";
+    if (nStatus == HTTP_INTERNAL_SERVER_ERROR) return "Internal Server Error";
+    if (nStatus == HTTP_SERVICE_UNAVAILABLE) return "Service Unavailable";
+    return "";
+}
+
+// The body (nContentLength bytes) is sent separately
+string HTTPReplyHeader(int nStatus, bool keepalive, size_t nContentLength, const char *contentType)
+{
+    return strprintf(
+            "HTTP/1.1 %d %s\r\n"
+            "Date: %s\r\n"
+            "Connection: %s\r\n"
+            "Content-Length: %u\r\n"
+            "Content-Type: %s\r\n"
+            "Server: patriotbit-json-rpc/%s\r\n"
+            "\r\n",
+        nStatus,
+        HTTPStatusText(nStatus),
+        rfc1123Time(),
+        keepalive ? "keep-alive" : "close",
+        nContentLength,
+        contentType,
+        FormatFullVersion());
+}
+
+string HTTPReply(int nStatus, const string& strMsg, bool keepalive, const char *contentType)
 {
     if (nStatus == HTTP_UNAUTHORIZED)
         return strprintf("HTTP/1.0 401 Authorization Required\r\n"
@@ -74,29 +105,32 @@ string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
             "</HEAD>\r\n"
             "<BODY><H1>401 Unauthorized.</H1></BODY>\r\n"
             "</HTML>\r\n", rfc1123Time(), FormatFullVersion());
-    const char *cStatus;
-         if (nStatus == HTTP_OK) cStatus = "OK";
-    else if (nStatus == HTTP_BAD_REQUEST) cStatus = "Bad Request";
-    else if (nStatus == HTTP_FORBIDDEN) cStatus = "Forbidden";
-    else if (nStatus == HTTP_NOT_FOUND) cStatus = "Not Found";
-    else if (nStatus == HTTP_INTERNAL_SERVER_ERROR) cStatus = "Internal Server Error";
-    else cStatus = "";
+    return HTTPReplyHeader(nStatus, keepalive, strMsg.size(), contentType) + strMsg;
+}
+
+string HTTPReplyChunkedHeader(int nStatus, bool keepalive)
+{
     return strprintf(
             "HTTP/1.1 %d %s\r\n"
             "Date: %s\r\n"
             "Connection: %s\r\n"
-            "Content-Length: %u\r\n"
+            "Transfer-Encoding: chunked\r\n"
             "Content-Type: application/json\r\n"
             "Server: patriotbit-json-rpc/%s\r\n"
-            "\r\n"
-            "%s",
+            "\r\n",
         nStatus,
-        cStatus,
+        HTTPStatusText(nStatus),
         rfc1123Time(),
         keepalive ? "keep-alive" : "close",
-        strMsg.size(),
-        FormatFullVersion(),
-        strMsg);
+        FormatFullVersion());
+}
+
+// An empty chunk ends the message
+string HTTPChunk(const string& strData)
+{
+    if (strData.empty())
+        return "0\r\n\r\n";
+    return strprintf("%x\r\n", strData.size()) + strData + "\r\n";
 }
 
 bool ReadHTTPRequestLine(std::basic_istream<char>& stream, int &proto,
@@ -189,7 +223,30 @@ int ReadHTTPMessage(std::basic_istream<char>& stream, map<string,
         return HTTP_INTERNAL_SERVER_ERROR;
 
     // Read message
-    if (nLen > 0)
+    if (mapHeadersRet["transfer-encoding"] == "chunked")
+    {
+        while (true)
+        {
+            string str;
+            std::getline(stream, str);
+            if (!stream)
+                return HTTP_INTERNAL_SERVER_ERROR;
+            unsigned int nChunk = strtoul(str.c_str(), NULL, 16);
+            if (nChunk == 0)
+                break;
+            if (strMessageRet.size() + nChunk > MAX_SIZE)
+                return HTTP_INTERNAL_SERVER_ERROR;
+            size_t nOld = strMessageRet.size();
+            strMessageRet.resize(nOld + nChunk);
+            stream.read(&strMessageRet[nOld], nChunk);
+            std::getline(stream, str); // CRLF after the chunk data
+        }
+        // Skip the (normally empty) trailer
+        string str;
+        while (std::getline(stream, str) && !str.empty() && str != "\r")
+            ;
+    }
+    else if (nLen > 0)
     {
         vector<char> vch(nLen);
         stream.read(&vch[0], nLen);
@@ -253,3 +310,111 @@ Object JSONRPCError(int code, const string& message)
     error.push_back(Pair("message", message));
     return error;
 }
+
+CJSONStreamWriter::CJSONStreamWriter(const SinkFunc& sinkIn, size_t nChunkSizeIn) :
+    sink(sinkIn), nChunkSize(nChunkSizeIn), fAfterKey(false), fFlushed(false)
+{
+    strBuffer.reserve(nChunkSize);
+}
+
+void CJSONStreamWriter::BeginElement()
+{
+    if (fAfterKey)
+    {
+        fAfterKey = false;
+        return;
+    }
+    if (!vHasElement.empty())
+    {
+        if (vHasElement.back())
+            strBuffer += ',';
+        vHasElement.back() = true;
+    }
+}
+
+void CJSONStreamWriter::EndElement()
+{
+    if (strBuffer.size() >= nChunkSize && !Flush())
+        throw runtime_error("JSON stream closed");
+}
+
+void CJSONStreamWriter::BeginObject()
+{
+    BeginElement();
+    strBuffer += '{';
+    vHasElement.push_back(false);
+}
+
+void CJSONStreamWriter::EndObject()
+{
+    assert(!vHasElement.empty() && !fAfterKey);
+    vHasElement.pop_back();
+    strBuffer += '}';
+    EndElement();
+}
+
+void CJSONStreamWriter::BeginArray()
+{
+    BeginElement();
+    strBuffer += '[';
+    vHasElement.push_back(false);
+}
+
+void CJSONStreamWriter::EndArray()
+{
+    assert(!vHasElement.empty() && !fAfterKey);
+    vHasElement.pop_back();
+    strBuffer += ']';
+    EndElement();
+}
+
+void CJSONStreamWriter::WriteKey(const string& strKey)
+{
+    BeginElement();
+    strBuffer += write_string(Value(strKey), false);
+    strBuffer += ':';
+    fAfterKey = true;
+}
+
+void CJSONStreamWriter::WriteValue(const Value& value)
+{
+    if (value.type() == obj_type)
+    {
+        BeginObject();
+        BOOST_FOREACH(const Pair& pair, value.get_obj())
+        {
+            WriteKey(pair.name_);
+            WriteValue(pair.value_);
+        }
+        EndObject();
+    }
+    else if (value.type() == array_type)
+    {
+        BeginArray();
+        BOOST_FOREACH(const Value& element, value.get_array())
+            WriteValue(element);
+        EndArray();
+    }
+    else
+    {
+        BeginElement();
+        strBuffer += write_string(value, false);
+        EndElement();
+    }
+}
+
+void CJSONStreamWriter::NewLine()
+{
+    strBuffer += '\n';
+}
+
+bool CJSONStreamWriter::Flush()
+{
+    if (strBuffer.empty())
+        return true;
+    fFlushed = true;
+    if (!sink(strBuffer))
+        return false;
+    strBuffer.clear();
+    return true;
+}
@@ -14,6 +14,7 @@
 #include <boost/iostreams/stream.hpp>
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
+#include <boost/function.hpp>
 
 #include "json/json_spirit_reader_template.h"
 #include "json/json_spirit_utils.h"
@@ -28,8 +29,12 @@ enum HTTPStatusCode
     HTTP_FORBIDDEN             = 403,
     HTTP_NOT_FOUND             = 404,
     HTTP_INTERNAL_SERVER_ERROR = 500,
+    HTTP_SERVICE_UNAVAILABLE   = 503,
 };
 
+/** Size of the pieces a streamed JSON-RPC reply is rendered and sent in */
+static const unsigned int JSON_STREAM_CHUNK_SIZE = 64 * 1024;
+
 // PatriotBit RPC error codes
 enum RPCErrorCode
 {
@@ -125,7 +130,12 @@ private:
 };
 
 std::string HTTPPost(const std::string& strMsg, const std::map<std::string,std::string>& mapRequestHeaders);
-std::string HTTPReply(int nStatus, const std::string& strMsg, bool keepalive);
+std::string HTTPReplyHeader(int nStatus, bool keepalive, size_t nContentLength,
+                            const char *contentType = "application/json");
+std::string HTTPReply(int nStatus, const std::string& strMsg, bool keepalive,
+                      const char *contentType = "application/json");
+std::string HTTPReplyChunkedHeader(int nStatus, bool keepalive);
+std::string HTTPChunk(const std::string& strData);
 bool ReadHTTPRequestLine(std::basic_istream<char>& stream, int &proto,
                          std::string& http_method, std::string& http_uri);
 int ReadHTTPStatus(std::basic_istream<char>& stream, int &proto);
@@ -137,4 +147,46 @@ json_spirit::Object JSONRPCReplyObj(const json_spirit::Value& result, const json
 std::string JSONRPCReply(const json_spirit::Value& result, const json_spirit::Value& error, const json_spirit::Value& id);
 json_spirit::Object JSONRPCError(int code, const std::string& message);
 
+/**
+ * Renders JSON text piece by piece and hands it to a sink every
+ * JSON_STREAM_CHUNK_SIZE bytes, so a large reply never exists as one string.
+ * The text is the same write_string(value, false) would produce.
+ */
+class CJSONStreamWriter
+{
+public:
+    // Returns false when the text can not be delivered any more
+    typedef boost::function<bool(const std::string&)> SinkFunc;
+
+    CJSONStreamWriter(const SinkFunc& sinkIn, size_t nChunkSizeIn = JSON_STREAM_CHUNK_SIZE);
+
+    void BeginObject();
+    void EndObject();
+    void BeginArray();
+    void EndArray();
+    // Name of the next member of the current object
+    void WriteKey(const std::string& strKey);
+    // Arrays and objects are written one element at a time
+    void WriteValue(const json_spirit::Value& value);
+    void NewLine();
+
+    // Hand everything buffered to the sink
+    bool Flush();
+    bool HasFlushed() const { return fFlushed; }
+    // Text that has not been handed to the sink yet
+    const std::string& GetBuffer() const { return strBuffer; }
+
+private:
+    SinkFunc sink;
+    size_t nChunkSize;
+    std::string strBuffer;
+    // One entry per open array or object, true once it has an element
+    std::vector<bool> vHasElement;
+    bool fAfterKey;
+    bool fFlushed;
+
+    void BeginElement();
+    void EndElement();
+};
+
 #endif
@@ -19,11 +19,14 @@
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
 #include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/foreach.hpp>
+#include <boost/function.hpp>
 #include <boost/iostreams/concepts.hpp>
 #include <boost/iostreams/stream.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
 #include "json/json_spirit_writer_template.h"
 
 using namespace std;
@@ -241,34 +244,36 @@ static const CRPCCommand vRPCCommands[] =
 
     /* Block chain and UTXO */
     { "getblockchaininfo",      &getblockchaininfo,      true,      false,      false },
-    { "getbestblockhash",       &getbestblockhash,       true,      false,      false },
-    { "getblockcount",          &getblockcount,          true,      false,      false },
-    { "getblock",               &getblock,               false,     false,      false },
-    { "getblockheader",         &getblockheader,         false,     false,      false },
-    { "getblockhash",           &getblockhash,           false,     false,      false },
+    { "getbestblockhash",       &getbestblockhash,       true,      true,       false },
+    { "getblockcount",          &getblockcount,          true,      true,       false },
+    { "getblock",               &getblock,               false,     true,       false },
+    { "getblockheader",         &getblockheader,         false,     true,       false },
+    { "getblockfilter",         &getblockfilter,         true,      true,       false },
+    { "getblockhash",           &getblockhash,           false,     true,       false },
     { "getdifficulty",          &getdifficulty,          true,      false,      false },
     { "getrawmempool",          &getrawmempool,          true,      false,      false },
-    { "gettxout",               &gettxout,               true,      false,      false },
+    { "gettxout",               &gettxout,               true,      true,       false },
     { "gettxoutsetinfo",        &gettxoutsetinfo,        true,      false,      false },
+    { "dumptxoutset",           &dumptxoutset,           true,      true,       false },
     { "verifychain",            &verifychain,            true,      false,      false },
 
     /* Mining */
-    { "getblocktemplate",       &getblocktemplate,       true,      false,      false },
+    { "getblocktemplate",       &getblocktemplate,       true,      true,       false },
     { "getmininginfo",          &getmininginfo,          true,      false,      false },
     { "getnetworkhashps",       &getnetworkhashps,       true,      false,      false },
     { "submitblock",            &submitblock,            false,     false,      false },
 
     /* Raw transactions */
     { "createrawtransaction",   &createrawtransaction,   false,     false,      false },
-    { "decoderawtransaction",   &decoderawtransaction,   false,     false,      false },
-    { "decodescript",           &decodescript,           false,     false,      false },
-    { "getrawtransaction",      &getrawtransaction,      false,     false,      false },
+    { "decoderawtransaction",   &decoderawtransaction,   false,     true,       false },
+    { "decodescript",           &decodescript,           false,     true,       false },
+    { "getrawtransaction",      &getrawtransaction,      false,     true,       false },
     { "sendrawtransaction",     &sendrawtransaction,     false,     false,      false },
     { "signrawtransaction",     &signrawtransaction,     false,     false,      false }, /* uses wallet if enabled */
  
     /* Utility functions */
     { "createmultisig",         &createmultisig,         true,      true ,      false },
-    { "validateaddress",        &validateaddress,        true,      false,      false }, /* uses wallet if enabled */
+    { "validateaddress",        &validateaddress,        true,      true,       false }, /* uses wallet if enabled */
     { "verifymessage",          &verifymessage,          false,     false,      false },
 
     /* PatriotBit features */
@@ -327,6 +332,16 @@ static const CRPCCommand vRPCCommands[] =
 #endif // ENABLE_WALLET
 };
 
+static const CRPCStreamCommand vRPCStreamCommands[] =
+{ //  name                      stream actor (NULL: stream the result Value)
+  //  ------------------------  --------------------------------------------
+    { "getblock",               NULL                     },
+    { "getrawmempool",          &getrawmempoolstream     },
+    { "listunspent",            NULL                     },
+    { "listtransactions",       NULL                     },
+    { "masternodelist",         NULL                     },
+};
+
 CRPCTable::CRPCTable()
 {
     unsigned int vcidx;
@@ -337,6 +352,8 @@ CRPCTable::CRPCTable()
         pcmd = &vRPCCommands[vcidx];
         mapCommands[pcmd->name] = pcmd;
     }
+    for (vcidx = 0; vcidx < (sizeof(vRPCStreamCommands) / sizeof(vRPCStreamCommands[0])); vcidx++)
+        mapStreamCommands[vRPCStreamCommands[vcidx].name] = &vRPCStreamCommands[vcidx];
 }
 
 const CRPCCommand *CRPCTable::operator[](string name) const
@@ -358,15 +375,15 @@ bool HTTPAuthorized(map<string, string>& mapHeaders)
     return TimingResistantEqual(strUserPass, strRPCUserColonPass);
 }
 
-void ErrorReply(std::ostream& stream, const Object& objError, const Value& id)
+string ErrorReply(const Object& objError, const Value& id)
 {
-    // Send error reply from json-rpc error object
+    // Build error reply from json-rpc error object
     int nStatus = HTTP_INTERNAL_SERVER_ERROR;
     int code = find_value(objError, "code").get_int();
     if (code == RPC_INVALID_REQUEST) nStatus = HTTP_BAD_REQUEST;
     else if (code == RPC_METHOD_NOT_FOUND) nStatus = HTTP_NOT_FOUND;
     string strReply = JSONRPCReply(Value::null, objError, id);
-    stream << HTTPReply(nStatus, strReply, false) << std::flush;
+    return HTTPReply(nStatus, strReply, false);
 }
 
 bool ClientAllowed(const boost::asio::ip::address& address)
@@ -392,78 +409,381 @@ bool ClientAllowed(const boost::asio::ip::address& address)
     return false;
 }
 
-class AcceptedConnection
+static string JSONRPCExecHTTP(const string& strRequest, bool& fKeepAlive, const CJSONStreamWriter::SinkFunc& sendChunk);
+
+namespace {
+
+/**
+ * Requests waiting for an RPC worker thread. The queue is bounded so that a
+ * flood of callers gets quick 503 replies instead of an ever growing backlog.
+ */
+class CRPCWorkQueue
 {
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque< boost::function<void()> > queue;
+    size_t nMaxDepth;
+    bool fRunning;
+
 public:
-    virtual ~AcceptedConnection() {}
+    CRPCWorkQueue(size_t nMaxDepthIn) : nMaxDepth(nMaxDepthIn), fRunning(true) {}
+
+    bool Enqueue(const boost::function<void()>& func)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (!fRunning || queue.size() >= nMaxDepth)
+            return false;
+        queue.push_back(func);
+        cond.notify_one();
+        return true;
+    }
+
+    // Worker thread body, returns after Interrupt()
+    void Run()
+    {
+        RenameThread("patriotbit-rpcworker");
+        while (true)
+        {
+            boost::function<void()> func;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (fRunning && queue.empty())
+                    cond.wait(lock);
+                if (!fRunning)
+                    return;
+                func = queue.front();
+                queue.pop_front();
+            }
+            func();
+        }
+    }
 
-    virtual std::iostream& stream() = 0;
-    virtual std::string peer_address_to_string() const = 0;
-    virtual void close() = 0;
+    void Interrupt()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fRunning = false;
+        queue.clear();
+        cond.notify_all();
+    }
 };
 
-template <typename Protocol>
-class AcceptedConnectionImpl : public AcceptedConnection
+} // anon namespace
+
+// Created by StartRPCThreads, destroyed in StopRPCThreads
+static CRPCWorkQueue* rpc_work_queue = NULL;
+// Helpers for the parallel calls of a batch get threads of their own, so they
+// neither use up -rpcworkqueue slots nor wait behind other requests
+static CRPCWorkQueue* rpc_batch_queue = NULL;
+static unsigned int nRPCWorkerThreads = 0;
+static bool fRESTEnabled = false;
+
+/**
+ * An RPC client connection. Requests are read and replies written
+ * asynchronously on the RPC I/O thread, so an idle keep-alive client does not
+ * hold on to a thread; only the call itself runs on a worker thread.
+ */
+class CRPCConnection : public boost::enable_shared_from_this<CRPCConnection>
 {
 public:
-    AcceptedConnectionImpl(
-            asio::io_service& io_service,
-            ssl::context &context,
-            bool fUseSSL) :
+    ip::tcp::endpoint peer;
+    asio::ssl::stream<ip::tcp::socket> sslStream;
+
+    CRPCConnection(asio::io_service& io_service, ssl::context& context, bool fUseSSLIn) :
         sslStream(io_service, context),
-        _d(sslStream, fUseSSL),
-        _stream(_d)
+        timer(io_service),
+        buf(MAX_HTTP_HEADERS_SIZE),
+        fUseSSL(fUseSSLIn),
+        fChunkedOK(false),
+        nChunkBytes(0),
+        fWritingChunks(false),
+        fChunkError(false)
     {
     }
 
-    virtual std::iostream& stream()
+    void Start()
     {
-        return _stream;
+        if (fUseSSL)
+            sslStream.async_handshake(ssl::stream_base::server,
+                boost::bind(&CRPCConnection::HandleHandshake, shared_from_this(), asio::placeholders::error));
+        else
+            ReadRequest();
     }
 
-    virtual std::string peer_address_to_string() const
+    // Send strReply, then read the next request or close the connection
+    void Write(const string& strReply, bool fKeepAlive)
     {
-        return peer.address().to_string();
+        strWrite = strReply;
+        if (fUseSSL)
+            asio::async_write(sslStream, asio::buffer(strWrite),
+                boost::bind(&CRPCConnection::HandleWrite, shared_from_this(), asio::placeholders::error, fKeepAlive));
+        else
+            asio::async_write(sslStream.next_layer(), asio::buffer(strWrite),
+                boost::bind(&CRPCConnection::HandleWrite, shared_from_this(), asio::placeholders::error, fKeepAlive));
     }
 
-    virtual void close()
+    void Close()
     {
-        _stream.close();
+        boost::system::error_code ec;
+        sslStream.lowest_layer().close(ec);
     }
 
-    typename Protocol::endpoint peer;
-    asio::ssl::stream<typename Protocol::socket> sslStream;
-
 private:
-    SSLIOStreamDevice<Protocol> _d;
-    iostreams::stream< SSLIOStreamDevice<Protocol> > _stream;
-};
+    deadline_timer timer;
+    asio::streambuf buf;
+    bool fUseSSL;
+    bool fChunkedOK;
+    string strURI;
+    map<string, string> mapHeaders;
+    string strBody;
+    string strWrite;
+
+    // Chunks of a streamed reply on their way from the worker to the socket
+    boost::mutex csChunks;
+    boost::condition_variable condChunks;
+    std::deque<string> queueChunks;
+    size_t nChunkBytes;
+    bool fWritingChunks;
+    bool fChunkError;
+
+    void HandleHandshake(const boost::system::error_code& error)
+    {
+        if (error)
+            Close();
+        else
+            ReadRequest();
+    }
+
+    void ReadRequest()
+    {
+        if (fUseSSL)
+            asio::async_read_until(sslStream, buf, "\r\n\r\n",
+                boost::bind(&CRPCConnection::HandleHeaders, shared_from_this(), asio::placeholders::error));
+        else
+            asio::async_read_until(sslStream.next_layer(), buf, "\r\n\r\n",
+                boost::bind(&CRPCConnection::HandleHeaders, shared_from_this(), asio::placeholders::error));
+    }
+
+    void HandleHeaders(const boost::system::error_code& error)
+    {
+        // Also fails when the headers do not fit in MAX_HTTP_HEADERS_SIZE
+        if (error)
+        {
+            Close();
+            return;
+        }
+
+        std::istream stream(&buf);
+        int nProto = 0;
+        string strMethod;
+        if (!ReadHTTPRequestLine(stream, nProto, strMethod, strURI))
+        {
+            Close();
+            return;
+        }
+        mapHeaders.clear();
+        fChunkedOK = (nProto >= 1);
+        int nLen = ReadHTTPHeaders(stream, mapHeaders);
+        if (nLen < 0 || nLen > (int)MAX_SIZE)
+        {
+            Write(HTTPReply(HTTP_BAD_REQUEST, "", false), false);
+            return;
+        }
+        string sConHdr = mapHeaders["connection"];
+        if ((sConHdr != "close") && (sConHdr != "keep-alive"))
+            mapHeaders["connection"] = (nProto >= 1) ? "keep-alive" : "close";
+
+        // Part of the body may already have been read along with the headers
+        strBody.resize(nLen);
+        size_t nHave = std::min(buf.size(), (size_t)nLen);
+        if (nHave > 0)
+            stream.read(&strBody[0], nHave);
+        if (nHave == (size_t)nLen)
+        {
+            HandleRequest(boost::system::error_code());
+            return;
+        }
+        if (fUseSSL)
+            asio::async_read(sslStream, asio::buffer(&strBody[nHave], nLen - nHave),
+                boost::bind(&CRPCConnection::HandleRequest, shared_from_this(), asio::placeholders::error));
+        else
+            asio::async_read(sslStream.next_layer(), asio::buffer(&strBody[nHave], nLen - nHave),
+                boost::bind(&CRPCConnection::HandleRequest, shared_from_this(), asio::placeholders::error));
+    }
+
+    void HandleRequest(const boost::system::error_code& error)
+    {
+        if (error)
+        {
+            Close();
+            return;
+        }
+
+        // The REST interface is read-only and public, it needs no authorization
+        if (fRESTEnabled && boost::starts_with(strURI, "/rest/"))
+        {
+            bool fKeepAlive = (mapHeaders["connection"] != "close");
+            if (!rpc_work_queue->Enqueue(boost::bind(&CRPCConnection::ExecuteREST, shared_from_this(), strURI, fKeepAlive)))
+                Write(HTTPReply(HTTP_SERVICE_UNAVAILABLE, "Work queue depth exceeded", false), false);
+            return;
+        }
+
+        if (strURI != "/")
+        {
+            Write(HTTPReply(HTTP_NOT_FOUND, "", false), false);
+            return;
+        }
+
+        // Check authorization
+        if (mapHeaders.count("authorization") == 0)
+        {
+            Write(HTTPReply(HTTP_UNAUTHORIZED, "", false), false);
+            return;
+        }
+        if (!HTTPAuthorized(mapHeaders))
+        {
+            LogPrintf("ThreadRPCServer incorrect password attempt from %s\n", peer.address().to_string());
+            /* Deter brute-forcing short passwords.
+               If this results in a DoS the user really
+               shouldn't have their RPC port exposed. */
+            if (mapArgs["-rpcpassword"].size() < 20)
+            {
+                timer.expires_from_now(posix_time::milliseconds(250));
+                timer.async_wait(boost::bind(&CRPCConnection::Write, shared_from_this(), HTTPReply(HTTP_UNAUTHORIZED, "", false), false));
+            }
+            else
+                Write(HTTPReply(HTTP_UNAUTHORIZED, "", false), false);
+            return;
+        }
+
+        bool fKeepAlive = (mapHeaders["connection"] != "close");
+        if (!rpc_work_queue->Enqueue(boost::bind(&CRPCConnection::Execute, shared_from_this(), strBody, fKeepAlive)))
+        {
+            LogPrint("rpc", "ThreadRPCServer work queue full, rejecting request from %s\n", peer.address().to_string());
+            Write(HTTPReply(HTTP_SERVICE_UNAVAILABLE, "Work queue depth exceeded", false), false);
+        }
+    }
+
+    // Runs on a worker thread; the reply is handed back to the I/O thread
+    void Execute(const string& strRequest, bool fKeepAlive)
+    {
+        CJSONStreamWriter::SinkFunc sendChunk;
+        if (fChunkedOK)
+            sendChunk = boost::bind(&CRPCConnection::SendChunk, this, _1);
+        string strReply = JSONRPCExecHTTP(strRequest, fKeepAlive, sendChunk);
+        PostReply(strReply, fKeepAlive);
+    }
+
+    void ExecuteREST(const string& strRequestURI, bool fKeepAlive)
+    {
+        string strReply = HTTPReq_REST(strRequestURI, fKeepAlive, boost::bind(&CRPCConnection::SendChunk, this, _1));
+        PostReply(strReply, fKeepAlive);
+    }
+
+    void PostReply(const string& strReply, bool fKeepAlive)
+    {
+        // Whatever was streamed has to be on the wire before the next write starts
+        bool fError;
+        {
+            boost::unique_lock<boost::mutex> lock(csChunks);
+            while (fWritingChunks)
+                condChunks.wait(lock);
+            fError = fChunkError;
+        }
+        if (fError)
+            return;
+        sslStream.get_io_service().post(boost::bind(&CRPCConnection::Write, shared_from_this(), strReply, fKeepAlive));
+    }
 
-void ServiceConnection(AcceptedConnection *conn);
+    // Called from the worker while a reply is streamed. Waits while too much
+    // is queued already, so a slow client holds back the worker, not memory.
+    bool SendChunk(const string& strChunk)
+    {
+        boost::unique_lock<boost::mutex> lock(csChunks);
+        while (!fChunkError && nChunkBytes >= MAX_QUEUED_CHUNK_BYTES)
+            condChunks.wait(lock);
+        if (fChunkError)
+            return false;
+        queueChunks.push_back(strChunk);
+        nChunkBytes += strChunk.size();
+        if (!fWritingChunks)
+        {
+            fWritingChunks = true;
+            sslStream.get_io_service().post(boost::bind(&CRPCConnection::WriteChunk, shared_from_this()));
+        }
+        return true;
+    }
+
+    void WriteChunk()
+    {
+        boost::unique_lock<boost::mutex> lock(csChunks);
+        if (queueChunks.empty())
+        {
+            fWritingChunks = false;
+            condChunks.notify_all();
+            return;
+        }
+        // deque::push_back leaves references to the front element valid
+        const string& strChunk = queueChunks.front();
+        if (fUseSSL)
+            asio::async_write(sslStream, asio::buffer(strChunk),
+                boost::bind(&CRPCConnection::HandleChunkWrite, shared_from_this(), asio::placeholders::error));
+        else
+            asio::async_write(sslStream.next_layer(), asio::buffer(strChunk),
+                boost::bind(&CRPCConnection::HandleChunkWrite, shared_from_this(), asio::placeholders::error));
+    }
+
+    void HandleChunkWrite(const boost::system::error_code& error)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(csChunks);
+            nChunkBytes -= queueChunks.front().size();
+            queueChunks.pop_front();
+            if (error)
+            {
+                fChunkError = true;
+                fWritingChunks = false;
+                queueChunks.clear();
+                nChunkBytes = 0;
+            }
+            condChunks.notify_all();
+        }
+        if (error)
+            Close();
+        else
+            WriteChunk();
+    }
+
+    void HandleWrite(const boost::system::error_code& error, bool fKeepAlive)
+    {
+        if (error || !fKeepAlive || ShutdownRequested())
+            Close();
+        else
+            ReadRequest();
+    }
+};
 
 // Forward declaration required for RPCListen
-template <typename Protocol, typename SocketAcceptorService>
-static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
+static void RPCAcceptHandler(boost::shared_ptr<ip::tcp::acceptor> acceptor,
                              ssl::context& context,
                              bool fUseSSL,
-                             boost::shared_ptr< AcceptedConnection > conn,
+                             boost::shared_ptr<CRPCConnection> conn,
                              const boost::system::error_code& error);
 
 /**
  * Sets up I/O resources to accept and handle a new connection.
  */
-template <typename Protocol, typename SocketAcceptorService>
-static void RPCListen(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
+static void RPCListen(boost::shared_ptr<ip::tcp::acceptor> acceptor,
                    ssl::context& context,
                    const bool fUseSSL)
 {
     // Accept connection
-    boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn(new AcceptedConnectionImpl<Protocol>(acceptor->get_io_service(), context, fUseSSL));
+    boost::shared_ptr<CRPCConnection> conn(new CRPCConnection(acceptor->get_io_service(), context, fUseSSL));
 
     acceptor->async_accept(
             conn->sslStream.lowest_layer(),
             conn->peer,
-            boost::bind(&RPCAcceptHandler<Protocol, SocketAcceptorService>,
+            boost::bind(&RPCAcceptHandler,
                 acceptor,
                 boost::ref(context),
                 fUseSSL,
@@ -475,42 +795,39 @@ static void RPCListen(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketA
 /**
  * Accept and handle incoming connection.
  */
-template <typename Protocol, typename SocketAcceptorService>
-static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
+static void RPCAcceptHandler(boost::shared_ptr<ip::tcp::acceptor> acceptor,
                              ssl::context& context,
                              const bool fUseSSL,
-                             boost::shared_ptr< AcceptedConnection > conn,
+                             boost::shared_ptr<CRPCConnection> conn,
                              const boost::system::error_code& error)
 {
     // Immediately start accepting new connections, except when we're cancelled or our socket is closed.
     if (error != asio::error::operation_aborted && acceptor->is_open())
         RPCListen(acceptor, context, fUseSSL);
 
-    AcceptedConnectionImpl<ip::tcp>* tcp_conn = dynamic_cast< AcceptedConnectionImpl<ip::tcp>* >(conn.get());
-
     if (error)
     {
         // TODO: Actually handle errors
         LogPrintf("%s: Error: %s\n", __func__, error.message());
     }
     // Restrict callers by IP.  It is important to
-    // do this before starting client thread, to filter out
+    // do this before reading the request, to filter out
     // certain DoS and misbehaving clients.
-    else if (tcp_conn && !ClientAllowed(tcp_conn->peer.address()))
+    else if (!ClientAllowed(conn->peer.address()))
     {
         // Only send a 403 if we're not using SSL to prevent a DoS during the SSL handshake.
         if (!fUseSSL)
-            conn->stream() << HTTPReply(HTTP_FORBIDDEN, "", false) << std::flush;
-        conn->close();
-    }
-    else {
-        ServiceConnection(conn.get());
-        conn->close();
+            conn->Write(HTTPReply(HTTP_FORBIDDEN, "", false), false);
+        else
+            conn->Close();
     }
+    else
+        conn->Start();
 }
 
 void StartRPCThreads()
 {
+    fRESTEnabled = GetBoolArg("-rest", false);
     strRPCUserColonPass = mapArgs["-rpcuser"] + ":" + mapArgs["-rpcpassword"];
     if (((mapArgs["-rpcpassword"] == "") ||
          (mapArgs["-rpcuser"] == mapArgs["-rpcpassword"])) && Params().RequireRPCPassword())
@@ -624,9 +941,17 @@ void StartRPCThreads()
         return;
     }
 
+    // One thread does all the network I/O, the workers execute the calls
+    rpc_work_queue = new CRPCWorkQueue(std::max((int)GetArg("-rpcworkqueue", DEFAULT_RPC_WORK_QUEUE), 1));
     rpc_worker_group = new boost::thread_group();
-    for (int i = 0; i < GetArg("-rpcthreads", 4); i++)
-        rpc_worker_group->create_thread(boost::bind(&asio::io_service::run, rpc_io_service));
+    rpc_worker_group->create_thread(boost::bind(&asio::io_service::run, rpc_io_service));
+    nRPCWorkerThreads = std::max((int)GetArg("-rpcthreads", DEFAULT_RPC_THREADS), 1);
+    for (unsigned int i = 0; i < nRPCWorkerThreads; i++)
+        rpc_worker_group->create_thread(boost::bind(&CRPCWorkQueue::Run, rpc_work_queue));
+    // More helpers than threads to run them would only wait
+    rpc_batch_queue = new CRPCWorkQueue(nRPCWorkerThreads);
+    for (unsigned int i = 0; i < nRPCWorkerThreads; i++)
+        rpc_worker_group->create_thread(boost::bind(&CRPCWorkQueue::Run, rpc_batch_queue));
 }
 
 void StartDummyRPCThread()
@@ -665,9 +990,15 @@ void StopRPCThreads()
     }
     deadlineTimers.clear();
 
+    if (rpc_work_queue != NULL)
+        rpc_work_queue->Interrupt();
+    if (rpc_batch_queue != NULL)
+        rpc_batch_queue->Interrupt();
     rpc_io_service->stop();
     if (rpc_worker_group != NULL)
         rpc_worker_group->join_all();
+    delete rpc_work_queue; rpc_work_queue = NULL;
+    delete rpc_batch_queue; rpc_batch_queue = NULL;
     delete rpc_dummy_work; rpc_dummy_work = NULL;
     delete rpc_worker_group; rpc_worker_group = NULL;
     delete rpc_ssl_context; rpc_ssl_context = NULL;
@@ -759,98 +1090,227 @@ static Object JSONRPCExecOne(const Value& req)
     return rpc_result;
 }
 
-static string JSONRPCExecBatch(const Array& vReq)
-{
-    Array ret;
-    for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
-        ret.push_back(JSONRPCExecOne(vReq[reqIdx]));
+namespace {
 
-    return write_string(Value(ret), false) + "\n";
+/**
+ * Read-only calls that do their own locking (threadSafe in the dispatch
+ * table) and have no side effects, so consecutive ones in a batch can run
+ * at the same time without changing the result.
+ */
+bool IsParallelBatchCall(const Value& req)
+{
+    if (req.type() != obj_type)
+        return false;
+    const Value& valMethod = find_value(req.get_obj(), "method");
+    if (valMethod.type() != str_type)
+        return false;
+    const string& strMethod = valMethod.get_str();
+    if (strMethod != "getblock" && strMethod != "getblockheader" &&
+        strMethod != "getblockhash" && strMethod != "getblockcount" &&
+        strMethod != "getbestblockhash" && strMethod != "getrawtransaction" &&
+        strMethod != "decoderawtransaction" && strMethod != "decodescript" &&
+        strMethod != "gettxout" && strMethod != "validateaddress")
+        return false;
+    const CRPCCommand *pcmd = tableRPC[strMethod];
+    return pcmd && pcmd->threadSafe;
 }
 
-void ServiceConnection(AcceptedConnection *conn)
+/** A run of batch calls shared between the request thread and RPC workers */
+class CRPCBatchCalls
 {
-    bool fRun = true;
-    while (fRun && !ShutdownRequested())
+public:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    const Array* pvReq;
+    Array* pvRet;
+    unsigned int nNext;
+    unsigned int nEnd;
+    unsigned int nRemaining;
+
+    CRPCBatchCalls(const Array& vReq, Array& vRet, unsigned int nBegin, unsigned int nEndIn) :
+        pvReq(&vReq), pvRet(&vRet), nNext(nBegin), nEnd(nEndIn), nRemaining(nEndIn - nBegin) {}
+};
+
+// Take calls until none are left. A helper that only gets to run after the
+// batch has finished finds nothing to do and never touches the arrays.
+void ExecBatchCalls(boost::shared_ptr<CRPCBatchCalls> calls)
+{
+    while (true)
     {
-        int nProto = 0;
-        map<string, string> mapHeaders;
-        string strRequest, strMethod, strURI;
+        unsigned int nIdx;
+        {
+            boost::unique_lock<boost::mutex> lock(calls->mutex);
+            if (calls->nNext == calls->nEnd)
+                return;
+            nIdx = calls->nNext++;
+        }
 
-        // Read HTTP request line
-        if (!ReadHTTPRequestLine(conn->stream(), nProto, strMethod, strURI))
-            break;
+        // Every index is written by exactly one thread
+        (*calls->pvRet)[nIdx] = JSONRPCExecOne((*calls->pvReq)[nIdx]);
 
-        // Read HTTP message headers and body
-        ReadHTTPMessage(conn->stream(), mapHeaders, strRequest, nProto);
+        boost::unique_lock<boost::mutex> lock(calls->mutex);
+        if (--calls->nRemaining == 0)
+            calls->cond.notify_all();
+    }
+}
 
-        if (strURI != "/") {
-            conn->stream() << HTTPReply(HTTP_NOT_FOUND, "", false) << std::flush;
-            break;
-        }
+} // anon namespace
 
-        // Check authorization
-        if (mapHeaders.count("authorization") == 0)
+static string JSONRPCExecBatch(const Array& vReq)
+{
+    Array ret(vReq.size());
+    unsigned int reqIdx = 0;
+    while (reqIdx < vReq.size())
+    {
+        if (!IsParallelBatchCall(vReq[reqIdx]))
         {
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
+            // Anything else runs in order, as if the batch was sent call by call
+            ret[reqIdx] = JSONRPCExecOne(vReq[reqIdx]);
+            reqIdx++;
+            continue;
         }
-        if (!HTTPAuthorized(mapHeaders))
-        {
-            LogPrintf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string());
-            /* Deter brute-forcing short passwords.
-               If this results in a DoS the user really
-               shouldn't have their RPC port exposed. */
-            if (mapArgs["-rpcpassword"].size() < 20)
-                MilliSleep(250);
 
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
+        unsigned int nEnd = reqIdx + 1;
+        while (nEnd < vReq.size() && IsParallelBatchCall(vReq[nEnd]))
+            nEnd++;
+
+        // This thread works on the run too, so the batch completes even when
+        // every helper thread is busy with other batches. With this thread
+        // taking a call as well, there are never more helpers than calls.
+        boost::shared_ptr<CRPCBatchCalls> calls(new CRPCBatchCalls(vReq, ret, reqIdx, nEnd));
+        unsigned int nHelpers = std::min(nEnd - reqIdx - 1, nRPCWorkerThreads);
+        for (unsigned int i = 0; i < nHelpers; i++)
+            if (!rpc_batch_queue || !rpc_batch_queue->Enqueue(boost::bind(&ExecBatchCalls, calls)))
+                break;
+        ExecBatchCalls(calls);
+        {
+            boost::unique_lock<boost::mutex> lock(calls->mutex);
+            while (calls->nRemaining > 0)
+                calls->cond.wait(lock);
         }
-        if (mapHeaders["connection"] == "close")
-            fRun = false;
+        reqIdx = nEnd;
+    }
 
-        JSONRequest jreq;
-        try
+    return write_string(Value(ret), false) + "\n";
+}
+
+namespace {
+
+/** Sends JSON text as HTTP chunks, starting with the headers */
+class CHTTPChunkedSink
+{
+public:
+    CHTTPChunkedSink(const CJSONStreamWriter::SinkFunc& sendIn, bool fKeepAliveIn) :
+        send(sendIn), fKeepAlive(fKeepAliveIn), fStarted(false) {}
+
+    bool Send(const string& strData)
+    {
+        string strChunk = HTTPChunk(strData);
+        if (!fStarted)
         {
-            // Parse request
-            Value valRequest;
-            if (!read_string(strRequest, valRequest))
-                throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
+            fStarted = true;
+            strChunk = HTTPReplyChunkedHeader(HTTP_OK, fKeepAlive) + strChunk;
+        }
+        return send(strChunk);
+    }
 
-            string strReply;
+    bool End() { return send(HTTPChunk("")); }
 
-            // singleton request
-            if (valRequest.type() == obj_type) {
-                jreq.parse(valRequest);
+    bool IsStarted() const { return fStarted; }
 
-                Value result = tableRPC.execute(jreq.strMethod, jreq.params);
+private:
+    CJSONStreamWriter::SinkFunc send;
+    bool fKeepAlive;
+    bool fStarted;
+};
 
-                // Send reply
-                strReply = JSONRPCReply(result, Value::null, jreq.id);
+} // anon namespace
 
-            // array of requests
-            } else if (valRequest.type() == array_type)
-                strReply = JSONRPCExecBatch(valRequest.get_array());
-            else
-                throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
+/**
+ * Run a call whose result can be large. The reply goes to sendChunk in
+ * pieces as it is rendered; a reply that fits in the first piece is
+ * returned as a normal HTTP reply instead, and so are errors that happen
+ * before anything was sent.
+ */
+static string JSONRPCExecStreamed(const JSONRequest& jreq, bool& fKeepAlive, const CJSONStreamWriter::SinkFunc& sendChunk)
+{
+    CHTTPChunkedSink sink(sendChunk, fKeepAlive);
+    CJSONStreamWriter writer(boost::bind(&CHTTPChunkedSink::Send, &sink, _1));
+    try
+    {
+        // Same layout as JSONRPCReply
+        writer.BeginObject();
+        writer.WriteKey("result");
+        tableRPC.execute(jreq.strMethod, jreq.params, writer);
+        writer.WriteKey("error");
+        writer.WriteValue(Value::null);
+        writer.WriteKey("id");
+        writer.WriteValue(jreq.id);
+        writer.EndObject();
+        writer.NewLine();
+    }
+    catch (...)
+    {
+        if (!sink.IsStarted())
+            throw;
+        // The 200 status is gone already, all that is left is to cut the reply short
+        LogPrint("rpc", "ThreadRPCServer %s failed while streaming its reply\n", jreq.strMethod);
+        fKeepAlive = false;
+        return "";
+    }
 
-            conn->stream() << HTTPReply(HTTP_OK, strReply, fRun) << std::flush;
-        }
-        catch (Object& objError)
-        {
-            ErrorReply(conn->stream(), objError, jreq.id);
-            break;
-        }
-        catch (std::exception& e)
-        {
-            ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
-            break;
-        }
+    if (!writer.HasFlushed())
+        return HTTPReply(HTTP_OK, writer.GetBuffer(), fKeepAlive);
+    if (!writer.Flush() || !sink.End())
+        fKeepAlive = false;
+    return "";
+}
+
+static string JSONRPCExecHTTP(const string& strRequest, bool& fKeepAlive, const CJSONStreamWriter::SinkFunc& sendChunk)
+{
+    JSONRequest jreq;
+    try
+    {
+        // Parse request
+        Value valRequest;
+        if (!read_string(strRequest, valRequest))
+            throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
+
+        string strReply;
+
+        // singleton request
+        if (valRequest.type() == obj_type) {
+            jreq.parse(valRequest);
+
+            if (sendChunk && tableRPC.isStreamed(jreq.strMethod))
+                return JSONRPCExecStreamed(jreq, fKeepAlive, sendChunk);
+
+            Value result = tableRPC.execute(jreq.strMethod, jreq.params);
+
+            // Send reply
+            strReply = JSONRPCReply(result, Value::null, jreq.id);
+
+        // array of requests
+        } else if (valRequest.type() == array_type)
+            strReply = JSONRPCExecBatch(valRequest.get_array());
+        else
+            throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
+
+        return HTTPReply(HTTP_OK, strReply, fKeepAlive);
+    }
+    catch (Object& objError)
+    {
+        fKeepAlive = false;
+        return ErrorReply(objError, jreq.id);
+    }
+    catch (std::exception& e)
+    {
+        fKeepAlive = false;
+        return ErrorReply(JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
     }
 }
 
-json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
+const CRPCCommand* CRPCTable::checkCommand(const std::string &strMethod) const
 {
     // Find method
     const CRPCCommand *pcmd = tableRPC[strMethod];
@@ -867,6 +1327,50 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
         !pcmd->okSafeMode)
         throw JSONRPCError(RPC_FORBIDDEN_BY_SAFE_MODE, string("Safe mode: ") + strWarning);
 
+    return pcmd;
+}
+
+bool CRPCTable::isStreamed(const std::string &strMethod) const
+{
+    return mapStreamCommands.count(strMethod) > 0;
+}
+
+// Wallet calls see every block connected before they were made; wallet
+// notifications are delivered in the background.
+static void WaitForWalletNotifications(const CRPCCommand *pcmd)
+{
+#ifdef ENABLE_WALLET
+    if (pcmd->reqWallet && pwalletMain)
+        SyncWithWalletNotifications();
+#endif
+}
+
+void CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params, CJSONStreamWriter& writer) const
+{
+    map<string, const CRPCStreamCommand*>::const_iterator it = mapStreamCommands.find(strMethod);
+    if (it == mapStreamCommands.end() || it->second->actor == NULL)
+    {
+        writer.WriteValue(execute(strMethod, params));
+        return;
+    }
+
+    const CRPCCommand *pcmd = checkCommand(strMethod);
+    WaitForWalletNotifications(pcmd);
+    try
+    {
+        it->second->actor(params, writer);
+    }
+    catch (std::exception& e)
+    {
+        throw JSONRPCError(RPC_MISC_ERROR, e.what());
+    }
+}
+
+json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
+{
+    const CRPCCommand *pcmd = checkCommand(strMethod);
+    WaitForWalletNotifications(pcmd);
+
     try
     {
         // Execute
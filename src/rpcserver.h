@@ -20,6 +20,19 @@
 
 class CBlockIndex;
 
+/** Default for -rpcthreads, the number of threads executing RPC calls */
+static const int DEFAULT_RPC_THREADS = 4;
+/** Default for -rpcworkqueue, the number of RPC calls that can wait for a thread */
+static const int DEFAULT_RPC_WORK_QUEUE = 16;
+/** Maximum size of the request line and headers of an RPC request */
+static const unsigned int MAX_HTTP_HEADERS_SIZE = 8192;
+/** Maximum number of headers returned by /rest/headers */
+static const int MAX_REST_HEADERS_RESULTS = 2000;
+/** Maximum number of outpoints that can be queried with /rest/getutxos */
+static const unsigned int MAX_GETUTXOS_OUTPOINTS = 15;
+/** Amount of a streamed reply that may wait to be sent before the call is held up */
+static const unsigned int MAX_QUEUED_CHUNK_BYTES = 4 * JSON_STREAM_CHUNK_SIZE;
+
 /* Start RPC threads */
 void StartRPCThreads();
 /* Alternative to StartRPCThreads for the GUI, when no server is
@@ -50,6 +63,12 @@ void RPCTypeCheck(const json_spirit::Object& o,
  */
 void RPCRunLater(const std::string& name, boost::function<void(void)> func, int64_t nSeconds);
 
+/*
+  Answer a request for the read-only REST interface (-rest) at strURI under
+  /rest/. Returns the HTTP reply, or "" when the reply went to send in pieces.
+ */
+std::string HTTPReq_REST(const std::string& strURI, bool& fKeepAlive, const CJSONStreamWriter::SinkFunc& send);
+
 typedef json_spirit::Value(*rpcfn_type)(const json_spirit::Array& params, bool fHelp);
 
 class CRPCCommand
@@ -62,6 +81,21 @@ public:
     bool reqWallet;
 };
 
+typedef void(*rpcstreamfn_type)(const json_spirit::Array& params, CJSONStreamWriter& writer);
+
+/**
+ * A command whose result can be large. Over HTTP/1.1 its reply is sent with
+ * chunked transfer encoding while it is rendered. The optional stream actor
+ * writes the result itself (with its own locking) so that the result is
+ * never built as one Value either.
+ */
+class CRPCStreamCommand
+{
+public:
+    std::string name;
+    rpcstreamfn_type actor;
+};
+
 /**
  * PatriotBit RPC command dispatcher.
  */
@@ -69,6 +103,9 @@ class CRPCTable
 {
 private:
     std::map<std::string, const CRPCCommand*> mapCommands;
+    std::map<std::string, const CRPCStreamCommand*> mapStreamCommands;
+
+    const CRPCCommand* checkCommand(const std::string &method) const;
 public:
     CRPCTable();
     const CRPCCommand* operator[](std::string name) const;
@@ -82,6 +119,14 @@ public:
      * @throws an exception (json_spirit::Value) when an error happens.
      */
     json_spirit::Value execute(const std::string &method, const json_spirit::Array &params) const;
+
+    // Whether method is worth streaming with the execute() below
+    bool isStreamed(const std::string &method) const;
+    /**
+     * Execute a method, writing its result to writer.
+     * @throws like execute(); anything already handed to the writer's sink stays sent.
+     */
+    void execute(const std::string &method, const json_spirit::Array &params, CJSONStreamWriter& writer) const;
 };
 
 extern const CRPCTable tableRPC;
@@ -183,10 +228,13 @@ extern json_spirit::Value getbestblockhash(const json_spirit::Array& params, boo
 extern json_spirit::Value getdifficulty(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value settxfee(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getrawmempool(const json_spirit::Array& params, bool fHelp);
+extern void getrawmempoolstream(const json_spirit::Array& params, CJSONStreamWriter& writer);
 extern json_spirit::Value getblockhash(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblock(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblockheader(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getblockfilter(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value gettxoutsetinfo(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value dumptxoutset(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value gettxout(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value verifychain(const json_spirit::Array& params, bool fHelp);
 
@@ -1122,9 +1122,18 @@ public:
     }
 
     void GetAndClear(CSerializeData &data) {
-        data.insert(data.end(), begin(), end());
+        if (data.empty() && nReadPos == 0)
+            data.swap(vch); // hand over the buffer instead of copying it
+        else
+            data.insert(data.end(), begin(), end());
         clear();
     }
+
+    // Exchange the whole buffer, including anything already read, with data
+    void SwapBuffer(CSerializeData &data) {
+        vch.swap(data);
+        nReadPos = 0;
+    }
 };
 
 
@@ -0,0 +1,228 @@
+// Copyright (c) 2014-2015 The Dash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "socketevents.h"
+
+#include "netbase.h"
+#include "util.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#endif
+
+using namespace std;
+
+CSocketEvents::CSocketEvents() : backend(BACKEND_SELECT), fWakeup(false), fWakeupPending(false)
+{
+#ifndef WIN32
+    hWakeupRead = hWakeupWrite = -1;
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+    hEpoll = -1;
+#endif
+    Reset();
+}
+
+CSocketEvents::~CSocketEvents()
+{
+#ifndef WIN32
+    if (hWakeupRead != -1)
+        close(hWakeupRead);
+    if (hWakeupWrite != -1)
+        close(hWakeupWrite);
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+    if (hEpoll != -1)
+        close(hEpoll);
+#endif
+}
+
+void CSocketEvents::DrainWakeup()
+{
+#ifndef WIN32
+    char buf[128];
+    while (read(hWakeupRead, buf, sizeof(buf)) > 0) {}
+#endif
+    // Only clear the flag with the pipe empty. A Wakeup that comes in between
+    // writes nothing, but this Wait is returning anyway; clearing first could
+    // leave the flag set after its byte was read and silence every later Wakeup.
+    fWakeupPending.store(false);
+}
+
+void CSocketEvents::Init(int nSizeHint, bool fEdgeTriggered)
+{
+#ifndef WIN32
+    backend = BACKEND_POLL;
+    int hPipe[2];
+    if (pipe(hPipe) == 0) {
+        hWakeupRead = hPipe[0];
+        hWakeupWrite = hPipe[1];
+        fcntl(hWakeupRead, F_SETFL, O_NONBLOCK);
+        fcntl(hWakeupWrite, F_SETFL, O_NONBLOCK);
+        fWakeup = true;
+    } else
+        LogPrintf("CSocketEvents::Init : pipe failed: %s\n", NetworkErrorString(errno));
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+    if (fEdgeTriggered) {
+        hEpoll = epoll_create(nSizeHint);
+        if (hEpoll != -1) {
+            backend = BACKEND_EPOLL;
+            vEpollEvents.resize(256);
+            if (fWakeup)
+                Add(hWakeupRead, true);
+        } else
+            LogPrintf("CSocketEvents::Init : epoll_create failed (%s), falling back to poll()\n", NetworkErrorString(errno));
+    }
+#endif
+    Reset();
+}
+
+const char* CSocketEvents::GetBackendName() const
+{
+    return backend == BACKEND_EPOLL ? "epoll" : backend == BACKEND_POLL ? "poll" : "select";
+}
+
+void CSocketEvents::Add(SOCKET hSocket, bool fListen)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (backend != BACKEND_EPOLL)
+        return;
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = fListen ? EPOLLIN : (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    event.data.fd = hSocket;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hSocket, &event) != 0 && errno != EEXIST)
+        LogPrintf("CSocketEvents::Add : epoll_ctl failed: %s\n", NetworkErrorString(errno));
+#endif
+}
+
+void CSocketEvents::Reset()
+{
+#ifdef WIN32
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    hSocketMax = 0;
+    fHaveFds = false;
+#else
+    vPollFds.clear();
+    if (fWakeup && backend == BACKEND_POLL) {
+        struct pollfd pollfd;
+        pollfd.fd = hWakeupRead;
+        pollfd.events = POLLIN;
+        pollfd.revents = 0;
+        vPollFds.push_back(pollfd);
+    }
+#endif
+}
+
+void CSocketEvents::Watch(SOCKET hSocket, int nEvents)
+{
+    if (backend == BACKEND_EPOLL)
+        return;
+#ifdef WIN32
+    if (nEvents & SOCKET_EVENT_RECV)
+        FD_SET(hSocket, &fdsetRecv);
+    if (nEvents & SOCKET_EVENT_SEND)
+        FD_SET(hSocket, &fdsetSend);
+    FD_SET(hSocket, &fdsetError);
+    hSocketMax = max(hSocketMax, hSocket);
+    fHaveFds = true;
+#else
+    struct pollfd pollfd;
+    pollfd.fd = hSocket;
+    pollfd.events = ((nEvents & SOCKET_EVENT_RECV) ? POLLIN : 0) | ((nEvents & SOCKET_EVENT_SEND) ? POLLOUT : 0);
+    pollfd.revents = 0;
+    vPollFds.push_back(pollfd);
+#endif
+}
+
+void CSocketEvents::Wait(int nTimeout, std::map<SOCKET, int>& mapEvents)
+{
+    mapEvents.clear();
+    int nErr = 0;
+#ifdef HAVE_SYS_EPOLL_H
+    if (backend == BACKEND_EPOLL) {
+        int nEvents = epoll_wait(hEpoll, &vEpollEvents[0], vEpollEvents.size(), nTimeout);
+        if (nEvents < 0)
+            nErr = errno;
+        for (int i = 0; i < nEvents; i++) {
+            const struct epoll_event& event = vEpollEvents[i];
+            if (fWakeup && event.data.fd == hWakeupRead) {
+                DrainWakeup();
+                continue;
+            }
+            int& nFlags = mapEvents[event.data.fd];
+            if (event.events & EPOLLIN)
+                nFlags |= SOCKET_EVENT_RECV;
+            if (event.events & EPOLLOUT)
+                nFlags |= SOCKET_EVENT_SEND;
+            if (event.events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+                nFlags |= SOCKET_EVENT_ERR;
+        }
+        // A full batch means more may be pending; make room for it next time
+        if (nEvents == (int)vEpollEvents.size())
+            vEpollEvents.resize(vEpollEvents.size() * 2);
+    }
+#endif
+#ifdef WIN32
+    struct timeval timeout;
+    timeout.tv_sec  = nTimeout / 1000;
+    timeout.tv_usec = (nTimeout % 1000) * 1000;
+    int nSelect = select(fHaveFds ? hSocketMax + 1 : 0, &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    if (nSelect == SOCKET_ERROR)
+        nErr = WSAGetLastError();
+    else if (nSelect > 0) {
+        for (unsigned int i = 0; i < fdsetRecv.fd_count; i++)
+            mapEvents[fdsetRecv.fd_array[i]] |= SOCKET_EVENT_RECV;
+        for (unsigned int i = 0; i < fdsetSend.fd_count; i++)
+            mapEvents[fdsetSend.fd_array[i]] |= SOCKET_EVENT_SEND;
+        for (unsigned int i = 0; i < fdsetError.fd_count; i++)
+            mapEvents[fdsetError.fd_array[i]] |= SOCKET_EVENT_ERR;
+    }
+#else
+    if (backend == BACKEND_POLL) {
+        int nPoll = 0;
+        if (vPollFds.empty())
+            MilliSleep(nTimeout);
+        else
+            nPoll = poll(&vPollFds[0], vPollFds.size(), nTimeout);
+        if (nPoll < 0)
+            nErr = errno;
+        for (unsigned int i = 0; nPoll > 0 && i < vPollFds.size(); i++) {
+            const struct pollfd& pollfd = vPollFds[i];
+            if (pollfd.revents == 0)
+                continue;
+            if (fWakeup && pollfd.fd == hWakeupRead) {
+                DrainWakeup();
+                continue;
+            }
+            int& nFlags = mapEvents[pollfd.fd];
+            if (pollfd.revents & POLLIN)
+                nFlags |= SOCKET_EVENT_RECV;
+            if (pollfd.revents & POLLOUT)
+                nFlags |= SOCKET_EVENT_SEND;
+            if (pollfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+                nFlags |= SOCKET_EVENT_ERR;
+        }
+    }
+#endif
+    if (nErr != 0 && nErr != WSAEINTR) {
+        LogPrintf("socket wait error %s\n", NetworkErrorString(nErr));
+        MilliSleep(SOCKET_WAIT_POLL_MS);
+    }
+}
+
+void CSocketEvents::Wakeup()
+{
+    // Only the caller that sets the flag writes, so the pipe holds at most one byte
+    if (!fWakeup || fWakeupPending.exchange(true))
+        return;
+#ifndef WIN32
+    char c = 0;
+    if (write(hWakeupWrite, &c, 1) < 0 && errno != EAGAIN)
+        LogPrintf("CSocketEvents::Wakeup : write failed: %s\n", NetworkErrorString(errno));
+#endif
+}
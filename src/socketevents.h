@@ -0,0 +1,104 @@
+// Copyright (c) 2014-2015 The Dash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SOCKETEVENTS_H
+#define BITCOIN_SOCKETEVENTS_H
+
+#if defined(HAVE_CONFIG_H)
+#include "patriotbit-config.h"
+#endif
+
+#include "compat.h"
+
+#include <map>
+#include <vector>
+
+#include <boost/atomic.hpp>
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+/** Readiness reported by CSocketEvents::Wait */
+enum
+{
+    SOCKET_EVENT_RECV = (1U << 0),
+    SOCKET_EVENT_SEND = (1U << 1),
+    SOCKET_EVENT_ERR  = (1U << 2),
+};
+
+/** Longest ThreadSocketHandler sleeps with nothing to do (inactivity checks, disconnects) */
+static const int SOCKET_WAIT_IDLE_MS = 1000;
+/** Sleep while some socket is readable but its node cannot take more data yet, or
+ *  when there is no way to interrupt the wait (select() on Windows) */
+static const int SOCKET_WAIT_POLL_MS = 50;
+
+/** The I/O multiplexer behind ThreadSocketHandler and the Stratum server.
+ *
+ * With epoll, sockets are registered once, edge-triggered, for both
+ * directions. Every change to readable or writable is reported only once, so
+ * the caller has to remember the readiness of each socket until a recv or send
+ * would block. poll() (and select() on Windows) report the current level
+ * instead and need the wanted directions again before every Wait.
+ *
+ * Other threads can interrupt Wait through a pipe, e.g. when they queued data
+ * that the level-triggered backends are not watching for yet.
+ */
+class CSocketEvents
+{
+private:
+    enum Backend { BACKEND_SELECT, BACKEND_POLL, BACKEND_EPOLL };
+    Backend backend;
+    bool fWakeup;
+    boost::atomic<bool> fWakeupPending; // a byte is in the wakeup pipe, or about to be
+#ifdef WIN32
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    SOCKET hSocketMax;
+    bool fHaveFds;
+#else
+    int hWakeupRead;
+    int hWakeupWrite;
+    std::vector<struct pollfd> vPollFds;
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+    int hEpoll;
+    std::vector<struct epoll_event> vEpollEvents;
+#endif
+
+    void DrainWakeup();
+
+public:
+    CSocketEvents();
+    ~CSocketEvents();
+
+    /** Pick the backend for about nSizeHint sockets. Callers that want the
+     *  current level of every socket on each Wait pass fEdgeTriggered=false. */
+    void Init(int nSizeHint, bool fEdgeTriggered = true);
+
+    bool IsEdgeTriggered() const { return backend == BACKEND_EPOLL; }
+    const char* GetBackendName() const;
+
+    /** Longest timeout that still notices queued data in time */
+    int MaxTimeout() const { return (fWakeup || backend == BACKEND_EPOLL) ? SOCKET_WAIT_IDLE_MS : SOCKET_WAIT_POLL_MS; }
+
+    /** Register a socket with the edge-triggered backend. Listening sockets stay
+     *  level-triggered so that one connection is accepted per Wait. */
+    void Add(SOCKET hSocket, bool fListen);
+
+    /** Start collecting interest for the next Wait (level-triggered backends) */
+    void Reset();
+
+    /** Watch a socket in the next Wait (level-triggered backends) */
+    void Watch(SOCKET hSocket, int nEvents);
+
+    /** Wait up to nTimeout milliseconds; the readiness of each reported socket is put in mapEvents */
+    void Wait(int nTimeout, std::map<SOCKET, int>& mapEvents);
+
+    /** Interrupt Wait from another thread */
+    void Wakeup();
+};
+
+#endif // BITCOIN_SOCKETEVENTS_H
@@ -21,6 +21,7 @@ class CSporkManager;
 
 CSporkManager sporkManager;
 
+CCriticalSection cs_spork;
 std::map<uint256, CSporkMessage> mapSporks;
 std::map<int, CSporkMessage> mapSporksActive;
 
@@ -36,19 +37,27 @@ void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
         CSporkMessage spork;
         vRecv >> spork;
 
-        if(chainActive.Tip() == NULL) return;
+        int nHeight;
+        {
+            LOCK(cs_main);
+            if(chainActive.Tip() == NULL) return;
+            nHeight = chainActive.Height();
+        }
 
         uint256 hash = spork.GetHash();
-        if(mapSporksActive.count(spork.nSporkID)) {
-            if(mapSporksActive[spork.nSporkID].nTimeSigned >= spork.nTimeSigned){
-                if(fDebug) LogPrintf("spork - seen %s block %d \n", hash.ToString().c_str(), chainActive.Tip()->nHeight);
-                return;
-            } else {
-                if(fDebug) LogPrintf("spork - got updated spork %s block %d \n", hash.ToString().c_str(), chainActive.Tip()->nHeight);
+        {
+            LOCK(cs_spork);
+            if(mapSporksActive.count(spork.nSporkID)) {
+                if(mapSporksActive[spork.nSporkID].nTimeSigned >= spork.nTimeSigned){
+                    if(fDebug) LogPrintf("spork - seen %s block %d \n", hash.ToString().c_str(), nHeight);
+                    return;
+                } else {
+                    if(fDebug) LogPrintf("spork - got updated spork %s block %d \n", hash.ToString().c_str(), nHeight);
+                }
             }
         }
 
-        LogPrintf("spork - new %s ID %d Time %d bestHeight %d\n", hash.ToString().c_str(), spork.nSporkID, spork.nValue, chainActive.Tip()->nHeight);
+        LogPrintf("spork - new %s ID %d Time %d bestHeight %d\n", hash.ToString().c_str(), spork.nSporkID, spork.nValue, nHeight);
 
         if(!sporkManager.CheckSignature(spork)){
             LogPrintf("spork - invalid signature\n");
@@ -56,8 +65,11 @@ void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
             return;
         }
 
-        mapSporks[hash] = spork;
-        mapSporksActive[spork.nSporkID] = spork;
+        {
+            LOCK(cs_spork);
+            mapSporks[hash] = spork;
+            mapSporksActive[spork.nSporkID] = spork;
+        }
         sporkManager.Relay(spork);
 
         //does a task if needed
@@ -65,9 +77,14 @@ void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
     }
     if (strCommand == "getsporks")
     {
-        std::map<int, CSporkMessage>::iterator it = mapSporksActive.begin();
+        std::map<int, CSporkMessage> mapSporksCopy;
+        {
+            LOCK(cs_spork);
+            mapSporksCopy = mapSporksActive;
+        }
+        std::map<int, CSporkMessage>::iterator it = mapSporksCopy.begin();
 
-        while(it != mapSporksActive.end()) {
+        while(it != mapSporksCopy.end()) {
             pfrom->PushMessage("spork", it->second);
             it++;
         }
@@ -80,6 +97,7 @@ bool IsSporkActive(int nSporkID)
 {
     int64_t r = 0;
 
+    LOCK(cs_spork);
     if(mapSporksActive.count(nSporkID)){
         r = mapSporksActive[nSporkID].nValue;
     } else {
@@ -101,6 +119,7 @@ int GetSporkValue(int nSporkID)
 {
     int r = 0;
 
+    LOCK(cs_spork);
     if(mapSporksActive.count(nSporkID)){
         r = mapSporksActive[nSporkID].nValue;
     } else {
@@ -173,6 +192,7 @@ bool CSporkManager::UpdateSpork(int nSporkID, int64_t nValue)
 
     if(Sign(msg)){
         Relay(msg);
+        LOCK(cs_spork);
         mapSporks[msg.GetHash()] = msg;
         mapSporksActive[nSporkID] = msg;
         return true;
@@ -47,6 +47,7 @@ class CSporkManager;
 using namespace std;
 using namespace boost;
 
+extern CCriticalSection cs_spork; // protects mapSporks and mapSporksActive, takes no other lock
 extern std::map<uint256, CSporkMessage> mapSporks;
 extern std::map<int, CSporkMessage> mapSporksActive;
 extern CSporkManager sporkManager;
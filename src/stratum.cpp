@@ -0,0 +1,643 @@
+// Copyright (c) 2014-2015 The Dash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "stratum.h"
+
+#include "base58.h"
+#include "bignum.h"
+#include "core.h"
+#include "main.h"
+#include "miner.h"
+#include "netbase.h"
+#include "socketevents.h"
+#include "ui_interface.h"
+#include "util.h"
+
+#include "json/json_spirit_reader_template.h"
+#include "json/json_spirit_utils.h"
+#include "json/json_spirit_writer_template.h"
+
+#include <deque>
+#include <limits>
+#include <list>
+
+#include <boost/foreach.hpp>
+
+#ifndef WIN32
+#include <fcntl.h>
+#endif
+
+using namespace json_spirit;
+using namespace std;
+
+namespace {
+
+/** Work handed out to miners. The coinbase scriptSig has room for the
+ *  connection's extranonce1 followed by the miner's extranonce2. */
+struct CStratumJob
+{
+    std::string strJobId;
+    CBlock block;
+    unsigned int nMinTime;
+    unsigned int nExtraNonceOffset; // position of extranonce1 in the coinbase scriptSig
+    std::string strCoinbase1;
+    std::string strCoinbase2;
+    std::vector<uint256> vMerkleBranch;
+    std::set<uint256> setSubmitted;
+};
+
+struct CStratumClient
+{
+    SOCKET hSocket;
+    std::string strAddr;
+    std::string strRecv;
+    std::string strSend;
+    uint32_t nExtraNonce1;
+    bool fSubscribed;
+    bool fAuthorized;
+    bool fDisconnect;
+
+    CStratumClient(SOCKET hSocketIn, const std::string& strAddrIn, uint32_t nExtraNonce1In) :
+        hSocket(hSocketIn), strAddr(strAddrIn), nExtraNonce1(nExtraNonce1In),
+        fSubscribed(false), fAuthorized(false), fDisconnect(false) {}
+};
+
+Array StratumError(int nCode, const std::string& strMessage)
+{
+    Array error;
+    error.push_back(nCode);
+    error.push_back(strMessage);
+    error.push_back(Value::null);
+    return error;
+}
+
+// Miners on this host are always let in, others only when they match -stratumallowip
+bool ClientAllowed(const CNetAddr& addr)
+{
+    if (addr.IsLocal())
+        return true;
+    const std::string strAddr = addr.ToStringIP();
+    BOOST_FOREACH(const std::string& strAllow, mapMultiArgs["-stratumallowip"])
+        if (WildcardMatch(strAddr, strAllow))
+            return true;
+    return false;
+}
+
+// Header byte order, with the bytes of every 32-bit word swapped, as Stratum sends it
+std::string StratumPrevHash(const uint256& hash)
+{
+    std::vector<unsigned char> vch(hash.begin(), hash.end());
+    for (unsigned int i = 0; i < vch.size(); i += 4)
+        std::reverse(vch.begin() + i, vch.begin() + i + 4);
+    return HexStr(vch);
+}
+
+class CStratumServer
+{
+public:
+    CScript scriptPayout;
+    double dDifficulty;
+    uint256 hashShareTarget;
+
+    CStratumServer() : hListenSocket(INVALID_SOCKET), nJobCounter(0), nExtraNonce1Next(0),
+                       pindexLastJob(NULL), nFeesAddedLastJob(0), nTransactionsUpdatedLastJob(0), nLastJobTime(0) {}
+
+    bool Bind(const CService& addrBind, std::string& strError);
+    void Run();
+
+private:
+    SOCKET hListenSocket;
+    std::list<CStratumClient> vClients;
+    std::map<std::string, CStratumJob> mapJobs;
+    std::deque<std::string> vJobIds; // oldest first
+    unsigned int nJobCounter;
+    uint32_t nExtraNonce1Next;
+    CBlockIndex* pindexLastJob;
+    int64_t nFeesAddedLastJob;
+    unsigned int nTransactionsUpdatedLastJob;
+    int64_t nLastJobTime;
+
+    CSocketEvents socketEvents;
+
+    void Poll();
+    void Accept();
+    void Receive(CStratumClient& client);
+    void SendQueued(CStratumClient& client);
+    void Send(CStratumClient& client, const Object& message);
+    void SendWork(CStratumClient& client, bool fCleanJobs);
+    void ProcessLine(CStratumClient& client, const std::string& strLine);
+    Value Subscribe(CStratumClient& client);
+    Value Submit(CStratumClient& client, const Array& params);
+    void UpdateJob();
+    bool NewJob(bool fCleanJobs);
+    void CloseAll();
+};
+
+CStratumServer stratumServer;
+
+bool CStratumServer::Bind(const CService& addrBind, std::string& strError)
+{
+    int nOne = 1;
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    if (!addrBind.GetSockAddr((struct sockaddr*)&sockaddr, &len)) {
+        strError = strprintf(_("Stratum bind address family for %s not supported"), addrBind.ToString());
+        return false;
+    }
+
+    hListenSocket = socket(((struct sockaddr*)&sockaddr)->sa_family, SOCK_STREAM, IPPROTO_TCP);
+    if (hListenSocket == INVALID_SOCKET) {
+        strError = strprintf(_("Couldn't open socket for Stratum connections (socket returned error %s)"), NetworkErrorString(WSAGetLastError()));
+        return false;
+    }
+
+#ifdef SO_NOSIGPIPE
+    setsockopt(hListenSocket, SOL_SOCKET, SO_NOSIGPIPE, (void*)&nOne, sizeof(int));
+#endif
+#ifndef WIN32
+    setsockopt(hListenSocket, SOL_SOCKET, SO_REUSEADDR, (void*)&nOne, sizeof(int));
+#endif
+
+#ifdef WIN32
+    if (ioctlsocket(hListenSocket, FIONBIO, (u_long*)&nOne) == SOCKET_ERROR)
+#else
+    if (fcntl(hListenSocket, F_SETFL, O_NONBLOCK) == SOCKET_ERROR)
+#endif
+    {
+        strError = strprintf(_("Couldn't set properties on socket for Stratum connections (error %s)"), NetworkErrorString(WSAGetLastError()));
+        return false;
+    }
+
+    if (::bind(hListenSocket, (struct sockaddr*)&sockaddr, len) == SOCKET_ERROR) {
+        strError = strprintf(_("Unable to bind Stratum server to %s on this computer (bind returned error %s)"), addrBind.ToString(), NetworkErrorString(WSAGetLastError()));
+        return false;
+    }
+    if (listen(hListenSocket, SOMAXCONN) == SOCKET_ERROR) {
+        strError = strprintf(_("Listening for Stratum connections failed (listen returned error %s)"), NetworkErrorString(WSAGetLastError()));
+        return false;
+    }
+
+    LogPrintf("Stratum server bound to %s\n", addrBind.ToString());
+    // Level-triggered, so a client is only watched for sending while it has something queued
+    socketEvents.Init(MAX_STRATUM_CLIENTS + 1, false);
+    nExtraNonce1Next = GetRand(std::numeric_limits<uint32_t>::max());
+    return true;
+}
+
+void CStratumServer::Run()
+{
+    try {
+        while (true) {
+            try {
+                Poll();
+            } catch (std::exception& e) {
+                // Keep serving; a job or socket call that failed is tried again next round
+                PrintExceptionContinue(&e, "stratum");
+                MilliSleep(1000);
+            }
+        }
+    } catch (boost::thread_interrupted) {
+        CloseAll();
+        throw;
+    }
+}
+
+void CStratumServer::Poll()
+{
+    UpdateJob();
+
+    socketEvents.Reset();
+    socketEvents.Watch(hListenSocket, SOCKET_EVENT_RECV);
+    BOOST_FOREACH(CStratumClient& client, vClients)
+        socketEvents.Watch(client.hSocket, SOCKET_EVENT_RECV | (client.strSend.empty() ? 0 : SOCKET_EVENT_SEND));
+
+    std::map<SOCKET, int> mapEvents;
+    socketEvents.Wait(SOCKET_WAIT_POLL_MS, mapEvents); // also how often a new tip is looked for
+    boost::this_thread::interruption_point();
+
+    if (mapEvents.count(hListenSocket))
+        Accept();
+
+    BOOST_FOREACH(CStratumClient& client, vClients) {
+        std::map<SOCKET, int>::const_iterator it = mapEvents.find(client.hSocket);
+        if (it == mapEvents.end())
+            continue;
+        // Errors and hangups show up as a failed or empty recv
+        if (!client.fDisconnect && (it->second & (SOCKET_EVENT_RECV | SOCKET_EVENT_ERR)))
+            Receive(client);
+        if (!client.fDisconnect && (it->second & SOCKET_EVENT_SEND))
+            SendQueued(client);
+    }
+
+    for (std::list<CStratumClient>::iterator it = vClients.begin(); it != vClients.end(); ) {
+        if (it->fDisconnect) {
+            LogPrint("stratum", "Stratum client %s disconnected\n", it->strAddr);
+            closesocket(it->hSocket);
+            vClients.erase(it++);
+        } else {
+            it++;
+        }
+    }
+}
+
+void CStratumServer::CloseAll()
+{
+    BOOST_FOREACH(CStratumClient& client, vClients)
+        closesocket(client.hSocket);
+    vClients.clear();
+    if (hListenSocket != INVALID_SOCKET)
+        closesocket(hListenSocket);
+    hListenSocket = INVALID_SOCKET;
+}
+
+void CStratumServer::Accept()
+{
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+    if (hSocket == INVALID_SOCKET) {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("Stratum socket error accept failed: %s\n", NetworkErrorString(nErr));
+        return;
+    }
+    if (vClients.size() >= MAX_STRATUM_CLIENTS) {
+        closesocket(hSocket);
+        return;
+    }
+    CService addr;
+    addr.SetSockAddr((const struct sockaddr*)&sockaddr);
+    if (!ClientAllowed(addr)) {
+        LogPrint("stratum", "Stratum connection from %s not allowed by -stratumallowip\n", addr.ToString());
+        closesocket(hSocket);
+        return;
+    }
+    LogPrint("stratum", "Accepted Stratum connection from %s\n", addr.ToString());
+    vClients.push_back(CStratumClient(hSocket, addr.ToString(), nExtraNonce1Next++));
+}
+
+void CStratumServer::Receive(CStratumClient& client)
+{
+    char pchBuf[0x1000];
+    int nBytes = recv(client.hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes == 0) {
+        client.fDisconnect = true;
+        return;
+    }
+    if (nBytes < 0) {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+            client.fDisconnect = true;
+        return;
+    }
+
+    client.strRecv.append(pchBuf, nBytes);
+    size_t nPos;
+    while (!client.fDisconnect && (nPos = client.strRecv.find('\n')) != std::string::npos) {
+        std::string strLine = client.strRecv.substr(0, nPos);
+        client.strRecv.erase(0, nPos + 1);
+        if (!strLine.empty() && strLine[strLine.size() - 1] == '\r')
+            strLine.erase(strLine.size() - 1);
+        if (!strLine.empty())
+            ProcessLine(client, strLine);
+    }
+    if (client.strRecv.size() > MAX_STRATUM_LINE)
+        client.fDisconnect = true;
+}
+
+void CStratumServer::SendQueued(CStratumClient& client)
+{
+    int nBytes = send(client.hSocket, client.strSend.data(), client.strSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (nBytes > 0) {
+        client.strSend.erase(0, nBytes);
+    } else if (nBytes < 0) {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+            client.fDisconnect = true;
+    }
+}
+
+void CStratumServer::Send(CStratumClient& client, const Object& message)
+{
+    client.strSend += write_string(Value(message), false) + "\n";
+    // A miner that does not read its jobs is of no use
+    if (client.strSend.size() > 1000 * MAX_STRATUM_LINE)
+        client.fDisconnect = true;
+    else
+        SendQueued(client);
+}
+
+void CStratumServer::SendWork(CStratumClient& client, bool fCleanJobs)
+{
+    if (vJobIds.empty())
+        return;
+    const CStratumJob& job = mapJobs[vJobIds.back()];
+
+    Array branch;
+    BOOST_FOREACH(const uint256& hash, job.vMerkleBranch)
+        branch.push_back(HexStr(hash.begin(), hash.end()));
+
+    Array params;
+    params.push_back(job.strJobId);
+    params.push_back(StratumPrevHash(job.block.hashPrevBlock));
+    params.push_back(job.strCoinbase1);
+    params.push_back(job.strCoinbase2);
+    params.push_back(branch);
+    params.push_back(strprintf("%08x", job.block.nVersion));
+    params.push_back(strprintf("%08x", job.block.nBits));
+    params.push_back(strprintf("%08x", job.block.nTime));
+    params.push_back(fCleanJobs);
+
+    Object notify;
+    notify.push_back(Pair("id", Value::null));
+    notify.push_back(Pair("method", "mining.notify"));
+    notify.push_back(Pair("params", params));
+    Send(client, notify);
+}
+
+void CStratumServer::ProcessLine(CStratumClient& client, const std::string& strLine)
+{
+    Value valRequest;
+    if (!read_string(strLine, valRequest) || valRequest.type() != obj_type) {
+        LogPrint("stratum", "Stratum client %s sent invalid JSON, disconnecting\n", client.strAddr);
+        client.fDisconnect = true;
+        return;
+    }
+    const Object& request = valRequest.get_obj();
+    const Value& valMethod = find_value(request, "method");
+    const Value& valParams = find_value(request, "params");
+    if (valMethod.type() != str_type) {
+        client.fDisconnect = true;
+        return;
+    }
+    std::string strMethod = valMethod.get_str();
+    Array params;
+    if (valParams.type() == array_type)
+        params = valParams.get_array();
+
+    Value result = Value::null;
+    Value error = Value::null;
+    try {
+        if (strMethod == "mining.subscribe")
+            result = Subscribe(client);
+        else if (strMethod == "mining.authorize") {
+            // Workers are only names; all rewards go to -stratumaddress
+            client.fAuthorized = true;
+            result = true;
+            if (params.size() > 0)
+                LogPrint("stratum", "Stratum client %s authorized as %s\n", client.strAddr, params[0].get_str());
+        }
+        else if (strMethod == "mining.submit")
+            result = Submit(client, params);
+        else
+            error = StratumError(20, "Method not found");
+    } catch (std::exception& e) {
+        error = StratumError(20, e.what());
+    }
+
+    Object reply;
+    reply.push_back(Pair("id", find_value(request, "id")));
+    reply.push_back(Pair("result", result));
+    reply.push_back(Pair("error", error));
+    Send(client, reply);
+
+    if (strMethod == "mining.subscribe" && client.fSubscribed) {
+        Object difficulty;
+        difficulty.push_back(Pair("id", Value::null));
+        difficulty.push_back(Pair("method", "mining.set_difficulty"));
+        Array difficultyParams;
+        difficultyParams.push_back(dDifficulty);
+        difficulty.push_back(Pair("params", difficultyParams));
+        Send(client, difficulty);
+
+        UpdateJob();
+        SendWork(client, true);
+    }
+}
+
+Value CStratumServer::Subscribe(CStratumClient& client)
+{
+    client.fSubscribed = true;
+    std::string strExtraNonce1 = strprintf("%08x", client.nExtraNonce1);
+
+    Array subscription;
+    subscription.push_back("mining.notify");
+    subscription.push_back(strExtraNonce1);
+    Array subscriptions;
+    subscriptions.push_back(subscription);
+
+    Array result;
+    result.push_back(subscriptions);
+    result.push_back(strExtraNonce1);
+    result.push_back((int)STRATUM_EXTRANONCE2_SIZE);
+    return result;
+}
+
+Value CStratumServer::Submit(CStratumClient& client, const Array& params)
+{
+    if (!client.fAuthorized)
+        return StratumError(24, "Unauthorized worker");
+    if (params.size() < 5)
+        return StratumError(20, "Expected worker, job id, extranonce2, ntime and nonce");
+
+    std::map<std::string, CStratumJob>::iterator it = mapJobs.find(params[1].get_str());
+    if (it == mapJobs.end())
+        return StratumError(21, "Job not found");
+    CStratumJob& job = it->second;
+
+    std::vector<unsigned char> vchExtraNonce2 = ParseHex(params[2].get_str());
+    if (vchExtraNonce2.size() != STRATUM_EXTRANONCE2_SIZE)
+        return StratumError(20, "Invalid extranonce2 size");
+    unsigned int nTime = strtoul(params[3].get_str().c_str(), NULL, 16);
+    unsigned int nNonce = strtoul(params[4].get_str().c_str(), NULL, 16);
+    if (nTime < job.nMinTime || nTime > GetAdjustedTime() + 2 * 60 * 60)
+        return StratumError(20, "ntime out of range");
+
+    // Put the extranonces in and rebuild the header
+    CTransaction txCoinbase = job.block.vtx[0];
+    SetStratumExtraNonce(txCoinbase, job.nExtraNonceOffset, client.nExtraNonce1, vchExtraNonce2);
+
+    CBlockHeader header = job.block.GetBlockHeader();
+    header.hashMerkleRoot = CBlock::CheckMerkleBranch(txCoinbase.GetHash(), job.vMerkleBranch, 0);
+    header.nTime = nTime;
+    header.nNonce = nNonce;
+
+    // The C11 proof-of-work hash decides everything before the block goes near ProcessBlock
+    uint256 hash;
+    if (!CheckStratumShare(header, hashShareTarget, hash))
+        return StratumError(23, "Low difficulty share");
+    // Only shares that meet the target are remembered, so junk cannot grow the set
+    if (!job.setSubmitted.insert(hash).second)
+        return StratumError(22, "Duplicate share");
+
+    if (hash <= CBigNum().SetCompact(header.nBits).getuint256()) {
+        CBlock block = job.block;
+        block.vtx[0] = txCoinbase;
+        block.hashMerkleRoot = header.hashMerkleRoot;
+        block.nTime = header.nTime;
+        block.nNonce = header.nNonce;
+        LogPrintf("Stratum: proof-of-work found by %s (%s)\n  hash: %s\n", client.strAddr, params[0].get_str(), hash.GetHex());
+
+        CValidationState state;
+        LOCK(cs_main);
+        if (!ProcessBlock(state, NULL, &block))
+            return StratumError(20, "Block rejected");
+    }
+    return true;
+}
+
+void CStratumServer::UpdateJob()
+{
+    if (vClients.empty() || IsInitialBlockDownload())
+        return;
+
+    CBlockIndex* pindexTip;
+    {
+        LOCK(cs_main);
+        pindexTip = chainActive.Tip();
+    }
+    bool fNewTip = pindexTip != pindexLastJob;
+    int64_t nFeesAdded = mempool.GetTotalFeesAdded();
+    // Same refresh rules as the shared getblocktemplate template
+    if (!fNewTip &&
+        !(nFeesAdded >= nFeesAddedLastJob + nLongPollFeeDelta && GetTime() - nLastJobTime > 5) &&
+        !(mempool.GetTransactionsUpdated() != nTransactionsUpdatedLastJob && GetTime() - nLastJobTime > 60))
+        return;
+
+    nFeesAddedLastJob = nFeesAdded;
+    nTransactionsUpdatedLastJob = mempool.GetTransactionsUpdated();
+    nLastJobTime = GetTime();
+    if (!NewJob(fNewTip))
+        return;
+    pindexLastJob = pindexTip;
+
+    BOOST_FOREACH(CStratumClient& client, vClients)
+        if (client.fSubscribed && !client.fDisconnect)
+            SendWork(client, fNewTip);
+}
+
+bool CStratumServer::NewJob(bool fCleanJobs)
+{
+    std::auto_ptr<CBlockTemplate> pblocktemplate(CreateNewBlock(scriptPayout));
+    if (!pblocktemplate.get())
+        return false;
+
+    CStratumJob job;
+    job.block = pblocktemplate->block;
+    int nHeight;
+    {
+        LOCK(cs_main);
+        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(job.block.hashPrevBlock);
+        if (mi == mapBlockIndex.end())
+            return false;
+        nHeight = mi->second->nHeight + 1;
+        job.nMinTime = mi->second->GetMedianTimePast() + 1;
+    }
+    if (!PrepareStratumCoinbase(job.block.vtx[0], nHeight, job.nExtraNonceOffset, job.strCoinbase1, job.strCoinbase2))
+        return error("CStratumServer::NewJob() : coinbase scriptSig too large");
+
+    job.vMerkleBranch = job.block.GetMerkleBranch(0);
+    job.strJobId = strprintf("%x", ++nJobCounter);
+
+    if (fCleanJobs) {
+        mapJobs.clear();
+        vJobIds.clear();
+    }
+    while (vJobIds.size() >= MAX_STRATUM_JOBS) {
+        mapJobs.erase(vJobIds.front());
+        vJobIds.pop_front();
+    }
+    vJobIds.push_back(job.strJobId);
+    mapJobs[job.strJobId] = job;
+
+    LogPrint("stratum", "Stratum job %s at height %d with %u transactions\n", job.strJobId, nHeight, job.block.vtx.size());
+    return true;
+}
+
+void ThreadStratumServer()
+{
+    stratumServer.Run();
+}
+
+} // anon namespace
+
+bool PrepareStratumCoinbase(CTransaction& txCoinbase, int nHeight, unsigned int& nExtraNonceOffset,
+                            std::string& strCoinbase1, std::string& strCoinbase2)
+{
+    CScript scriptSig = CScript() << nHeight;
+    nExtraNonceOffset = scriptSig.size() + 1;
+    scriptSig << std::vector<unsigned char>(STRATUM_EXTRANONCE1_SIZE + STRATUM_EXTRANONCE2_SIZE, 0);
+    scriptSig += COINBASE_FLAGS;
+    if (scriptSig.size() > 100)
+        return false;
+    txCoinbase.vin[0].scriptSig = scriptSig;
+
+    // Split the serialized coinbase around the extranonces; in front of the scriptSig
+    // are the version, the input count, the prevout and the scriptSig length
+    CDataStream ssCoinbase(SER_NETWORK, PROTOCOL_VERSION);
+    ssCoinbase << txCoinbase;
+    std::string strCoinbase = HexStr(ssCoinbase.begin(), ssCoinbase.end());
+    unsigned int nOffset = 4 + 1 + 36 + GetSizeOfCompactSize(scriptSig.size()) + nExtraNonceOffset;
+    unsigned int nExtraNonceSize = STRATUM_EXTRANONCE1_SIZE + STRATUM_EXTRANONCE2_SIZE;
+    strCoinbase1 = strCoinbase.substr(0, 2 * nOffset);
+    strCoinbase2 = strCoinbase.substr(2 * (nOffset + nExtraNonceSize));
+    return true;
+}
+
+void SetStratumExtraNonce(CTransaction& txCoinbase, unsigned int nExtraNonceOffset, uint32_t nExtraNonce1,
+                          const std::vector<unsigned char>& vchExtraNonce2)
+{
+    // extranonce1 goes in big-endian, the way mining.subscribe hands it out as hex
+    CScript& scriptSig = txCoinbase.vin[0].scriptSig;
+    for (unsigned int i = 0; i < STRATUM_EXTRANONCE1_SIZE; i++)
+        scriptSig[nExtraNonceOffset + i] = (nExtraNonce1 >> (8 * (STRATUM_EXTRANONCE1_SIZE - 1 - i))) & 0xff;
+    std::copy(vchExtraNonce2.begin(), vchExtraNonce2.end(), scriptSig.begin() + nExtraNonceOffset + STRATUM_EXTRANONCE1_SIZE);
+}
+
+uint256 GetStratumShareTarget(double dDifficulty)
+{
+    return (CBigNum().SetCompact(STRATUM_DIFF1_BITS) * 65536 / CBigNum((int64_t)(dDifficulty * 65536))).getuint256();
+}
+
+bool CheckStratumShare(const CBlockHeader& header, const uint256& hashShareTarget, uint256& hashRet)
+{
+    hashRet = header.GetHash();
+    return hashRet <= hashShareTarget;
+}
+
+bool StartStratumServer(boost::thread_group& threadGroup, std::string& strError)
+{
+    CBitcoinAddress address(GetArg("-stratumaddress", ""));
+    if (!address.IsValid()) {
+        strError = _("-stratum requires a valid -stratumaddress to pay block rewards to");
+        return false;
+    }
+    stratumServer.scriptPayout.SetDestination(address.Get());
+
+    stratumServer.dDifficulty = atof(GetArg("-stratumdifficulty", "1").c_str());
+    if (stratumServer.dDifficulty * 65536 < 1) {
+        strError = strprintf(_("Invalid -stratumdifficulty: '%s'"), GetArg("-stratumdifficulty", ""));
+        return false;
+    }
+    stratumServer.hashShareTarget = GetStratumShareTarget(stratumServer.dDifficulty);
+
+    unsigned short nPort = GetArg("-stratumport", DEFAULT_STRATUM_PORT);
+    CService addrBind;
+    if (mapArgs.count("-stratumbind")) {
+        if (!Lookup(mapArgs["-stratumbind"].c_str(), addrBind, nPort, false)) {
+            strError = strprintf(_("Cannot resolve -stratumbind address: '%s'"), mapArgs["-stratumbind"]);
+            return false;
+        }
+    } else {
+        // Like RPC, only listen beyond this host when other miners are allowed in
+        struct in_addr inaddr;
+        inaddr.s_addr = mapArgs.count("-stratumallowip") ? htonl(INADDR_ANY) : htonl(INADDR_LOOPBACK);
+        addrBind = CService(inaddr, nPort);
+    }
+    if (!stratumServer.Bind(addrBind, strError))
+        return false;
+
+    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "stratum", &ThreadStratumServer));
+    return true;
+}
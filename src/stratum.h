@@ -0,0 +1,51 @@
+// Copyright (c) 2014-2015 The Dash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_STRATUM_H
+#define BITCOIN_STRATUM_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+class CBlockHeader;
+class CTransaction;
+class uint256;
+
+/** Default for -stratumport */
+static const unsigned short DEFAULT_STRATUM_PORT = 3333;
+/** Maximum number of miners connected to the Stratum server at once */
+static const unsigned int MAX_STRATUM_CLIENTS = 256;
+/** Maximum length of a single Stratum request line */
+static const unsigned int MAX_STRATUM_LINE = 16 * 1024;
+/** Number of jobs kept around for late share submissions */
+static const unsigned int MAX_STRATUM_JOBS = 8;
+/** Bytes of the coinbase scriptSig set per connection and per miner */
+static const unsigned int STRATUM_EXTRANONCE1_SIZE = 4;
+static const unsigned int STRATUM_EXTRANONCE2_SIZE = 4;
+/** Difficulty 1 share target, as in bitcoin */
+static const unsigned int STRATUM_DIFF1_BITS = 0x1d00ffff;
+
+/** Start the built-in Stratum v1 mining server (-stratum). Miners get jobs
+ *  built from CreateNewBlock paying -stratumaddress, each connection with its
+ *  own extranonce1; a new job is pushed as soon as the tip changes. */
+bool StartStratumServer(boost::thread_group& threadGroup, std::string& strError);
+
+/** Give the coinbase of a block at nHeight a scriptSig with zeroed room for the
+ *  extranonces at nExtraNonceOffset, and split its serialization around them
+ *  into the hex coinbase1 and coinbase2 of mining.notify. Fails if the
+ *  scriptSig would be too large. */
+bool PrepareStratumCoinbase(CTransaction& txCoinbase, int nHeight, unsigned int& nExtraNonceOffset,
+                            std::string& strCoinbase1, std::string& strCoinbase2);
+/** Put a miner's extranonces into a coinbase made by PrepareStratumCoinbase */
+void SetStratumExtraNonce(CTransaction& txCoinbase, unsigned int nExtraNonceOffset, uint32_t nExtraNonce1,
+                          const std::vector<unsigned char>& vchExtraNonce2);
+/** Share target for -stratumdifficulty */
+uint256 GetStratumShareTarget(double dDifficulty);
+/** Whether the proof-of-work hash of header, put in hashRet, meets the share target */
+bool CheckStratumShare(const CBlockHeader& header, const uint256& hashShareTarget, uint256& hashRet);
+
+#endif // BITCOIN_STRATUM_H
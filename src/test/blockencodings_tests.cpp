@@ -0,0 +1,122 @@
+// Copyright (c) 2014 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "main.h"
+#include "txmempool.h"
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blockencodings_tests)
+
+static CBlock BuildBlockTestCase()
+{
+    CBlock block;
+    block.vtx.resize(4);
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+    {
+        block.vtx[i].vin.resize(1);
+        block.vtx[i].vin[0].scriptSig = CScript() << OP_11;
+        block.vtx[i].vin[0].prevout.hash = GetRandHash();
+        block.vtx[i].vin[0].prevout.n = i;
+        block.vtx[i].vout.resize(1);
+        block.vtx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        block.vtx[i].vout[0].nValue = 42000LL;
+    }
+    block.vtx[0].vin[0].prevout.SetNull();
+
+    block.nVersion = 2;
+    block.hashPrevBlock = GetRandHash();
+    block.nBits = 0x207fffff;
+    block.nTime = 1400000000;
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(SimpleRoundTripTest)
+{
+    CBlock block = BuildBlockTestCase();
+
+    CTxMemPool pool;
+    pool.addUnchecked(block.vtx[1].GetHash(), CTxMemPoolEntry(block.vtx[1], 1000LL, 0, 0.0, 1));
+    pool.addUnchecked(block.vtx[3].GetHash(), CTxMemPoolEntry(block.vtx[3], 1000LL, 0, 0.0, 1));
+
+    // Only the coinbase is sent in full
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    BOOST_CHECK_EQUAL(cmpctblock.prefilledtxn.size(), 1U);
+    BOOST_CHECK_EQUAL(cmpctblock.shorttxids.size(), 3U);
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << cmpctblock;
+    BOOST_CHECK_EQUAL(stream.size(), cmpctblock.GetSerializeSize(SER_NETWORK, PROTOCOL_VERSION));
+
+    CBlockHeaderAndShortTxIDs cmpctblock2;
+    stream >> cmpctblock2;
+    BOOST_CHECK(cmpctblock2.shorttxids == cmpctblock.shorttxids);
+    BOOST_CHECK_EQUAL(cmpctblock2.GetShortID(block.vtx[2].GetHash()), cmpctblock.shorttxids[1]);
+
+    CPartialBlock partialBlock;
+    BOOST_CHECK(partialBlock.InitData(cmpctblock2, pool, vector<CTransaction>()) == READ_STATUS_OK);
+    BOOST_CHECK(partialBlock.GetBlockHash() == block.GetHash());
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+    BOOST_CHECK(partialBlock.IsTxAvailable(1));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(2));
+    BOOST_CHECK(partialBlock.IsTxAvailable(3));
+
+    vector<unsigned int> vMissing = partialBlock.GetMissing();
+    BOOST_CHECK_EQUAL(vMissing.size(), 1U);
+    BOOST_CHECK_EQUAL(vMissing[0], 2U);
+
+    // Too few or too many transactions
+    CBlock block2;
+    BOOST_CHECK(partialBlock.FillBlock(block2, vector<CTransaction>()) == READ_STATUS_INVALID);
+    BOOST_CHECK(partialBlock.FillBlock(block2, vector<CTransaction>(2, block.vtx[2])) == READ_STATUS_INVALID);
+
+    // The wrong transaction does not match the merkle root
+    BOOST_CHECK(partialBlock.FillBlock(block2, vector<CTransaction>(1, block.vtx[1])) == READ_STATUS_FAILED);
+
+    BOOST_CHECK(partialBlock.FillBlock(block2, vector<CTransaction>(1, block.vtx[2])) == READ_STATUS_OK);
+    BOOST_CHECK(block2.GetHash() == block.GetHash());
+    BOOST_CHECK(block2.BuildMerkleTree() == block.hashMerkleRoot);
+}
+
+BOOST_AUTO_TEST_CASE(ExtraTransactionsTest)
+{
+    CBlock block = BuildBlockTestCase();
+
+    CTxMemPool pool;
+    pool.addUnchecked(block.vtx[1].GetHash(), CTxMemPoolEntry(block.vtx[1], 1000LL, 0, 0.0, 1));
+
+    CPartialBlock partialBlock;
+    vector<CTransaction> vExtraTxn;
+    vExtraTxn.push_back(block.vtx[2]);
+    vExtraTxn.push_back(block.vtx[3]);
+    BOOST_CHECK(partialBlock.InitData(CBlockHeaderAndShortTxIDs(block), pool, vExtraTxn) == READ_STATUS_OK);
+    BOOST_CHECK(partialBlock.GetMissing().empty());
+
+    CBlock block2;
+    BOOST_CHECK(partialBlock.FillBlock(block2, vector<CTransaction>()) == READ_STATUS_OK);
+    BOOST_CHECK(block2.GetHash() == block.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(InvalidPrefilledTest)
+{
+    CBlock block = BuildBlockTestCase();
+    CTxMemPool pool;
+
+    // A prefilled index beyond the end of the block
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    cmpctblock.prefilledtxn[0].nIndex = 4;
+    CPartialBlock partialBlock;
+    BOOST_CHECK(partialBlock.InitData(cmpctblock, pool, vector<CTransaction>()) == READ_STATUS_INVALID);
+
+    // Two transactions with the same short ID
+    CBlockHeaderAndShortTxIDs cmpctblock2(block);
+    cmpctblock2.shorttxids[1] = cmpctblock2.shorttxids[0];
+    BOOST_CHECK(partialBlock.InitData(cmpctblock2, pool, vector<CTransaction>()) == READ_STATUS_FAILED);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
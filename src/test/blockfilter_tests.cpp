@@ -0,0 +1,89 @@
+// Copyright (c) 2014 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+#include "main.h"
+#include "util.h"
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blockfilter_tests)
+
+BOOST_AUTO_TEST_CASE(gcsfilter_test)
+{
+    CGCSFilter::ElementSet included, excluded;
+    for (int i = 0; i < 100; i++) {
+        uint256 hash = GetRandHash();
+        included.insert(CGCSFilter::Element(hash.begin(), hash.end()));
+        hash = GetRandHash();
+        excluded.insert(CGCSFilter::Element(hash.begin(), hash.end()));
+    }
+
+    CGCSFilter filter(0, 0, BASIC_FILTER_P, BASIC_FILTER_M, included);
+    BOOST_CHECK_EQUAL(filter.GetN(), 100U);
+    BOOST_FOREACH(const CGCSFilter::Element& element, included)
+        BOOST_CHECK(filter.Match(element));
+    BOOST_CHECK(filter.MatchAny(included));
+    // A false positive here has a chance of about 1 in 8000
+    BOOST_CHECK(!filter.MatchAny(excluded));
+
+    CGCSFilter filter2(0, 0, BASIC_FILTER_P, BASIC_FILTER_M, filter.GetEncoded());
+    BOOST_CHECK_EQUAL(filter2.GetN(), 100U);
+    BOOST_CHECK(filter2.MatchAny(included));
+
+    // A truncated filter is rejected
+    vector<unsigned char> vchTruncated = filter.GetEncoded();
+    vchTruncated.resize(vchTruncated.size() / 2);
+    BOOST_CHECK_THROW(CGCSFilter(0, 0, BASIC_FILTER_P, BASIC_FILTER_M, vchTruncated), ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_basic_test)
+{
+    // BIP 158 test vector: the testnet genesis block
+    CScript scriptGenesis = CScript() << ParseHex("04678afdb0fe5548271967f1a67130b7105cd6a828e03909a67962e0ea1f61deb649f6bc3f4cef38c4f35504e51ec112de5c384df7ba0b8d578a4c702b6bf11d5f") << OP_CHECKSIG;
+    CGCSFilter::ElementSet elements;
+    elements.insert(CGCSFilter::Element(scriptGenesis.begin(), scriptGenesis.end()));
+    uint256 hashGenesis("000000000933ea01ad0ee984209779baaec3ced90fa3f408719526f8d77f4943");
+    CGCSFilter filterGenesis(hashGenesis.Get64(0), hashGenesis.Get64(1), BASIC_FILTER_P, BASIC_FILTER_M, elements);
+    BOOST_CHECK_EQUAL(HexStr(filterGenesis.GetEncoded()), "019dfca8");
+
+    CScript scriptPaid = CScript() << OP_DUP << OP_HASH160 << ParseHex("0102030405060708090a0b0c0d0e0f1011121314") << OP_EQUALVERIFY << OP_CHECKSIG;
+    CScript scriptData = CScript() << OP_RETURN << ParseHex("0102");
+    CScript scriptSpent = CScript() << OP_2 << OP_EQUAL;
+
+    CBlock block;
+    block.vtx.resize(2);
+    block.vtx[0].vin.resize(1);
+    block.vtx[0].vin[0].prevout.SetNull();
+    block.vtx[0].vout.resize(1);
+    block.vtx[0].vout[0].scriptPubKey = CScript() << OP_TRUE;
+    block.vtx[1].vin.resize(1);
+    block.vtx[1].vin[0].prevout.hash = GetRandHash();
+    block.vtx[1].vout.resize(3);
+    block.vtx[1].vout[0].scriptPubKey = scriptPaid;
+    block.vtx[1].vout[1].scriptPubKey = scriptData;
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    CBlockUndo blockundo;
+    blockundo.vtxundo.resize(1);
+    blockundo.vtxundo[0].vprevout.push_back(CTxInUndo(CTxOut(1000, scriptSpent)));
+
+    CBlockFilter filter(block, blockundo);
+    BOOST_CHECK(filter.hashBlock == block.GetHash());
+    // The coinbase output, the paid script and the spent script; OP_RETURN and empty scripts are left out
+    BOOST_CHECK_EQUAL(filter.filter.GetN(), 3U);
+    BOOST_CHECK(filter.filter.Match(CGCSFilter::Element(scriptPaid.begin(), scriptPaid.end())));
+    BOOST_CHECK(filter.filter.Match(CGCSFilter::Element(scriptSpent.begin(), scriptSpent.end())));
+
+    CBlockFilter filter2(block.GetHash(), filter.filter.GetEncoded());
+    BOOST_CHECK(filter2.GetHash() == filter.GetHash());
+    uint256 hashHeader = filter.ComputeHeader(0);
+    BOOST_CHECK(filter2.ComputeHeader(0) == hashHeader);
+    BOOST_CHECK(filter.ComputeHeader(hashHeader) != hashHeader);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
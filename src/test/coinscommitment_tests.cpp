@@ -0,0 +1,160 @@
+// Copyright (c) 2014 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinscommitment.h"
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(coinscommitment_tests)
+
+BOOST_AUTO_TEST_CASE(muhash_order_test)
+{
+    uint256 hash1 = GetRandHash(), hash2 = GetRandHash(), hash3 = GetRandHash();
+
+    CMuHash3072 a, b;
+    a.Insert(hash1);
+    a.Insert(hash2);
+    a.Insert(hash3);
+    b.Insert(hash3);
+    b.Insert(hash1);
+    b.Insert(hash2);
+    BOOST_CHECK(a.GetHash() == b.GetHash());
+
+    // A different set gives a different hash
+    CMuHash3072 c;
+    c.Insert(hash1);
+    c.Insert(hash2);
+    BOOST_CHECK(a.GetHash() != c.GetHash());
+
+    // Removing may come before or after the insert it cancels
+    c.Remove(hash3);
+    c.Insert(hash3);
+    c.Insert(hash3);
+    BOOST_CHECK(a.GetHash() == c.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(muhash_remove_test)
+{
+    uint256 hashEmpty = CMuHash3072().GetHash();
+
+    CMuHash3072 muhash;
+    for (int i = 0; i < 10; i++) {
+        uint256 hash = GetRandHash();
+        muhash.Insert(hash);
+        BOOST_CHECK(muhash.GetHash() != hashEmpty);
+        muhash.Remove(hash);
+        BOOST_CHECK(muhash.GetHash() == hashEmpty);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(muhash_serialize_test)
+{
+    uint256 hash1 = GetRandHash(), hash2 = GetRandHash(), hash3 = GetRandHash();
+
+    CCoinsCommitment commitment;
+    commitment.nTransactions = 2;
+    commitment.nTransactionOutputs = 3;
+    commitment.nTotalAmount = 150 * COIN;
+    commitment.muhash.Insert(hash1);
+    commitment.muhash.Insert(hash2);
+    commitment.muhash.Remove(hash3);
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << commitment;
+    CCoinsCommitment commitment2;
+    ss >> commitment2;
+    BOOST_CHECK(ss.empty());
+    BOOST_CHECK_EQUAL(commitment2.nTransactions, commitment.nTransactions);
+    BOOST_CHECK_EQUAL(commitment2.nTransactionOutputs, commitment.nTransactionOutputs);
+    BOOST_CHECK_EQUAL(commitment2.nTotalAmount, commitment.nTotalAmount);
+    BOOST_CHECK(commitment2.GetHash() == commitment.GetHash());
+
+    // The read back state keeps rolling the same way, pending removals included
+    commitment.muhash.Insert(hash3);
+    commitment2.muhash.Insert(hash3);
+    BOOST_CHECK(commitment2.GetHash() == commitment.GetHash());
+    CMuHash3072 muhash;
+    muhash.Insert(hash1);
+    muhash.Insert(hash2);
+    BOOST_CHECK(commitment2.GetHash() == muhash.GetHash());
+}
+
+static CTransaction MakeTx(const vector<COutPoint>& vPrevout, unsigned int nOutputs, int64_t nValue, int nUnique = 0)
+{
+    CTransaction tx;
+    tx.vin.resize(vPrevout.empty() ? 1 : vPrevout.size());
+    for (unsigned int i = 0; i < vPrevout.size(); i++)
+        tx.vin[i].prevout = vPrevout[i];
+    if (vPrevout.empty())
+        tx.vin[0].scriptSig = CScript() << nUnique << OP_0;
+    tx.vout.resize(nOutputs);
+    for (unsigned int i = 0; i < nOutputs; i++) {
+        tx.vout[i].nValue = nValue;
+        tx.vout[i].scriptPubKey = CScript() << OP_TRUE;
+    }
+    return tx;
+}
+
+static void CheckAgainstFullWalk(CCoinsViewCache& view, CCoinsViewDB& base, const CCoinsCommitment& commitment)
+{
+    view.SetBestBlock(GetRandHash());
+    BOOST_REQUIRE(view.Flush());
+    CCoinsCommitment commitmentFull;
+    uint256 hashBlock;
+    BOOST_REQUIRE(ComputeCoinsCommitment(base, commitmentFull, hashBlock));
+    BOOST_CHECK(hashBlock == view.GetBestBlock());
+    BOOST_CHECK_EQUAL(commitment.nTransactions, commitmentFull.nTransactions);
+    BOOST_CHECK_EQUAL(commitment.nTransactionOutputs, commitmentFull.nTransactionOutputs);
+    BOOST_CHECK_EQUAL(commitment.nTotalAmount, commitmentFull.nTotalAmount);
+    BOOST_CHECK(commitment.GetHash() == commitmentFull.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(commitment_connect_disconnect_test)
+{
+    CCoinsViewDB base(1 << 20, true, false, "commitment_test");
+    CCoinsViewCache view(base);
+    CCoinsCommitment commitment;
+    CValidationState state;
+
+    // Two coinbases, the way ConnectBlock adds them
+    CTransaction txCoinbase1 = MakeTx(vector<COutPoint>(), 2, 50 * COIN, 1);
+    CTransaction txCoinbase2 = MakeTx(vector<COutPoint>(), 3, 10 * COIN, 2);
+    CTxUndo undoCoinbase;
+    UpdateCoins(txCoinbase1, state, view, undoCoinbase, 1, txCoinbase1.GetHash());
+    UpdateCoinsCommitment(txCoinbase1, view, undoCoinbase, 1, txCoinbase1.GetHash(), commitment);
+    UpdateCoins(txCoinbase2, state, view, undoCoinbase, 2, txCoinbase2.GetHash());
+    UpdateCoinsCommitment(txCoinbase2, view, undoCoinbase, 2, txCoinbase2.GetHash(), commitment);
+    CheckAgainstFullWalk(view, base, commitment);
+    CCoinsCommitment commitmentBefore = commitment;
+
+    // Spend all of the first and part of the second, so the undo data carries metadata
+    // for the fully spent transaction only
+    vector<COutPoint> vPrevout;
+    vPrevout.push_back(COutPoint(txCoinbase1.GetHash(), 1));
+    vPrevout.push_back(COutPoint(txCoinbase2.GetHash(), 0));
+    vPrevout.push_back(COutPoint(txCoinbase1.GetHash(), 0));
+    CTransaction tx = MakeTx(vPrevout, 2, 55 * COIN);
+    CTxUndo txundo;
+    UpdateCoins(tx, state, view, txundo, 102, tx.GetHash());
+    UpdateCoinsCommitment(tx, view, txundo, 102, tx.GetHash(), commitment);
+    CheckAgainstFullWalk(view, base, commitment);
+
+    // Disconnect it the way DisconnectBlock does: outputs out, spent inputs back in reverse
+    commitment.RemoveCoins(tx.GetHash(), CCoins(tx, 102));
+    view.GetCoins(tx.GetHash()) = CCoins();
+    bool fClean = true;
+    for (unsigned int j = tx.vin.size(); j-- > 0;)
+        BOOST_CHECK(ApplyTxInUndo(txundo.vprevout[j], view, tx.vin[j].prevout, &commitment, fClean));
+    BOOST_CHECK(fClean);
+    CheckAgainstFullWalk(view, base, commitment);
+    BOOST_CHECK(commitment.GetHash() == commitmentBefore.GetHash());
+    BOOST_CHECK_EQUAL(commitment.nTransactions, commitmentBefore.nTransactions);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -5,8 +5,15 @@
 
 #include "core.h"
 #include "main.h"
+#include "net.h"
+#include "util.h"
 
+#include <stdio.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 BOOST_AUTO_TEST_SUITE(main_tests)
 
@@ -23,4 +30,158 @@ BOOST_AUTO_TEST_CASE(subsidy_limit_test)
     BOOST_CHECK(nSum == 2099999997690000ULL);
 }
 
+// Frames a block the way blk?????.dat stores it
+static void WriteFramedBlock(FILE* file, const CBlock& block)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << block;
+    unsigned int nSize = ss.size();
+    fwrite(Params().MessageStart(), 1, MESSAGE_START_SIZE, file);
+    fwrite(&nSize, 1, sizeof(nSize), file);
+    fwrite(&ss[0], 1, ss.size(), file);
+}
+
+BOOST_AUTO_TEST_CASE(import_pipeline_test)
+{
+    const CBlock& genesis = Params().GenesisBlock();
+    uint256 hashTip = chainActive.Tip()->GetBlockHash();
+    const char* threads[] = { "1", "4" };
+
+    BOOST_FOREACH(const char* nThreads, threads) {
+        mapArgs["-importthreads"] = nThreads;
+        FILE* file = tmpfile();
+        BOOST_REQUIRE(file);
+
+        // More blocks than fit in the import queue, with junk and a truncated frame in between
+        const char junk[] = "not a block";
+        for (unsigned int i = 0; i < MAX_IMPORT_QUEUE + 8; i++) {
+            WriteFramedBlock(file, genesis);
+            if (i % 16 == 0)
+                fwrite(junk, 1, sizeof(junk), file);
+        }
+        fwrite(Params().MessageStart(), 1, MESSAGE_START_SIZE, file);
+        rewind(file);
+
+        // Every block is already known, so nothing is loaded and the tip does not move
+        BOOST_CHECK(!LoadExternalBlockFile(file));
+        BOOST_CHECK(chainActive.Tip()->GetBlockHash() == hashTip);
+    }
+    mapArgs.erase("-importthreads");
+}
+
+// Writes blocks into blk?????.dat number nFile and reopens it for import, like -reindex does
+static FILE* WriteBlockFile(CDiskBlockPos& pos, int nFile, const std::vector<CBlock>& vBlocks)
+{
+    pos = CDiskBlockPos(nFile, 0);
+    FILE* file = OpenBlockFile(pos);
+    BOOST_REQUIRE(file);
+    BOOST_FOREACH(const CBlock& block, vBlocks)
+        WriteFramedBlock(file, block);
+    fclose(file);
+    return OpenBlockFile(pos, true);
+}
+
+BOOST_AUTO_TEST_CASE(import_out_of_order_test)
+{
+    // A chain of three blocks on top of genesis. Their proof of work is not valid
+    // (mining it would take too long here), so none of them can be connected.
+    std::vector<CBlock> vChain;
+    CBlock block = Params().GenesisBlock();
+    for (int i = 0; i < 3; i++) {
+        block.hashPrevBlock = block.GetHash();
+        block.nTime += 60;
+        vChain.push_back(block);
+    }
+    uint256 hashTip = chainActive.Tip()->GetBlockHash();
+    std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+
+    // The first file only holds the grandchildren, in reverse order: both are parked
+    std::vector<CBlock> vFirst;
+    vFirst.push_back(vChain[2]);
+    vFirst.push_back(vChain[1]);
+    CDiskBlockPos pos;
+    FILE* file = WriteBlockFile(pos, 9000, vFirst);
+    BOOST_REQUIRE(file);
+    BOOST_CHECK(!LoadExternalBlockFile(file, &pos, &mapBlocksUnknownParent));
+    BOOST_CHECK_EQUAL(mapBlocksUnknownParent.size(), 2U);
+    BOOST_REQUIRE(mapBlocksUnknownParent.count(vChain[0].GetHash()));
+    BOOST_CHECK_EQUAL(mapBlocksUnknownParent.find(vChain[0].GetHash())->second.nFile, 9000);
+
+    // The parent shows up in the next file: its waiting child is re-read from the first
+    // file and handed on, but the grandchild stays parked as its own parent never connected
+    file = WriteBlockFile(pos, 9001, std::vector<CBlock>(1, vChain[0]));
+    BOOST_REQUIRE(file);
+    BOOST_CHECK(!LoadExternalBlockFile(file, &pos, &mapBlocksUnknownParent));
+    BOOST_CHECK_EQUAL(mapBlocksUnknownParent.size(), 1U);
+    BOOST_CHECK(!mapBlocksUnknownParent.count(vChain[0].GetHash()));
+    BOOST_CHECK(mapBlocksUnknownParent.count(vChain[1].GetHash()));
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == hashTip);
+
+    for (int nFile = 9000; nFile <= 9001; nFile++)
+        boost::filesystem::remove(GetDataDir() / "blocks" / strprintf("blk%05u.dat", nFile));
+}
+
+// Queue a message on a node as if it had come in over the network
+static void ReceiveMessage(CNode& node, const char* pszCommand)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    CMessageHeader hdr(pszCommand, 0);
+    uint256 hash = Hash(ss.begin(), ss.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+    ss << hdr;
+    LOCK(node.cs_vRecvMsg);
+    BOOST_REQUIRE(node.ReceiveMsgBytes(&ss[0], ss.size()));
+}
+
+static void ProcessMessagesThread(CNode* pnode)
+{
+    LOCK(pnode->cs_vRecvMsg);
+    ProcessMessages(pnode);
+}
+
+BOOST_AUTO_TEST_CASE(message_handler_locks_test)
+{
+    CCriticalSection* pcsSpork = GetMessageLock("spork");
+    CCriticalSection* pcsMasternode = GetMessageLock("dsee");
+    BOOST_CHECK(GetMessageLock("ping") == NULL);
+    BOOST_CHECK(GetMessageLock("addr") == NULL);
+    BOOST_CHECK(GetMessageLock("tx") == &cs_main);
+    BOOST_CHECK(GetMessageLock("block") == &cs_main);
+    BOOST_CHECK(GetMessageLock("mnw") == &cs_main);
+    BOOST_CHECK(pcsSpork != NULL && pcsSpork != &cs_main);
+    BOOST_CHECK(pcsMasternode != NULL && pcsMasternode != &cs_main && pcsMasternode != pcsSpork);
+    BOOST_CHECK(GetMessageLock("getsporks") == pcsSpork);
+    BOOST_CHECK(GetMessageLock("dseg") == pcsMasternode);
+    BOOST_CHECK(GetMessageLock("txlvote") != pcsMasternode);
+    BOOST_CHECK(GetMessageLock("dsq") != pcsMasternode);
+
+    CNode nodeSpork(INVALID_SOCKET, CAddress(CService("10.0.0.1", 18001)), "", true);
+    CNode nodeChain(INVALID_SOCKET, CAddress(CService("10.0.0.2", 18001)), "", true);
+    CNode nodeMasternode(INVALID_SOCKET, CAddress(CService("10.0.0.3", 18001)), "", true);
+    nodeSpork.nVersion = nodeChain.nVersion = nodeMasternode.nVersion = PROTOCOL_VERSION;
+    ReceiveMessage(nodeSpork, "getsporks");
+    ReceiveMessage(nodeChain, "mempool");
+    ReceiveMessage(nodeMasternode, "dseg");
+
+    boost::thread_group threadGroup;
+    {
+        // While a masternode message is being handled...
+        LOCK(*pcsMasternode);
+
+        // ...spork and chainstate messages from other peers are handled all the same
+        boost::thread* threadSpork = threadGroup.create_thread(boost::bind(&ProcessMessagesThread, &nodeSpork));
+        boost::thread* threadChain = threadGroup.create_thread(boost::bind(&ProcessMessagesThread, &nodeChain));
+        BOOST_CHECK(threadSpork->timed_join(boost::posix_time::seconds(30)));
+        BOOST_CHECK(threadChain->timed_join(boost::posix_time::seconds(30)));
+
+        // ...and another masternode message waits for it
+        boost::thread* threadMasternode = threadGroup.create_thread(boost::bind(&ProcessMessagesThread, &nodeMasternode));
+        BOOST_CHECK(!threadMasternode->timed_join(boost::posix_time::milliseconds(200)));
+    }
+    threadGroup.join_all();
+    BOOST_CHECK(nodeSpork.vRecvMsg.empty());
+    BOOST_CHECK(nodeChain.vRecvMsg.empty());
+    BOOST_CHECK(nodeMasternode.vRecvMsg.empty());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,288 @@
+// Copyright (c) 2014 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "keystore.h"
+#include "main.h"
+#include "script.h"
+#include "txmempool.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+BOOST_AUTO_TEST_CASE(MempoolAncestorStateTest)
+{
+    // Parent with two outputs, a child spending one of them and a grandchild
+    CTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(2);
+    for (int i = 0; i < 2; i++)
+    {
+        txParent.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txParent.vout[i].nValue = 33000LL;
+    }
+
+    CTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].scriptSig = CScript() << OP_11;
+    txChild.vin[0].prevout.hash = txParent.GetHash();
+    txChild.vin[0].prevout.n = 0;
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 11000LL;
+
+    CTransaction txGrandChild;
+    txGrandChild.vin.resize(1);
+    txGrandChild.vin[0].scriptSig = CScript() << OP_11;
+    txGrandChild.vin[0].prevout.hash = txChild.GetHash();
+    txGrandChild.vin[0].prevout.n = 0;
+    txGrandChild.vout.resize(1);
+    txGrandChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txGrandChild.vout[0].nValue = 11000LL;
+
+    CTxMemPool testPool;
+    std::list<CTransaction> removed;
+
+    // Children that arrive first pick their parent up once it is added
+    testPool.addUnchecked(txGrandChild.GetHash(), CTxMemPoolEntry(txGrandChild, 1000LL, 0, 0.0, 1));
+    testPool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 2000LL, 0, 0.0, 1));
+    testPool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 3000LL, 0, 0.0, 1));
+
+    const CTxMemPoolEntry& entry = testPool.mapTx[txGrandChild.GetHash()];
+    BOOST_CHECK_EQUAL(entry.GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(entry.GetFeesWithAncestors(), 6000LL);
+    BOOST_CHECK_EQUAL(entry.GetSizeWithAncestors(),
+        testPool.mapTx[txParent.GetHash()].GetTxSize() + testPool.mapTx[txChild.GetHash()].GetTxSize() + entry.GetTxSize());
+    BOOST_CHECK_EQUAL(testPool.setAncestorScore.size(), 3);
+
+    // Best package first: the parent, whose own fee rate is the highest
+    BOOST_CHECK((*testPool.setAncestorScore.begin())->first == txParent.GetHash());
+
+    // Parent confirmed: the rest no longer counts it
+    testPool.remove(txParent, removed);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    BOOST_CHECK_EQUAL(testPool.mapTx[txGrandChild.GetHash()].GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(testPool.mapTx[txGrandChild.GetHash()].GetFeesWithAncestors(), 3000LL);
+    BOOST_CHECK_EQUAL(testPool.mapTx[txChild.GetHash()].GetCountWithAncestors(), 1);
+
+    // Recursive removal takes the descendants and their index entries along
+    removed.clear();
+    testPool.remove(txChild, removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 2);
+    BOOST_CHECK_EQUAL(testPool.mapTx.size(), 0);
+    BOOST_CHECK_EQUAL(testPool.setAncestorScore.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    // A low fee parent with a high fee child, and an unrelated middling transaction
+    CTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_1;
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+    txParent.vout[0].nValue = 10 * COIN;
+
+    CTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].scriptSig = CScript() << OP_2;
+    txChild.vin[0].prevout.hash = txParent.GetHash();
+    txChild.vin[0].prevout.n = 0;
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_2 << OP_EQUAL;
+    txChild.vout[0].nValue = 10 * COIN;
+
+    CTransaction txOther;
+    txOther.vin.resize(1);
+    txOther.vin[0].scriptSig = CScript() << OP_3;
+    txOther.vout.resize(1);
+    txOther.vout[0].scriptPubKey = CScript() << OP_3 << OP_EQUAL;
+    txOther.vout[0].nValue = 10 * COIN;
+
+    CTxMemPool testPool;
+    testPool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000LL, 0, 0.0, 1));
+    testPool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 100000LL, 1, 0.0, 1));
+    testPool.addUnchecked(txOther.GetHash(), CTxMemPoolEntry(txOther, 10000LL, 2, 0.0, 1));
+
+    const CTxMemPoolEntry& entry = testPool.mapTx[txParent.GetHash()];
+    BOOST_CHECK_EQUAL(entry.GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(entry.GetFeesWithDescendants(), 101000LL);
+    BOOST_CHECK_EQUAL(testPool.setDescendantScore.size(), 3);
+    BOOST_CHECK_EQUAL(testPool.GetMinFee(1000000), 0);
+
+    // The child pays for its parent, so the unrelated transaction goes first
+    size_t nUsage = testPool.DynamicMemoryUsage();
+    BOOST_CHECK(nUsage > 0);
+    testPool.TrimToSize(nUsage - 1);
+    BOOST_CHECK(!testPool.exists(txOther.GetHash()));
+    BOOST_CHECK(testPool.exists(txParent.GetHash()));
+    BOOST_CHECK(testPool.GetMinFee(1000000) > CTransaction::nMinRelayTxFee);
+
+    // Expiry drops the parent and, with it, the child
+    BOOST_CHECK_EQUAL(testPool.Expire(1), 2);
+    BOOST_CHECK_EQUAL(testPool.mapTx.size(), 0);
+    BOOST_CHECK_EQUAL(testPool.DynamicMemoryUsage(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolTrimKeepTest)
+{
+    // The same low fee parent with a high fee child, and the unrelated transaction
+    CTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_1;
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+    txParent.vout[0].nValue = 10 * COIN;
+
+    CTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].scriptSig = CScript() << OP_2;
+    txChild.vin[0].prevout.hash = txParent.GetHash();
+    txChild.vin[0].prevout.n = 0;
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_2 << OP_EQUAL;
+    txChild.vout[0].nValue = 10 * COIN;
+
+    CTransaction txOther;
+    txOther.vin.resize(1);
+    txOther.vin[0].scriptSig = CScript() << OP_3;
+    txOther.vout.resize(1);
+    txOther.vout[0].scriptPubKey = CScript() << OP_3 << OP_EQUAL;
+    txOther.vout[0].nValue = 10 * COIN;
+
+    CTxMemPool testPool;
+    testPool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000LL, 0, 0.0, 1));
+    testPool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 100000LL, 1, 0.0, 1));
+    testPool.addUnchecked(txOther.GetHash(), CTxMemPoolEntry(txOther, 10000LL, 2, 0.0, 1));
+
+    // With the worst package kept, the next one goes instead
+    std::set<uint256> setKeep;
+    setKeep.insert(txOther.GetHash());
+    std::list<CTransaction> removed;
+    testPool.TrimToSize(testPool.DynamicMemoryUsage() - 1, &removed, &setKeep);
+    BOOST_CHECK(testPool.exists(txOther.GetHash()));
+    BOOST_CHECK(!testPool.exists(txParent.GetHash()));
+    BOOST_CHECK(!testPool.exists(txChild.GetHash()));
+    BOOST_CHECK_EQUAL(removed.size(), 2);
+
+    // Kept transactions stay even if the pool then does not fit
+    testPool.TrimToSize(0, &removed, &setKeep);
+    BOOST_CHECK(testPool.exists(txOther.GetHash()));
+    BOOST_CHECK_EQUAL(removed.size(), 2);
+
+    // A kept child keeps the parent it spends
+    testPool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000LL, 3, 0.0, 1));
+    testPool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 100000LL, 4, 0.0, 1));
+    setKeep.clear();
+    setKeep.insert(txChild.GetHash());
+    removed.clear();
+    testPool.TrimToSize(0, &removed, &setKeep);
+    BOOST_CHECK(testPool.exists(txParent.GetHash()));
+    BOOST_CHECK(testPool.exists(txChild.GetHash()));
+    BOOST_CHECK(!testPool.exists(txOther.GetHash()));
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolFreeTxTest)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CBasicKeyStore keystore;
+    keystore.AddKey(key);
+
+    CTransaction txPrev;
+    txPrev.vin.resize(1);
+    txPrev.vin[0].prevout.hash = GetRandHash();
+    txPrev.vin[0].prevout.n = 0;
+    txPrev.vout.resize(1);
+    txPrev.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    txPrev.vout[0].nValue = 10 * COIN;
+
+    // Pays no fee at all, and is small enough for the free area of a block
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = txPrev.GetHash();
+    tx.vin[0].prevout.n = 0;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    tx.vout[0].nValue = 10 * COIN;
+    BOOST_CHECK(SignSignature(keystore, txPrev, tx, 0));
+
+    LOCK(cs_main);
+    pcoinsTip->SetCoins(txPrev.GetHash(), CCoins(txPrev, 0));
+
+    // A pool that never had to evict anything asks for no more than the relay rules
+    CTxMemPool testPool;
+    CValidationState state;
+    BOOST_CHECK_EQUAL(testPool.GetMinFee(1000000), 0);
+    BOOST_CHECK(AcceptToMemoryPool(testPool, state, tx, true, NULL));
+    BOOST_CHECK(testPool.exists(tx.GetHash()));
+
+    pcoinsTip->SetCoins(txPrev.GetHash(), CCoins());
+}
+
+// A transaction spending output 0 of txPrev, or a fresh one when txPrev is null
+static CTransaction MakeChainTx(const CTransaction* ptxPrev, int n)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << n;
+    if (ptxPrev) {
+        tx.vin[0].prevout.hash = ptxPrev->GetHash();
+        tx.vin[0].prevout.n = 0;
+    }
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+    tx.vout[0].nValue = COIN;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(MempoolChainLimitTest)
+{
+    // A chain one short of the ancestor limit
+    CTxMemPool testPool;
+    std::vector<CTransaction> vChain;
+    uint64_t nChainSize = 0;
+    for (unsigned int i = 0; i < DEFAULT_ANCESTOR_LIMIT - 1; i++) {
+        vChain.push_back(MakeChainTx(i ? &vChain.back() : NULL, i));
+        testPool.addUnchecked(vChain.back().GetHash(), CTxMemPoolEntry(vChain.back(), 1000LL, 0, 0.0, 1));
+        nChainSize += testPool.mapTx[vChain.back().GetHash()].GetTxSize();
+    }
+
+    std::string strError;
+    CTransaction txTip = MakeChainTx(&vChain.back(), 100);
+    uint64_t nTipSize = ::GetSerializeSize(txTip, SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK(testPool.CheckPackageLimits(txTip, nTipSize, DEFAULT_ANCESTOR_LIMIT, DEFAULT_ANCESTOR_SIZE_LIMIT * 1000,
+                                            DEFAULT_DESCENDANT_LIMIT, DEFAULT_DESCENDANT_SIZE_LIMIT * 1000, strError));
+    // Size limits count the transaction with its whole package
+    BOOST_CHECK(!testPool.CheckPackageLimits(txTip, nTipSize, DEFAULT_ANCESTOR_LIMIT, nChainSize + nTipSize - 1,
+                                             DEFAULT_DESCENDANT_LIMIT, DEFAULT_DESCENDANT_SIZE_LIMIT * 1000, strError));
+    BOOST_CHECK(!testPool.CheckPackageLimits(txTip, nTipSize, DEFAULT_ANCESTOR_LIMIT, DEFAULT_ANCESTOR_SIZE_LIMIT * 1000,
+                                             DEFAULT_DESCENDANT_LIMIT, nChainSize + nTipSize - 1, strError));
+    testPool.addUnchecked(txTip.GetHash(), CTxMemPoolEntry(txTip, 1000LL, 0, 0.0, 1));
+    vChain.push_back(txTip);
+
+    // Now at the limit: nothing more on top of the chain ...
+    CTransaction txTooLong = MakeChainTx(&vChain.back(), 101);
+    BOOST_CHECK(!testPool.CheckPackageLimits(txTooLong, nTipSize, DEFAULT_ANCESTOR_LIMIT, DEFAULT_ANCESTOR_SIZE_LIMIT * 1000,
+                                             DEFAULT_DESCENDANT_LIMIT, DEFAULT_DESCENDANT_SIZE_LIMIT * 1000, strError));
+    BOOST_CHECK(strError.find("ancestors") != std::string::npos);
+
+    // ... and no other child of its first transaction, which already has the most descendants
+    CTransaction txSibling = MakeChainTx(NULL, 102);
+    txSibling.vin.resize(2);
+    txSibling.vin[1].prevout.hash = vChain[0].GetHash();
+    txSibling.vin[1].prevout.n = 1;
+    BOOST_CHECK(!testPool.CheckPackageLimits(txSibling, nTipSize, DEFAULT_ANCESTOR_LIMIT, DEFAULT_ANCESTOR_SIZE_LIMIT * 1000,
+                                             DEFAULT_DESCENDANT_LIMIT, DEFAULT_DESCENDANT_SIZE_LIMIT * 1000, strError));
+    BOOST_CHECK(strError.find("descendants") != std::string::npos);
+
+    // Unrelated transactions are not held back
+    CTransaction txOther = MakeChainTx(NULL, 103);
+    BOOST_CHECK(testPool.CheckPackageLimits(txOther, nTipSize, DEFAULT_ANCESTOR_LIMIT, DEFAULT_ANCESTOR_SIZE_LIMIT * 1000,
+                                            DEFAULT_DESCENDANT_LIMIT, DEFAULT_DESCENDANT_SIZE_LIMIT * 1000, strError));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
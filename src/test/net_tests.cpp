@@ -0,0 +1,104 @@
+// Copyright (c) 2014-2015 The Dash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "net.h"
+
+#include "serialize.h"
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+// Take the whole buffer out of a stream, to look at its capacity and allocator
+static CSerializeData TakeBuffer(CDataStream& ss)
+{
+    CSerializeData data;
+    ss.SwapBuffer(data);
+    return data;
+}
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+BOOST_AUTO_TEST_CASE(zero_after_free_allocator_swap)
+{
+    CSerializeData zeroed;
+    CSerializeData plain((zero_after_free_allocator<char>(false)));
+    BOOST_CHECK(zeroed.get_allocator().fZero);
+    BOOST_CHECK(!plain.get_allocator().fZero);
+
+    // Whether memory is cleared goes along with it
+    plain.resize(100);
+    zeroed.swap(plain);
+    BOOST_CHECK(!zeroed.get_allocator().fZero);
+    BOOST_CHECK(plain.get_allocator().fZero);
+    plain = CSerializeData(zero_after_free_allocator<char>(false));
+    BOOST_CHECK(!plain.get_allocator().fZero);
+
+    // Streams still clear their buffers by default
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << 1;
+    BOOST_CHECK(TakeBuffer(ss).get_allocator().fZero);
+}
+
+BOOST_AUTO_TEST_CASE(receive_buffer_pool)
+{
+    CReceiveBufferPool pool;
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+
+    // An empty pool hands out a new buffer that is not cleared when freed
+    pool.Get(ss);
+    ss.reserve(1000);
+    ss << 1;
+    CSerializeData data = TakeBuffer(ss);
+    BOOST_CHECK(!data.get_allocator().fZero);
+    BOOST_CHECK(data.capacity() >= 1000);
+
+    // A message's buffer is kept, and the next message gets it back empty
+    ss.SwapBuffer(data);
+    const char* pchBuffer = &ss[0];
+    pool.Put(ss);
+    BOOST_CHECK_EQUAL(pool.size(), 1U);
+    BOOST_CHECK(ss.empty());
+    CDataStream ss2(SER_NETWORK, PROTOCOL_VERSION);
+    pool.Get(ss2);
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+    BOOST_CHECK(ss2.empty());
+    data = TakeBuffer(ss2);
+    BOOST_CHECK(data.capacity() >= 1000);
+    BOOST_CHECK(data.data() == pchBuffer);
+    BOOST_CHECK(!data.get_allocator().fZero);
+
+    // Growing a pooled buffer keeps it non-clearing
+    ss2.SwapBuffer(data);
+    ss2.reserve(MAX_POOLED_RECV_BUFFER + 1);
+    data = TakeBuffer(ss2);
+    BOOST_CHECK(!data.get_allocator().fZero);
+
+    // Too large a buffer is released instead of kept
+    ss2.SwapBuffer(data);
+    pool.Put(ss2);
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+
+    // So are buffers that were never used, and any beyond RECV_BUFFER_POOL_SIZE
+    pool.Put(ss2);
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+    for (unsigned int i = 0; i < RECV_BUFFER_POOL_SIZE + 2; i++) {
+        CDataStream ssMsg(SER_NETWORK, PROTOCOL_VERSION);
+        pool.Get(ssMsg);
+        ssMsg << i;
+        pool.Put(ssMsg);
+        // The same buffer goes round, so the pool never holds more than one
+        BOOST_CHECK_EQUAL(pool.size(), 1U);
+    }
+    vector<CDataStream> vMsgs(RECV_BUFFER_POOL_SIZE + 2, CDataStream(SER_NETWORK, PROTOCOL_VERSION));
+    BOOST_FOREACH(CDataStream& ssMsg, vMsgs) {
+        pool.Get(ssMsg);
+        ssMsg << 1;
+    }
+    BOOST_FOREACH(CDataStream& ssMsg, vMsgs)
+        pool.Put(ssMsg);
+    BOOST_CHECK_EQUAL(pool.size(), RECV_BUFFER_POOL_SIZE);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -8,6 +8,8 @@
 #include "base58.h"
 
 #include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
 
 using namespace std;
@@ -138,4 +140,46 @@ BOOST_AUTO_TEST_CASE(rpc_parse_monetary_values)
     BOOST_CHECK(AmountFromValue(ValueFromString("20999999.99999999")) == 2099999999999999LL);
 }
 
+static bool AppendChunk(vector<string>& vChunks, const string& str)
+{
+    vChunks.push_back(str);
+    return true;
+}
+
+BOOST_AUTO_TEST_CASE(rpc_stream_writer)
+{
+    Object obj;
+    obj.push_back(Pair("txid", "00ff\"\\"));
+    obj.push_back(Pair("value", ValueFromAmount(123456789)));
+    obj.push_back(Pair("empty", Array()));
+    obj.push_back(Pair("nested", Object()));
+    Array arr;
+    for (int i = 0; i < 50; i++)
+    {
+        arr.push_back(obj);
+        arr.push_back(i);
+        arr.push_back(Value::null);
+    }
+    Value value(arr);
+
+    // Small chunks so that the text is split in many places
+    vector<string> vChunks;
+    CJSONStreamWriter writer(boost::bind(&AppendChunk, boost::ref(vChunks), _1), 16);
+    writer.WriteValue(value);
+    BOOST_CHECK(writer.Flush());
+    BOOST_CHECK(vChunks.size() > 1);
+    BOOST_CHECK_EQUAL(boost::algorithm::join(vChunks, ""), write_string(value, false));
+
+    // The same text comes back out of a chunked HTTP message
+    string strMessage = HTTPReplyChunkedHeader(HTTP_OK, true).substr(strlen("HTTP/1.1 200 OK\r\n"));
+    BOOST_FOREACH(const string& strChunk, vChunks)
+        strMessage += HTTPChunk(strChunk);
+    strMessage += HTTPChunk("");
+    std::istringstream stream(strMessage);
+    map<string, string> mapHeaders;
+    string strBody;
+    BOOST_CHECK_EQUAL(ReadHTTPMessage(stream, mapHeaders, strBody, 1), HTTP_OK);
+    BOOST_CHECK_EQUAL(strBody, write_string(value, false));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -158,6 +158,21 @@ BOOST_AUTO_TEST_CASE(insert_delete)
     CSerializeData d;
     ss.GetAndClear(d);
     BOOST_CHECK_EQUAL(ss.size(), 0);
+    BOOST_CHECK_EQUAL(d.size(), 4);
+    BOOST_CHECK_EQUAL(d[3], (char)0xff);
+
+    // ... also when the buffer is handed over instead of copied, or appended to
+    CDataStream ss2(SER_DISK, 0);
+    ss2 << (unsigned char)7;
+    CSerializeData d2;
+    ss2.GetAndClear(d2);
+    BOOST_CHECK_EQUAL(ss2.size(), 0);
+    BOOST_CHECK_EQUAL(d2.size(), 1);
+    ss2 << (unsigned char)8;
+    ss2.GetAndClear(d2);
+    BOOST_CHECK_EQUAL(d2.size(), 2);
+    BOOST_CHECK_EQUAL(d2[0], 7);
+    BOOST_CHECK_EQUAL(d2[1], 8);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,136 @@
+// Copyright (c) 2014-2015 The Dash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "socketevents.h"
+
+#include "util.h"
+
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+static void WakeupAfter(CSocketEvents* pevents, int64_t nMilliseconds)
+{
+    MilliSleep(nMilliseconds);
+    pevents->Wakeup();
+}
+
+BOOST_AUTO_TEST_SUITE(socketevents_tests)
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(socketevents_wakeup)
+{
+    for (int nEdgeTriggered = 0; nEdgeTriggered < 2; nEdgeTriggered++) {
+        CSocketEvents events;
+        events.Init(8, nEdgeTriggered);
+        BOOST_CHECK_EQUAL(events.MaxTimeout(), SOCKET_WAIT_IDLE_MS);
+
+        // Every round needs its own wakeup, so a flag left behind would show up here
+        for (int i = 0; i < 3; i++) {
+            events.Reset();
+            boost::thread thread(WakeupAfter, &events, 50);
+            int64_t nStart = GetTimeMillis();
+            map<SOCKET, int> mapEvents;
+            events.Wait(20000, mapEvents);
+            BOOST_CHECK(GetTimeMillis() - nStart < 10000);
+            // The wakeup pipe is not reported as a socket
+            BOOST_CHECK(mapEvents.empty());
+            thread.join();
+        }
+
+        // Wakeups before the Wait are not lost, and collapse into one
+        events.Wakeup();
+        events.Wakeup();
+        events.Reset();
+        int64_t nStart = GetTimeMillis();
+        map<SOCKET, int> mapEvents;
+        events.Wait(20000, mapEvents);
+        BOOST_CHECK(GetTimeMillis() - nStart < 10000);
+        events.Reset();
+        nStart = GetTimeMillis();
+        events.Wait(100, mapEvents);
+        BOOST_CHECK(GetTimeMillis() - nStart >= 90);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(socketevents_level_triggered)
+{
+    int hSockets[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, hSockets) == 0);
+    CSocketEvents events;
+    events.Init(8, false);
+    BOOST_CHECK(!events.IsEdgeTriggered());
+
+    // Nothing to read yet
+    map<SOCKET, int> mapEvents;
+    events.Reset();
+    events.Watch(hSockets[0], SOCKET_EVENT_RECV);
+    events.Wait(0, mapEvents);
+    BOOST_CHECK(mapEvents.empty());
+
+    // Writable right away, but only reported when asked for
+    events.Reset();
+    events.Watch(hSockets[0], SOCKET_EVENT_SEND);
+    events.Wait(0, mapEvents);
+    BOOST_CHECK_EQUAL(mapEvents[hSockets[0]], SOCKET_EVENT_SEND);
+
+    // Readable for as long as the data is not read
+    BOOST_CHECK_EQUAL(send(hSockets[1], "x", 1, 0), 1);
+    for (int i = 0; i < 2; i++) {
+        events.Reset();
+        events.Watch(hSockets[0], SOCKET_EVENT_RECV);
+        events.Wait(1000, mapEvents);
+        BOOST_CHECK_EQUAL(mapEvents.size(), 1U);
+        BOOST_CHECK(mapEvents[hSockets[0]] & SOCKET_EVENT_RECV);
+    }
+    char c;
+    BOOST_CHECK_EQUAL(recv(hSockets[0], &c, 1, 0), 1);
+    events.Reset();
+    events.Watch(hSockets[0], SOCKET_EVENT_RECV);
+    events.Wait(0, mapEvents);
+    BOOST_CHECK(mapEvents.empty());
+
+    // A hangup is reported on a socket watched for receiving
+    close(hSockets[1]);
+    events.Reset();
+    events.Watch(hSockets[0], SOCKET_EVENT_RECV);
+    events.Wait(1000, mapEvents);
+    BOOST_CHECK(mapEvents[hSockets[0]] != 0);
+    close(hSockets[0]);
+}
+
+BOOST_AUTO_TEST_CASE(socketevents_edge_triggered)
+{
+    CSocketEvents events;
+    events.Init(8);
+    if (!events.IsEdgeTriggered())
+        return; // no epoll on this system
+
+    int hSockets[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, hSockets) == 0);
+    events.Add(hSockets[0], false);
+
+    // Registering reports the writable socket once, without being asked again
+    map<SOCKET, int> mapEvents;
+    events.Wait(1000, mapEvents);
+    BOOST_CHECK_EQUAL(mapEvents[hSockets[0]], SOCKET_EVENT_SEND);
+    events.Wait(0, mapEvents);
+    BOOST_CHECK(mapEvents.empty());
+
+    // New data is reported once, even while it stays unread
+    BOOST_CHECK_EQUAL(send(hSockets[1], "x", 1, 0), 1);
+    events.Wait(1000, mapEvents);
+    BOOST_CHECK(mapEvents[hSockets[0]] & SOCKET_EVENT_RECV);
+    events.Wait(0, mapEvents);
+    BOOST_CHECK(mapEvents.empty());
+
+    close(hSockets[1]);
+    events.Wait(1000, mapEvents);
+    BOOST_CHECK(mapEvents[hSockets[0]] & SOCKET_EVENT_ERR);
+    close(hSockets[0]);
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,99 @@
+// Copyright (c) 2014-2015 The Dash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "stratum.h"
+
+#include "bignum.h"
+#include "chainparams.h"
+#include "main.h"
+#include "util.h"
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+// The serialized coinbase as hex, the way a miner assembles it from mining.notify
+static string CoinbaseHex(const CTransaction& tx)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << tx;
+    return HexStr(ss.begin(), ss.end());
+}
+
+BOOST_AUTO_TEST_SUITE(stratum_tests)
+
+BOOST_AUTO_TEST_CASE(stratum_coinbase_split)
+{
+    CTransaction txTemplate;
+    txTemplate.vin.resize(1);
+    txTemplate.vin[0].prevout.SetNull();
+    txTemplate.vout.resize(2);
+    txTemplate.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(20, 0x42) << OP_EQUALVERIFY << OP_CHECKSIG;
+    txTemplate.vout[0].nValue = 5 * COIN;
+    txTemplate.vout[1].scriptPubKey = CScript() << OP_TRUE;
+    txTemplate.vout[1].nValue = COIN;
+
+    // One, two, three and four byte height pushes
+    int nHeights[] = {1, 300, 100000, 20000000};
+    BOOST_FOREACH(int nHeight, nHeights) {
+        CTransaction tx = txTemplate;
+        unsigned int nExtraNonceOffset;
+        string strCoinbase1, strCoinbase2;
+        BOOST_CHECK(PrepareStratumCoinbase(tx, nHeight, nExtraNonceOffset, strCoinbase1, strCoinbase2));
+        BOOST_CHECK(tx.vin[0].scriptSig.size() <= 100);
+
+        // With zero extranonces the pieces make up the template coinbase
+        string strZeros(2 * (STRATUM_EXTRANONCE1_SIZE + STRATUM_EXTRANONCE2_SIZE), '0');
+        BOOST_CHECK_EQUAL(strCoinbase1 + strZeros + strCoinbase2, CoinbaseHex(tx));
+
+        // The height stays in front of the extranonces (BIP34)
+        CScript scriptHeight = CScript() << nHeight;
+        BOOST_CHECK(std::equal(scriptHeight.begin(), scriptHeight.end(), tx.vin[0].scriptSig.begin()));
+        BOOST_CHECK_EQUAL(tx.vin[0].scriptSig[nExtraNonceOffset - 1], STRATUM_EXTRANONCE1_SIZE + STRATUM_EXTRANONCE2_SIZE);
+
+        // What the miner builds from coinbase1, extranonce1, extranonce2 and coinbase2
+        // is what the server rebuilds on mining.submit
+        uint32_t nExtraNonce1 = 0x01020304;
+        vector<unsigned char> vchExtraNonce2 = ParseHex("aabbccdd");
+        string strMiner = strCoinbase1 + strprintf("%08x", nExtraNonce1) + HexStr(vchExtraNonce2) + strCoinbase2;
+        SetStratumExtraNonce(tx, nExtraNonceOffset, nExtraNonce1, vchExtraNonce2);
+        BOOST_CHECK_EQUAL(strMiner, CoinbaseHex(tx));
+    }
+
+    // No room left for the extranonces under the 100 byte scriptSig limit
+    CScript scriptFlags = COINBASE_FLAGS;
+    COINBASE_FLAGS = CScript() << vector<unsigned char>(90, 0x01);
+    CTransaction tx = txTemplate;
+    unsigned int nExtraNonceOffset;
+    string strCoinbase1, strCoinbase2;
+    BOOST_CHECK(!PrepareStratumCoinbase(tx, 1, nExtraNonceOffset, strCoinbase1, strCoinbase2));
+    COINBASE_FLAGS = scriptFlags;
+}
+
+BOOST_AUTO_TEST_CASE(stratum_share_target)
+{
+    // Difficulty 1 is the bitcoin difficulty 1 target, higher difficulties divide it
+    uint256 hashDiff1 = CBigNum().SetCompact(STRATUM_DIFF1_BITS).getuint256();
+    BOOST_CHECK(GetStratumShareTarget(1) == hashDiff1);
+    BOOST_CHECK(GetStratumShareTarget(16) == (CBigNum(hashDiff1) / 16).getuint256());
+    BOOST_CHECK(GetStratumShareTarget(1.0 / 65536) == (CBigNum(hashDiff1) * 65536).getuint256());
+
+    // The main network genesis block, hash 000006d2f89bed88...
+    const CBlockHeader header = Params().GenesisBlock().GetBlockHeader();
+    uint256 hash;
+    BOOST_CHECK(CheckStratumShare(header, CBigNum().SetCompact(header.nBits).getuint256(), hash));
+    BOOST_CHECK(hash == Params().HashGenesisBlock());
+
+    // The share target is inclusive
+    BOOST_CHECK(CheckStratumShare(header, hash, hash));
+    uint256 hashBelow = hash;
+    hashBelow -= 1;
+    BOOST_CHECK(!CheckStratumShare(header, hashBelow, hash));
+
+    // About 2^235: a share at the lowest difficulty, not at difficulty 1
+    BOOST_CHECK(CheckStratumShare(header, GetStratumShareTarget(1.0 / 65536), hash));
+    BOOST_CHECK(!CheckStratumShare(header, GetStratumShareTarget(1), hash));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
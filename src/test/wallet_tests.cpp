@@ -4,6 +4,10 @@
 
 #include "wallet.h"
 
+#include "instantx.h"
+#include "main.h"
+
+#include <list>
 #include <set>
 #include <stdint.h>
 #include <utility>
@@ -303,4 +307,246 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+BOOST_AUTO_TEST_CASE(ismine_index_tests)
+{
+    CWallet keywallet;
+    LOCK(keywallet.cs_wallet);
+    CKey key, keyOther;
+    key.MakeNewKey(true);
+    keyOther.MakeNewKey(false);
+    BOOST_CHECK(keywallet.AddKeyPubKey(key, key.GetPubKey()));
+
+    CTxOut txout;
+    txout.scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    BOOST_CHECK(keywallet.IsMine(txout));
+    txout.scriptPubKey = CScript() << key.GetPubKey() << OP_CHECKSIG;
+    BOOST_CHECK(keywallet.IsMine(txout));
+    txout.scriptPubKey.SetDestination(keyOther.GetPubKey().GetID());
+    BOOST_CHECK(!keywallet.IsMine(txout));
+    txout.scriptPubKey = CScript() << keyOther.GetPubKey() << OP_CHECKSIG;
+    BOOST_CHECK(!keywallet.IsMine(txout));
+
+    // Pay-to-script-hash is ours once the redeem script is added
+    vector<CPubKey> vPubKeys;
+    vPubKeys.push_back(key.GetPubKey());
+    vPubKeys.push_back(keyOther.GetPubKey());
+    CScript redeemScript;
+    redeemScript.SetMultisig(1, vPubKeys);
+    txout.scriptPubKey.SetDestination(redeemScript.GetID());
+    BOOST_CHECK(!keywallet.IsMine(txout));
+    BOOST_CHECK(keywallet.AddCScript(redeemScript));
+    BOOST_CHECK(keywallet.IsMine(txout));
+
+    // Bare multisig is not covered by the index and still goes through the solver
+    txout.scriptPubKey.SetMultisig(1, vector<CPubKey>(1, key.GetPubKey()));
+    BOOST_CHECK(keywallet.IsMine(txout));
+    txout.scriptPubKey = redeemScript; // needs every key
+    BOOST_CHECK(!keywallet.IsMine(txout));
+}
+
+static set<COutPoint> AvailableOutPoints(const CWallet& w, AvailableCoinsType coin_type = ALL_COINS)
+{
+    vector<COutput> vAvailable;
+    w.AvailableCoins(vAvailable, false, NULL, coin_type);
+    set<COutPoint> setRet;
+    BOOST_FOREACH(const COutput& out, vAvailable)
+        setRet.insert(COutPoint(out.tx->GetHash(), out.i));
+    return setRet;
+}
+
+BOOST_AUTO_TEST_CASE(unspent_index_tests)
+{
+    CWallet keywallet;
+    CKey key, keyOther, keyLate;
+    key.MakeNewKey(true);
+    keyOther.MakeNewKey(true);
+    keyLate.MakeNewKey(true);
+    LOCK2(cs_main, keywallet.cs_wallet);
+    BOOST_CHECK(keywallet.AddKeyPubKey(key, key.GetPubKey()));
+    darkSendDenominations.push_back(1 * COIN + 1000);
+
+    // One output of each class
+    CTransaction txFund;
+    txFund.vin.resize(1);
+    txFund.vin[0].prevout.hash = GetRandHash();
+    txFund.vin[0].prevout.n = 0;
+    txFund.vout.resize(4);
+    txFund.vout[0].nValue = 1 * COIN + 1000;
+    txFund.vout[1].nValue = 2 * DARKSEND_COLLATERAL;
+    txFund.vout[2].nValue = 1000 * COIN;
+    txFund.vout[3].nValue = 5 * COIN;
+    for (unsigned int i = 0; i < txFund.vout.size(); i++)
+        txFund.vout[i].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    uint256 hashFund = txFund.GetHash();
+    BOOST_CHECK(keywallet.AddToWallet(CWalletTx(&keywallet, txFund)));
+
+    BOOST_CHECK_EQUAL(AvailableOutPoints(keywallet).size(), 4);
+    set<COutPoint> setAvailable = AvailableOutPoints(keywallet, ONLY_DENOMINATED);
+    BOOST_CHECK_EQUAL(setAvailable.size(), 1);
+    BOOST_CHECK(setAvailable.count(COutPoint(hashFund, 0)));
+    setAvailable = AvailableOutPoints(keywallet, ONLY_NONDENOMINATED);
+    BOOST_CHECK_EQUAL(setAvailable.size(), 2);
+    BOOST_CHECK(setAvailable.count(COutPoint(hashFund, 2)));
+    BOOST_CHECK(setAvailable.count(COutPoint(hashFund, 3)));
+    setAvailable = AvailableOutPoints(keywallet, ONLY_NONDENOMINATED_NOTMN);
+    BOOST_CHECK_EQUAL(setAvailable.size(), 1);
+    BOOST_CHECK(setAvailable.count(COutPoint(hashFund, 3)));
+
+    // Spend the last output in a block on top of genesis
+    CBlockIndex* pindexGenesis = chainActive.Tip();
+    uint256 hashBlock = GetRandHash();
+    CBlockIndex indexBlock;
+    indexBlock.phashBlock = &hashBlock;
+    indexBlock.pprev = pindexGenesis;
+    indexBlock.nHeight = pindexGenesis->nHeight + 1;
+    indexBlock.nTime = pindexGenesis->nTime + 1;
+    mapBlockIndex[hashBlock] = &indexBlock;
+    chainActive.SetTip(&indexBlock);
+
+    CTransaction txSpend;
+    txSpend.vin.resize(1);
+    txSpend.vin[0].prevout = COutPoint(hashFund, 3);
+    txSpend.vout.resize(1);
+    txSpend.vout[0].nValue = 5 * COIN;
+    txSpend.vout[0].scriptPubKey.SetDestination(keyOther.GetPubKey().GetID());
+    CWalletTx wtxSpend(&keywallet, txSpend);
+    wtxSpend.hashBlock = hashBlock;
+    wtxSpend.nIndex = 0;
+    wtxSpend.fMerkleVerified = true;
+    BOOST_CHECK(keywallet.AddToWallet(wtxSpend));
+
+    // Pruned from the index once the spend is confirmed
+    setAvailable = AvailableOutPoints(keywallet);
+    BOOST_CHECK_EQUAL(setAvailable.size(), 3);
+    BOOST_CHECK(!setAvailable.count(COutPoint(hashFund, 3)));
+
+    // Disconnecting the spending block brings it back
+    chainActive.SetTip(pindexGenesis);
+    mapBlockIndex.erase(hashBlock);
+    setAvailable = AvailableOutPoints(keywallet);
+    BOOST_CHECK_EQUAL(setAvailable.size(), 4);
+    BOOST_CHECK(setAvailable.count(COutPoint(hashFund, 3)));
+
+    // Pay-to-script-hash output that is only ours once the script is added
+    CScript redeemScript;
+    redeemScript.SetMultisig(1, vector<CPubKey>(1, key.GetPubKey()));
+    CTransaction txScript;
+    txScript.vin.resize(1);
+    txScript.vin[0].prevout.hash = GetRandHash();
+    txScript.vin[0].prevout.n = 0;
+    txScript.vout.resize(1);
+    txScript.vout[0].nValue = 7 * COIN;
+    txScript.vout[0].scriptPubKey.SetDestination(redeemScript.GetID());
+    BOOST_CHECK(keywallet.AddToWallet(CWalletTx(&keywallet, txScript)));
+    BOOST_CHECK(!AvailableOutPoints(keywallet).count(COutPoint(txScript.GetHash(), 0)));
+    BOOST_CHECK(keywallet.AddCScript(redeemScript));
+    BOOST_CHECK(AvailableOutPoints(keywallet).count(COutPoint(txScript.GetHash(), 0)));
+
+    // A key imported after its payment arrived, then MarkDirty as importprivkey does
+    CTransaction txLate;
+    txLate.vin.resize(1);
+    txLate.vin[0].prevout.hash = GetRandHash();
+    txLate.vin[0].prevout.n = 0;
+    txLate.vout.resize(1);
+    txLate.vout[0].nValue = 3 * COIN;
+    txLate.vout[0].scriptPubKey.SetDestination(keyLate.GetPubKey().GetID());
+    BOOST_CHECK(keywallet.AddToWallet(CWalletTx(&keywallet, txLate)));
+    BOOST_CHECK(!AvailableOutPoints(keywallet).count(COutPoint(txLate.GetHash(), 0)));
+    BOOST_CHECK(keywallet.AddKeyPubKey(keyLate, keyLate.GetPubKey()));
+    keywallet.MarkDirty();
+    setAvailable = AvailableOutPoints(keywallet);
+    BOOST_CHECK_EQUAL(setAvailable.size(), 6);
+    BOOST_CHECK(setAvailable.count(COutPoint(txLate.GetHash(), 0)));
+
+    darkSendDenominations.pop_back();
+}
+
+BOOST_AUTO_TEST_CASE(balance_cache_tests)
+{
+    CWallet keywallet;
+    CKey key;
+    key.MakeNewKey(true);
+    {
+        LOCK(keywallet.cs_wallet);
+        BOOST_CHECK(keywallet.AddKeyPubKey(key, key.GetPubKey()));
+    }
+
+    // Paid by someone else, so only a block or a complete lock makes it trusted
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vin[0].prevout.n = 0;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    tx.vout[0].nValue = COIN;
+    uint256 hash = tx.GetHash();
+    {
+        LOCK2(cs_main, keywallet.cs_wallet);
+        BOOST_CHECK(keywallet.AddToWallet(CWalletTx(&keywallet, tx)));
+    }
+
+    // Neither in a block nor in the memory pool
+    BOOST_CHECK_EQUAL(keywallet.GetUnconfirmedBalance(), 0);
+    BOOST_CHECK_EQUAL(keywallet.GetBalance(), 0);
+
+    // Entering the memory pool, as the wallet hears of it from AcceptToMemoryPool
+    mempool.addUnchecked(hash, CTxMemPoolEntry(tx, 0, GetTime(), 0.0, 0));
+    keywallet.SyncTransaction(hash, tx, NULL);
+    BOOST_CHECK_EQUAL(keywallet.GetUnconfirmedBalance(), COIN);
+    BOOST_CHECK_EQUAL(keywallet.GetBalance(), 0);
+
+    // Completing a lock, as ProcessConsensusVote does
+    CTransactionLock txlock;
+    txlock.nBlockHeight = 1;
+    txlock.txHash = hash;
+    txlock.nExpiration = GetTime() + 60 * 60;
+    txlock.nTimeout = GetTime() + 60 * 5;
+    txlock.vecConsensusVotes.resize(INSTANTX_SIGNATURES_REQUIRED);
+    BOOST_FOREACH(CConsensusVote& vote, txlock.vecConsensusVotes)
+        vote.nBlockHeight = 1;
+    {
+        LOCK(cs_instantx);
+        mapTxLocks[hash] = txlock;
+    }
+    nCompleteTXLocks++;
+    BOOST_CHECK_EQUAL(keywallet.GetUnconfirmedBalance(), 0);
+    BOOST_CHECK_EQUAL(keywallet.GetBalance(), COIN);
+
+    // Locks are not trusted while a large work fork is around
+    fLargeWorkForkFound = true;
+    BOOST_CHECK_EQUAL(keywallet.GetBalance(), 0);
+    fLargeWorkForkFound = false;
+    BOOST_CHECK_EQUAL(keywallet.GetBalance(), COIN);
+
+    // Removing the expired lock
+    {
+        LOCK2(cs_main, cs_instantx);
+        mapTxLocks[hash].nExpiration = GetTime() - 1;
+        CleanTransactionLocksList();
+        BOOST_CHECK(!mapTxLocks.count(hash));
+    }
+    BOOST_CHECK_EQUAL(keywallet.GetBalance(), 0);
+    BOOST_CHECK_EQUAL(keywallet.GetUnconfirmedBalance(), COIN);
+
+    // Unrelated memory pool traffic leaves the cached balances alone
+    CTransaction txOther;
+    txOther.vin.resize(1);
+    txOther.vin[0].prevout.hash = GetRandHash();
+    txOther.vin[0].prevout.n = 0;
+    txOther.vout.resize(1);
+    txOther.vout[0].nValue = COIN;
+    unsigned int nGeneration = keywallet.nMempoolGeneration;
+    mempool.addUnchecked(txOther.GetHash(), CTxMemPoolEntry(txOther, 0, GetTime(), 0.0, 0));
+    keywallet.SyncTransaction(txOther.GetHash(), txOther, NULL);
+    keywallet.UpdatedTransaction(txOther.GetHash());
+    BOOST_CHECK_EQUAL(keywallet.nMempoolGeneration, nGeneration);
+    list<CTransaction> removed;
+    mempool.remove(txOther, removed);
+
+    // Leaving the memory pool, as the wallet hears of it after an eviction
+    mempool.remove(tx, removed);
+    keywallet.UpdatedTransaction(hash);
+    BOOST_CHECK_EQUAL(keywallet.GetUnconfirmedBalance(), 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -4,12 +4,18 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "txdb.h"
+#include "blockfilter.h"
+#include "coinscommitment.h"
 
 #include "core.h"
+#include "hash.h"
 #include "uint256.h"
 
 #include <stdint.h>
 
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+
 using namespace std;
 
 void static BatchWriteCoins(CLevelDBBatch &batch, const uint256 &hash, const CCoins &coins) {
@@ -23,7 +29,7 @@ void static BatchWriteHashBestChain(CLevelDBBatch &batch, const uint256 &hash) {
     batch.Write('B', hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) {
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe, const std::string &strName) : db(GetDataDir() / strName, nCacheSize, fMemory, fWipe) {
 }
 
 bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) {
@@ -107,57 +113,114 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
     return Read('l', nFile);
 }
 
+void ApplyStats(CCoinsStats &stats, CHashWriter &ss, const uint256 &txid, const CCoins &coins) {
+    ss << txid;
+    ss << VARINT(coins.nVersion);
+    ss << (coins.fCoinBase ? 'c' : 'n');
+    ss << VARINT(coins.nHeight);
+    stats.nTransactions++;
+    for (unsigned int i=0; i<coins.vout.size(); i++) {
+        const CTxOut &out = coins.vout[i];
+        if (!out.IsNull()) {
+            stats.nTransactionOutputs++;
+            ss << VARINT(i+1);
+            ss << out;
+            stats.nTotalAmount += out.nValue;
+        }
+    }
+    ss << VARINT(0);
+}
+
 bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
-    leveldb::Iterator *pcursor = db.NewIterator();
-    pcursor->SeekToFirst();
+    boost::scoped_ptr<CCoinsViewCursor> pcursor(Cursor());
 
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = GetBestBlock();
+    stats.hashBlock = pcursor->GetBestBlock();
     ss << stats.hashBlock;
-    int64_t nTotalAmount = 0;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
-        try {
-            leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'c') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CCoins coins;
-                ssValue >> coins;
-                uint256 txhash;
-                ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n');
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
-                }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
-            }
-            pcursor->Next();
-        } catch (std::exception &e) {
-            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        uint256 txhash;
+        CCoins coins;
+        if (!pcursor->GetKey(txhash) || !pcursor->GetValue(coins))
+            return error("%s : unable to read value", __func__);
+        ApplyStats(stats, ss, txhash, coins);
+        stats.nSerializedSize += 32 + pcursor->GetValueSize();
+        pcursor->Next();
+    }
+    stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
+    stats.hashSerialized = ss.GetHash();
+    return true;
+}
+
+CCoinsViewCursor *CCoinsViewDB::Cursor() {
+    const leveldb::Snapshot *snapshot = db.GetSnapshot();
+
+    // Read the best block as of the snapshot, not as of now
+    uint256 hashBestChain = 0;
+    {
+        boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator(snapshot));
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey << 'B';
+        pcursor->Seek(ssKey.str());
+        if (pcursor->Valid() && pcursor->key() == ssKey.str()) {
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> hashBestChain;
         }
     }
+
+    return new CCoinsViewDBCursor(db, snapshot, hashBestChain);
+}
+
+CCoinsViewDBCursor::CCoinsViewDBCursor(CLevelDBWrapper &dbIn, const leveldb::Snapshot *snapshotIn, const uint256 &hashBlockIn) :
+    CCoinsViewCursor(hashBlockIn), db(dbIn), snapshot(snapshotIn), pcursor(dbIn.NewIterator(snapshotIn))
+{
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('c', uint256(0));
+    pcursor->Seek(ssKeySet.str());
+}
+
+CCoinsViewDBCursor::~CCoinsViewDBCursor() {
     delete pcursor;
-    stats.nHeight = mapBlockIndex.find(GetBestBlock())->second->nHeight;
-    stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
+    db.ReleaseSnapshot(snapshot);
+}
+
+bool CCoinsViewDBCursor::GetKey(uint256 &txid) const {
+    try {
+        leveldb::Slice slKey = pcursor->key();
+        CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+        char chType;
+        ssKey >> chType >> txid;
+    } catch (std::exception &e) {
+        return false;
+    }
     return true;
 }
 
+bool CCoinsViewDBCursor::GetValue(CCoins &coins) const {
+    try {
+        leveldb::Slice slValue = pcursor->value();
+        CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+        ssValue >> coins;
+    } catch (std::exception &e) {
+        return false;
+    }
+    return true;
+}
+
+unsigned int CCoinsViewDBCursor::GetValueSize() const {
+    return pcursor->value().size();
+}
+
+bool CCoinsViewDBCursor::Valid() const {
+    // Coin entries are the 'c' records; stop at the first key of another type
+    return pcursor->Valid() && pcursor->key().size() > 0 && pcursor->key()[0] == 'c';
+}
+
+void CCoinsViewDBCursor::Next() {
+    pcursor->Next();
+}
+
 bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
     return Read(make_pair('t', txid), pos);
 }
@@ -181,55 +244,156 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
-bool CBlockTreeDB::LoadBlockIndexGuts()
+bool CBlockTreeDB::WriteCoinsCommitment(const uint256 &hashBlock, const CCoinsCommitment &commitment) {
+    return Write(make_pair('u', hashBlock), commitment);
+}
+
+bool CBlockTreeDB::ReadCoinsCommitment(const uint256 &hashBlock, CCoinsCommitment &commitment) {
+    return Read(make_pair('u', hashBlock), commitment);
+}
+
+bool CBlockTreeDB::EraseCoinsCommitment(const uint256 &hashBlock) {
+    return Erase(make_pair('u', hashBlock));
+}
+
+bool CBlockTreeDB::WriteSnapshotBase(const uint256 &hashBlock, const uint256 &hashSerialized) {
+    return Write('S', make_pair(hashBlock, hashSerialized));
+}
+
+bool CBlockTreeDB::ReadSnapshotBase(uint256 &hashBlock, uint256 &hashSerialized) {
+    pair<uint256, uint256> base;
+    if (!Read('S', base))
+        return false;
+    hashBlock = base.first;
+    hashSerialized = base.second;
+    return true;
+}
+
+bool CBlockTreeDB::EraseSnapshotBase() {
+    return Erase('S');
+}
+
+CBlockFilterDB::CBlockFilterDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "filter", nCacheSize, fMemory, fWipe) {
+}
+
+bool CBlockFilterDB::WriteFilter(const CBlockFilter &filter, const uint256 &hashHeader) {
+    CLevelDBBatch batch;
+    batch.Write(make_pair('f', filter.hashBlock), filter.filter.GetEncoded());
+    batch.Write(make_pair('h', filter.hashBlock), make_pair(filter.GetHash(), hashHeader));
+    return WriteBatch(batch);
+}
+
+bool CBlockFilterDB::ReadFilter(const uint256 &hashBlock, std::vector<unsigned char> &vchFilter) {
+    return Read(make_pair('f', hashBlock), vchFilter);
+}
+
+bool CBlockFilterDB::ReadFilterHeader(const uint256 &hashBlock, uint256 &hashFilter, uint256 &hashHeader) {
+    std::pair<uint256, uint256> hashes;
+    if (!Read(make_pair('h', hashBlock), hashes))
+        return false;
+    hashFilter = hashes.first;
+    hashHeader = hashes.second;
+    return true;
+}
+
+namespace {
+
+/** A block index record as read from disk, with the values that are costly to compute
+ *  (header hash and block work) already filled in by a loader thread. */
+struct CLoadedBlockIndex
 {
-    leveldb::Iterator *pcursor = NewIterator();
+    CDiskBlockIndex diskindex;
+    uint256 hash;
+    uint256 nWork;
+};
+
+/** Deserialize all 'b' records whose hash starts (in serialized form) with a byte in
+ *  [nBegin, nEnd). Each loader thread uses its own LevelDB iterator. */
+void LoadBlockIndexRange(CBlockTreeDB* pdb, unsigned int nBegin, unsigned int nEnd, std::vector<CLoadedBlockIndex>* pvLoaded, std::string* pstrError)
+{
+    leveldb::Iterator *pcursor = pdb->NewIterator();
 
+    uint256 hashSeek = 0;
+    *hashSeek.begin() = (unsigned char)nBegin;
     CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
-    ssKeySet << make_pair('b', uint256(0));
+    ssKeySet << make_pair('b', hashSeek);
     pcursor->Seek(ssKeySet.str());
 
-    // Load mapBlockIndex
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        try {
+    try {
+        while (pcursor->Valid()) {
+            boost::this_thread::interruption_point();
             leveldb::Slice slKey = pcursor->key();
             CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
             char chType;
             ssKey >> chType;
-            if (chType == 'b') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CDiskBlockIndex diskindex;
-                ssValue >> diskindex;
-
-                // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-                pindexNew->nHeight        = diskindex.nHeight;
-                pindexNew->nFile          = diskindex.nFile;
-                pindexNew->nDataPos       = diskindex.nDataPos;
-                pindexNew->nUndoPos       = diskindex.nUndoPos;
-                pindexNew->nVersion       = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime          = diskindex.nTime;
-                pindexNew->nBits          = diskindex.nBits;
-                pindexNew->nNonce         = diskindex.nNonce;
-                pindexNew->nStatus        = diskindex.nStatus;
-                pindexNew->nTx            = diskindex.nTx;
-
-                if (!pindexNew->CheckIndex())
-                    return error("LoadBlockIndex() : CheckIndex failed: %s", pindexNew->ToString());
-
-                pcursor->Next();
-            } else {
-                break; // if shutdown requested or finished loading block index
+            if (chType != 'b')
+                break;
+            uint256 hashKey;
+            ssKey >> hashKey;
+            if (*hashKey.begin() >= nEnd)
+                break;
+
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            pvLoaded->push_back(CLoadedBlockIndex());
+            CLoadedBlockIndex& loaded = pvLoaded->back();
+            ssValue >> loaded.diskindex;
+            loaded.hash = loaded.diskindex.GetBlockHash();
+            loaded.nWork = loaded.diskindex.GetBlockWork().getuint256();
+
+            if (!CheckProofOfWork(loaded.hash, loaded.diskindex.nBits)) {
+                *pstrError = strprintf("CheckIndex failed: %s", loaded.hash.ToString());
+                break;
             }
-        } catch (std::exception &e) {
-            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+
+            pcursor->Next();
         }
+    } catch (std::exception &e) {
+        *pstrError = strprintf("Deserialize or I/O error - %s", e.what());
     }
     delete pcursor;
+}
+
+} // anon namespace
+
+bool CBlockTreeDB::LoadBlockIndexGuts()
+{
+    // Deserializing, hashing and computing the work of each entry is independent,
+    // so split the key space over several threads and link the results afterwards.
+    int nThreads = GetImportThreads();
+    std::vector<std::vector<CLoadedBlockIndex> > vvLoaded(nThreads);
+    std::vector<std::string> vstrError(nThreads);
+    boost::thread_group loaders;
+    for (int i = 0; i < nThreads; i++)
+        loaders.create_thread(boost::bind(&LoadBlockIndexRange, this, 256 * i / nThreads, 256 * (i + 1) / nThreads, &vvLoaded[i], &vstrError[i]));
+    loaders.join_all();
+
+    // Load mapBlockIndex
+    for (int i = 0; i < nThreads; i++) {
+        if (!vstrError[i].empty())
+            return error("LoadBlockIndex() : %s", vstrError[i]);
+        BOOST_FOREACH(const CLoadedBlockIndex& loaded, vvLoaded[i]) {
+            const CDiskBlockIndex& diskindex = loaded.diskindex;
+
+            // Construct block index object
+            CBlockIndex* pindexNew = InsertBlockIndex(loaded.hash);
+            pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nDataPos       = diskindex.nDataPos;
+            pindexNew->nUndoPos       = diskindex.nUndoPos;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+            pindexNew->nStatus        = diskindex.nStatus;
+            pindexNew->nTx            = diskindex.nTx;
+            // Work of this block only; LoadBlockIndexDB turns it into the chain total
+            pindexNew->nChainWork     = loaded.nWork;
+        }
+        std::vector<CLoadedBlockIndex>().swap(vvLoaded[i]);
+    }
 
     return true;
 }
@@ -15,7 +15,10 @@
 #include <vector>
 
 class CBigNum;
+class CBlockFilter;
 class CCoins;
+class CCoinsCommitment;
+class CHashWriter;
 class uint256;
 
 // -dbcache default (MiB)
@@ -31,7 +34,7 @@ class CCoinsViewDB : public CCoinsView
 protected:
     CLevelDBWrapper db;
 public:
-    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, const std::string &strName = "chainstate");
 
     bool GetCoins(const uint256 &txid, CCoins &coins);
     bool SetCoins(const uint256 &txid, const CCoins &coins);
@@ -40,8 +43,35 @@ public:
     bool SetBestBlock(const uint256 &hashBlock);
     bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlock);
     bool GetStats(CCoinsStats &stats);
+    CCoinsViewCursor *Cursor();
 };
 
+/** Cursor over a LevelDB snapshot of the coin database */
+class CCoinsViewDBCursor : public CCoinsViewCursor
+{
+public:
+    ~CCoinsViewDBCursor();
+
+    bool GetKey(uint256 &txid) const;
+    bool GetValue(CCoins &coins) const;
+    unsigned int GetValueSize() const;
+
+    bool Valid() const;
+    void Next();
+
+private:
+    CCoinsViewDBCursor(CLevelDBWrapper &dbIn, const leveldb::Snapshot *snapshotIn, const uint256 &hashBlockIn);
+
+    CLevelDBWrapper &db;
+    const leveldb::Snapshot *snapshot;
+    leveldb::Iterator *pcursor;
+
+    friend class CCoinsViewDB;
+};
+
+/** Add one chainstate entry to the statistics and to the hash_serialized commitment reported by gettxoutsetinfo */
+void ApplyStats(CCoinsStats &stats, CHashWriter &ss, const uint256 &txid, const CCoins &coins);
+
 /** Access to the block database (blocks/index/) */
 class CBlockTreeDB : public CLevelDBWrapper
 {
@@ -63,7 +93,28 @@ public:
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
+    bool WriteCoinsCommitment(const uint256 &hashBlock, const CCoinsCommitment &commitment);
+    bool ReadCoinsCommitment(const uint256 &hashBlock, CCoinsCommitment &commitment);
+    bool EraseCoinsCommitment(const uint256 &hashBlock);
+    bool WriteSnapshotBase(const uint256 &hashBlock, const uint256 &hashSerialized);
+    bool ReadSnapshotBase(uint256 &hashBlock, uint256 &hashSerialized);
+    bool EraseSnapshotBase();
     bool LoadBlockIndexGuts();
 };
 
+/** Access to the compact block filter index (blocks/filter/) */
+class CBlockFilterDB : public CLevelDBWrapper
+{
+public:
+    CBlockFilterDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+private:
+    CBlockFilterDB(const CBlockFilterDB&);
+    void operator=(const CBlockFilterDB&);
+public:
+    bool WriteFilter(const CBlockFilter &filter, const uint256 &hashHeader);
+    bool ReadFilter(const uint256 &hashBlock, std::vector<unsigned char> &vchFilter);
+    /** The filter hash and header, without reading the filter itself */
+    bool ReadFilterHeader(const uint256 &hashBlock, uint256 &hashFilter, uint256 &hashHeader);
+};
+
 #endif // BITCOIN_TXDB_LEVELDB_H
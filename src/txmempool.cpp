@@ -4,13 +4,49 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "core.h"
+#include "main.h"
 #include "txmempool.h"
 
+#include <math.h>
+
 using namespace std;
 
+namespace {
+
+// Size of a heap allocation as glibc malloc rounds it on 64-bit systems
+size_t MallocUsage(size_t alloc)
+{
+    if (alloc == 0)
+        return 0;
+    return ((alloc + 31) >> 4) << 4;
+}
+
+// Heap usage of a node in a std::map or std::set holding T
+template<typename T>
+size_t TreeNodeUsage()
+{
+    return MallocUsage(sizeof(T) + 4 * sizeof(void*));
+}
+
+size_t TransactionUsage(const CTransaction& tx)
+{
+    size_t nUsage = MallocUsage(tx.vin.capacity() * sizeof(CTxIn)) + MallocUsage(tx.vout.capacity() * sizeof(CTxOut));
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nUsage += MallocUsage(txin.scriptSig.capacity());
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nUsage += MallocUsage(txout.scriptPubKey.capacity());
+    return nUsage;
+}
+
+} // anon namespace
+
 CTxMemPoolEntry::CTxMemPoolEntry()
 {
     nHeight = MEMPOOL_HEIGHT;
+    nSigOps = 0;
+    nUsageSize = 0;
+    SetAncestorState(1, 0, 0, 0);
+    SetDescendantState(1, 0, 0);
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, int64_t _nFee,
@@ -19,6 +55,10 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, int64_t _nFee,
     tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight)
 {
     nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    nSigOps = GetLegacySigOpCount(tx);
+    nUsageSize = TransactionUsage(tx);
+    SetAncestorState(1, nTxSize, nFee, nSigOps);
+    SetDescendantState(1, nTxSize, nFee);
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
@@ -26,6 +66,21 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
     *this = other;
 }
 
+void CTxMemPoolEntry::SetAncestorState(uint64_t nCount, uint64_t nSize, int64_t nFees, unsigned int nSigOpCount)
+{
+    nCountWithAncestors = nCount;
+    nSizeWithAncestors = nSize;
+    nFeesWithAncestors = nFees;
+    nSigOpsWithAncestors = nSigOpCount;
+}
+
+void CTxMemPoolEntry::SetDescendantState(uint64_t nCount, uint64_t nSize, int64_t nFees)
+{
+    nCountWithDescendants = nCount;
+    nSizeWithDescendants = nSize;
+    nFeesWithDescendants = nFees;
+}
+
 double
 CTxMemPoolEntry::GetPriority(unsigned int currentHeight) const
 {
@@ -35,12 +90,57 @@ CTxMemPoolEntry::GetPriority(unsigned int currentHeight) const
     return dResult;
 }
 
+double GetAncestorScore(int64_t nFees, uint64_t nSize, int64_t nFeesWithAncestors, uint64_t nSizeWithAncestors)
+{
+    double dFeeRate = nSize ? nFees * 1000.0 / nSize : 0;
+    double dAncestorFeeRate = nSizeWithAncestors ? nFeesWithAncestors * 1000.0 / nSizeWithAncestors : 0;
+    return std::min(dFeeRate, dAncestorFeeRate);
+}
+
+bool CTxMemPool::CompareIteratorByAncestorScore::operator()(const txiter &a, const txiter &b) const
+{
+    const CTxMemPoolEntry &ea = a->second, &eb = b->second;
+    double dScoreA = GetAncestorScore(ea.GetFee(), ea.GetTxSize(), ea.GetFeesWithAncestors(), ea.GetSizeWithAncestors());
+    double dScoreB = GetAncestorScore(eb.GetFee(), eb.GetTxSize(), eb.GetFeesWithAncestors(), eb.GetSizeWithAncestors());
+    if (dScoreA != dScoreB)
+        return dScoreA > dScoreB;
+    return a->first < b->first;
+}
+
+double GetDescendantScore(int64_t nFees, uint64_t nSize, int64_t nFeesWithDescendants, uint64_t nSizeWithDescendants)
+{
+    double dFeeRate = nSize ? nFees * 1000.0 / nSize : 0;
+    double dDescendantFeeRate = nSizeWithDescendants ? nFeesWithDescendants * 1000.0 / nSizeWithDescendants : 0;
+    return std::max(dFeeRate, dDescendantFeeRate);
+}
+
+bool CTxMemPool::CompareIteratorByDescendantScore::operator()(const txiter &a, const txiter &b) const
+{
+    const CTxMemPoolEntry &ea = a->second, &eb = b->second;
+    double dScoreA = GetDescendantScore(ea.GetFee(), ea.GetTxSize(), ea.GetFeesWithDescendants(), ea.GetSizeWithDescendants());
+    double dScoreB = GetDescendantScore(eb.GetFee(), eb.GetTxSize(), eb.GetFeesWithDescendants(), eb.GetSizeWithDescendants());
+    if (dScoreA != dScoreB)
+        return dScoreA < dScoreB;
+    return a->first < b->first;
+}
+
+bool CTxMemPool::CompareIteratorByEntryTime::operator()(const txiter &a, const txiter &b) const
+{
+    if (a->second.GetTime() != b->second.GetTime())
+        return a->second.GetTime() < b->second.GetTime();
+    return a->first < b->first;
+}
+
 CTxMemPool::CTxMemPool()
 {
     // Sanity checks off by default for performance, because otherwise
     // accepting transactions becomes O(N^2) where N is the number
     // of transactions in the pool
     fSanityCheck = false;
+    nInnerUsage = 0;
+    nTotalFeesAdded = 0;
+    dRollingMinimumFeeRate = 0;
+    nLastRollingFeeUpdate = GetTime();
 }
 
 void CTxMemPool::pruneSpent(const uint256 &hashTx, CCoins &coins)
@@ -68,6 +168,170 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
     nTransactionsUpdated += n;
 }
 
+int64_t CTxMemPool::GetTotalFeesAdded() const
+{
+    LOCK(cs);
+    return nTotalFeesAdded;
+}
+
+
+const CTxMemPool::setEntries& CTxMemPool::GetMemPoolParents(txiter it) const
+{
+    std::map<txiter, TxLinks, CompareIteratorByHash>::const_iterator itLinks = mapLinks.find(it);
+    assert(itLinks != mapLinks.end());
+    return itLinks->second.parents;
+}
+
+const CTxMemPool::setEntries& CTxMemPool::GetMemPoolChildren(txiter it) const
+{
+    std::map<txiter, TxLinks, CompareIteratorByHash>::const_iterator itLinks = mapLinks.find(it);
+    assert(itLinks != mapLinks.end());
+    return itLinks->second.children;
+}
+
+void CTxMemPool::CalculateMemPoolAncestors(txiter it, setEntries &setAncestors) const
+{
+    std::vector<txiter> vStack(GetMemPoolParents(it).begin(), GetMemPoolParents(it).end());
+    while (!vStack.empty()) {
+        txiter itParent = vStack.back();
+        vStack.pop_back();
+        if (!setAncestors.insert(itParent).second)
+            continue;
+        const setEntries &parents = GetMemPoolParents(itParent);
+        vStack.insert(vStack.end(), parents.begin(), parents.end());
+    }
+}
+
+void CTxMemPool::CalculateDescendants(txiter it, setEntries &setDescendants) const
+{
+    std::vector<txiter> vStack(1, it);
+    while (!vStack.empty()) {
+        txiter itChild = vStack.back();
+        vStack.pop_back();
+        if (!setDescendants.insert(itChild).second)
+            continue;
+        const setEntries &children = GetMemPoolChildren(itChild);
+        vStack.insert(vStack.end(), children.begin(), children.end());
+    }
+}
+
+bool CTxMemPool::CheckPackageLimits(const CTransaction& tx, uint64_t nTxSize, uint64_t nLimitAncestorCount, uint64_t nLimitAncestorSize,
+                                    uint64_t nLimitDescendantCount, uint64_t nLimitDescendantSize, std::string& strError)
+{
+    LOCK(cs);
+    std::vector<txiter> vStack;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+        txiter itParent = mapTx.find(txin.prevout.hash);
+        if (itParent != mapTx.end())
+            vStack.push_back(itParent);
+    }
+
+    // The walk stops at the first limit hit, so it costs no more than the limits allow
+    setEntries setAncestors;
+    uint64_t nSizeWithAncestors = nTxSize;
+    while (!vStack.empty()) {
+        txiter it = vStack.back();
+        vStack.pop_back();
+        if (!setAncestors.insert(it).second)
+            continue;
+        nSizeWithAncestors += it->second.GetTxSize();
+        if (setAncestors.size() + 1 > nLimitAncestorCount) {
+            strError = strprintf("too many unconfirmed ancestors [limit: %u]", nLimitAncestorCount);
+            return false;
+        }
+        if (nSizeWithAncestors > nLimitAncestorSize) {
+            strError = strprintf("exceeds ancestor size limit [limit: %u]", nLimitAncestorSize);
+            return false;
+        }
+        // Each ancestor gains tx as a descendant
+        if (it->second.GetCountWithDescendants() + 1 > nLimitDescendantCount) {
+            strError = strprintf("too many descendants for tx %s [limit: %u]", it->first.ToString(), nLimitDescendantCount);
+            return false;
+        }
+        if (it->second.GetSizeWithDescendants() + nTxSize > nLimitDescendantSize) {
+            strError = strprintf("exceeds descendant size limit for tx %s [limit: %u]", it->first.ToString(), nLimitDescendantSize);
+            return false;
+        }
+        const setEntries &parents = GetMemPoolParents(it);
+        vStack.insert(vStack.end(), parents.begin(), parents.end());
+    }
+    return true;
+}
+
+void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool fAdd)
+{
+    if (fAdd) {
+        if (mapLinks[entry].parents.insert(parent).second)
+            nInnerUsage += TreeNodeUsage<txiter>();
+        if (mapLinks[parent].children.insert(entry).second)
+            nInnerUsage += TreeNodeUsage<txiter>();
+    } else {
+        if (mapLinks[entry].parents.erase(parent))
+            nInnerUsage -= TreeNodeUsage<txiter>();
+        if (mapLinks[parent].children.erase(entry))
+            nInnerUsage -= TreeNodeUsage<txiter>();
+    }
+}
+
+void CTxMemPool::UpdateAncestorState(txiter it)
+{
+    setEntries setAncestors;
+    CalculateMemPoolAncestors(it, setAncestors);
+
+    CTxMemPoolEntry &entry = it->second;
+    uint64_t nCount = 1, nSize = entry.GetTxSize();
+    int64_t nFees = entry.GetFee();
+    unsigned int nSigOpCount = entry.GetSigOpCount();
+    BOOST_FOREACH(txiter itAncestor, setAncestors) {
+        nCount++;
+        nSize += itAncestor->second.GetTxSize();
+        nFees += itAncestor->second.GetFee();
+        nSigOpCount += itAncestor->second.GetSigOpCount();
+    }
+
+    // The index is keyed on the ancestor state, so take the entry out while it changes
+    setAncestorScore.erase(it);
+    entry.SetAncestorState(nCount, nSize, nFees, nSigOpCount);
+    setAncestorScore.insert(it);
+}
+
+void CTxMemPool::UpdateDescendantState(txiter it)
+{
+    setEntries setDescendants;
+    CalculateDescendants(it, setDescendants);
+
+    uint64_t nCount = 0, nSize = 0;
+    int64_t nFees = 0;
+    BOOST_FOREACH(txiter itDescendant, setDescendants) {
+        nCount++;
+        nSize += itDescendant->second.GetTxSize();
+        nFees += itDescendant->second.GetFee();
+    }
+
+    setDescendantScore.erase(it);
+    it->second.SetDescendantState(nCount, nSize, nFees);
+    setDescendantScore.insert(it);
+}
+
+// Add (nSign 1) or take out (nSign -1) a relative's own figures from the ancestor
+// or descendant package state of an entry
+void CTxMemPool::ModifyPackageState(txiter it, const CTxMemPoolEntry& relative, bool fAncestor, int nSign)
+{
+    CTxMemPoolEntry &entry = it->second;
+    int64_t nSize = nSign * (int64_t)relative.GetTxSize();
+    int64_t nFees = nSign * relative.GetFee();
+    if (fAncestor) {
+        setAncestorScore.erase(it);
+        entry.SetAncestorState(entry.GetCountWithAncestors() + nSign, entry.GetSizeWithAncestors() + nSize,
+                               entry.GetFeesWithAncestors() + nFees, entry.GetSigOpsWithAncestors() + nSign * (int)relative.GetSigOpCount());
+        setAncestorScore.insert(it);
+    } else {
+        setDescendantScore.erase(it);
+        entry.SetDescendantState(entry.GetCountWithDescendants() + nSign, entry.GetSizeWithDescendants() + nSize,
+                                 entry.GetFeesWithDescendants() + nFees);
+        setDescendantScore.insert(it);
+    }
+}
 
 bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry)
 {
@@ -76,10 +340,52 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry)
     // all the appropriate checks.
     LOCK(cs);
     {
-        mapTx[hash] = entry;
-        const CTransaction& tx = mapTx[hash].GetTx();
-        for (unsigned int i = 0; i < tx.vin.size(); i++)
+        if (mapTx.count(hash))
+            return true;
+        txiter newit = mapTx.insert(std::make_pair(hash, entry)).first;
+        mapLinks.insert(std::make_pair(newit, TxLinks()));
+        setEntryTime.insert(newit);
+        nInnerUsage += newit->second.GetUsageSize();
+        nTotalFeesAdded += newit->second.GetFee();
+        const CTransaction& tx = newit->second.GetTx();
+        for (unsigned int i = 0; i < tx.vin.size(); i++) {
             mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+            txiter itParent = mapTx.find(tx.vin[i].prevout.hash);
+            if (itParent != mapTx.end())
+                UpdateParent(newit, itParent, true);
+        }
+
+        // Transactions already in the pool can spend this one, when the transactions
+        // of a disconnected block are put back
+        for (std::map<COutPoint, CInPoint>::iterator it = mapNextTx.lower_bound(COutPoint(hash, 0));
+             it != mapNextTx.end() && it->first.hash == hash; ++it) {
+            txiter itChild = mapTx.find(it->second.ptx->GetHash());
+            if (itChild != mapTx.end())
+                UpdateParent(itChild, newit, true);
+        }
+
+        // Update the package state of the relatives. Without in-mempool children or
+        // without in-mempool parents they only gain this entry itself; with both,
+        // they are recomputed.
+        setEntries setAncestors, setDescendants;
+        CalculateMemPoolAncestors(newit, setAncestors);
+        CalculateDescendants(newit, setDescendants);
+        setDescendants.erase(newit);
+        UpdateAncestorState(newit);
+        UpdateDescendantState(newit);
+        bool fRecompute = !setAncestors.empty() && !setDescendants.empty();
+        BOOST_FOREACH(txiter it, setAncestors) {
+            if (fRecompute)
+                UpdateDescendantState(it);
+            else
+                ModifyPackageState(it, newit->second, false, 1);
+        }
+        BOOST_FOREACH(txiter it, setDescendants) {
+            if (fRecompute)
+                UpdateAncestorState(it);
+            else
+                ModifyPackageState(it, newit->second, true, 1);
+        }
         nTransactionsUpdated++;
     }
     return true;
@@ -100,12 +406,46 @@ void CTxMemPool::remove(const CTransaction &tx, std::list<CTransaction>& removed
                 remove(*it->second.ptx, removed, true);
             }
         }
-        if (mapTx.count(hash))
+        txiter itRemove = mapTx.find(hash);
+        if (itRemove != mapTx.end())
         {
             removed.push_front(tx);
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
-            mapTx.erase(hash);
+
+            // Whatever stays behind loses this transaction from its packages; as in
+            // addUnchecked, relatives on both sides are recomputed
+            setEntries setAncestors, setDescendants;
+            CalculateMemPoolAncestors(itRemove, setAncestors);
+            CalculateDescendants(itRemove, setDescendants);
+            setDescendants.erase(itRemove);
+            bool fRecompute = !setAncestors.empty() && !setDescendants.empty();
+            if (!fRecompute) {
+                BOOST_FOREACH(txiter it, setAncestors)
+                    ModifyPackageState(it, itRemove->second, false, -1);
+                BOOST_FOREACH(txiter it, setDescendants)
+                    ModifyPackageState(it, itRemove->second, true, -1);
+            }
+
+            const setEntries parents = GetMemPoolParents(itRemove);
+            const setEntries children = GetMemPoolChildren(itRemove);
+            BOOST_FOREACH(txiter itParent, parents)
+                UpdateParent(itRemove, itParent, false);
+            BOOST_FOREACH(txiter itChild, children)
+                UpdateParent(itChild, itRemove, false);
+            mapLinks.erase(itRemove);
+            setAncestorScore.erase(itRemove);
+            setDescendantScore.erase(itRemove);
+            setEntryTime.erase(itRemove);
+            nInnerUsage -= itRemove->second.GetUsageSize();
+            mapTx.erase(itRemove);
+
+            if (fRecompute) {
+                BOOST_FOREACH(txiter it, setAncestors)
+                    UpdateDescendantState(it);
+                BOOST_FOREACH(txiter it, setDescendants)
+                    UpdateAncestorState(it);
+            }
             nTransactionsUpdated++;
         }
     }
@@ -133,6 +473,11 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    mapLinks.clear();
+    setAncestorScore.clear();
+    setDescendantScore.clear();
+    setEntryTime.clear();
+    nInnerUsage = 0;
     ++nTransactionsUpdated;
 }
 
@@ -144,6 +489,9 @@ void CTxMemPool::check(CCoinsViewCache *pcoins) const
     LogPrint("mempool", "Checking mempool with %u transactions and %u inputs\n", (unsigned int)mapTx.size(), (unsigned int)mapNextTx.size());
 
     LOCK(cs);
+    // The links are keyed on mutable iterators
+    std::map<uint256, CTxMemPoolEntry> &mapTxLinked = const_cast<std::map<uint256, CTxMemPoolEntry>&>(mapTx);
+    uint64_t nUsageCheck = 0;
     for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
         unsigned int i = 0;
         const CTransaction& tx = it->second.GetTx();
@@ -164,7 +512,50 @@ void CTxMemPool::check(CCoinsViewCache *pcoins) const
             assert(it3->second.n == i);
             i++;
         }
+        // Check the parent/child links and the ancestor state built from them.
+        txiter itEntry = mapTxLinked.find(it->first);
+        setEntries setParentCheck;
+        BOOST_FOREACH(const CTxIn &txin, tx.vin) {
+            txiter itParent = mapTxLinked.find(txin.prevout.hash);
+            if (itParent != mapTxLinked.end()) {
+                setParentCheck.insert(itParent);
+                assert(GetMemPoolChildren(itParent).count(itEntry));
+            }
+        }
+        assert(setParentCheck == GetMemPoolParents(itEntry));
+        setEntries setAncestors;
+        CalculateMemPoolAncestors(itEntry, setAncestors);
+        uint64_t nSizeCheck = it->second.GetTxSize();
+        int64_t nFeesCheck = it->second.GetFee();
+        BOOST_FOREACH(txiter itAncestor, setAncestors) {
+            nSizeCheck += itAncestor->second.GetTxSize();
+            nFeesCheck += itAncestor->second.GetFee();
+        }
+        assert(it->second.GetCountWithAncestors() == setAncestors.size() + 1);
+        assert(it->second.GetSizeWithAncestors() == nSizeCheck);
+        assert(it->second.GetFeesWithAncestors() == nFeesCheck);
+        assert(setAncestorScore.count(itEntry));
+
+        setEntries setDescendants;
+        CalculateDescendants(itEntry, setDescendants);
+        nSizeCheck = 0;
+        nFeesCheck = 0;
+        BOOST_FOREACH(txiter itDescendant, setDescendants) {
+            nSizeCheck += itDescendant->second.GetTxSize();
+            nFeesCheck += itDescendant->second.GetFee();
+        }
+        assert(it->second.GetCountWithDescendants() == setDescendants.size());
+        assert(it->second.GetSizeWithDescendants() == nSizeCheck);
+        assert(it->second.GetFeesWithDescendants() == nFeesCheck);
+        assert(setDescendantScore.count(itEntry));
+        assert(setEntryTime.count(itEntry));
+        nUsageCheck += it->second.GetUsageSize() + 2 * GetMemPoolParents(itEntry).size() * TreeNodeUsage<txiter>();
     }
+    assert(setAncestorScore.size() == mapTx.size());
+    assert(setDescendantScore.size() == mapTx.size());
+    assert(setEntryTime.size() == mapTx.size());
+    assert(mapLinks.size() == mapTx.size());
+    assert(nUsageCheck == nInnerUsage);
     for (std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
         uint256 hash = it->second.ptx->GetHash();
         map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(hash);
@@ -195,6 +586,102 @@ bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
     return true;
 }
 
+size_t CTxMemPool::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    // Every entry sits in mapTx, mapLinks and the three index sets
+    size_t nEntryUsage = TreeNodeUsage<std::pair<const uint256, CTxMemPoolEntry> >() +
+                         TreeNodeUsage<std::pair<const txiter, TxLinks> >() +
+                         3 * TreeNodeUsage<txiter>();
+    return mapTx.size() * nEntryUsage +
+           mapNextTx.size() * TreeNodeUsage<std::pair<const COutPoint, CInPoint> >() +
+           nInnerUsage;
+}
+
+void CTxMemPool::TrimToSize(size_t nSizeLimit, std::list<CTransaction>* pvRemoved, const std::set<uint256>* psetKeep)
+{
+    LOCK(cs);
+    unsigned int nTxnRemoved = 0;
+    indexed_descendant_score::const_iterator itScore = setDescendantScore.begin();
+    while (itScore != setDescendantScore.end() && DynamicMemoryUsage() > nSizeLimit) {
+        txiter it = *itScore;
+        if (psetKeep) {
+            setEntries setPackage;
+            CalculateDescendants(it, setPackage);
+            bool fKeep = false;
+            BOOST_FOREACH(txiter itPackage, setPackage)
+                if (psetKeep->count(itPackage->first)) {
+                    fKeep = true;
+                    break;
+                }
+            if (fKeep) {
+                ++itScore;
+                continue;
+            }
+        }
+
+        // Anything that would pay no more than the package just dropped is not
+        // let back in until the pool has had time to drain
+        const CTxMemPoolEntry& entry = it->second;
+        double dRemovedRate = entry.GetSizeWithDescendants() ? entry.GetFeesWithDescendants() * 1000.0 / entry.GetSizeWithDescendants() : 0;
+        dRollingMinimumFeeRate = std::max(dRollingMinimumFeeRate, dRemovedRate + CTransaction::nMinRelayTxFee);
+
+        std::list<CTransaction> removed;
+        CTransaction tx = entry.GetTx();
+        remove(tx, removed, true);
+        nTxnRemoved += removed.size();
+        if (pvRemoved)
+            pvRemoved->splice(pvRemoved->end(), removed);
+        // The scores of what is left may have moved
+        itScore = setDescendantScore.begin();
+    }
+    if (nTxnRemoved > 0)
+        LogPrint("mempool", "Removed %u transactions to keep the mempool below %u bytes, minimum fee rate now %.0f\n",
+            nTxnRemoved, (unsigned int)nSizeLimit, dRollingMinimumFeeRate);
+}
+
+int CTxMemPool::Expire(int64_t nTime, std::list<CTransaction>* pvRemoved)
+{
+    LOCK(cs);
+    std::vector<CTransaction> vExpired;
+    for (indexed_entry_time::const_iterator it = setEntryTime.begin(); it != setEntryTime.end() && (*it)->second.GetTime() < nTime; ++it)
+        vExpired.push_back((*it)->second.GetTx());
+
+    std::list<CTransaction> removed;
+    BOOST_FOREACH(const CTransaction& tx, vExpired)
+        remove(tx, removed, true);
+    int nRemoved = removed.size();
+    if (pvRemoved)
+        pvRemoved->splice(pvRemoved->end(), removed);
+    return nRemoved;
+}
+
+int64_t CTxMemPool::GetMinFee(size_t nSizeLimit) const
+{
+    LOCK(cs);
+    if (dRollingMinimumFeeRate == 0)
+        return 0;
+
+    int64_t nTime = GetTime();
+    if (nTime > nLastRollingFeeUpdate + 10) {
+        // Decay with a half-life of 12 hours, faster while the pool is mostly empty
+        double dHalfLife = 12 * 60 * 60;
+        size_t nUsage = DynamicMemoryUsage();
+        if (nUsage < nSizeLimit / 4)
+            dHalfLife /= 4;
+        else if (nUsage < nSizeLimit / 2)
+            dHalfLife /= 2;
+        dRollingMinimumFeeRate /= pow(2.0, (nTime - nLastRollingFeeUpdate) / dHalfLife);
+        nLastRollingFeeUpdate = nTime;
+
+        if (dRollingMinimumFeeRate < CTransaction::nMinRelayTxFee / 2) {
+            dRollingMinimumFeeRate = 0;
+            return 0;
+        }
+    }
+    return std::max((int64_t)ceil(dRollingMinimumFeeRate), CTransaction::nMinRelayTxFee);
+}
+
 CCoinsViewMemPool::CCoinsViewMemPool(CCoinsView &baseIn, CTxMemPool &mempoolIn) : CCoinsViewBacked(baseIn), mempool(mempoolIn) { }
 
 bool CCoinsViewMemPool::GetCoins(const uint256 &txid, CCoins &coins) {
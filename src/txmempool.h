@@ -6,6 +6,7 @@
 #define BITCOIN_TXMEMPOOL_H
 
 #include <list>
+#include <set>
 
 #include "coins.h"
 #include "core.h"
@@ -26,6 +27,20 @@ private:
     int64_t nTime; // Local time when entering the mempool
     double dPriority; // Priority when entering the mempool
     unsigned int nHeight; // Chain height when entering the mempool
+    unsigned int nSigOps; // Legacy sigop count, cached for block assembly
+    size_t nUsageSize; // Heap memory held by tx, for the pool's memory accounting
+
+    // Totals over this transaction and all its in-mempool ancestors, kept up to
+    // date by CTxMemPool as the pool changes
+    uint64_t nCountWithAncestors;
+    uint64_t nSizeWithAncestors;
+    int64_t nFeesWithAncestors;
+    unsigned int nSigOpsWithAncestors;
+
+    // ... and over this transaction and all its in-mempool descendants
+    uint64_t nCountWithDescendants;
+    uint64_t nSizeWithDescendants;
+    int64_t nFeesWithDescendants;
 
 public:
     CTxMemPoolEntry(const CTransaction& _tx, int64_t _nFee,
@@ -39,6 +54,20 @@ public:
     size_t GetTxSize() const { return nTxSize; }
     int64_t GetTime() const { return nTime; }
     unsigned int GetHeight() const { return nHeight; }
+    unsigned int GetSigOpCount() const { return nSigOps; }
+    size_t GetUsageSize() const { return nUsageSize; }
+
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    int64_t GetFeesWithAncestors() const { return nFeesWithAncestors; }
+    unsigned int GetSigOpsWithAncestors() const { return nSigOpsWithAncestors; }
+
+    uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    int64_t GetFeesWithDescendants() const { return nFeesWithDescendants; }
+
+    void SetAncestorState(uint64_t nCount, uint64_t nSize, int64_t nFees, unsigned int nSigOpCount);
+    void SetDescendantState(uint64_t nCount, uint64_t nSize, int64_t nFees);
 };
 
 /*
@@ -53,14 +82,66 @@ public:
  */
 class CTxMemPool
 {
+public:
+    typedef std::map<uint256, CTxMemPoolEntry>::iterator txiter;
+
+    struct CompareIteratorByHash {
+        bool operator()(const txiter &a, const txiter &b) const
+        {
+            return a->first < b->first;
+        }
+    };
+    typedef std::set<txiter, CompareIteratorByHash> setEntries;
+
+    /** Orders entries best first by ancestor score: the lower of their own fee rate
+     *  and the fee rate of the package they form with their in-mempool ancestors. */
+    struct CompareIteratorByAncestorScore {
+        bool operator()(const txiter &a, const txiter &b) const;
+    };
+    typedef std::set<txiter, CompareIteratorByAncestorScore> indexed_ancestor_score;
+
+    /** Orders entries worst first by descendant score: the higher of their own fee rate
+     *  and the fee rate of the package they form with their in-mempool descendants. */
+    struct CompareIteratorByDescendantScore {
+        bool operator()(const txiter &a, const txiter &b) const;
+    };
+    typedef std::set<txiter, CompareIteratorByDescendantScore> indexed_descendant_score;
+
+    /** Orders entries oldest first */
+    struct CompareIteratorByEntryTime {
+        bool operator()(const txiter &a, const txiter &b) const;
+    };
+    typedef std::set<txiter, CompareIteratorByEntryTime> indexed_entry_time;
+
 private:
     bool fSanityCheck; // Normally false, true if -checkmempool or -regtest
     unsigned int nTransactionsUpdated;
+    uint64_t nInnerUsage; // Heap usage of the entries' transactions and links
+    int64_t nTotalFeesAdded; // Fees of all transactions ever added, for getblocktemplate longpolls
+
+    // Fee rate (per 1000 bytes) a transaction must pay since the pool last had to
+    // evict; decays back to zero over time
+    mutable double dRollingMinimumFeeRate;
+    mutable int64_t nLastRollingFeeUpdate;
+
+    struct TxLinks {
+        setEntries parents;
+        setEntries children;
+    };
+    std::map<txiter, TxLinks, CompareIteratorByHash> mapLinks;
+
+    void UpdateParent(txiter entry, txiter parent, bool fAdd);
+    void UpdateAncestorState(txiter it);
+    void UpdateDescendantState(txiter it);
+    void ModifyPackageState(txiter it, const CTxMemPoolEntry& relative, bool fAncestor, int nSign);
 
 public:
     mutable CCriticalSection cs;
     std::map<uint256, CTxMemPoolEntry> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
+    indexed_ancestor_score setAncestorScore;
+    indexed_descendant_score setDescendantScore;
+    indexed_entry_time setEntryTime;
 
     CTxMemPool();
 
@@ -81,6 +162,7 @@ public:
     void pruneSpent(const uint256& hash, CCoins &coins);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
+    int64_t GetTotalFeesAdded() const;
 
     unsigned long size()
     {
@@ -95,8 +177,41 @@ public:
     }
 
     bool lookup(uint256 hash, CTransaction& result) const;
+
+    /** In-mempool parents and children of an entry; cs must be held */
+    const setEntries& GetMemPoolParents(txiter it) const;
+    const setEntries& GetMemPoolChildren(txiter it) const;
+    /** Collect all in-mempool ancestors (or descendants, including it itself) of an entry; cs must be held */
+    void CalculateMemPoolAncestors(txiter it, setEntries &setAncestors) const;
+    void CalculateDescendants(txiter it, setEntries &setDescendants) const;
+    /** Check that adding tx, of nTxSize bytes, keeps it within the ancestor limits and
+     *  each of its in-mempool ancestors within the descendant limits; sizes in bytes.
+     *  Sets strError and returns false if not. */
+    bool CheckPackageLimits(const CTransaction& tx, uint64_t nTxSize, uint64_t nLimitAncestorCount, uint64_t nLimitAncestorSize,
+                            uint64_t nLimitDescendantCount, uint64_t nLimitDescendantSize, std::string& strError);
+
+    /** Estimated heap memory used by the pool, in bytes */
+    size_t DynamicMemoryUsage() const;
+    /** Evict the lowest descendant score packages until the pool fits in sizelimit
+     *  bytes, raising the rolling minimum fee above what was evicted; evicted
+     *  transactions are appended to pvRemoved if given. Packages with a
+     *  transaction in psetKeep are left alone. */
+    void TrimToSize(size_t sizelimit, std::list<CTransaction>* pvRemoved = NULL, const std::set<uint256>* psetKeep = NULL);
+    /** Remove transactions that entered before nTime, with their descendants;
+     *  returns the number removed and appends them to pvRemoved if given */
+    int Expire(int64_t nTime, std::list<CTransaction>* pvRemoved = NULL);
+    /** Minimum fee per 1000 bytes to get into a pool limited to sizelimit bytes; 0 unless
+     *  the pool had to evict transactions recently */
+    int64_t GetMinFee(size_t sizelimit) const;
 };
 
+/** Ancestor fee rate of a package in satoshis per 1000 bytes, floored by the fee rate of the
+ *  transaction itself; the key of CTxMemPool::setAncestorScore */
+double GetAncestorScore(int64_t nFees, uint64_t nSize, int64_t nFeesWithAncestors, uint64_t nSizeWithAncestors);
+/** Descendant fee rate of a package, raised to the fee rate of the transaction itself;
+ *  the key of CTxMemPool::setDescendantScore */
+double GetDescendantScore(int64_t nFees, uint64_t nSize, int64_t nFeesWithDescendants, uint64_t nSizeWithDescendants);
+
 /** CCoinsView that brings transactions from a memorypool into view.
     It does not check for spendings by memory pool transactions. */
 class CCoinsViewMemPool : public CCoinsViewBacked
@@ -41,6 +41,11 @@
 #include <sys/resource.h>
 #include <sys/stat.h>
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 #else
 
 #ifdef _MSC_VER
@@ -1530,6 +1535,20 @@ void RenameThread(const char* name)
 #endif
 }
 
+bool SetThreadAffinity(unsigned int nCpu)
+{
+#if defined(__linux__) && defined(CPU_SET)
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(nCpu, &cpuset);
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) == 0;
+#else
+    // Leave scheduling to the OS
+    (void)nCpu;
+    return false;
+#endif
+}
+
 void SetupEnvironment()
 {
     #ifndef WIN32
@@ -527,6 +527,8 @@ inline void SetThreadPriority(int nPriority)
 #endif
 
 void RenameThread(const char* name);
+/** Pin the calling thread to one CPU core. Returns false where unsupported. */
+bool SetThreadAffinity(unsigned int nCpu);
 
 inline uint32_t ByteReverse(uint32_t value)
 {
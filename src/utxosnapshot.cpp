@@ -0,0 +1,279 @@
+// Copyright (c) 2009-2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "utxosnapshot.h"
+
+#include "chainparams.h"
+#include "checkpoints.h"
+#include "coins.h"
+#include "hash.h"
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
+
+using namespace std;
+
+bool DumpUTXOSnapshot(const boost::filesystem::path& path, CUTXOSnapshotHeader& header, std::string& strError)
+{
+    boost::scoped_ptr<CCoinsViewCursor> pcursor;
+    std::vector<std::pair<CBlockHeader, unsigned int> > vHeaders;
+    {
+        LOCK(cs_main);
+        // Everything below the cache is read from a LevelDB snapshot, so the
+        // rest of the dump can run without holding cs_main. The block files and
+        // index are synced as well, so that the tip the coins refer to is durable.
+        if (!FlushStateToDisk()) {
+            strError = "failed to flush the chain state";
+            return false;
+        }
+        pcursor.reset(pcoinsTip->Cursor());
+        if (!pcursor) {
+            strError = "coin database does not support snapshots";
+            return false;
+        }
+        CBlockIndex* pindexTip = chainActive.Tip();
+        if (pindexTip == NULL || pindexTip->GetBlockHash() != pcursor->GetBestBlock()) {
+            strError = "coin database is not at the active chain tip";
+            return false;
+        }
+        header.SetNull();
+        header.hashBlock = pindexTip->GetBlockHash();
+        header.nHeight = pindexTip->nHeight;
+        vHeaders.reserve(pindexTip->nHeight);
+        for (int nHeight = 1; nHeight <= pindexTip->nHeight; nHeight++)
+            vHeaders.push_back(make_pair(chainActive[nHeight]->GetBlockHeader(), chainActive[nHeight]->nTx));
+    }
+
+    boost::filesystem::path pathTmp = path;
+    pathTmp += ".incomplete";
+    CAutoFile fileout = CAutoFile(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (!fileout) {
+        strError = strprintf("unable to open %s for writing", pathTmp.string());
+        return false;
+    }
+
+    try {
+        // The header is written twice; the first time only to reserve its space
+        fileout << FLATDATA(Params().MessageStart()) << header;
+
+        for (unsigned int i = 0; i < vHeaders.size(); i++)
+            fileout << vHeaders[i].first << VARINT(vHeaders[i].second);
+
+        CCoinsStats stats;
+        CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+        ss << header.hashBlock;
+        while (pcursor->Valid()) {
+            boost::this_thread::interruption_point();
+            uint256 txid;
+            CCoins coins;
+            if (!pcursor->GetKey(txid) || !pcursor->GetValue(coins)) {
+                strError = "unable to read from the coin database";
+                return false;
+            }
+            fileout << txid << coins;
+            ApplyStats(stats, ss, txid, coins);
+            pcursor->Next();
+        }
+        header.nTransactions = stats.nTransactions;
+        header.hashSerialized = ss.GetHash();
+
+        if (fseek(fileout, MESSAGE_START_SIZE, SEEK_SET) != 0) {
+            strError = "unable to rewind snapshot file";
+            return false;
+        }
+        fileout << header;
+    } catch (std::exception &e) {
+        strError = strprintf("I/O error - %s", e.what());
+        return false;
+    }
+
+    FileCommit(fileout);
+    fileout.fclose();
+    if (!RenameOver(pathTmp, path)) {
+        strError = strprintf("unable to rename %s to %s", pathTmp.string(), path.string());
+        return false;
+    }
+
+    LogPrintf("Wrote UTXO snapshot at block %s (height %d, %u transactions, hash %s) to %s\n",
+        header.hashBlock.ToString(), header.nHeight, header.nTransactions, header.hashSerialized.ToString(), path.string());
+    return true;
+}
+
+namespace {
+
+/** Read a snapshot file up to the first coins entry. With fCheck, the header chain is
+ *  validated and turned into block index records in vIndex. */
+bool ReadSnapshotHeaders(CAutoFile& filein, CUTXOSnapshotHeader& header, bool fCheck, std::vector<CDiskBlockIndex>& vIndex, std::string& strError)
+{
+    unsigned char pchMessageStart[MESSAGE_START_SIZE];
+    filein >> FLATDATA(pchMessageStart) >> header;
+    if (memcmp(pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE)) {
+        strError = "snapshot is for a different network";
+        return false;
+    }
+    if (header.nVersion > CUTXOSnapshotHeader::CURRENT_VERSION || header.nHeight <= 0) {
+        strError = strprintf("unsupported snapshot (version %d, height %d)", header.nVersion, header.nHeight);
+        return false;
+    }
+
+    uint256 hashPrev = Params().HashGenesisBlock();
+    for (int nHeight = 1; nHeight <= header.nHeight; nHeight++) {
+        CBlockHeader block;
+        unsigned int nTx;
+        filein >> block >> VARINT(nTx);
+        if (!fCheck)
+            continue;
+
+        uint256 hash = block.GetHash();
+        if (block.hashPrevBlock != hashPrev || !CheckProofOfWork(hash, block.nBits) || !Checkpoints::CheckBlock(nHeight, hash)) {
+            strError = strprintf("invalid block header at height %d", nHeight);
+            return false;
+        }
+        hashPrev = hash;
+
+        CDiskBlockIndex diskindex;
+        diskindex.hashPrev       = block.hashPrevBlock;
+        diskindex.nHeight        = nHeight;
+        diskindex.nVersion       = block.nVersion;
+        diskindex.hashMerkleRoot = block.hashMerkleRoot;
+        diskindex.nTime          = block.nTime;
+        diskindex.nBits          = block.nBits;
+        diskindex.nNonce         = block.nNonce;
+        diskindex.nTx            = nTx;
+        // Validity is vouched for by the snapshot commitment; there is no block data on disk
+        diskindex.nStatus        = BLOCK_VALID_CHAIN;
+        vIndex.push_back(diskindex);
+    }
+    if (fCheck && hashPrev != header.hashBlock) {
+        strError = "block headers do not end in the snapshot block";
+        return false;
+    }
+    return true;
+}
+
+} // anon namespace
+
+bool LoadUTXOSnapshot(const boost::filesystem::path& path, std::string& strError)
+{
+    LOCK(cs_main);
+    if (chainActive.Height() != 0 || pcoinsTip->GetBestBlock() != Params().HashGenesisBlock()) {
+        strError = "a snapshot can only be loaded into an empty chainstate";
+        return false;
+    }
+
+    CUTXOSnapshotHeader header;
+    std::vector<CDiskBlockIndex> vIndex;
+
+    // First pass: check the header chain and the coins against the commitment
+    // before anything is written.
+    {
+        CAutoFile filein = CAutoFile(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        if (!filein) {
+            strError = strprintf("unable to open %s", path.string());
+            return false;
+        }
+        try {
+            if (!ReadSnapshotHeaders(filein, header, true, vIndex, strError))
+                return false;
+
+            map<uint256, uint256>::const_iterator it = Params().UTXOSnapshots().find(header.hashBlock);
+            if (it != Params().UTXOSnapshots().end()) {
+                if (it->second != header.hashSerialized) {
+                    strError = "snapshot does not match the commitment for its block";
+                    return false;
+                }
+            } else if (Params().RequireSnapshotCommitment()) {
+                strError = strprintf("no known commitment for a snapshot at block %s", header.hashBlock.ToString());
+                return false;
+            }
+
+            CCoinsStats stats;
+            CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+            ss << header.hashBlock;
+            uint256 txidLast = 0;
+            for (uint64_t i = 0; i < header.nTransactions; i++) {
+                boost::this_thread::interruption_point();
+                uint256 txid;
+                CCoins coins;
+                filein >> txid >> coins;
+                if (i > 0 && !(txidLast < txid)) {
+                    strError = "snapshot coins are not sorted";
+                    return false;
+                }
+                txidLast = txid;
+                ApplyStats(stats, ss, txid, coins);
+            }
+            if (ss.GetHash() != header.hashSerialized) {
+                strError = "snapshot contents do not match its hash";
+                return false;
+            }
+        } catch (std::exception &e) {
+            strError = strprintf("Deserialize or I/O error - %s", e.what());
+            return false;
+        }
+    }
+
+    LogPrintf("Loading UTXO snapshot at block %s (height %d, %u transactions)\n",
+        header.hashBlock.ToString(), header.nHeight, header.nTransactions);
+
+    // Second pass: write the coins. The flag marks a chainstate that must not be
+    // used if we get interrupted before the best block is switched over.
+    if (!pblocktree->WriteFlag("loadingsnapshot", true)) {
+        strError = "failed to write to the block index database";
+        return false;
+    }
+    {
+        CAutoFile filein = CAutoFile(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        if (!filein) {
+            strError = strprintf("unable to open %s", path.string());
+            return false;
+        }
+        try {
+            std::vector<CDiskBlockIndex> vUnused;
+            if (!ReadSnapshotHeaders(filein, header, false, vUnused, strError))
+                return false;
+            for (uint64_t i = 0; i < header.nTransactions; i++) {
+                boost::this_thread::interruption_point();
+                uint256 txid;
+                CCoins coins;
+                filein >> txid >> coins;
+                pcoinsTip->SetCoins(txid, coins);
+                if (pcoinsTip->GetCacheSize() > nCoinCacheSize && !pcoinsTip->Flush()) {
+                    strError = "failed to write to the coin database";
+                    return false;
+                }
+            }
+        } catch (std::exception &e) {
+            strError = strprintf("Deserialize or I/O error - %s", e.what());
+            return false;
+        }
+    }
+
+    BOOST_FOREACH(const CDiskBlockIndex& diskindex, vIndex) {
+        if (!pblocktree->WriteBlockIndex(diskindex)) {
+            strError = "failed to write to the block index database";
+            return false;
+        }
+    }
+    pcoinsTip->SetBestBlock(header.hashBlock);
+    // The blocks below the snapshot are downloaded and checked against it afterwards
+    if (!pcoinsTip->Flush() || !pblocktree->WriteSnapshotBase(header.hashBlock, header.hashSerialized) ||
+        !pblocktree->WriteFlag("loadingsnapshot", false) || !pblocktree->Sync()) {
+        strError = "failed to write the snapshot state";
+        return false;
+    }
+
+    // Rebuild the in-memory block index from what was just written
+    UnloadBlockIndex();
+    if (!LoadBlockIndex()) {
+        strError = "failed to reload the block index";
+        return false;
+    }
+
+    LogPrintf("Loaded UTXO snapshot, chain tip is now %s (height %d)\n", chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height());
+    return true;
+}
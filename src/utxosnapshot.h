@@ -0,0 +1,69 @@
+// Copyright (c) 2009-2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_UTXOSNAPSHOT_H
+#define BITCOIN_UTXOSNAPSHOT_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+#include <stdint.h>
+#include <string>
+
+#include <boost/filesystem/path.hpp>
+
+/** Header of a UTXO snapshot file.
+ *
+ * A snapshot file consists of:
+ * - the network's message start bytes
+ * - this header
+ * - nHeight entries of (CBlockHeader, VARINT nTx) for blocks 1..nHeight of the chain ending in hashBlock
+ * - nTransactions entries of (txid, CCoins), ordered by txid
+ *
+ * hashSerialized commits to the coins exactly like gettxoutsetinfo's hash_serialized.
+ */
+class CUTXOSnapshotHeader
+{
+public:
+    static const int CURRENT_VERSION = 1;
+    int nVersion;
+    uint256 hashBlock;
+    int nHeight;
+    uint64_t nTransactions;
+    uint256 hashSerialized;
+
+    CUTXOSnapshotHeader()
+    {
+        SetNull();
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(this->nVersion);
+        nVersion = this->nVersion;
+        READWRITE(hashBlock);
+        READWRITE(nHeight);
+        READWRITE(nTransactions);
+        READWRITE(hashSerialized);
+    )
+
+    void SetNull()
+    {
+        nVersion = CUTXOSnapshotHeader::CURRENT_VERSION;
+        hashBlock = 0;
+        nHeight = 0;
+        nTransactions = 0;
+        hashSerialized = 0;
+    }
+};
+
+/** Write the UTXO set at the current tip to a snapshot file (dumptxoutset).
+ *  cs_main is only held while the coin database snapshot is taken. */
+bool DumpUTXOSnapshot(const boost::filesystem::path& path, CUTXOSnapshotHeader& header, std::string& strError);
+
+/** Build the chainstate and block index from a snapshot file (-loadsnapshot).
+ *  Only allowed on a chainstate that holds nothing but the genesis block. */
+bool LoadUTXOSnapshot(const boost::filesystem::path& path, std::string& strError);
+
+#endif // BITCOIN_UTXOSNAPSHOT_H
@@ -28,7 +28,7 @@ extern const std::string CLIENT_DATE;
 //
 
 //static const int PROTOCOL_VERSION = 80005; // nodes with broken masternode
-static const int PROTOCOL_VERSION = 80006;
+static const int PROTOCOL_VERSION = 80007;
 
 // intial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -50,4 +50,7 @@ static const int BIP0031_VERSION = 60000;
 // "mempool" command, enhanced "getdata" behavior starts with this version:
 static const int MEMPOOL_GD_VERSION = 60002;
 
+// "cmpctblock", "getblocktxn" and "blocktxn" messages start with this version
+static const int COMPACT_BLOCKS_VERSION = 80007;
+
 #endif
@@ -9,10 +9,12 @@
 #include "base58.h"
 #include "checkpoints.h"
 #include "coincontrol.h"
+#include "hash.h"
 #include "net.h"
 #include "darksend.h"
 #include "keepass.h"
 #include "instantx.h"
+#include "spork.h"
 
 #include <boost/algorithm/string/replace.hpp>
 #include <openssl/rand.h>
@@ -73,11 +75,38 @@ CPubKey CWallet::GenerateNewKey()
     return pubkey;
 }
 
+uint64_t CWallet::GetScriptIndexHash(const CScript& script) const
+{
+    return CSipHasher(nScriptIndexK0, nScriptIndexK1).Write(script.empty() ? NULL : &script[0], script.size()).Finalize();
+}
+
+void CWallet::AddKeyToScriptIndex(const CPubKey& pubkey)
+{
+    CScript scriptPubKeyHash;
+    scriptPubKeyHash.SetDestination(pubkey.GetID());
+    CScript scriptPubKey;
+    scriptPubKey << pubkey << OP_CHECKSIG;
+
+    LOCK(cs_KeyStore);
+    setScriptIndex.insert(GetScriptIndexHash(scriptPubKeyHash));
+    setScriptIndex.insert(GetScriptIndexHash(scriptPubKey));
+}
+
+void CWallet::AddScriptToScriptIndex(const CScript& redeemScript)
+{
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(redeemScript.GetID());
+
+    LOCK(cs_KeyStore);
+    setScriptIndex.insert(GetScriptIndexHash(scriptPubKey));
+}
+
 bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
 {
     AssertLockHeld(cs_wallet); // mapKeyMetadata
     if (!CCryptoKeyStore::AddKeyPubKey(secret, pubkey))
         return false;
+    AddKeyToScriptIndex(pubkey);
     if (!fFileBacked)
         return true;
     if (!IsCrypted()) {
@@ -93,6 +122,7 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey,
 {
     if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
         return false;
+    AddKeyToScriptIndex(vchPubKey);
     if (!fFileBacked)
         return true;
     {
@@ -119,15 +149,32 @@ bool CWallet::LoadKeyMetadata(const CPubKey &pubkey, const CKeyMetadata &meta)
     return true;
 }
 
+bool CWallet::LoadKey(const CKey& key, const CPubKey &pubkey)
+{
+    if (!CCryptoKeyStore::AddKeyPubKey(key, pubkey))
+        return false;
+    AddKeyToScriptIndex(pubkey);
+    return true;
+}
+
 bool CWallet::LoadCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret)
 {
-    return CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret);
+    if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
+        return false;
+    AddKeyToScriptIndex(vchPubKey);
+    return true;
 }
 
 bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    AddScriptToScriptIndex(redeemScript);
+    {
+        // Outputs of wallet transactions paying to it are ours now
+        LOCK(cs_wallet);
+        fUnspentIndexStale = true;
+    }
     if (!fFileBacked)
         return true;
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
@@ -146,7 +193,10 @@ bool CWallet::LoadCScript(const CScript& redeemScript)
         return true;
     }
 
-    return CCryptoKeyStore::AddCScript(redeemScript);
+    if (!CCryptoKeyStore::AddCScript(redeemScript))
+        return false;
+    AddScriptToScriptIndex(redeemScript);
+    return true;
 }
 
 bool CWallet::Unlock(const SecureString& strWalletPassphrase, bool anonymizeOnly)
@@ -391,6 +441,7 @@ bool CWallet::IsSpent(const uint256& hash, unsigned int n) const
 void CWallet::AddToSpends(const COutPoint& outpoint, const uint256& wtxid)
 {
     mapTxSpends.insert(make_pair(outpoint, wtxid));
+    MarkBalancesDirty();
 
     pair<TxSpends::iterator, TxSpends::iterator> range;
     range = mapTxSpends.equal_range(outpoint);
@@ -543,6 +594,8 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        MarkBalancesDirty();
+        fUnspentIndexStale = true;
     }
 }
 
@@ -555,6 +608,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         mapWallet[hash] = wtxIn;
         mapWallet[hash].BindWallet(this);
         AddToSpends(hash);
+        AddToUnspentIndex(hash, mapWallet[hash]);
     }
     else
     {
@@ -649,6 +703,10 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
 
         // Break debit/credit balance caches:
         wtx.MarkDirty();
+        MarkBalancesDirty();
+        // A merge only brings block data, never new outputs
+        if (fInsertedNew)
+            AddToUnspentIndex(hash, wtx);
 
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
@@ -689,9 +747,17 @@ bool CWallet::AddToWalletIfInvolvingMe(const uint256 &hash, const CTransaction&
 
 void CWallet::SyncTransaction(const uint256 &hash, const CTransaction& tx, const CBlock* pblock)
 {
+    {
+        // Most transactions are not ours; finding that out needs no cs_main
+        LOCK(cs_wallet);
+        if (!mapWallet.count(hash) && !IsMine(tx) && !IsFromMe(tx))
+            return;
+    }
     LOCK2(cs_main, cs_wallet);
     if (!AddToWalletIfInvolvingMe(hash, tx, pblock, true))
         return; // Not one of ours
+    // It entered the memory pool, or left it for a block or a conflict
+    nMempoolGeneration++;
 
     // If a transaction changes 'conflicted' state, that changes the balance
     // available of the outputs it spends. So force those to be
@@ -711,6 +777,8 @@ void CWallet::EraseFromWallet(const uint256 &hash)
         LOCK(cs_wallet);
         if (mapWallet.erase(hash))
             CWalletDB(strWalletFile).EraseTx(hash);
+        MarkBalancesDirty();
+        fUnspentIndexStale = true;
     }
     return;
 }
@@ -732,6 +800,31 @@ bool CWallet::IsMine(const CTxIn &txin) const
     return false;
 }
 
+// Whether script is in one of the forms covered by the script index: exactly
+// the pay-to-pubkey-hash, pay-to-pubkey and pay-to-script-hash templates of the solver
+static bool IsIndexedScriptForm(const CScript& script)
+{
+    if (script.size() == 25)
+        return script[0] == OP_DUP && script[1] == OP_HASH160 && script[2] == 20 &&
+               script[23] == OP_EQUALVERIFY && script[24] == OP_CHECKSIG;
+    if (script.size() == 35 || script.size() == 67)
+        return script[0] == script.size() - 2 && script[script.size() - 1] == OP_CHECKSIG;
+    return script.IsPayToScriptHash();
+}
+
+bool CWallet::IsMine(const CTxOut& txout) const
+{
+    const CScript& script = txout.scriptPubKey;
+    if (IsIndexedScriptForm(script))
+    {
+        LOCK(cs_KeyStore);
+        if (!setScriptIndex.count(GetScriptIndexHash(script)))
+            return false;
+    }
+    // Ours, a rare hash collision, or a form the index does not cover
+    return ::IsMine(*this, script);
+}
+
 int64_t CWallet::GetDebit(const CTxIn &txin) const
 {
     {
@@ -1001,7 +1094,10 @@ void CWalletTx::RelayWalletTransaction(std::string strCommand)
             LogPrintf("Relaying wtx %s\n", hash.ToString());
 
             if(strCommand == "txlreq"){
-                mapTxLockReq.insert(make_pair(hash, ((CTransaction)*this)));
+                {
+                    LOCK(cs_instantx);
+                    mapTxLockReq.insert(make_pair(hash, ((CTransaction)*this)));
+                }
                 CreateNewLock(((CTransaction)*this));
                 RelayTransactionLockReq(((CTransaction)*this), hash, true);
             } else {
@@ -1072,17 +1168,58 @@ void CWallet::ResendWalletTransactions()
 //
 
 
+bool CWallet::GetCachedBalance(int nType, int64_t& nBalanceRet) const
+{
+    AssertLockHeld(cs_wallet);
+    // Depths depend on mempool membership and, through InstantX, on the lock
+    // maps, on SPORK_2 and on large work forks
+    unsigned int nMempool = nMempoolGeneration;
+    bool fInstantX = IsSporkActive(SPORK_2_INSTANTX) && !fLargeWorkForkFound && !fLargeWorkInvalidChainFound;
+    unsigned int nTxLockGeneration;
+    {
+        LOCK(cs_instantx);
+        nTxLockGeneration = nTXLockGeneration;
+    }
+    if (pindexBalanceCache != chainActive.Tip() || nBalanceCacheMempool != nMempool ||
+        nBalanceCacheTxLocks != nCompleteTXLocks || nBalanceCacheTxLockGeneration != nTxLockGeneration ||
+        fBalanceCacheInstantX != fInstantX || nBalanceCacheRounds != nDarksendRounds)
+    {
+        // Depths, maturity, conflicts and rounds may all have moved
+        mapBalanceCache.clear();
+        pindexBalanceCache = chainActive.Tip();
+        nBalanceCacheMempool = nMempool;
+        nBalanceCacheTxLocks = nCompleteTXLocks;
+        nBalanceCacheTxLockGeneration = nTxLockGeneration;
+        fBalanceCacheInstantX = fInstantX;
+        nBalanceCacheRounds = nDarksendRounds;
+        return false;
+    }
+    map<int, int64_t>::const_iterator it = mapBalanceCache.find(nType);
+    if (it == mapBalanceCache.end())
+        return false;
+    nBalanceRet = it->second;
+    return true;
+}
+
 int64_t CWallet::GetBalance() const
 {
     int64_t nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
+        if (GetCachedBalance(BALANCE_TRUSTED, nTotal))
+            return nTotal;
+        // A transaction waiting on its lock time becomes final as time passes, not as the wallet or chain changes
+        bool fCacheable = true;
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
         {
             const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
+            if (!IsFinalTx(*pcoin))
+                fCacheable = false;
+            else if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAvailableCredit();
         }
+        if (fCacheable)
+            mapBalanceCache[BALANCE_TRUSTED] = nTotal;
     }
 
     return nTotal;
@@ -1095,11 +1232,16 @@ int64_t CWallet::GetAnonymizedBalance() const
     int64_t nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
+        if (GetCachedBalance(BALANCE_ANONYMIZED, nTotal))
+            return nTotal;
+        bool fCacheable = true;
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
         {
             const CWalletTx* pcoin = &(*it).second;
 
-            if (pcoin->IsTrusted())
+            if (!IsFinalTx(*pcoin))
+                fCacheable = false;
+            else if (pcoin->IsTrusted())
             {
                 uint256 hash = (*it).first;
                 for (unsigned int i = 0; i < pcoin->vout.size(); i++)
@@ -1115,6 +1257,8 @@ int64_t CWallet::GetAnonymizedBalance() const
                 }
             }
         }
+        if (fCacheable)
+            mapBalanceCache[BALANCE_ANONYMIZED] = nTotal;
     }
 
     return nTotal;
@@ -1160,11 +1304,16 @@ int64_t CWallet::GetNormalizedAnonymizedBalance() const
 
     {
         LOCK2(cs_main, cs_wallet);
+        if (GetCachedBalance(BALANCE_NORMALIZED_ANONYMIZED, nTotal))
+            return nTotal;
+        bool fCacheable = true;
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
         {
             const CWalletTx* pcoin = &(*it).second;
 
-            if (pcoin->IsTrusted())
+            if (!IsFinalTx(*pcoin))
+                fCacheable = false;
+            else if (pcoin->IsTrusted())
             {
                 uint256 hash = (*it).first;
 
@@ -1179,6 +1328,8 @@ int64_t CWallet::GetNormalizedAnonymizedBalance() const
                 }
             }
         }
+        if (fCacheable)
+            mapBalanceCache[BALANCE_NORMALIZED_ANONYMIZED] = nTotal;
     }
 
     return nTotal;
@@ -1186,9 +1337,13 @@ int64_t CWallet::GetNormalizedAnonymizedBalance() const
 
 int64_t CWallet::GetDenominatedBalance(bool onlyDenom, bool onlyUnconfirmed) const
 {
+    int nType = BALANCE_DENOMINATED + (onlyDenom ? 1 : 0) + (onlyUnconfirmed ? 2 : 0);
     int64_t nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
+        if (GetCachedBalance(nType, nTotal))
+            return nTotal;
+        bool fCacheable = true;
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
         {
             const CWalletTx* pcoin = &(*it).second;
@@ -1198,7 +1353,10 @@ int64_t CWallet::GetDenominatedBalance(bool onlyDenom, bool onlyUnconfirmed) con
             // skip conflicted
             if(nDepth < 0) continue;
 
-            bool unconfirmed = (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && nDepth == 0));
+            bool fFinal = IsFinalTx(*pcoin);
+            if (!fFinal)
+                fCacheable = false;
+            bool unconfirmed = (!fFinal || (!pcoin->IsTrusted() && nDepth == 0));
             if(onlyUnconfirmed != unconfirmed) continue;
             uint256 hash = (*it).first;
 
@@ -1211,10 +1369,10 @@ int64_t CWallet::GetDenominatedBalance(bool onlyDenom, bool onlyUnconfirmed) con
                 nTotal += pcoin->vout[i].nValue;
             }
         }
+        if (fCacheable)
+            mapBalanceCache[nType] = nTotal;
     }
 
-
-
     return nTotal;
 }
 
@@ -1223,12 +1381,20 @@ int64_t CWallet::GetUnconfirmedBalance() const
     int64_t nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
+        if (GetCachedBalance(BALANCE_UNCONFIRMED, nTotal))
+            return nTotal;
+        bool fCacheable = true;
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
         {
             const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
+            bool fFinal = IsFinalTx(*pcoin);
+            if (!fFinal)
+                fCacheable = false;
+            if (!fFinal || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
                 nTotal += pcoin->GetAvailableCredit();
         }
+        if (fCacheable)
+            mapBalanceCache[BALANCE_UNCONFIRMED] = nTotal;
     }
     return nTotal;
 }
@@ -1238,64 +1404,151 @@ int64_t CWallet::GetImmatureBalance() const
     int64_t nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
+        if (GetCachedBalance(BALANCE_IMMATURE, nTotal))
+            return nTotal;
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
         {
             const CWalletTx* pcoin = &(*it).second;
             nTotal += pcoin->GetImmatureCredit();
         }
+        mapBalanceCache[BALANCE_IMMATURE] = nTotal;
     }
     return nTotal;
 }
 
-// populate vCoins with vector of spendable COutputs
-void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const CCoinControl *coinControl, AvailableCoinsType coin_type, bool useIX) const
+int CWallet::GetUnspentClass(int64_t nValue) const
 {
-    vCoins.clear();
+    if (IsDenominatedAmount(nValue))
+        return UNSPENT_DENOMINATED;
+    if (IsCollateralAmount(nValue))
+        return UNSPENT_COLLATERAL;
+    if (nValue == 1000*COIN)
+        return UNSPENT_MASTERNODE;
+    return UNSPENT_OTHER;
+}
 
+void CWallet::AddToUnspentIndex(const uint256& hash, const CWalletTx& wtx)
+{
+    AssertLockHeld(cs_wallet);
+    if (fUnspentIndexStale)
+        return; // built from mapWallet on next use
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+        if (wtx.vout[i].nValue > 0 && IsMine(wtx.vout[i]))
+            setUnspentIndex[GetUnspentClass(wtx.vout[i].nValue)].insert(COutPoint(hash, i));
+}
+
+void CWallet::SyncUnspentIndex() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    // Outputs were dropped against the chain up to pindexUnspentIndex; if a
+    // block of it was disconnected, some of them may be unspent again
+    if (fUnspentIndexStale || (pindexUnspentIndex && !chainActive.Contains(pindexUnspentIndex)))
     {
-        LOCK2(cs_main, cs_wallet);
+        for (int nClass = 0; nClass < UNSPENT_CLASSES; nClass++)
+            setUnspentIndex[nClass].clear();
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
         {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx& wtx = it->second;
+            for (unsigned int i = 0; i < wtx.vout.size(); i++)
+                if (wtx.vout[i].nValue > 0 && IsMine(wtx.vout[i]))
+                    setUnspentIndex[GetUnspentClass(wtx.vout[i].nValue)].insert(COutPoint(it->first, i));
+        }
+        fUnspentIndexStale = false;
+    }
+    pindexUnspentIndex = chainActive.Tip();
+}
 
-            if (!IsFinalTx(*pcoin))
-                continue;
+// Outpoint is spent by a transaction confirmed in the active chain, which
+// unlike IsSpent cannot change until a block is disconnected
+bool CWallet::IsSpentInChain(const COutPoint& outpoint) const
+{
+    pair<TxSpends::const_iterator, TxSpends::const_iterator> range;
+    range = mapTxSpends.equal_range(outpoint);
 
-            if (fOnlyConfirmed && !pcoin->IsTrusted())
-                continue;
+    for (TxSpends::const_iterator it = range.first; it != range.second; ++it)
+    {
+        std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(it->second);
+        if (mit != mapWallet.end() && mit->second.GetDepthInMainChain(false) >= 1)
+            return true;
+    }
+    return false;
+}
 
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
-                continue;
+static bool CompareOutputs(const COutput& a, const COutput& b)
+{
+    return COutPoint(a.tx->GetHash(), a.i) < COutPoint(b.tx->GetHash(), b.i);
+}
 
-            int nDepth = pcoin->GetDepthInMainChain(false);
-            // do not use IX for inputs that have less then 6 blockchain confirmations
-            if (useIX && nDepth < 6)
-                continue;
+// populate vCoins with vector of spendable COutputs
+void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const CCoinControl *coinControl, AvailableCoinsType coin_type, bool useIX) const
+{
+    vCoins.clear();
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                bool found = false;
-                if(coin_type == ONLY_DENOMINATED) {
-                    //should make this a vector
-
-                    found = IsDenominatedAmount(pcoin->vout[i].nValue);
-                } else if(coin_type == ONLY_NONDENOMINATED || coin_type == ONLY_NONDENOMINATED_NOTMN) {
-                    found = true;
-                    if (IsCollateralAmount(pcoin->vout[i].nValue)) continue; // do not use collateral amounts
-                    found = !IsDenominatedAmount(pcoin->vout[i].nValue);
-                    if(found && coin_type == ONLY_NONDENOMINATED_NOTMN) found = (pcoin->vout[i].nValue != 1000*COIN); // do not use MN funds
-                } else {
-                    found = true;
+    vector<int> vClasses;
+    if(coin_type == ONLY_DENOMINATED) {
+        vClasses.push_back(UNSPENT_DENOMINATED);
+    } else if(coin_type == ONLY_NONDENOMINATED || coin_type == ONLY_NONDENOMINATED_NOTMN) {
+        // do not use collateral amounts, nor MN funds for ONLY_NONDENOMINATED_NOTMN
+        if(coin_type == ONLY_NONDENOMINATED) vClasses.push_back(UNSPENT_MASTERNODE);
+        vClasses.push_back(UNSPENT_OTHER);
+    } else {
+        for (int nClass = 0; nClass < UNSPENT_CLASSES; nClass++)
+            vClasses.push_back(nClass);
+    }
+
+    {
+        LOCK2(cs_main, cs_wallet);
+        SyncUnspentIndex();
+
+        BOOST_FOREACH(int nClass, vClasses)
+        {
+            set<COutPoint>& setOutputs = setUnspentIndex[nClass];
+            // Outputs of one transaction are next to each other, so check it once
+            const CWalletTx* pcoin = NULL;
+            bool fUsable = false;
+            int nDepth = 0;
+            for (set<COutPoint>::iterator it = setOutputs.begin(); it != setOutputs.end(); )
+            {
+                const COutPoint& outpoint = *it;
+                if (IsSpentInChain(outpoint))
+                {
+                    setOutputs.erase(it++);
+                    continue;
+                }
+
+                if (pcoin == NULL || pcoin->GetHash() != outpoint.hash)
+                {
+                    map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(outpoint.hash);
+                    if (mi == mapWallet.end())
+                    {
+                        setOutputs.erase(it++);
+                        continue;
+                    }
+                    pcoin = &mi->second;
+
+                    fUsable = IsFinalTx(*pcoin) && (!fOnlyConfirmed || pcoin->IsTrusted()) &&
+                              !(pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0);
+                    if (fUsable)
+                    {
+                        nDepth = pcoin->GetDepthInMainChain(false);
+                        // do not use IX for inputs that have less then 6 blockchain confirmations
+                        fUsable = !(useIX && nDepth < 6);
+                    }
                 }
-                if(!found) continue;
 
-                if (!(IsSpent(wtxid, i)) && IsMine(pcoin->vout[i]) &&
-                    !IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue > 0 &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
-                        vCoins.push_back(COutput(pcoin, i, nDepth));
+                if (fUsable && !IsSpent(outpoint.hash, outpoint.n) &&
+                    !IsLockedCoin(outpoint.hash, outpoint.n) &&
+                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected(outpoint.hash, outpoint.n)))
+                        vCoins.push_back(COutput(pcoin, outpoint.n, nDepth));
+                ++it;
             }
         }
     }
+
+    // Keep the order of a walk over mapWallet
+    if (vClasses.size() > 1)
+        sort(vCoins.begin(), vCoins.end(), CompareOutputs);
 }
 
 static void ApproximateBestSubset(vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > >vValue, int64_t nTotalLower, int64_t nTargetValue,
@@ -2771,6 +3024,9 @@ bool CWallet::UpdatedTransaction(const uint256 &hashTx)
         // Only notify UI if this transaction is in this wallet
         map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hashTx);
         if (mi != mapWallet.end()){
+            // Possibly evicted or expired from the memory pool
+            nMempoolGeneration++;
+            MarkBalancesDirty();
             NotifyTransactionChanged(this, hashTx, CT_UPDATED);
             return true;
         }
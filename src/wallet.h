@@ -16,6 +16,7 @@
 #include "walletdb.h"
 
 #include <algorithm>
+#include <limits>
 #include <map>
 #include <set>
 #include <stdexcept>
@@ -24,6 +25,8 @@
 #include <utility>
 #include <vector>
 
+#include <boost/unordered_set.hpp>
+
 // Settings
 extern int64_t nTransactionFee;
 extern bool bSpendZeroConfChange;
@@ -131,6 +134,63 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    // Salted SipHashes of every pay-to-pubkey(-hash) script of our keys and
+    // pay-to-script-hash script of our redeem scripts, protected by cs_KeyStore.
+    // An output in one of those forms whose hash is missing here is not ours,
+    // which IsMine(CTxOut) finds out without running the solver.
+    boost::unordered_set<uint64_t> setScriptIndex;
+    uint64_t nScriptIndexK0, nScriptIndexK1;
+    uint64_t GetScriptIndexHash(const CScript& script) const;
+    void AddKeyToScriptIndex(const CPubKey& pubkey);
+    void AddScriptToScriptIndex(const CScript& redeemScript);
+
+    enum BalanceType
+    {
+        BALANCE_TRUSTED,
+        BALANCE_UNCONFIRMED,
+        BALANCE_IMMATURE,
+        BALANCE_ANONYMIZED,
+        BALANCE_NORMALIZED_ANONYMIZED,
+        BALANCE_DENOMINATED // plus 1 for onlyDenom and 2 for onlyUnconfirmed
+    };
+
+    // Balances by BalanceType, valid until the wallet's transactions, the chain
+    // tip, the wallet's transactions in the memory pool, the InstantX locks
+    // (completed or removed, and whether they count at all) or the Darksend
+    // rounds change.
+    // Protected by cs_wallet.
+    mutable std::map<int, int64_t> mapBalanceCache;
+    mutable const CBlockIndex* pindexBalanceCache;
+    mutable unsigned int nBalanceCacheMempool;
+    mutable int nBalanceCacheTxLocks;
+    mutable unsigned int nBalanceCacheTxLockGeneration;
+    mutable bool fBalanceCacheInstantX;
+    mutable int nBalanceCacheRounds;
+    bool GetCachedBalance(int nType, int64_t& nBalanceRet) const;
+    void MarkBalancesDirty() const { mapBalanceCache.clear(); }
+
+    enum UnspentClass
+    {
+        UNSPENT_DENOMINATED,
+        UNSPENT_COLLATERAL,
+        UNSPENT_MASTERNODE, // exactly 1000 coins
+        UNSPENT_OTHER,
+        UNSPENT_CLASSES
+    };
+
+    // Outputs of ours that may be unspent, by UnspentClass of their value. An
+    // output is dropped once a transaction spending it is confirmed in the
+    // active chain, and the whole index rebuilt when a block at or below
+    // pindexUnspentIndex is disconnected, or when fUnspentIndexStale is set
+    // because outputs may have become ours. Protected by cs_wallet.
+    mutable std::set<COutPoint> setUnspentIndex[UNSPENT_CLASSES];
+    mutable const CBlockIndex* pindexUnspentIndex;
+    mutable bool fUnspentIndexStale;
+    int GetUnspentClass(int64_t nValue) const;
+    void AddToUnspentIndex(const uint256& hash, const CWalletTx& wtx);
+    void SyncUnspentIndex() const;
+    bool IsSpentInChain(const COutPoint& outpoint) const;
+
 public:
     bool SelectCoins(int64_t nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl *coinControl = NULL, AvailableCoinsType coin_type=ALL_COINS, bool useIX = true) const;
     bool SelectCoinsDark(int64_t nValueMin, int64_t nValueMax, std::vector<CTxIn>& setCoinsRet, int64_t& nValueRet, int nDarksendRoundsMin, int nDarksendRoundsMax) const;
@@ -158,6 +218,10 @@ public:
     std::set<int64_t> setKeyPool;
     std::map<CKeyID, CKeyMetadata> mapKeyMetadata;
 
+    // Bumped whenever one of the wallet's transactions enters or leaves the
+    // memory pool, so unrelated traffic leaves the balance cache alone
+    unsigned int nMempoolGeneration;
+
     typedef std::map<unsigned int, CMasterKey> MasterKeyMap;
     MasterKeyMap mapMasterKeys;
     unsigned int nMasterKeyMaxID;
@@ -185,6 +249,17 @@ public:
         nLastResend = 0;
         nTimeFirstKey = 0;
         fWalletUnlockAnonymizeOnly = false;
+        nScriptIndexK0 = GetRand(std::numeric_limits<uint64_t>::max());
+        nScriptIndexK1 = GetRand(std::numeric_limits<uint64_t>::max());
+        pindexBalanceCache = NULL;
+        nBalanceCacheMempool = 0;
+        nMempoolGeneration = 0;
+        nBalanceCacheTxLocks = 0;
+        nBalanceCacheTxLockGeneration = 0;
+        fBalanceCacheInstantX = false;
+        nBalanceCacheRounds = 0;
+        pindexUnspentIndex = NULL;
+        fUnspentIndexStale = true;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -223,7 +298,7 @@ public:
     // Adds a key to the store, and saves it to disk.
     bool AddKeyPubKey(const CKey& key, const CPubKey &pubkey);
     // Adds a key to the store, without saving it to disk (used by LoadWallet)
-    bool LoadKey(const CKey& key, const CPubKey &pubkey) { return CCryptoKeyStore::AddKeyPubKey(key, pubkey); }
+    bool LoadKey(const CKey& key, const CPubKey &pubkey);
     // Load metadata (used by LoadWallet)
     bool LoadKeyMetadata(const CPubKey &pubkey, const CKeyMetadata &metadata);
 
@@ -330,10 +405,7 @@ public:
 
     bool IsMine(const CTxIn& txin) const;
     int64_t GetDebit(const CTxIn& txin) const;
-    bool IsMine(const CTxOut& txout) const
-    {
-        return ::IsMine(*this, txout.scriptPubKey);
-    }
+    bool IsMine(const CTxOut& txout) const;
     int64_t GetCredit(const CTxOut& txout) const
     {
         if (!MoneyRange(txout.nValue))